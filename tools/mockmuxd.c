@@ -0,0 +1,1101 @@
+/*
+ * mockmuxd.c
+ *
+ * Stand-in usbmuxd emulating virtual devices, for benchmarking and testing
+ * usbfluxd without real hardware.
+ *
+ * Copyright (C) 2026 Corellium LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <plist/plist.h>
+
+#include "usbmuxd-proto.h"
+
+#define MOCK_DEFAULT_SOCKET "/var/run/usbmuxd.orig"
+#define MOCK_BUF_SIZE 0x10000
+#define MOCK_MAX_MSG_SIZE 0x100000
+#define MOCK_PRODUCT_ID 0x12a8
+#define MOCK_CONNECTION_SPEED 480000000
+
+enum service_type {
+	SERVICE_NONE = 0,
+	SERVICE_ECHO,		// send back whatever is received
+	SERVICE_SINK,		// discard everything received
+	SERVICE_SOURCE		// send a data pattern as fast as allowed
+};
+
+enum mock_client_state {
+	MC_COMMAND,
+	MC_LISTEN,
+	MC_CONNECTED
+};
+
+struct mock_device {
+	uint32_t id;
+	char serial[64];
+	uint32_t location;
+	int attached;
+};
+
+struct mock_client {
+	int fd;
+	enum mock_client_state state;
+	uint32_t proto_version;
+	unsigned char *ib_buf;
+	uint32_t ib_size;
+	uint32_t ib_capacity;
+	unsigned char *ob_buf;
+	uint32_t ob_size;
+	uint32_t ob_capacity;
+	uint64_t release_at;	// ob_buf is held back until then (latency emulation)
+	enum service_type service;
+	uint32_t device_id;
+	int64_t tokens;		// bytes this session may still transfer (rate limiting)
+	uint64_t last_refill;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+};
+
+struct service_map {
+	uint16_t port;
+	enum service_type type;
+};
+
+static int verbose = 0;
+static volatile int should_exit = 0;
+
+static struct mock_device *devices = NULL;
+static int num_devices = 1;
+static const char *serial_prefix = "mock";
+static unsigned int churn_ms = 0;
+static uint64_t next_churn = 0;
+static uint64_t rate_limit = 0;		// bytes per second and session, 0 = unlimited
+static unsigned int latency_ms = 0;
+static struct service_map services[32];
+static int num_services = 0;
+static enum service_type default_service = SERVICE_NONE;
+static plist_t pair_records = NULL;
+
+static struct mock_client **clients = NULL;
+static int clients_capacity = 0;
+
+static struct {
+	uint64_t accepted;
+	uint64_t commands;
+	uint64_t connects;
+	uint64_t connects_refused;
+	uint64_t attaches;
+	uint64_t detaches;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+} mock_stats;
+
+#define mock_log(level, ...) do { if (verbose >= level) { fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); } } while (0)
+
+static uint64_t mstime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static const char *service_name(enum service_type type)
+{
+	switch (type) {
+		case SERVICE_ECHO:
+			return "echo";
+		case SERVICE_SINK:
+			return "sink";
+		case SERVICE_SOURCE:
+			return "source";
+		case SERVICE_NONE:
+		default:
+			return "none";
+	}
+}
+
+static enum service_type parse_service(const char *name)
+{
+	if (!strcmp(name, "echo"))
+		return SERVICE_ECHO;
+	if (!strcmp(name, "sink"))
+		return SERVICE_SINK;
+	if (!strcmp(name, "source"))
+		return SERVICE_SOURCE;
+	return SERVICE_NONE;
+}
+
+static enum service_type lookup_service(uint16_t port)
+{
+	int i;
+	for (i = 0; i < num_services; i++) {
+		if (services[i].port == port)
+			return services[i].type;
+	}
+	return default_service;
+}
+
+static uint64_t parse_size(const char *arg)
+{
+	char *end = NULL;
+	uint64_t val = strtoull(arg, &end, 10);
+	if (end) {
+		switch (*end) {
+			case 'k':
+			case 'K':
+				val *= 1024;
+				break;
+			case 'm':
+			case 'M':
+				val *= 1024 * 1024;
+				break;
+			case 'g':
+			case 'G':
+				val *= 1024ULL * 1024 * 1024;
+				break;
+			default:
+				break;
+		}
+	}
+	return val;
+}
+
+/* {{{ client list */
+static void client_list_add(struct mock_client *client)
+{
+	int i;
+	for (i = 0; i < clients_capacity; i++) {
+		if (!clients[i]) {
+			clients[i] = client;
+			return;
+		}
+	}
+	clients = realloc(clients, sizeof(struct mock_client*) * (clients_capacity + 64));
+	memset(&clients[clients_capacity], 0, sizeof(struct mock_client*) * 64);
+	clients[clients_capacity] = client;
+	clients_capacity += 64;
+}
+
+static void client_list_remove(struct mock_client *client)
+{
+	int i;
+	for (i = 0; i < clients_capacity; i++) {
+		if (clients[i] == client) {
+			clients[i] = NULL;
+			return;
+		}
+	}
+}
+/* }}} */
+
+static void client_free(struct mock_client *client)
+{
+	mock_log(2, "Closing client fd %d (%s, in %llu out %llu)", client->fd, service_name(client->service),
+		(unsigned long long)client->bytes_in, (unsigned long long)client->bytes_out);
+	close(client->fd);
+	client_list_remove(client);
+	free(client->ib_buf);
+	free(client->ob_buf);
+	free(client);
+}
+
+static int client_queue(struct mock_client *client, const void *data, uint32_t length)
+{
+	if (client->ob_capacity - client->ob_size < length) {
+		uint32_t new_size = ((client->ob_size + length + 4095) / 4096) * 4096;
+		unsigned char *new_buf = realloc(client->ob_buf, new_size);
+		if (!new_buf)
+			return -1;
+		client->ob_buf = new_buf;
+		client->ob_capacity = new_size;
+	}
+	memcpy(client->ob_buf + client->ob_size, data, length);
+	client->ob_size += length;
+	return (int)length;
+}
+
+static int send_pkt(struct mock_client *client, uint32_t tag, enum usbmuxd_msgtype msg, const void *payload, uint32_t payload_length)
+{
+	struct usbmuxd_header hdr;
+	hdr.length = sizeof(hdr) + payload_length;
+	hdr.version = client->proto_version;
+	hdr.message = msg;
+	hdr.tag = tag;
+	if (client_queue(client, &hdr, sizeof(hdr)) < 0)
+		return -1;
+	if (payload && payload_length > 0 && client_queue(client, payload, payload_length) < 0)
+		return -1;
+	return hdr.length;
+}
+
+static int send_plist_pkt(struct mock_client *client, uint32_t tag, plist_t plist)
+{
+	char *xml = NULL;
+	uint32_t xmlsize = 0;
+	int res = -1;
+	plist_to_xml(plist, &xml, &xmlsize);
+	if (xml) {
+		res = send_pkt(client, tag, MESSAGE_PLIST, xml, xmlsize);
+		free(xml);
+	}
+	return res;
+}
+
+static int send_result(struct mock_client *client, uint32_t tag, uint32_t result)
+{
+	int res;
+	if (client->proto_version == 1) {
+		plist_t dict = plist_new_dict();
+		plist_dict_set_item(dict, "MessageType", plist_new_string("Result"));
+		plist_dict_set_item(dict, "Number", plist_new_uint(result));
+		res = send_plist_pkt(client, tag, dict);
+		plist_free(dict);
+	} else {
+		res = send_pkt(client, tag, MESSAGE_RESULT, &result, sizeof(result));
+	}
+	return res;
+}
+
+static plist_t create_device_plist(struct mock_device *dev)
+{
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "DeviceID", plist_new_uint(dev->id));
+	plist_dict_set_item(dict, "MessageType", plist_new_string("Attached"));
+	plist_t props = plist_new_dict();
+	plist_dict_set_item(props, "ConnectionSpeed", plist_new_uint(MOCK_CONNECTION_SPEED));
+	plist_dict_set_item(props, "ConnectionType", plist_new_string("USB"));
+	plist_dict_set_item(props, "DeviceID", plist_new_uint(dev->id));
+	plist_dict_set_item(props, "LocationID", plist_new_uint(dev->location));
+	plist_dict_set_item(props, "ProductID", plist_new_uint(MOCK_PRODUCT_ID));
+	plist_dict_set_item(props, "SerialNumber", plist_new_string(dev->serial));
+	plist_dict_set_item(dict, "Properties", props);
+	return dict;
+}
+
+static int notify_device_add(struct mock_client *client, struct mock_device *dev)
+{
+	int res;
+	if (client->proto_version == 1) {
+		plist_t dict = create_device_plist(dev);
+		res = send_plist_pkt(client, 0, dict);
+		plist_free(dict);
+	} else {
+		struct usbmuxd_device_record rec;
+		memset(&rec, '\0', sizeof(rec));
+		rec.device_id = dev->id;
+		rec.product_id = MOCK_PRODUCT_ID;
+		strncpy(rec.serial_number, dev->serial, sizeof(rec.serial_number) - 1);
+		rec.location = dev->location;
+		res = send_pkt(client, 0, MESSAGE_DEVICE_ADD, &rec, sizeof(rec));
+	}
+	return res;
+}
+
+static int notify_device_remove(struct mock_client *client, uint32_t device_id)
+{
+	int res;
+	if (client->proto_version == 1) {
+		plist_t dict = plist_new_dict();
+		plist_dict_set_item(dict, "MessageType", plist_new_string("Detached"));
+		plist_dict_set_item(dict, "DeviceID", plist_new_uint(device_id));
+		res = send_plist_pkt(client, 0, dict);
+		plist_free(dict);
+	} else {
+		res = send_pkt(client, 0, MESSAGE_DEVICE_REMOVE, &device_id, sizeof(device_id));
+	}
+	return res;
+}
+
+static struct mock_device *find_device(uint32_t device_id)
+{
+	if (device_id < 1 || device_id > (uint32_t)num_devices)
+		return NULL;
+	return &devices[device_id - 1];
+}
+
+static void device_set_attached(struct mock_device *dev, int attached)
+{
+	int i;
+	if (dev->attached == attached)
+		return;
+	dev->attached = attached;
+	mock_log(1, "Device %u (%s) %s", dev->id, dev->serial, (attached) ? "attached" : "detached");
+	if (attached)
+		mock_stats.attaches++;
+	else
+		mock_stats.detaches++;
+	for (i = 0; i < clients_capacity; i++) {
+		struct mock_client *client = clients[i];
+		if (!client)
+			continue;
+		if (client->state == MC_LISTEN) {
+			if (attached)
+				notify_device_add(client, dev);
+			else
+				notify_device_remove(client, dev->id);
+		} else if (!attached && client->state == MC_CONNECTED && client->device_id == dev->id) {
+			/* the device went away, so do its sessions */
+			client_free(client);
+		}
+	}
+}
+
+static void churn_devices(void)
+{
+	if (num_devices <= 0)
+		return;
+	struct mock_device *dev = &devices[rand() % num_devices];
+	device_set_attached(dev, !dev->attached);
+}
+
+static plist_t create_pair_record(struct mock_device *dev)
+{
+	plist_t record = plist_new_dict();
+	char buf[80];
+	snprintf(buf, sizeof(buf), "MOCK-HOST-%08X", dev->id);
+	plist_dict_set_item(record, "HostID", plist_new_string(buf));
+	plist_dict_set_item(record, "SystemBUID", plist_new_string("MOCK-BUID-00000000"));
+	snprintf(buf, sizeof(buf), "mock-wifi-%s", dev->serial);
+	plist_dict_set_item(record, "WiFiMACAddress", plist_new_string(buf));
+	plist_dict_set_item(record, "DeviceCertificate", plist_new_data("mock-device-certificate", 23));
+	plist_dict_set_item(record, "HostCertificate", plist_new_data("mock-host-certificate", 21));
+	plist_dict_set_item(record, "RootCertificate", plist_new_data("mock-root-certificate", 21));
+
+	char *xml = NULL;
+	uint32_t xmlsize = 0;
+	plist_to_xml(record, &xml, &xmlsize);
+	plist_free(record);
+	plist_t data = plist_new_data(xml, xmlsize);
+	free(xml);
+	return data;
+}
+
+static char *plist_dict_copy_string_val(plist_t dict, const char *key)
+{
+	plist_t node = plist_dict_get_item(dict, key);
+	char *val = NULL;
+	if (node && plist_get_node_type(node) == PLIST_STRING)
+		plist_get_string_val(node, &val);
+	return val;
+}
+
+static void start_connected(struct mock_client *client, uint32_t device_id, enum service_type service)
+{
+	client->state = MC_CONNECTED;
+	client->device_id = device_id;
+	client->service = service;
+	client->last_refill = mstime();
+	client->tokens = 0;
+	free(client->ib_buf);
+	client->ib_buf = NULL;
+	client->ib_size = 0;
+	client->ib_capacity = 0;
+	mock_stats.connects++;
+}
+
+static int handle_connect(struct mock_client *client, uint32_t tag, uint32_t device_id, uint16_t port)
+{
+	struct mock_device *dev = find_device(device_id);
+	if (!dev || !dev->attached) {
+		mock_log(1, "Connect to unknown device %u refused", device_id);
+		mock_stats.connects_refused++;
+		return send_result(client, tag, RESULT_BADDEV);
+	}
+	enum service_type service = lookup_service(ntohs(port));
+	if (service == SERVICE_NONE) {
+		mock_log(1, "Connect to device %u port %u refused", device_id, ntohs(port));
+		mock_stats.connects_refused++;
+		return send_result(client, tag, RESULT_CONNREFUSED);
+	}
+	mock_log(2, "Client fd %d connected to device %u port %u (%s)", client->fd, device_id, ntohs(port), service_name(service));
+	if (send_result(client, tag, RESULT_OK) < 0)
+		return -1;
+	start_connected(client, device_id, service);
+	return 0;
+}
+
+static int handle_plist_command(struct mock_client *client, struct usbmuxd_header *hdr)
+{
+	plist_t dict = NULL;
+	int res = 0;
+	plist_from_xml((char*)hdr + sizeof(struct usbmuxd_header), hdr->length - sizeof(struct usbmuxd_header), &dict);
+	if (!dict) {
+		mock_log(1, "Client fd %d sent invalid plist", client->fd);
+		return -1;
+	}
+	char *message = plist_dict_copy_string_val(dict, "MessageType");
+	if (!message) {
+		plist_free(dict);
+		return -1;
+	}
+	mock_log(2, "Client fd %d: %s", client->fd, message);
+
+	if (!strcmp(message, "Listen")) {
+		int i;
+		res = send_result(client, hdr->tag, RESULT_OK);
+		client->state = MC_LISTEN;
+		for (i = 0; i < num_devices && res >= 0; i++) {
+			if (devices[i].attached)
+				res = notify_device_add(client, &devices[i]);
+		}
+	} else if (!strcmp(message, "ListDevices")) {
+		int i;
+		plist_t reply = plist_new_dict();
+		plist_t list = plist_new_array();
+		for (i = 0; i < num_devices; i++) {
+			if (devices[i].attached)
+				plist_array_append_item(list, create_device_plist(&devices[i]));
+		}
+		plist_dict_set_item(reply, "DeviceList", list);
+		res = send_plist_pkt(client, hdr->tag, reply);
+		plist_free(reply);
+	} else if (!strcmp(message, "Connect")) {
+		uint64_t device_id = 0;
+		uint64_t port = 0;
+		plist_t node = plist_dict_get_item(dict, "DeviceID");
+		if (node)
+			plist_get_uint_val(node, &device_id);
+		node = plist_dict_get_item(dict, "PortNumber");
+		if (node)
+			plist_get_uint_val(node, &port);
+		res = handle_connect(client, hdr->tag, (uint32_t)device_id, (uint16_t)port);
+	} else if (!strcmp(message, "ReadBUID")) {
+		plist_t reply = plist_new_dict();
+		plist_dict_set_item(reply, "BUID", plist_new_string("MOCK-BUID-00000000"));
+		res = send_plist_pkt(client, hdr->tag, reply);
+		plist_free(reply);
+	} else if (!strcmp(message, "ReadPairRecord")) {
+		char *record_id = plist_dict_copy_string_val(dict, "PairRecordID");
+		plist_t data = (record_id) ? plist_dict_get_item(pair_records, record_id) : NULL;
+		if (data) {
+			plist_t reply = plist_new_dict();
+			plist_dict_set_item(reply, "PairRecordData", plist_copy(data));
+			res = send_plist_pkt(client, hdr->tag, reply);
+			plist_free(reply);
+		} else {
+			res = send_result(client, hdr->tag, ENOENT);
+		}
+		free(record_id);
+	} else if (!strcmp(message, "SavePairRecord")) {
+		char *record_id = plist_dict_copy_string_val(dict, "PairRecordID");
+		plist_t data = plist_dict_get_item(dict, "PairRecordData");
+		if (record_id && data && plist_get_node_type(data) == PLIST_DATA) {
+			plist_dict_set_item(pair_records, record_id, plist_copy(data));
+			res = send_result(client, hdr->tag, RESULT_OK);
+		} else {
+			res = send_result(client, hdr->tag, EINVAL);
+		}
+		free(record_id);
+	} else if (!strcmp(message, "DeletePairRecord")) {
+		char *record_id = plist_dict_copy_string_val(dict, "PairRecordID");
+		if (record_id && plist_dict_get_item(pair_records, record_id)) {
+			plist_dict_remove_item(pair_records, record_id);
+			res = send_result(client, hdr->tag, RESULT_OK);
+		} else {
+			res = send_result(client, hdr->tag, ENOENT);
+		}
+		free(record_id);
+	} else {
+		mock_log(1, "Client fd %d sent unsupported command '%s'", client->fd, message);
+		res = send_result(client, hdr->tag, RESULT_BADCOMMAND);
+	}
+	free(message);
+	plist_free(dict);
+	return (res < 0) ? -1 : 0;
+}
+
+static int client_command(struct mock_client *client, struct usbmuxd_header *hdr)
+{
+	mock_stats.commands++;
+	if (latency_ms > 0)
+		client->release_at = mstime() + latency_ms;
+	if (client->state != MC_COMMAND) {
+		send_result(client, hdr->tag, RESULT_BADCOMMAND);
+		return -1;
+	}
+	if (hdr->version != 0 && hdr->version != 1) {
+		return send_result(client, hdr->tag, RESULT_BADVERSION);
+	}
+	client->proto_version = hdr->version;
+	switch (hdr->message) {
+		case MESSAGE_PLIST:
+			client->proto_version = 1;
+			return handle_plist_command(client, hdr);
+		case MESSAGE_LISTEN: {
+			int i;
+			int res = send_result(client, hdr->tag, RESULT_OK);
+			client->state = MC_LISTEN;
+			for (i = 0; i < num_devices && res >= 0; i++) {
+				if (devices[i].attached)
+					res = notify_device_add(client, &devices[i]);
+			}
+			return (res < 0) ? -1 : 0;
+		}
+		case MESSAGE_CONNECT: {
+			struct usbmuxd_connect_request *req = (struct usbmuxd_connect_request*)hdr;
+			if (hdr->length < sizeof(struct usbmuxd_connect_request))
+				return -1;
+			return handle_connect(client, hdr->tag, req->device_id, req->port);
+		}
+		default:
+			return send_result(client, hdr->tag, RESULT_BADCOMMAND);
+	}
+}
+
+static void refill_tokens(struct mock_client *client, uint64_t now)
+{
+	if (rate_limit == 0)
+		return;
+	int64_t burst = (rate_limit / 10 > MOCK_BUF_SIZE) ? (int64_t)(rate_limit / 10) : MOCK_BUF_SIZE;
+	client->tokens += (int64_t)((now - client->last_refill) * rate_limit / 1000);
+	client->last_refill = now;
+	if (client->tokens > burst)
+		client->tokens = burst;
+}
+
+static uint32_t allowed_bytes(struct mock_client *client, uint32_t wanted)
+{
+	if (rate_limit == 0)
+		return wanted;
+	if (client->tokens <= 0)
+		return 0;
+	return ((int64_t)wanted > client->tokens) ? (uint32_t)client->tokens : wanted;
+}
+
+static void consume_tokens(struct mock_client *client, uint32_t amount)
+{
+	if (rate_limit > 0)
+		client->tokens -= amount;
+}
+
+static short client_events(struct mock_client *client, uint64_t now)
+{
+	short events = 0;
+	int may_write = (client->release_at <= now);
+
+	if (client->state != MC_CONNECTED) {
+		events = POLLIN;
+		if (client->ob_size > 0 && may_write)
+			events |= POLLOUT;
+		return events;
+	}
+	refill_tokens(client, now);
+	switch (client->service) {
+		case SERVICE_ECHO:
+			if (client->ob_size < MOCK_BUF_SIZE)
+				events |= POLLIN;
+			if (client->ob_size > 0 && may_write && allowed_bytes(client, client->ob_size) > 0)
+				events |= POLLOUT;
+			break;
+		case SERVICE_SINK:
+			if (client->ob_size > 0 && may_write)
+				events |= POLLOUT;
+			if (allowed_bytes(client, MOCK_BUF_SIZE) > 0)
+				events |= POLLIN;
+			break;
+		case SERVICE_SOURCE:
+			/* still watch for the peer closing the session */
+			events |= POLLIN;
+			if (may_write && allowed_bytes(client, MOCK_BUF_SIZE) > 0)
+				events |= POLLOUT;
+			break;
+		case SERVICE_NONE:
+		default:
+			events = POLLIN;
+			break;
+	}
+	return events;
+}
+
+/* returns -1 if the client was closed */
+static int client_recv(struct mock_client *client)
+{
+	ssize_t r;
+	if (client->state == MC_CONNECTED) {
+		unsigned char scratch[MOCK_BUF_SIZE];
+		uint32_t room = MOCK_BUF_SIZE;
+		if (client->service == SERVICE_ECHO) {
+			room = MOCK_BUF_SIZE - client->ob_size;
+		} else if (client->service == SERVICE_SINK) {
+			room = allowed_bytes(client, MOCK_BUF_SIZE);
+		}
+		if (room == 0)
+			return 0;
+		r = recv(client->fd, scratch, room, 0);
+		if (r <= 0) {
+			client_free(client);
+			return -1;
+		}
+		client->bytes_in += r;
+		mock_stats.bytes_in += r;
+		if (client->service == SERVICE_ECHO) {
+			if (client->ob_size == 0 && latency_ms > 0)
+				client->release_at = mstime() + latency_ms;
+			client_queue(client, scratch, r);
+		} else if (client->service == SERVICE_SINK) {
+			consume_tokens(client, r);
+		}
+		return 0;
+	}
+
+	if (client->ib_size < sizeof(struct usbmuxd_header)) {
+		r = recv(client->fd, client->ib_buf + client->ib_size, sizeof(struct usbmuxd_header) - client->ib_size, 0);
+		if (r <= 0) {
+			client_free(client);
+			return -1;
+		}
+		client->ib_size += r;
+		if (client->ib_size < sizeof(struct usbmuxd_header))
+			return 0;
+	}
+	struct usbmuxd_header *hdr = (struct usbmuxd_header*)client->ib_buf;
+	if (hdr->length < sizeof(struct usbmuxd_header) || hdr->length > MOCK_MAX_MSG_SIZE) {
+		mock_log(1, "Client fd %d sent invalid message length %u", client->fd, hdr->length);
+		client_free(client);
+		return -1;
+	}
+	if (hdr->length > client->ib_capacity) {
+		uint32_t new_size = hdr->length;
+		unsigned char *new_buf = realloc(client->ib_buf, new_size);
+		if (!new_buf) {
+			client_free(client);
+			return -1;
+		}
+		client->ib_buf = new_buf;
+		client->ib_capacity = new_size;
+		hdr = (struct usbmuxd_header*)client->ib_buf;
+	}
+	if (client->ib_size < hdr->length) {
+		r = recv(client->fd, client->ib_buf + client->ib_size, hdr->length - client->ib_size, 0);
+		if (r <= 0) {
+			if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return 0;
+			client_free(client);
+			return -1;
+		}
+		client->ib_size += r;
+		if (client->ib_size < hdr->length)
+			return 0;
+	}
+	client->ib_size = 0;
+	if (client_command(client, hdr) < 0) {
+		client_free(client);
+		return -1;
+	}
+	return 0;
+}
+
+/* returns -1 if the client was closed */
+static int client_send(struct mock_client *client)
+{
+	ssize_t s;
+	if (client->ob_size > 0) {
+		uint32_t len = client->ob_size;
+		if (client->state == MC_CONNECTED && client->service == SERVICE_ECHO)
+			len = allowed_bytes(client, len);
+		s = send(client->fd, client->ob_buf, len, 0);
+		if (s <= 0) {
+			if (s < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return 0;
+			client_free(client);
+			return -1;
+		}
+		if (client->state == MC_CONNECTED && client->service == SERVICE_ECHO) {
+			consume_tokens(client, s);
+			client->bytes_out += s;
+			mock_stats.bytes_out += s;
+		}
+		client->ob_size -= s;
+		if (client->ob_size > 0)
+			memmove(client->ob_buf, client->ob_buf + s, client->ob_size);
+		return 0;
+	}
+	if (client->state == MC_CONNECTED && client->service == SERVICE_SOURCE) {
+		static unsigned char pattern[MOCK_BUF_SIZE];
+		static int pattern_init = 0;
+		if (!pattern_init) {
+			int i;
+			for (i = 0; i < MOCK_BUF_SIZE; i++)
+				pattern[i] = (unsigned char)(i & 0xFF);
+			pattern_init = 1;
+		}
+		uint32_t len = allowed_bytes(client, MOCK_BUF_SIZE);
+		if (len == 0)
+			return 0;
+		s = send(client->fd, pattern, len, 0);
+		if (s <= 0) {
+			if (s < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return 0;
+			client_free(client);
+			return -1;
+		}
+		consume_tokens(client, s);
+		client->bytes_out += s;
+		mock_stats.bytes_out += s;
+	}
+	return 0;
+}
+
+static void client_accept(int listenfd)
+{
+	int fd = accept(listenfd, NULL, NULL);
+	if (fd < 0) {
+		mock_log(1, "accept() failed: %s", strerror(errno));
+		return;
+	}
+	int flags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	int yes = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+	struct mock_client *client = calloc(1, sizeof(struct mock_client));
+	client->fd = fd;
+	client->state = MC_COMMAND;
+	client->ib_buf = malloc(MOCK_BUF_SIZE);
+	client->ib_capacity = MOCK_BUF_SIZE;
+	client->ob_buf = malloc(MOCK_BUF_SIZE);
+	client->ob_capacity = MOCK_BUF_SIZE;
+	client_list_add(client);
+	mock_stats.accepted++;
+	mock_log(2, "New client fd %d", fd);
+}
+
+static int create_unix_socket(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	unlink(path);
+	memset(&addr, '\0', sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 512) < 0) {
+		close(fd);
+		return -1;
+	}
+	chmod(path, 0666);
+	return fd;
+}
+
+static int create_tcp_socket(const char *bind_addr, uint16_t port)
+{
+	struct sockaddr_in addr;
+	int yes = 1;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	memset(&addr, '\0', sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (!bind_addr || inet_pton(AF_INET, bind_addr, &addr.sin_addr) != 1)
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 512) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void handle_signal(int sig)
+{
+	should_exit = 1;
+}
+
+static void print_stats(void)
+{
+	fprintf(stderr, "mockmuxd: %llu clients, %llu commands, %llu connects (%llu refused), %llu attaches, %llu detaches, %llu bytes in, %llu bytes out\n",
+		(unsigned long long)mock_stats.accepted, (unsigned long long)mock_stats.commands,
+		(unsigned long long)mock_stats.connects, (unsigned long long)mock_stats.connects_refused,
+		(unsigned long long)mock_stats.attaches, (unsigned long long)mock_stats.detaches,
+		(unsigned long long)mock_stats.bytes_in, (unsigned long long)mock_stats.bytes_out);
+}
+
+static void print_usage(const char *argv0)
+{
+	const char *cmd = strrchr(argv0, '/');
+	cmd = (cmd) ? cmd+1 : argv0;
+	printf("Usage: %s [OPTIONS]\n", cmd);
+	printf("Stand-in usbmuxd serving virtual devices, for benchmarking usbfluxd.\n\n");
+	printf("  -u, --unix PATH\tListen on unix socket PATH (default %s\n", MOCK_DEFAULT_SOCKET);
+	printf("                 \tunless --tcp is given).\n");
+	printf("  -t, --tcp PORT\tListen on TCP port PORT.\n");
+	printf("  -b, --bind ADDR\tBind the TCP socket to ADDR (default any).\n");
+	printf("  -d, --devices N\tEmulate N devices (default 1).\n");
+	printf("  -p, --prefix STR\tSerial number prefix (default \"mock\").\n");
+	printf("  -c, --churn MS\tAttach or detach a random device every MS ms.\n");
+	printf("  -r, --rate BYTES\tLimit each session to BYTES/s (K, M, G suffixes).\n");
+	printf("  -l, --latency MS\tDelay replies and echoed data by MS ms.\n");
+	printf("  -s, --service PORT=TYPE\tServe TYPE (echo, sink, source) on device PORT.\n");
+	printf("                 \tDefaults: 7=echo, 9=sink, 19=source.\n");
+	printf("  -D, --default-service TYPE\tServe TYPE on all other ports instead of\n");
+	printf("                 \trefusing the connection.\n");
+	printf("  -v, --verbose\t\tBe verbose (use twice for more).\n");
+	printf("  -h, --help\t\tPrint this message.\n");
+}
+
+int main(int argc, char **argv)
+{
+	static struct option longopts[] = {
+		{"unix", required_argument, NULL, 'u'},
+		{"tcp", required_argument, NULL, 't'},
+		{"bind", required_argument, NULL, 'b'},
+		{"devices", required_argument, NULL, 'd'},
+		{"prefix", required_argument, NULL, 'p'},
+		{"churn", required_argument, NULL, 'c'},
+		{"rate", required_argument, NULL, 'r'},
+		{"latency", required_argument, NULL, 'l'},
+		{"service", required_argument, NULL, 's'},
+		{"default-service", required_argument, NULL, 'D'},
+		{"verbose", no_argument, NULL, 'v'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	const char *unix_path = NULL;
+	const char *bind_addr = NULL;
+	int tcp_port = 0;
+	int c;
+	int i;
+
+	services[num_services++] = (struct service_map){ 7, SERVICE_ECHO };
+	services[num_services++] = (struct service_map){ 9, SERVICE_SINK };
+	services[num_services++] = (struct service_map){ 19, SERVICE_SOURCE };
+
+	while ((c = getopt_long(argc, argv, "u:t:b:d:p:c:r:l:s:D:vh", longopts, NULL)) != -1) {
+		switch (c) {
+			case 'u':
+				unix_path = optarg;
+				break;
+			case 't':
+				tcp_port = atoi(optarg);
+				break;
+			case 'b':
+				bind_addr = optarg;
+				break;
+			case 'd':
+				num_devices = atoi(optarg);
+				break;
+			case 'p':
+				serial_prefix = optarg;
+				break;
+			case 'c':
+				churn_ms = (unsigned int)strtoul(optarg, NULL, 10);
+				break;
+			case 'r':
+				rate_limit = parse_size(optarg);
+				break;
+			case 'l':
+				latency_ms = (unsigned int)strtoul(optarg, NULL, 10);
+				break;
+			case 's': {
+				char *eq = strchr(optarg, '=');
+				enum service_type type = (eq) ? parse_service(eq + 1) : SERVICE_NONE;
+				if (type == SERVICE_NONE || num_services >= (int)(sizeof(services) / sizeof(services[0]))) {
+					fprintf(stderr, "Invalid service specification '%s'\n", optarg);
+					return 2;
+				}
+				uint16_t port = (uint16_t)atoi(optarg);
+				for (i = 0; i < num_services; i++) {
+					if (services[i].port == port)
+						break;
+				}
+				services[i].port = port;
+				services[i].type = type;
+				if (i == num_services)
+					num_services++;
+				break;
+			}
+			case 'D':
+				default_service = parse_service(optarg);
+				if (default_service == SERVICE_NONE) {
+					fprintf(stderr, "Invalid service type '%s'\n", optarg);
+					return 2;
+				}
+				break;
+			case 'v':
+				verbose++;
+				break;
+			case 'h':
+				print_usage(argv[0]);
+				return 0;
+			default:
+				print_usage(argv[0]);
+				return 2;
+		}
+	}
+	if (!unix_path && tcp_port == 0)
+		unix_path = MOCK_DEFAULT_SOCKET;
+	if (num_devices < 0 || num_devices > 0xFFFFFF) {
+		fprintf(stderr, "Invalid number of devices\n");
+		return 2;
+	}
+
+	srand((unsigned int)getpid());
+	pair_records = plist_new_dict();
+	devices = calloc((num_devices > 0) ? num_devices : 1, sizeof(struct mock_device));
+	for (i = 0; i < num_devices; i++) {
+		devices[i].id = i + 1;
+		snprintf(devices[i].serial, sizeof(devices[i].serial), "%s-%08d", serial_prefix, i + 1);
+		devices[i].location = 0x14100000 | (i + 1);
+		devices[i].attached = 1;
+		plist_dict_set_item(pair_records, devices[i].serial, create_pair_record(&devices[i]));
+	}
+
+	int listenfds[2] = { -1, -1 };
+	if (unix_path) {
+		listenfds[0] = create_unix_socket(unix_path);
+		if (listenfds[0] < 0) {
+			fprintf(stderr, "Could not listen on %s: %s\n", unix_path, strerror(errno));
+			return 1;
+		}
+	}
+	if (tcp_port > 0) {
+		listenfds[1] = create_tcp_socket(bind_addr, (uint16_t)tcp_port);
+		if (listenfds[1] < 0) {
+			fprintf(stderr, "Could not listen on TCP port %d: %s\n", tcp_port, strerror(errno));
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	mock_log(0, "mockmuxd: %d devices%s%s, TCP port %d, churn %u ms, rate %llu B/s, latency %u ms",
+		num_devices, (unix_path) ? ", unix socket " : "", (unix_path) ? unix_path : "", tcp_port,
+		churn_ms, (unsigned long long)rate_limit, latency_ms);
+
+	struct pollfd *fds = NULL;
+	struct mock_client **fd_clients = NULL;
+	int fds_capacity = 0;
+	if (churn_ms > 0)
+		next_churn = mstime() + churn_ms;
+
+	while (!should_exit) {
+		uint64_t now = mstime();
+		int timeout = -1;
+		int count = 0;
+
+		if (fds_capacity < clients_capacity + 2) {
+			fds_capacity = clients_capacity + 2;
+			fds = realloc(fds, sizeof(struct pollfd) * fds_capacity);
+			fd_clients = realloc(fd_clients, sizeof(struct mock_client*) * fds_capacity);
+		}
+		for (i = 0; i < 2; i++) {
+			if (listenfds[i] >= 0) {
+				fds[count].fd = listenfds[i];
+				fds[count].events = POLLIN;
+				fd_clients[count] = NULL;
+				count++;
+			}
+		}
+		for (i = 0; i < clients_capacity; i++) {
+			struct mock_client *client = clients[i];
+			if (!client)
+				continue;
+			short events = client_events(client, now);
+			if (client->release_at > now && client->ob_size > 0) {
+				int wait = (int)(client->release_at - now);
+				if (timeout < 0 || wait < timeout)
+					timeout = wait;
+			}
+			if (rate_limit > 0 && client->state == MC_CONNECTED && client->tokens <= 0) {
+				if (timeout < 0 || timeout > 10)
+					timeout = 10;
+			}
+			fds[count].fd = client->fd;
+			fds[count].events = events;
+			fd_clients[count] = client;
+			count++;
+		}
+		if (next_churn > 0) {
+			int wait = (next_churn > now) ? (int)(next_churn - now) : 0;
+			if (timeout < 0 || wait < timeout)
+				timeout = wait;
+		}
+
+		int ready = poll(fds, count, timeout);
+		if (ready < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+			break;
+		}
+		for (i = 0; i < count && ready > 0; i++) {
+			if (!fds[i].revents)
+				continue;
+			ready--;
+			if (!fd_clients[i]) {
+				client_accept(fds[i].fd);
+				continue;
+			}
+			struct mock_client *client = fd_clients[i];
+			if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL) && !(fds[i].revents & POLLIN)) {
+				client_free(client);
+				continue;
+			}
+			if ((fds[i].revents & POLLIN) && client_recv(client) < 0)
+				continue;
+			if (fds[i].revents & POLLOUT) {
+				client_send(client);
+			}
+		}
+		if (next_churn > 0 && mstime() >= next_churn) {
+			churn_devices();
+			next_churn += churn_ms;
+		}
+	}
+
+	print_stats();
+	for (i = 0; i < clients_capacity; i++) {
+		if (clients[i])
+			client_free(clients[i]);
+	}
+	free(clients);
+	free(fds);
+	free(fd_clients);
+	if (listenfds[0] >= 0) {
+		close(listenfds[0]);
+		unlink(unix_path);
+	}
+	if (listenfds[1] >= 0)
+		close(listenfds[1]);
+	plist_free(pair_records);
+	free(devices);
+	return 0;
+}
@@ -0,0 +1,963 @@
+/*
+ * muxload.c
+ *
+ * Load generator opening many concurrent usbmuxd client connections with a
+ * configurable mix of operations, reporting throughput, latency percentiles
+ * and error counts.
+ *
+ * Copyright (C) 2026 Corellium LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <plist/plist.h>
+
+#include "usbmuxd-proto.h"
+
+#define LOAD_DEFAULT_SOCKET "/var/run/usbmuxd"
+#define LOAD_CHUNK_SIZE 0x10000
+#define LOAD_MAX_MSG_SIZE 0x100000
+#define LOAD_RETRY_DELAY_US 100000
+
+enum load_op {
+	OP_SOCKET,		// socket connect to the usbmuxd socket
+	OP_LISTEN,		// Listen until the Result arrived
+	OP_LIST_DEVICES,
+	OP_CONNECT,		// Connect until the Result arrived
+	OP_READ_PAIR_RECORD,
+	OP_ECHO,		// round trip of one echo chunk
+	OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = {
+	"socket",
+	"listen",
+	"list_devices",
+	"connect",
+	"read_pair_record",
+	"echo"
+};
+
+enum worker_kind {
+	WORKER_LISTEN,		// holds a Listen subscription open
+	WORKER_POLL,		// ListDevices in a loop
+	WORKER_BULK,		// Connect followed by bulk transfer
+	WORKER_PAIR		// ReadPairRecord in a loop
+};
+
+enum worker_state {
+	W_IDLE,			// waiting for start_at
+	W_CONNECTING,		// non-blocking connect() in progress
+	W_REQUEST,		// request sent, waiting for the reply
+	W_LISTENING,		// receiving device events
+	W_STREAMING		// connected session, transferring data
+};
+
+enum bulk_direction {
+	DIR_UP,			// write to the device (sink service)
+	DIR_DOWN,		// read from the device (source service)
+	DIR_ECHO		// write a chunk, wait for it to come back
+};
+
+struct latency_samples {
+	uint32_t *values;	// microseconds
+	size_t count;
+	size_t capacity;
+};
+
+struct op_stats {
+	uint64_t ok;
+	uint64_t errors;
+	struct latency_samples lat;
+};
+
+struct thread_stats {
+	struct op_stats ops[OP_COUNT];
+	uint64_t connections;
+	uint64_t bytes_up;
+	uint64_t bytes_down;
+	uint64_t device_events;
+	uint64_t disconnects;	// sessions closed by the other side
+};
+
+struct worker {
+	enum worker_kind kind;
+	enum worker_state state;
+	int fd;
+	int index;
+	uint64_t start_at;
+	uint64_t op_start;
+	enum load_op op;
+	unsigned char *ib_buf;
+	uint32_t ib_size;
+	uint32_t ib_capacity;
+	const unsigned char *ob_data;
+	uint32_t ob_size;
+	uint32_t ob_sent;
+	unsigned char *req_buf;
+	uint64_t session_bytes;
+	uint32_t echo_pending;
+};
+
+struct load_thread {
+	pthread_t thread;
+	int id;
+	struct worker *workers;
+	int num_workers;
+	struct thread_stats stats;
+};
+
+static const char *socket_path = LOAD_DEFAULT_SOCKET;
+static int num_threads = 4;
+static unsigned int duration_s = 10;
+static int num_listeners = 0;
+static int num_pollers = 0;
+static int num_bulk = 0;
+static int num_pair = 0;
+static unsigned int interval_ms = 0;
+static enum bulk_direction direction = DIR_UP;
+static uint16_t device_port = 0;
+static uint64_t session_bytes = 0;
+static uint32_t echo_size = 4096;
+static int output_json = 1;
+
+static uint32_t *device_ids = NULL;
+static char **device_serials = NULL;
+static int num_devices = 0;
+
+static volatile int should_stop = 0;
+static uint64_t end_time = 0;
+static unsigned char pattern[LOAD_CHUNK_SIZE];
+
+static uint64_t ustime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void latency_add(struct latency_samples *lat, uint64_t us)
+{
+	if (lat->count == lat->capacity) {
+		size_t new_capacity = (lat->capacity) ? lat->capacity * 2 : 1024;
+		uint32_t *new_values = realloc(lat->values, sizeof(uint32_t) * new_capacity);
+		if (!new_values)
+			return;
+		lat->values = new_values;
+		lat->capacity = new_capacity;
+	}
+	lat->values[lat->count++] = (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+}
+
+static void op_done(struct load_thread *thr, enum load_op op, uint64_t start, int ok)
+{
+	struct op_stats *st = &thr->stats.ops[op];
+	if (ok) {
+		st->ok++;
+		latency_add(&st->lat, ustime() - start);
+	} else {
+		st->errors++;
+	}
+}
+
+/* {{{ request encoding */
+static unsigned char *create_request(const char *message_type, uint32_t tag, plist_t extra, uint32_t *length)
+{
+	plist_t dict = (extra) ? plist_copy(extra) : plist_new_dict();
+	plist_dict_set_item(dict, "BundleID", plist_new_string("com.corellium.muxload"));
+	plist_dict_set_item(dict, "ClientVersionString", plist_new_string("muxload"));
+	plist_dict_set_item(dict, "MessageType", plist_new_string(message_type));
+	plist_dict_set_item(dict, "ProgName", plist_new_string("muxload"));
+	plist_dict_set_item(dict, "kLibUSBMuxVersion", plist_new_uint(3));
+	char *xml = NULL;
+	uint32_t xmlsize = 0;
+	plist_to_xml(dict, &xml, &xmlsize);
+	plist_free(dict);
+	if (!xml)
+		return NULL;
+
+	struct usbmuxd_header hdr;
+	hdr.length = sizeof(hdr) + xmlsize;
+	hdr.version = 1;
+	hdr.message = MESSAGE_PLIST;
+	hdr.tag = tag;
+	unsigned char *buf = malloc(hdr.length);
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy(buf + sizeof(hdr), xml, xmlsize);
+	free(xml);
+	*length = hdr.length;
+	return buf;
+}
+
+static unsigned char *create_connect_request(uint32_t device_id, uint16_t port, uint32_t *length)
+{
+	plist_t extra = plist_new_dict();
+	plist_dict_set_item(extra, "DeviceID", plist_new_uint(device_id));
+	plist_dict_set_item(extra, "PortNumber", plist_new_uint(htons(port)));
+	unsigned char *buf = create_request("Connect", 1, extra, length);
+	plist_free(extra);
+	return buf;
+}
+
+static unsigned char *create_pair_record_request(const char *udid, uint32_t *length)
+{
+	plist_t extra = plist_new_dict();
+	plist_dict_set_item(extra, "PairRecordID", plist_new_string(udid));
+	unsigned char *buf = create_request("ReadPairRecord", 1, extra, length);
+	plist_free(extra);
+	return buf;
+}
+
+static plist_t reply_plist(struct usbmuxd_header *hdr)
+{
+	plist_t pl = NULL;
+	if (hdr->message != MESSAGE_PLIST)
+		return NULL;
+	plist_from_xml((char*)hdr + sizeof(struct usbmuxd_header), hdr->length - sizeof(struct usbmuxd_header), &pl);
+	return pl;
+}
+
+static int reply_result(struct usbmuxd_header *hdr)
+{
+	if (hdr->message == MESSAGE_RESULT && hdr->length >= sizeof(struct usbmuxd_result_msg))
+		return (int)((struct usbmuxd_result_msg*)hdr)->result;
+	plist_t pl = reply_plist(hdr);
+	int res = -1;
+	if (pl) {
+		plist_t node = plist_dict_get_item(pl, "Number");
+		if (node && plist_get_node_type(node) == PLIST_UINT) {
+			uint64_t val = 0;
+			plist_get_uint_val(node, &val);
+			res = (int)val;
+		}
+		plist_free(pl);
+	}
+	return res;
+}
+/* }}} */
+
+static int socket_connect_nonblock(const char *path, int *in_progress)
+{
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	int flags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	memset(&addr, '\0', sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	*in_progress = 0;
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		if (errno == EINPROGRESS || errno == EAGAIN) {
+			*in_progress = 1;
+			return fd;
+		}
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void worker_close(struct worker *w, uint64_t restart_delay)
+{
+	if (w->fd >= 0)
+		close(w->fd);
+	w->fd = -1;
+	w->state = W_IDLE;
+	w->ib_size = 0;
+	w->ob_size = 0;
+	w->ob_sent = 0;
+	w->echo_pending = 0;
+	free(w->req_buf);
+	w->req_buf = NULL;
+	w->start_at = ustime() + restart_delay;
+}
+
+static void worker_fail(struct load_thread *thr, struct worker *w)
+{
+	op_done(thr, w->op, w->op_start, 0);
+	worker_close(w, LOAD_RETRY_DELAY_US);
+}
+
+static void worker_send_request(struct worker *w)
+{
+	uint32_t length = 0;
+	switch (w->kind) {
+		case WORKER_LISTEN:
+			w->req_buf = create_request("Listen", 1, NULL, &length);
+			w->op = OP_LISTEN;
+			break;
+		case WORKER_POLL:
+			w->req_buf = create_request("ListDevices", 1, NULL, &length);
+			w->op = OP_LIST_DEVICES;
+			break;
+		case WORKER_BULK:
+			w->req_buf = create_connect_request(device_ids[w->index % num_devices], device_port, &length);
+			w->op = OP_CONNECT;
+			break;
+		case WORKER_PAIR:
+			w->req_buf = create_pair_record_request(device_serials[w->index % num_devices], &length);
+			w->op = OP_READ_PAIR_RECORD;
+			break;
+		default:
+			break;
+	}
+	w->ob_data = w->req_buf;
+	w->ob_size = length;
+	w->ob_sent = 0;
+	w->ib_size = 0;
+	w->state = W_REQUEST;
+	w->op_start = ustime();
+}
+
+static void worker_start(struct load_thread *thr, struct worker *w)
+{
+	int in_progress = 0;
+	w->op = OP_SOCKET;
+	w->op_start = ustime();
+	w->fd = socket_connect_nonblock(socket_path, &in_progress);
+	if (w->fd < 0) {
+		worker_fail(thr, w);
+		return;
+	}
+	thr->stats.connections++;
+	w->session_bytes = 0;
+	if (in_progress) {
+		w->state = W_CONNECTING;
+		return;
+	}
+	op_done(thr, OP_SOCKET, w->op_start, 1);
+	worker_send_request(w);
+}
+
+/* Read one complete framed message into ib_buf. Returns 1 when complete,
+ * 0 when more data is needed, -1 on error or EOF. */
+static int worker_read_message(struct worker *w)
+{
+	uint32_t want = sizeof(struct usbmuxd_header);
+	if (w->ib_size >= sizeof(struct usbmuxd_header)) {
+		want = ((struct usbmuxd_header*)w->ib_buf)->length;
+		if (want < sizeof(struct usbmuxd_header) || want > LOAD_MAX_MSG_SIZE)
+			return -1;
+		if (want > w->ib_capacity) {
+			unsigned char *new_buf = realloc(w->ib_buf, want);
+			if (!new_buf)
+				return -1;
+			w->ib_buf = new_buf;
+			w->ib_capacity = want;
+		}
+	}
+	ssize_t r = recv(w->fd, w->ib_buf + w->ib_size, want - w->ib_size, 0);
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (r <= 0)
+		return -1;
+	w->ib_size += r;
+	if (w->ib_size == sizeof(struct usbmuxd_header) && want == sizeof(struct usbmuxd_header))
+		return (((struct usbmuxd_header*)w->ib_buf)->length == sizeof(struct usbmuxd_header)) ? 1 : 0;
+	return (w->ib_size == want) ? 1 : 0;
+}
+
+static void worker_handle_reply(struct load_thread *thr, struct worker *w)
+{
+	struct usbmuxd_header *hdr = (struct usbmuxd_header*)w->ib_buf;
+	int res;
+	w->ib_size = 0;
+	switch (w->kind) {
+		case WORKER_LISTEN:
+			res = reply_result(hdr);
+			op_done(thr, OP_LISTEN, w->op_start, res == 0);
+			if (res != 0) {
+				worker_close(w, LOAD_RETRY_DELAY_US);
+				return;
+			}
+			w->state = W_LISTENING;
+			break;
+		case WORKER_POLL:
+		case WORKER_PAIR: {
+			plist_t pl = reply_plist(hdr);
+			const char *key = (w->kind == WORKER_POLL) ? "DeviceList" : "PairRecordData";
+			int ok = (pl && plist_dict_get_item(pl, key));
+			plist_free(pl);
+			op_done(thr, w->op, w->op_start, ok);
+			worker_close(w, (uint64_t)interval_ms * 1000);
+			break;
+		}
+		case WORKER_BULK:
+			res = reply_result(hdr);
+			op_done(thr, OP_CONNECT, w->op_start, res == 0);
+			if (res != 0) {
+				worker_close(w, LOAD_RETRY_DELAY_US);
+				return;
+			}
+			free(w->req_buf);
+			w->req_buf = NULL;
+			w->ob_size = 0;
+			w->state = W_STREAMING;
+			break;
+		default:
+			break;
+	}
+}
+
+static short worker_events(struct worker *w)
+{
+	switch (w->state) {
+		case W_CONNECTING:
+			return POLLOUT;
+		case W_REQUEST:
+			return (w->ob_sent < w->ob_size) ? POLLOUT : POLLIN;
+		case W_LISTENING:
+			return POLLIN;
+		case W_STREAMING:
+			if (direction == DIR_UP)
+				return POLLOUT | POLLIN;
+			if (direction == DIR_DOWN)
+				return POLLIN;
+			return (w->echo_pending) ? POLLIN : POLLOUT;
+		case W_IDLE:
+		default:
+			return 0;
+	}
+}
+
+static void worker_stream(struct load_thread *thr, struct worker *w, short revents, unsigned char *scratch)
+{
+	ssize_t r;
+	if (revents & POLLIN) {
+		r = recv(w->fd, scratch, LOAD_CHUNK_SIZE, 0);
+		if (r <= 0) {
+			if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return;
+			thr->stats.disconnects++;
+			worker_close(w, LOAD_RETRY_DELAY_US);
+			return;
+		}
+		thr->stats.bytes_down += r;
+		w->session_bytes += r;
+		if (direction == DIR_ECHO && w->echo_pending > 0) {
+			w->echo_pending = ((uint32_t)r >= w->echo_pending) ? 0 : w->echo_pending - r;
+			if (w->echo_pending == 0)
+				op_done(thr, OP_ECHO, w->op_start, 1);
+		}
+	} else if (revents & POLLOUT) {
+		uint32_t len = (direction == DIR_ECHO) ? echo_size : LOAD_CHUNK_SIZE;
+		r = send(w->fd, pattern, len, 0);
+		if (r <= 0) {
+			if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return;
+			thr->stats.disconnects++;
+			worker_close(w, LOAD_RETRY_DELAY_US);
+			return;
+		}
+		thr->stats.bytes_up += r;
+		w->session_bytes += r;
+		if (direction == DIR_ECHO) {
+			w->echo_pending = (uint32_t)r;
+			w->op_start = ustime();
+		}
+	}
+	if (session_bytes > 0 && w->session_bytes >= session_bytes && w->echo_pending == 0) {
+		/* start over with a new Connect */
+		worker_close(w, 0);
+	}
+}
+
+static void worker_process(struct load_thread *thr, struct worker *w, short revents, unsigned char *scratch)
+{
+	if (revents & (POLLERR | POLLNVAL) || ((revents & POLLHUP) && !(revents & POLLIN))) {
+		if (w->state == W_STREAMING || w->state == W_LISTENING) {
+			thr->stats.disconnects++;
+			worker_close(w, LOAD_RETRY_DELAY_US);
+		} else {
+			worker_fail(thr, w);
+		}
+		return;
+	}
+	switch (w->state) {
+		case W_CONNECTING: {
+			int err = 0;
+			socklen_t len = sizeof(err);
+			getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+			if (err != 0) {
+				worker_fail(thr, w);
+				return;
+			}
+			op_done(thr, OP_SOCKET, w->op_start, 1);
+			worker_send_request(w);
+			break;
+		}
+		case W_REQUEST:
+			if (w->ob_sent < w->ob_size) {
+				ssize_t s = send(w->fd, w->ob_data + w->ob_sent, w->ob_size - w->ob_sent, 0);
+				if (s < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+					return;
+				if (s <= 0) {
+					worker_fail(thr, w);
+					return;
+				}
+				w->ob_sent += s;
+			} else if (revents & POLLIN) {
+				int res = worker_read_message(w);
+				if (res < 0) {
+					worker_fail(thr, w);
+				} else if (res > 0) {
+					worker_handle_reply(thr, w);
+				}
+			}
+			break;
+		case W_LISTENING: {
+			int res = worker_read_message(w);
+			if (res < 0) {
+				thr->stats.disconnects++;
+				worker_close(w, LOAD_RETRY_DELAY_US);
+			} else if (res > 0) {
+				thr->stats.device_events++;
+				w->ib_size = 0;
+			}
+			break;
+		}
+		case W_STREAMING:
+			worker_stream(thr, w, revents, scratch);
+			break;
+		case W_IDLE:
+		default:
+			break;
+	}
+}
+
+static void *load_thread_func(void *data)
+{
+	struct load_thread *thr = (struct load_thread*)data;
+	struct pollfd *fds = calloc(thr->num_workers, sizeof(struct pollfd));
+	int *fd_workers = calloc(thr->num_workers, sizeof(int));
+	unsigned char *scratch = malloc(LOAD_CHUNK_SIZE);
+	int i;
+
+	while (!should_stop) {
+		uint64_t now = ustime();
+		int count = 0;
+		int timeout = 100;
+		if (now >= end_time)
+			break;
+		for (i = 0; i < thr->num_workers; i++) {
+			struct worker *w = &thr->workers[i];
+			if (w->state == W_IDLE) {
+				if (w->start_at <= now) {
+					worker_start(thr, w);
+				} else {
+					int wait = (int)((w->start_at - now + 999) / 1000);
+					if (wait < timeout)
+						timeout = wait;
+				}
+			}
+			if (w->state == W_IDLE)
+				continue;
+			fds[count].fd = w->fd;
+			fds[count].events = worker_events(w);
+			fds[count].revents = 0;
+			fd_workers[count] = i;
+			count++;
+		}
+		int ready = poll(fds, count, timeout);
+		if (ready < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; i < count && ready > 0; i++) {
+			if (!fds[i].revents)
+				continue;
+			ready--;
+			worker_process(thr, &thr->workers[fd_workers[i]], fds[i].revents, scratch);
+		}
+	}
+	for (i = 0; i < thr->num_workers; i++) {
+		struct worker *w = &thr->workers[i];
+		if (w->fd >= 0)
+			close(w->fd);
+		free(w->req_buf);
+		free(w->ib_buf);
+	}
+	free(scratch);
+	free(fds);
+	free(fd_workers);
+	return NULL;
+}
+
+/* blocking ListDevices used to pick targets for Connect and ReadPairRecord */
+static int fetch_devices(void)
+{
+	int in_progress = 0;
+	int fd = socket_connect_nonblock(socket_path, &in_progress);
+	if (fd < 0)
+		return -1;
+	int flags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+	if (in_progress) {
+		struct pollfd pfd = { fd, POLLOUT, 0 };
+		poll(&pfd, 1, 5000);
+	}
+	uint32_t length = 0;
+	unsigned char *req = create_request("ListDevices", 1, NULL, &length);
+	if (!req || send(fd, req, length, 0) != (ssize_t)length) {
+		free(req);
+		close(fd);
+		return -1;
+	}
+	free(req);
+	struct usbmuxd_header hdr;
+	if (recv(fd, &hdr, sizeof(hdr), MSG_WAITALL) != sizeof(hdr) || hdr.length < sizeof(hdr) || hdr.length > LOAD_MAX_MSG_SIZE) {
+		close(fd);
+		return -1;
+	}
+	uint32_t payload_size = hdr.length - sizeof(hdr);
+	char *payload = malloc(payload_size);
+	if (recv(fd, payload, payload_size, MSG_WAITALL) != (ssize_t)payload_size) {
+		free(payload);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	plist_t pl = NULL;
+	plist_from_xml(payload, payload_size, &pl);
+	free(payload);
+	plist_t list = (pl) ? plist_dict_get_item(pl, "DeviceList") : NULL;
+	uint32_t i, n = plist_array_get_size(list);
+	device_ids = calloc(n + 1, sizeof(uint32_t));
+	device_serials = calloc(n + 1, sizeof(char*));
+	for (i = 0; i < n; i++) {
+		plist_t dev = plist_array_get_item(list, i);
+		plist_t node = plist_dict_get_item(dev, "DeviceID");
+		uint64_t val = 0;
+		if (node)
+			plist_get_uint_val(node, &val);
+		node = plist_access_path(dev, 2, "Properties", "SerialNumber");
+		char *serial = NULL;
+		if (node)
+			plist_get_string_val(node, &serial);
+		device_ids[num_devices] = (uint32_t)val;
+		device_serials[num_devices] = (serial) ? serial : strdup("");
+		num_devices++;
+	}
+	plist_free(pl);
+	return num_devices;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static uint32_t percentile(struct latency_samples *lat, double p)
+{
+	if (lat->count == 0)
+		return 0;
+	size_t idx = (size_t)(p * (double)(lat->count - 1) + 0.5);
+	return lat->values[idx];
+}
+
+static void merge_stats(struct load_thread *threads, struct thread_stats *total)
+{
+	int t, op;
+	memset(total, '\0', sizeof(struct thread_stats));
+	for (t = 0; t < num_threads; t++) {
+		struct thread_stats *st = &threads[t].stats;
+		total->connections += st->connections;
+		total->bytes_up += st->bytes_up;
+		total->bytes_down += st->bytes_down;
+		total->device_events += st->device_events;
+		total->disconnects += st->disconnects;
+		for (op = 0; op < OP_COUNT; op++) {
+			struct op_stats *dst = &total->ops[op];
+			struct op_stats *src = &st->ops[op];
+			dst->ok += src->ok;
+			dst->errors += src->errors;
+			if (src->lat.count > 0) {
+				size_t i;
+				for (i = 0; i < src->lat.count; i++)
+					latency_add(&dst->lat, src->lat.values[i]);
+			}
+		}
+	}
+	for (op = 0; op < OP_COUNT; op++) {
+		struct latency_samples *lat = &total->ops[op].lat;
+		qsort(lat->values, lat->count, sizeof(uint32_t), compare_u32);
+	}
+}
+
+static void print_report(struct thread_stats *total, double elapsed)
+{
+	int op;
+	uint64_t errors = 0;
+	for (op = 0; op < OP_COUNT; op++)
+		errors += total->ops[op].errors;
+
+	if (output_json) {
+		printf("{\n");
+		printf("  \"socket\": \"%s\",\n", socket_path);
+		printf("  \"threads\": %d,\n", num_threads);
+		printf("  \"duration\": %.3f,\n", elapsed);
+		printf("  \"workers\": { \"listen\": %d, \"list_devices\": %d, \"bulk\": %d, \"read_pair_record\": %d },\n", num_listeners, num_pollers, num_bulk, num_pair);
+		printf("  \"connections\": %llu,\n", (unsigned long long)total->connections);
+		printf("  \"connection_rate\": %.1f,\n", total->connections / elapsed);
+		printf("  \"bytes_up\": %llu,\n", (unsigned long long)total->bytes_up);
+		printf("  \"bytes_down\": %llu,\n", (unsigned long long)total->bytes_down);
+		printf("  \"throughput_up\": %.0f,\n", total->bytes_up / elapsed);
+		printf("  \"throughput_down\": %.0f,\n", total->bytes_down / elapsed);
+		printf("  \"device_events\": %llu,\n", (unsigned long long)total->device_events);
+		printf("  \"disconnects\": %llu,\n", (unsigned long long)total->disconnects);
+		printf("  \"errors\": %llu,\n", (unsigned long long)errors);
+		printf("  \"ops\": {\n");
+		for (op = 0; op < OP_COUNT; op++) {
+			struct op_stats *st = &total->ops[op];
+			printf("    \"%s\": { \"ok\": %llu, \"errors\": %llu, \"rate\": %.1f, \"p50_us\": %u, \"p99_us\": %u, \"max_us\": %u }%s\n",
+				op_names[op], (unsigned long long)st->ok, (unsigned long long)st->errors, st->ok / elapsed,
+				percentile(&st->lat, 0.50), percentile(&st->lat, 0.99),
+				(st->lat.count > 0) ? st->lat.values[st->lat.count - 1] : 0,
+				(op < OP_COUNT - 1) ? "," : "");
+		}
+		printf("  }\n");
+		printf("}\n");
+	} else {
+		printf("duration %.3f s, %d threads, %llu connections (%.1f/s), %llu errors, %llu disconnects\n",
+			elapsed, num_threads, (unsigned long long)total->connections, total->connections / elapsed,
+			(unsigned long long)errors, (unsigned long long)total->disconnects);
+		printf("up %.1f MB/s, down %.1f MB/s, %llu device events\n",
+			total->bytes_up / elapsed / 1e6, total->bytes_down / elapsed / 1e6, (unsigned long long)total->device_events);
+		printf("%-18s %10s %8s %10s %10s %10s %10s\n", "op", "ok", "errors", "rate/s", "p50 us", "p99 us", "max us");
+		for (op = 0; op < OP_COUNT; op++) {
+			struct op_stats *st = &total->ops[op];
+			printf("%-18s %10llu %8llu %10.1f %10u %10u %10u\n", op_names[op],
+				(unsigned long long)st->ok, (unsigned long long)st->errors, st->ok / elapsed,
+				percentile(&st->lat, 0.50), percentile(&st->lat, 0.99),
+				(st->lat.count > 0) ? st->lat.values[st->lat.count - 1] : 0);
+		}
+	}
+}
+
+static void handle_signal(int sig)
+{
+	should_stop = 1;
+}
+
+static void print_usage(const char *argv0)
+{
+	const char *cmd = strrchr(argv0, '/');
+	cmd = (cmd) ? cmd+1 : argv0;
+	printf("Usage: %s [OPTIONS]\n", cmd);
+	printf("Generates concurrent usbmuxd client load and reports throughput and latency.\n\n");
+	printf("  -u, --socket PATH\tusbmuxd socket to connect to (default %s).\n", LOAD_DEFAULT_SOCKET);
+	printf("  -T, --threads N\tNumber of worker threads (default 4).\n");
+	printf("  -d, --duration SEC\tRun for SEC seconds (default 10).\n");
+	printf("  -L, --listen N\tHold N Listen subscriptions open.\n");
+	printf("  -l, --list-devices N\tRun N ListDevices loops.\n");
+	printf("  -c, --connect N\tRun N Connect sessions with bulk transfer.\n");
+	printf("  -p, --pair-record N\tRun N ReadPairRecord loops.\n");
+	printf("  -i, --interval MS\tPause between ListDevices/ReadPairRecord requests.\n");
+	printf("  -D, --direction DIR\tBulk direction: up, down or echo (default up).\n");
+	printf("  -P, --port PORT\tDevice port to connect to (default 9, 19 or 7\n");
+	printf("                 \tdepending on the direction, see mockmuxd).\n");
+	printf("  -b, --bytes N\t\tReconnect after N bytes per session (default never).\n");
+	printf("  -e, --echo-size N\tEcho chunk size (default 4096).\n");
+	printf("  -o, --output FMT\tReport format: json (default) or text.\n");
+	printf("  -h, --help\t\tPrint this message.\n");
+}
+
+int main(int argc, char **argv)
+{
+	static struct option longopts[] = {
+		{"socket", required_argument, NULL, 'u'},
+		{"threads", required_argument, NULL, 'T'},
+		{"duration", required_argument, NULL, 'd'},
+		{"listen", required_argument, NULL, 'L'},
+		{"list-devices", required_argument, NULL, 'l'},
+		{"connect", required_argument, NULL, 'c'},
+		{"pair-record", required_argument, NULL, 'p'},
+		{"interval", required_argument, NULL, 'i'},
+		{"direction", required_argument, NULL, 'D'},
+		{"port", required_argument, NULL, 'P'},
+		{"bytes", required_argument, NULL, 'b'},
+		{"echo-size", required_argument, NULL, 'e'},
+		{"output", required_argument, NULL, 'o'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	int c, i, t;
+
+	while ((c = getopt_long(argc, argv, "u:T:d:L:l:c:p:i:D:P:b:e:o:h", longopts, NULL)) != -1) {
+		switch (c) {
+			case 'u':
+				socket_path = optarg;
+				break;
+			case 'T':
+				num_threads = atoi(optarg);
+				break;
+			case 'd':
+				duration_s = (unsigned int)strtoul(optarg, NULL, 10);
+				break;
+			case 'L':
+				num_listeners = atoi(optarg);
+				break;
+			case 'l':
+				num_pollers = atoi(optarg);
+				break;
+			case 'c':
+				num_bulk = atoi(optarg);
+				break;
+			case 'p':
+				num_pair = atoi(optarg);
+				break;
+			case 'i':
+				interval_ms = (unsigned int)strtoul(optarg, NULL, 10);
+				break;
+			case 'D':
+				if (!strcmp(optarg, "up")) {
+					direction = DIR_UP;
+				} else if (!strcmp(optarg, "down")) {
+					direction = DIR_DOWN;
+				} else if (!strcmp(optarg, "echo")) {
+					direction = DIR_ECHO;
+				} else {
+					fprintf(stderr, "Invalid direction '%s'\n", optarg);
+					return 2;
+				}
+				break;
+			case 'P':
+				device_port = (uint16_t)atoi(optarg);
+				break;
+			case 'b':
+				session_bytes = strtoull(optarg, NULL, 10);
+				break;
+			case 'e':
+				echo_size = (uint32_t)strtoul(optarg, NULL, 10);
+				if (echo_size == 0 || echo_size > LOAD_CHUNK_SIZE)
+					echo_size = LOAD_CHUNK_SIZE;
+				break;
+			case 'o':
+				output_json = strcmp(optarg, "text") != 0;
+				break;
+			case 'h':
+				print_usage(argv[0]);
+				return 0;
+			default:
+				print_usage(argv[0]);
+				return 2;
+		}
+	}
+	if (num_threads < 1)
+		num_threads = 1;
+	if (device_port == 0)
+		device_port = (direction == DIR_UP) ? 9 : (direction == DIR_DOWN) ? 19 : 7;
+	if (num_listeners + num_pollers + num_bulk + num_pair == 0) {
+		num_listeners = 1;
+		num_pollers = 1;
+	}
+
+	/* every worker needs a descriptor */
+	struct rlimit rlim;
+	getrlimit(RLIMIT_NOFILE, &rlim);
+	rlim.rlim_cur = rlim.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rlim);
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	if ((num_bulk > 0 || num_pair > 0) && fetch_devices() <= 0) {
+		fprintf(stderr, "No devices available at %s, cannot run Connect or ReadPairRecord load\n", socket_path);
+		return 1;
+	}
+	for (i = 0; i < LOAD_CHUNK_SIZE; i++)
+		pattern[i] = (unsigned char)(i & 0xFF);
+
+	struct load_thread *threads = calloc(num_threads, sizeof(struct load_thread));
+	int total_workers = num_listeners + num_pollers + num_bulk + num_pair;
+	for (t = 0; t < num_threads; t++) {
+		threads[t].id = t;
+		threads[t].workers = calloc(total_workers / num_threads + 1, sizeof(struct worker));
+	}
+	/* distribute workers round robin, staggering their start a little */
+	uint64_t start = ustime();
+	for (i = 0; i < total_workers; i++) {
+		struct load_thread *thr = &threads[i % num_threads];
+		struct worker *w = &thr->workers[thr->num_workers++];
+		if (i < num_listeners) {
+			w->kind = WORKER_LISTEN;
+		} else if (i < num_listeners + num_pollers) {
+			w->kind = WORKER_POLL;
+		} else if (i < num_listeners + num_pollers + num_bulk) {
+			w->kind = WORKER_BULK;
+		} else {
+			w->kind = WORKER_PAIR;
+		}
+		w->index = i;
+		w->fd = -1;
+		w->state = W_IDLE;
+		w->start_at = start + (uint64_t)(i / num_threads) * 100;
+		w->ib_capacity = LOAD_CHUNK_SIZE;
+		w->ib_buf = malloc(w->ib_capacity);
+	}
+	end_time = start + (uint64_t)duration_s * 1000000;
+
+	for (t = 0; t < num_threads; t++)
+		pthread_create(&threads[t].thread, NULL, load_thread_func, &threads[t]);
+	for (t = 0; t < num_threads; t++)
+		pthread_join(threads[t].thread, NULL);
+	double elapsed = (ustime() - start) / 1e6;
+
+	struct thread_stats total;
+	merge_stats(threads, &total);
+	print_report(&total, elapsed);
+
+	uint64_t errors = 0;
+	for (i = 0; i < OP_COUNT; i++) {
+		errors += total.ops[i].errors;
+		free(total.ops[i].lat.values);
+	}
+	for (t = 0; t < num_threads; t++) {
+		for (i = 0; i < OP_COUNT; i++)
+			free(threads[t].stats.ops[i].lat.values);
+		free(threads[t].workers);
+	}
+	free(threads);
+	for (i = 0; i < num_devices; i++)
+		free(device_serials[i]);
+	free(device_serials);
+	free(device_ids);
+	return (errors > 0) ? 1 : 0;
+}
@@ -0,0 +1,1214 @@
+/*
+ * muxreplay.c
+ *
+ * Replays traffic recorded with usbfluxd -R against a usbmuxd socket and
+ * reports command latency and relay throughput, optionally compared with
+ * the results of a previous run.
+ *
+ * Copyright (C) 2026 Corellium LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <plist/plist.h>
+
+#include "usbmuxd-proto.h"
+#include "record.h"
+
+#define REPLAY_DEFAULT_SOCKET "/var/run/usbmuxd"
+#define REPLAY_CHUNK_SIZE 0x10000
+#define REPLAY_MAX_MSG_SIZE 0x100000
+#define REPLAY_MAX_OPS 32
+#define REPLAY_MAX_METRICS 256
+
+enum port_mode {
+	PORT_AUTO,		// pick a mockmuxd service matching the recorded direction
+	PORT_KEEP,		// use the recorded port
+	PORT_FIXED		// use the port given with -P
+};
+
+enum session_mode {
+	MODE_COMMAND,		// issuing commands
+	MODE_LISTEN,		// receiving device events
+	MODE_CONNECTED		// relaying data
+};
+
+struct replay_event {
+	enum record_type type;
+	uint64_t ts;		// microseconds since the start of the recording
+	uint32_t value;		// message length or byte count
+	unsigned char *msg;
+};
+
+struct latency_samples {
+	uint32_t *values;
+	size_t count;
+	size_t capacity;
+};
+
+struct op_stats {
+	char name[32];
+	uint64_t ok;
+	uint64_t errors;
+	struct latency_samples lat;
+};
+
+struct session {
+	uint32_t client_number;
+	struct replay_event *events;
+	int num_events;
+	int events_capacity;
+	int next;
+	int fd;
+	int done;
+	enum session_mode mode;
+	int waiting_reply;
+	struct op_stats *op;
+	uint64_t op_start;
+	unsigned char *ob_data;
+	uint32_t ob_size;
+	uint32_t ob_sent;
+	unsigned char *ib_buf;
+	uint32_t ib_size;
+	uint32_t ib_capacity;
+	uint64_t up_pending;
+	uint64_t rec_up;
+	uint64_t rec_down;
+};
+
+struct metric {
+	char name[64];
+	double value;
+};
+
+static const char *socket_path = REPLAY_DEFAULT_SOCKET;
+static double speed = 1.0;
+static enum port_mode port_mode = PORT_AUTO;
+static uint16_t fixed_port = 0;
+static unsigned int timeout_s = 0;
+static int verbose = 0;
+
+static struct session *sessions = NULL;
+static int num_sessions = 0;
+static int sessions_capacity = 0;
+static uint64_t recording_duration = 0;
+
+static struct op_stats ops[REPLAY_MAX_OPS];
+static int num_ops = 0;
+static struct latency_samples schedule_lag;
+static uint64_t bytes_up = 0;
+static uint64_t bytes_down = 0;
+static uint64_t connections = 0;
+static uint64_t connect_errors = 0;
+static uint64_t disconnects = 0;
+static uint64_t device_events = 0;
+
+/* device remapping, recorded id/serial -> target id/serial */
+static uint32_t *target_ids = NULL;
+static char **target_serials = NULL;
+static int num_targets = 0;
+static uint32_t *seen_ids = NULL;
+static int num_seen_ids = 0;
+static char **seen_serials = NULL;
+static int num_seen_serials = 0;
+
+static volatile int should_stop = 0;
+static unsigned char pattern[REPLAY_CHUNK_SIZE];
+static unsigned char scratch[REPLAY_CHUNK_SIZE];
+
+static uint64_t ustime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void latency_add(struct latency_samples *lat, uint64_t us)
+{
+	if (lat->count == lat->capacity) {
+		size_t new_capacity = (lat->capacity) ? lat->capacity * 2 : 256;
+		uint32_t *new_values = realloc(lat->values, sizeof(uint32_t) * new_capacity);
+		if (!new_values)
+			return;
+		lat->values = new_values;
+		lat->capacity = new_capacity;
+	}
+	lat->values[lat->count++] = (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static uint32_t percentile(struct latency_samples *lat, double p)
+{
+	if (lat->count == 0)
+		return 0;
+	return lat->values[(size_t)(p * (double)(lat->count - 1) + 0.5)];
+}
+
+static struct op_stats *op_get(const char *name)
+{
+	int i;
+	for (i = 0; i < num_ops; i++) {
+		if (!strcmp(ops[i].name, name))
+			return &ops[i];
+	}
+	if (num_ops == REPLAY_MAX_OPS)
+		return &ops[REPLAY_MAX_OPS - 1];
+	snprintf(ops[num_ops].name, sizeof(ops[num_ops].name), "%s", name);
+	return &ops[num_ops++];
+}
+
+/* {{{ loading */
+static int get_uvarint(const unsigned char **p, const unsigned char *end, uint64_t *val)
+{
+	uint64_t res = 0;
+	int shift = 0;
+	while (*p < end && shift < 64) {
+		unsigned char b = *(*p)++;
+		res |= (uint64_t)(b & 0x7F) << shift;
+		if (!(b & 0x80)) {
+			*val = res;
+			return 0;
+		}
+		shift += 7;
+	}
+	return -1;
+}
+
+static struct session *session_get(uint32_t client_number)
+{
+	int i;
+	/* client numbers are mostly increasing, so search backwards */
+	for (i = num_sessions - 1; i >= 0; i--) {
+		if (sessions[i].client_number == client_number && !sessions[i].done)
+			return &sessions[i];
+	}
+	if (num_sessions == sessions_capacity) {
+		sessions_capacity = (sessions_capacity) ? sessions_capacity * 2 : 64;
+		sessions = realloc(sessions, sizeof(struct session) * sessions_capacity);
+	}
+	struct session *s = &sessions[num_sessions++];
+	memset(s, '\0', sizeof(struct session));
+	s->client_number = client_number;
+	s->fd = -1;
+	return s;
+}
+
+static void session_add_event(struct session *s, enum record_type type, uint64_t ts, uint32_t value, const unsigned char *msg)
+{
+	if (s->num_events == s->events_capacity) {
+		s->events_capacity = (s->events_capacity) ? s->events_capacity * 2 : 8;
+		s->events = realloc(s->events, sizeof(struct replay_event) * s->events_capacity);
+	}
+	struct replay_event *ev = &s->events[s->num_events++];
+	ev->type = type;
+	ev->ts = ts;
+	ev->value = value;
+	ev->msg = NULL;
+	if (msg) {
+		ev->msg = malloc(value);
+		memcpy(ev->msg, msg, value);
+	}
+	if (type == RECORD_DATA_UP)
+		s->rec_up += value;
+	else if (type == RECORD_DATA_DOWN)
+		s->rec_down += value;
+}
+
+static int recording_load(const char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f) {
+		fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	long fsize = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (fsize < RECORD_HEADER_SIZE) {
+		fprintf(stderr, "%s is not a usbfluxd recording\n", filename);
+		fclose(f);
+		return -1;
+	}
+	unsigned char *data = malloc(fsize);
+	if (fread(data, 1, fsize, f) != (size_t)fsize) {
+		fprintf(stderr, "Could not read %s\n", filename);
+		free(data);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	if (memcmp(data, RECORD_MAGIC, 4) != 0 || (data[4] | (data[5] << 8)) != RECORD_VERSION) {
+		fprintf(stderr, "%s is not a usbfluxd recording (or an unsupported version)\n", filename);
+		free(data);
+		return -1;
+	}
+
+	const unsigned char *p = data + RECORD_HEADER_SIZE;
+	const unsigned char *end = data + fsize;
+	uint64_t ts = 0;
+	int truncated = 0;
+	while (p < end) {
+		uint64_t delta = 0, client = 0, value = 0;
+		enum record_type type = (enum record_type)*p++;
+		if (get_uvarint(&p, end, &delta) < 0 || get_uvarint(&p, end, &client) < 0) {
+			truncated = 1;
+			break;
+		}
+		ts += delta;
+		struct session *s = session_get((uint32_t)client);
+		switch (type) {
+			case RECORD_OPEN:
+				session_add_event(s, type, ts, 0, NULL);
+				break;
+			case RECORD_CLOSE:
+				session_add_event(s, type, ts, 0, NULL);
+				s->done = 1;	// a new session may reuse the number
+				break;
+			case RECORD_COMMAND:
+				if (get_uvarint(&p, end, &value) < 0 || value > REPLAY_MAX_MSG_SIZE || value < sizeof(struct usbmuxd_header) || (uint64_t)(end - p) < value) {
+					truncated = 1;
+					break;
+				}
+				session_add_event(s, type, ts, (uint32_t)value, p);
+				p += value;
+				break;
+			case RECORD_DATA_UP:
+			case RECORD_DATA_DOWN:
+				if (get_uvarint(&p, end, &value) < 0) {
+					truncated = 1;
+					break;
+				}
+				session_add_event(s, type, ts, (uint32_t)value, NULL);
+				break;
+			default:
+				fprintf(stderr, "Unknown record type %d at offset %ld\n", type, (long)(p - data - 1));
+				truncated = 1;
+				break;
+		}
+		if (truncated)
+			break;
+	}
+	if (truncated) {
+		fprintf(stderr, "Warning: %s is truncated or corrupt, replaying what could be read\n", filename);
+	}
+	recording_duration = ts;
+	free(data);
+
+	int i;
+	for (i = 0; i < num_sessions; i++) {
+		sessions[i].done = 0;
+	}
+	return num_sessions;
+}
+/* }}} */
+
+/* {{{ message helpers */
+static const char *message_name(const unsigned char *msg, char *buf, size_t bufsize)
+{
+	const struct usbmuxd_header *hdr = (const struct usbmuxd_header*)msg;
+	switch (hdr->message) {
+		case MESSAGE_PLIST: {
+			plist_t pl = NULL;
+			plist_from_xml((const char*)msg + sizeof(struct usbmuxd_header), hdr->length - sizeof(struct usbmuxd_header), &pl);
+			plist_t node = (pl) ? plist_dict_get_item(pl, "MessageType") : NULL;
+			char *str = NULL;
+			if (node && plist_get_node_type(node) == PLIST_STRING)
+				plist_get_string_val(node, &str);
+			snprintf(buf, bufsize, "%s", (str) ? str : "(invalid)");
+			free(str);
+			plist_free(pl);
+			break;
+		}
+		case MESSAGE_LISTEN:
+			snprintf(buf, bufsize, "Listen");
+			break;
+		case MESSAGE_CONNECT:
+			snprintf(buf, bufsize, "Connect");
+			break;
+		default:
+			snprintf(buf, bufsize, "Message%u", hdr->message);
+			break;
+	}
+	return buf;
+}
+
+static int remap_index_id(uint32_t id)
+{
+	int i;
+	for (i = 0; i < num_seen_ids; i++) {
+		if (seen_ids[i] == id)
+			return i;
+	}
+	seen_ids = realloc(seen_ids, sizeof(uint32_t) * (num_seen_ids + 1));
+	seen_ids[num_seen_ids] = id;
+	return num_seen_ids++;
+}
+
+static int remap_index_serial(const char *serial)
+{
+	int i;
+	for (i = 0; i < num_seen_serials; i++) {
+		if (!strcmp(seen_serials[i], serial))
+			return i;
+	}
+	seen_serials = realloc(seen_serials, sizeof(char*) * (num_seen_serials + 1));
+	seen_serials[num_seen_serials] = strdup(serial);
+	return num_seen_serials++;
+}
+
+static uint16_t session_port(struct session *s, uint16_t recorded)
+{
+	switch (port_mode) {
+		case PORT_KEEP:
+			return recorded;
+		case PORT_FIXED:
+			return fixed_port;
+		case PORT_AUTO:
+		default:
+			/* mockmuxd services: 7 echo, 9 sink, 19 source */
+			if (s->rec_up > 0 && s->rec_down > 0)
+				return 7;
+			if (s->rec_down > 0)
+				return 19;
+			return 9;
+	}
+}
+
+/* Point device ids, ports and pair record ids at the replay target. */
+static void rewrite_command(struct session *s, struct replay_event *ev)
+{
+	struct usbmuxd_header *hdr = (struct usbmuxd_header*)ev->msg;
+	if (hdr->message == MESSAGE_CONNECT && hdr->length >= sizeof(struct usbmuxd_connect_request)) {
+		struct usbmuxd_connect_request *req = (struct usbmuxd_connect_request*)ev->msg;
+		int idx = remap_index_id(req->device_id);
+		if (num_targets > 0)
+			req->device_id = target_ids[idx % num_targets];
+		req->port = htons(session_port(s, ntohs(req->port)));
+		return;
+	}
+	if (hdr->message != MESSAGE_PLIST)
+		return;
+
+	plist_t pl = NULL;
+	plist_from_xml((char*)ev->msg + sizeof(struct usbmuxd_header), hdr->length - sizeof(struct usbmuxd_header), &pl);
+	if (!pl)
+		return;
+	int changed = 0;
+	plist_t node = plist_dict_get_item(pl, "DeviceID");
+	if (node && plist_get_node_type(node) == PLIST_UINT && num_targets > 0) {
+		uint64_t val = 0;
+		plist_get_uint_val(node, &val);
+		int idx = remap_index_id((uint32_t)val);
+		plist_dict_set_item(pl, "DeviceID", plist_new_uint(target_ids[idx % num_targets]));
+		changed = 1;
+	}
+	node = plist_dict_get_item(pl, "PortNumber");
+	if (node && plist_get_node_type(node) == PLIST_UINT && port_mode != PORT_KEEP) {
+		uint64_t val = 0;
+		plist_get_uint_val(node, &val);
+		plist_dict_set_item(pl, "PortNumber", plist_new_uint(htons(session_port(s, ntohs((uint16_t)val)))));
+		changed = 1;
+	}
+	node = plist_dict_get_item(pl, "PairRecordID");
+	if (node && plist_get_node_type(node) == PLIST_STRING && num_targets > 0) {
+		char *serial = NULL;
+		plist_get_string_val(node, &serial);
+		if (serial) {
+			int idx = remap_index_serial(serial);
+			plist_dict_set_item(pl, "PairRecordID", plist_new_string(target_serials[idx % num_targets]));
+			changed = 1;
+			free(serial);
+		}
+	}
+	if (changed) {
+		char *xml = NULL;
+		uint32_t xmlsize = 0;
+		plist_to_xml(pl, &xml, &xmlsize);
+		if (xml) {
+			struct usbmuxd_header newhdr = *hdr;
+			newhdr.length = sizeof(struct usbmuxd_header) + xmlsize;
+			free(ev->msg);
+			ev->msg = malloc(newhdr.length);
+			memcpy(ev->msg, &newhdr, sizeof(newhdr));
+			memcpy(ev->msg + sizeof(newhdr), xml, xmlsize);
+			ev->value = newhdr.length;
+			free(xml);
+		}
+	}
+	plist_free(pl);
+}
+
+static int reply_result(struct usbmuxd_header *hdr)
+{
+	if (hdr->message == MESSAGE_RESULT && hdr->length >= sizeof(struct usbmuxd_result_msg))
+		return (int)((struct usbmuxd_result_msg*)hdr)->result;
+	if (hdr->message != MESSAGE_PLIST)
+		return 0;
+	plist_t pl = NULL;
+	plist_from_xml((char*)hdr + sizeof(struct usbmuxd_header), hdr->length - sizeof(struct usbmuxd_header), &pl);
+	if (!pl)
+		return -1;
+	int res = 0;
+	plist_t node = plist_dict_get_item(pl, "MessageType");
+	char *str = NULL;
+	if (node && plist_get_node_type(node) == PLIST_STRING)
+		plist_get_string_val(node, &str);
+	if (str && !strcmp(str, "Result")) {
+		node = plist_dict_get_item(pl, "Number");
+		uint64_t val = 0;
+		if (node)
+			plist_get_uint_val(node, &val);
+		res = (int)val;
+	}
+	free(str);
+	plist_free(pl);
+	return res;
+}
+
+static int socket_connect_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	memset(&addr, '\0', sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* blocking ListDevices used to map recorded devices to available ones */
+static int fetch_devices(void)
+{
+	int fd = socket_connect_unix(socket_path);
+	if (fd < 0)
+		return -1;
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "MessageType", plist_new_string("ListDevices"));
+	plist_dict_set_item(dict, "ProgName", plist_new_string("muxreplay"));
+	char *xml = NULL;
+	uint32_t xmlsize = 0;
+	plist_to_xml(dict, &xml, &xmlsize);
+	plist_free(dict);
+	struct usbmuxd_header hdr = { sizeof(struct usbmuxd_header) + xmlsize, 1, MESSAGE_PLIST, 1 };
+	if (send(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || send(fd, xml, xmlsize, 0) != (ssize_t)xmlsize) {
+		free(xml);
+		close(fd);
+		return -1;
+	}
+	free(xml);
+	if (recv(fd, &hdr, sizeof(hdr), MSG_WAITALL) != sizeof(hdr) || hdr.length < sizeof(hdr) || hdr.length > REPLAY_MAX_MSG_SIZE) {
+		close(fd);
+		return -1;
+	}
+	uint32_t payload_size = hdr.length - sizeof(hdr);
+	char *payload = malloc(payload_size);
+	if (recv(fd, payload, payload_size, MSG_WAITALL) != (ssize_t)payload_size) {
+		free(payload);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	plist_t pl = NULL;
+	plist_from_xml(payload, payload_size, &pl);
+	free(payload);
+	plist_t list = (pl) ? plist_dict_get_item(pl, "DeviceList") : NULL;
+	uint32_t i, n = plist_array_get_size(list);
+	target_ids = calloc(n + 1, sizeof(uint32_t));
+	target_serials = calloc(n + 1, sizeof(char*));
+	for (i = 0; i < n; i++) {
+		plist_t dev = plist_array_get_item(list, i);
+		plist_t node = plist_dict_get_item(dev, "DeviceID");
+		uint64_t val = 0;
+		if (node)
+			plist_get_uint_val(node, &val);
+		node = plist_access_path(dev, 2, "Properties", "SerialNumber");
+		char *serial = NULL;
+		if (node)
+			plist_get_string_val(node, &serial);
+		target_ids[num_targets] = (uint32_t)val;
+		target_serials[num_targets] = (serial) ? serial : strdup("");
+		num_targets++;
+	}
+	plist_free(pl);
+	return num_targets;
+}
+/* }}} */
+
+/* {{{ replay */
+static void session_close(struct session *s)
+{
+	if (s->fd >= 0)
+		close(s->fd);
+	s->fd = -1;
+	s->done = 1;
+	s->waiting_reply = 0;
+	s->ob_size = 0;
+}
+
+static int session_open(struct session *s)
+{
+	s->fd = socket_connect_unix(socket_path);
+	connections++;
+	if (s->fd < 0) {
+		connect_errors++;
+		return -1;
+	}
+	int flags = fcntl(s->fd, F_GETFL, 0);
+	fcntl(s->fd, F_SETFL, flags | O_NONBLOCK);
+	s->mode = MODE_COMMAND;
+	return 0;
+}
+
+static uint64_t event_due(struct replay_event *ev, uint64_t start)
+{
+	if (speed <= 0)
+		return start;
+	return start + (uint64_t)((double)ev->ts / speed);
+}
+
+/* Advance a session through all events that are due. Returns the time the
+ * next event is due at, or 0 if the session is blocked on I/O or done. */
+static uint64_t session_advance(struct session *s, uint64_t start, uint64_t now)
+{
+	char name[32];
+	while (!s->done && !s->waiting_reply && s->next < s->num_events) {
+		struct replay_event *ev = &s->events[s->next];
+		uint64_t due = event_due(ev, start);
+		if (due > now)
+			return due;
+		switch (ev->type) {
+			case RECORD_OPEN:
+				if (s->fd < 0 && session_open(s) < 0) {
+					session_close(s);
+					return 0;
+				}
+				break;
+			case RECORD_COMMAND:
+				if (s->fd < 0 && session_open(s) < 0) {
+					session_close(s);
+					return 0;
+				}
+				if (s->mode != MODE_COMMAND)
+					break;
+				latency_add(&schedule_lag, now - due);
+				s->op = op_get(message_name(ev->msg, name, sizeof(name)));
+				s->op_start = now;
+				s->ob_data = ev->msg;
+				s->ob_size = ev->value;
+				s->ob_sent = 0;
+				s->ib_size = 0;
+				s->waiting_reply = 1;
+				break;
+			case RECORD_DATA_UP:
+				if (s->mode == MODE_CONNECTED)
+					s->up_pending += ev->value;
+				break;
+			case RECORD_DATA_DOWN:
+				/* data is read as it arrives, only the volume is reported */
+				break;
+			case RECORD_CLOSE:
+				if (s->up_pending > 0)
+					return 0;
+				session_close(s);
+				break;
+			default:
+				break;
+		}
+		s->next++;
+	}
+	if (!s->done && s->next >= s->num_events && !s->waiting_reply && s->up_pending == 0) {
+		/* the client was still connected when the recording ended; keep
+		 * listeners subscribed until the end of the recording */
+		uint64_t end = start + ((speed > 0) ? (uint64_t)(recording_duration / speed) : 0);
+		if (s->mode != MODE_LISTEN || now >= end) {
+			session_close(s);
+		} else {
+			return end;
+		}
+	}
+	return 0;
+}
+
+static int session_read_message(struct session *s)
+{
+	uint32_t want = sizeof(struct usbmuxd_header);
+	if (s->ib_size >= sizeof(struct usbmuxd_header)) {
+		want = ((struct usbmuxd_header*)s->ib_buf)->length;
+		if (want < sizeof(struct usbmuxd_header) || want > REPLAY_MAX_MSG_SIZE)
+			return -1;
+	}
+	if (want > s->ib_capacity) {
+		unsigned char *new_buf = realloc(s->ib_buf, want);
+		if (!new_buf)
+			return -1;
+		s->ib_buf = new_buf;
+		s->ib_capacity = want;
+	}
+	ssize_t r = recv(s->fd, s->ib_buf + s->ib_size, want - s->ib_size, 0);
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (r <= 0)
+		return -1;
+	s->ib_size += r;
+	if (s->ib_size < sizeof(struct usbmuxd_header))
+		return 0;
+	return (s->ib_size == ((struct usbmuxd_header*)s->ib_buf)->length) ? 1 : 0;
+}
+
+static void session_handle_reply(struct session *s)
+{
+	struct usbmuxd_header *hdr = (struct usbmuxd_header*)s->ib_buf;
+	int res = reply_result(hdr);
+	struct replay_event *ev = &s->events[s->next - 1];
+	struct usbmuxd_header *req = (struct usbmuxd_header*)ev->msg;
+	char name[32];
+
+	s->ib_size = 0;
+	s->waiting_reply = 0;
+	if (res != 0) {
+		s->op->errors++;
+		if (verbose)
+			fprintf(stderr, "client %u: %s failed with result %d\n", s->client_number, s->op->name, res);
+	} else {
+		s->op->ok++;
+		latency_add(&s->op->lat, ustime() - s->op_start);
+	}
+	message_name(ev->msg, name, sizeof(name));
+	if (res == 0 && (req->message == MESSAGE_LISTEN || !strcmp(name, "Listen"))) {
+		s->mode = MODE_LISTEN;
+	} else if (req->message == MESSAGE_CONNECT || !strcmp(name, "Connect")) {
+		if (res == 0) {
+			s->mode = MODE_CONNECTED;
+		} else {
+			/* like a real client, give up on this session */
+			session_close(s);
+		}
+	}
+}
+
+static void session_process(struct session *s, short revents)
+{
+	if (revents & (POLLERR | POLLNVAL)) {
+		if (s->waiting_reply)
+			s->op->errors++;
+		disconnects++;
+		session_close(s);
+		return;
+	}
+	if (s->waiting_reply) {
+		if (s->ob_sent < s->ob_size && (revents & POLLOUT)) {
+			ssize_t r = send(s->fd, s->ob_data + s->ob_sent, s->ob_size - s->ob_sent, 0);
+			if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return;
+			if (r <= 0) {
+				s->op->errors++;
+				session_close(s);
+				return;
+			}
+			s->ob_sent += r;
+		} else if (revents & (POLLIN | POLLHUP)) {
+			int res = session_read_message(s);
+			if (res < 0) {
+				s->op->errors++;
+				disconnects++;
+				session_close(s);
+			} else if (res > 0) {
+				session_handle_reply(s);
+			}
+		}
+		return;
+	}
+	if (s->mode == MODE_LISTEN && (revents & (POLLIN | POLLHUP))) {
+		int res = session_read_message(s);
+		if (res < 0) {
+			disconnects++;
+			session_close(s);
+		} else if (res > 0) {
+			device_events++;
+			s->ib_size = 0;
+		}
+		return;
+	}
+	if (s->mode == MODE_CONNECTED) {
+		if (revents & (POLLIN | POLLHUP)) {
+			ssize_t r = recv(s->fd, scratch, sizeof(scratch), 0);
+			if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+				disconnects++;
+				session_close(s);
+				return;
+			}
+			if (r > 0)
+				bytes_down += r;
+		}
+		if ((revents & POLLOUT) && s->up_pending > 0) {
+			size_t len = (s->up_pending > sizeof(pattern)) ? sizeof(pattern) : (size_t)s->up_pending;
+			ssize_t r = send(s->fd, pattern, len, 0);
+			if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return;
+			if (r <= 0) {
+				disconnects++;
+				session_close(s);
+				return;
+			}
+			bytes_up += r;
+			s->up_pending -= r;
+		}
+	}
+}
+
+static short session_events(struct session *s)
+{
+	if (s->waiting_reply)
+		return (s->ob_sent < s->ob_size) ? POLLOUT : POLLIN;
+	switch (s->mode) {
+		case MODE_LISTEN:
+			return POLLIN;
+		case MODE_CONNECTED:
+			return POLLIN | ((s->up_pending > 0) ? POLLOUT : 0);
+		case MODE_COMMAND:
+		default:
+			return 0;
+	}
+}
+
+static double replay_run(void)
+{
+	struct pollfd *fds = calloc(num_sessions, sizeof(struct pollfd));
+	int *fd_sessions = calloc(num_sessions, sizeof(int));
+	uint64_t start = ustime();
+	uint64_t deadline = start + ((speed > 0) ? (uint64_t)(recording_duration / speed) : 0) + (uint64_t)timeout_s * 1000000;
+	int i;
+
+	while (!should_stop) {
+		uint64_t now = ustime();
+		uint64_t next_due = 0;
+		int count = 0;
+		int active = 0;
+		if (now >= deadline) {
+			fprintf(stderr, "Replay timed out, closing remaining sessions\n");
+			break;
+		}
+		for (i = 0; i < num_sessions; i++) {
+			struct session *s = &sessions[i];
+			if (s->done)
+				continue;
+			uint64_t due = session_advance(s, start, now);
+			if (s->done)
+				continue;
+			active++;
+			if (due > 0 && (next_due == 0 || due < next_due))
+				next_due = due;
+			if (s->fd < 0)
+				continue;
+			short events = session_events(s);
+			if (!events && s->mode == MODE_COMMAND)
+				continue;
+			fds[count].fd = s->fd;
+			fds[count].events = events;
+			fds[count].revents = 0;
+			fd_sessions[count] = i;
+			count++;
+		}
+		if (active == 0)
+			break;
+		int timeout = 100;
+		if (next_due > 0) {
+			uint64_t wait = (next_due > now) ? (next_due - now + 999) / 1000 : 0;
+			if (wait < (uint64_t)timeout)
+				timeout = (int)wait;
+		}
+		int ready = poll(fds, count, timeout);
+		if (ready < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; i < count && ready > 0; i++) {
+			if (!fds[i].revents)
+				continue;
+			ready--;
+			session_process(&sessions[fd_sessions[i]], fds[i].revents);
+		}
+	}
+	double elapsed = (ustime() - start) / 1e6;
+	for (i = 0; i < num_sessions; i++) {
+		if (sessions[i].waiting_reply)
+			sessions[i].op->errors++;
+		session_close(&sessions[i]);
+	}
+	free(fds);
+	free(fd_sessions);
+	return elapsed;
+}
+/* }}} */
+
+/* {{{ reporting */
+static void metric_add(struct metric *metrics, int *count, const char *name, double value)
+{
+	if (*count >= REPLAY_MAX_METRICS)
+		return;
+	snprintf(metrics[*count].name, sizeof(metrics[*count].name), "%.63s", name);
+	metrics[*count].value = value;
+	(*count)++;
+}
+
+static int collect_metrics(struct metric *metrics, double elapsed)
+{
+	int count = 0;
+	int i;
+	char name[64];
+	uint64_t errors = connect_errors;
+
+	metric_add(metrics, &count, "recorded_s", recording_duration / 1e6);
+	metric_add(metrics, &count, "replay_s", elapsed);
+	metric_add(metrics, &count, "sessions", num_sessions);
+	metric_add(metrics, &count, "bytes_up", (double)bytes_up);
+	metric_add(metrics, &count, "bytes_down", (double)bytes_down);
+	metric_add(metrics, &count, "throughput_up_Bps", bytes_up / elapsed);
+	metric_add(metrics, &count, "throughput_down_Bps", bytes_down / elapsed);
+	metric_add(metrics, &count, "device_events", (double)device_events);
+	metric_add(metrics, &count, "disconnects", (double)disconnects);
+	qsort(schedule_lag.values, schedule_lag.count, sizeof(uint32_t), compare_u32);
+	metric_add(metrics, &count, "schedule_lag.p50_us", percentile(&schedule_lag, 0.50));
+	metric_add(metrics, &count, "schedule_lag.p99_us", percentile(&schedule_lag, 0.99));
+	for (i = 0; i < num_ops; i++) {
+		struct op_stats *op = &ops[i];
+		qsort(op->lat.values, op->lat.count, sizeof(uint32_t), compare_u32);
+		errors += op->errors;
+		snprintf(name, sizeof(name), "%.31s.ok", op->name);
+		metric_add(metrics, &count, name, (double)op->ok);
+		snprintf(name, sizeof(name), "%.31s.errors", op->name);
+		metric_add(metrics, &count, name, (double)op->errors);
+		snprintf(name, sizeof(name), "%.31s.p50_us", op->name);
+		metric_add(metrics, &count, name, percentile(&op->lat, 0.50));
+		snprintf(name, sizeof(name), "%.31s.p99_us", op->name);
+		metric_add(metrics, &count, name, percentile(&op->lat, 0.99));
+		snprintf(name, sizeof(name), "%.31s.max_us", op->name);
+		metric_add(metrics, &count, name, (op->lat.count > 0) ? op->lat.values[op->lat.count - 1] : 0);
+	}
+	metric_add(metrics, &count, "errors", (double)errors);
+	return count;
+}
+
+static int metrics_load(const char *filename, struct metric *metrics)
+{
+	FILE *f = fopen(filename, "r");
+	if (!f)
+		return -1;
+	char line[256];
+	int count = 0;
+	while (fgets(line, sizeof(line), f) && count < REPLAY_MAX_METRICS) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%63s %lf", metrics[count].name, &metrics[count].value) == 2)
+			count++;
+	}
+	fclose(f);
+	return count;
+}
+
+/* latencies and error counts are better when lower, throughput when higher */
+static int metric_regressed(const char *name, double base, double cur, double tolerance)
+{
+	double delta = (base > 0) ? (cur - base) * 100.0 / base : 0;
+	if (strstr(name, "errors") || !strcmp(name, "disconnects")) {
+		if (base == 0)
+			return cur > 0;
+		return delta > tolerance;
+	}
+	if (strstr(name, "_us"))
+		return (base > 0 && delta > tolerance);
+	if (strstr(name, "throughput"))
+		return (delta < -tolerance);
+	return 0;
+}
+
+static int print_metrics(struct metric *metrics, int count, struct metric *base, int base_count, double tolerance)
+{
+	int i, j;
+	int regressions = 0;
+	printf("%-32s %16s", "metric", "value");
+	if (base)
+		printf(" %16s %8s", "baseline", "delta");
+	printf("\n");
+	for (i = 0; i < count; i++) {
+		printf("%-32s %16.1f", metrics[i].name, metrics[i].value);
+		if (base) {
+			for (j = 0; j < base_count; j++) {
+				if (!strcmp(base[j].name, metrics[i].name))
+					break;
+			}
+			if (j < base_count) {
+				double delta = (base[j].value > 0) ? (metrics[i].value - base[j].value) * 100.0 / base[j].value : 0;
+				printf(" %16.1f %+7.1f%%", base[j].value, delta);
+				if (tolerance > 0 && metric_regressed(metrics[i].name, base[j].value, metrics[i].value, tolerance)) {
+					printf("  REGRESSION");
+					regressions++;
+				}
+			} else {
+				printf(" %16s", "(new)");
+			}
+		}
+		printf("\n");
+	}
+	return regressions;
+}
+
+static void print_recording(void)
+{
+	int i, j;
+	char name[32];
+	uint64_t up = 0, down = 0;
+	printf("duration %.3f s, %d sessions\n", recording_duration / 1e6, num_sessions);
+	for (i = 0; i < num_sessions; i++) {
+		struct session *s = &sessions[i];
+		for (j = 0; j < s->num_events; j++) {
+			struct replay_event *ev = &s->events[j];
+			if (ev->type == RECORD_COMMAND) {
+				op_get(message_name(ev->msg, name, sizeof(name)))->ok++;
+			}
+			if (verbose) {
+				printf("%12.6f client %u ", ev->ts / 1e6, s->client_number);
+				switch (ev->type) {
+					case RECORD_OPEN: printf("open\n"); break;
+					case RECORD_CLOSE: printf("close\n"); break;
+					case RECORD_COMMAND: printf("command %s (%u bytes)\n", message_name(ev->msg, name, sizeof(name)), ev->value); break;
+					case RECORD_DATA_UP: printf("data up %u bytes\n", ev->value); break;
+					case RECORD_DATA_DOWN: printf("data down %u bytes\n", ev->value); break;
+					default: printf("type %d\n", ev->type); break;
+				}
+			}
+		}
+		up += s->rec_up;
+		down += s->rec_down;
+	}
+	printf("relayed %llu bytes up, %llu bytes down\n", (unsigned long long)up, (unsigned long long)down);
+	for (i = 0; i < num_ops; i++) {
+		printf("%-24s %10llu\n", ops[i].name, (unsigned long long)ops[i].ok);
+	}
+}
+/* }}} */
+
+static void handle_signal(int sig)
+{
+	should_stop = 1;
+}
+
+static void print_usage(const char *argv0)
+{
+	const char *cmd = strrchr(argv0, '/');
+	cmd = (cmd) ? cmd+1 : argv0;
+	printf("Usage: %s [OPTIONS] RECORDING\n", cmd);
+	printf("Replays a traffic recording made with usbfluxd -R.\n\n");
+	printf("  -u, --socket PATH\tusbmuxd socket to replay against (default %s).\n", REPLAY_DEFAULT_SOCKET);
+	printf("  -s, --speed FACTOR\tReplay speed, 2 is twice as fast; 0 replays\n");
+	printf("                  \twithout pauses (default 1).\n");
+	printf("  -P, --port MODE\tauto (mockmuxd echo/sink/source by recorded\n");
+	printf("                  \tdirection, default), keep, or a port number.\n");
+	printf("  -t, --timeout SEC\tExtra time allowed beyond the recording (default 30).\n");
+	printf("  -w, --write FILE\tWrite the results to FILE for later comparison.\n");
+	printf("  -c, --compare FILE\tCompare the results with a previous run.\n");
+	printf("  -r, --tolerance PCT\tWith -c, fail on latency, error or throughput\n");
+	printf("                  \tregressions above PCT percent.\n");
+	printf("  -l, --list\t\tSummarize the recording instead of replaying it\n");
+	printf("                  \t(with -v, list every record).\n");
+	printf("  -v, --verbose\t\tBe verbose.\n");
+	printf("  -h, --help\t\tPrint this message.\n");
+}
+
+int main(int argc, char **argv)
+{
+	static struct option longopts[] = {
+		{"socket", required_argument, NULL, 'u'},
+		{"speed", required_argument, NULL, 's'},
+		{"port", required_argument, NULL, 'P'},
+		{"timeout", required_argument, NULL, 't'},
+		{"write", required_argument, NULL, 'w'},
+		{"compare", required_argument, NULL, 'c'},
+		{"tolerance", required_argument, NULL, 'r'},
+		{"list", no_argument, NULL, 'l'},
+		{"verbose", no_argument, NULL, 'v'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	const char *write_file = NULL;
+	const char *compare_file = NULL;
+	double tolerance = 0;
+	int list_only = 0;
+	int c, i, j;
+
+	timeout_s = 30;
+	while ((c = getopt_long(argc, argv, "u:s:P:t:w:c:r:lvh", longopts, NULL)) != -1) {
+		switch (c) {
+			case 'u':
+				socket_path = optarg;
+				break;
+			case 's':
+				speed = strtod(optarg, NULL);
+				break;
+			case 'P':
+				if (!strcmp(optarg, "auto")) {
+					port_mode = PORT_AUTO;
+				} else if (!strcmp(optarg, "keep")) {
+					port_mode = PORT_KEEP;
+				} else {
+					port_mode = PORT_FIXED;
+					fixed_port = (uint16_t)atoi(optarg);
+				}
+				break;
+			case 't':
+				timeout_s = (unsigned int)strtoul(optarg, NULL, 10);
+				break;
+			case 'w':
+				write_file = optarg;
+				break;
+			case 'c':
+				compare_file = optarg;
+				break;
+			case 'r':
+				tolerance = strtod(optarg, NULL);
+				break;
+			case 'l':
+				list_only = 1;
+				break;
+			case 'v':
+				verbose++;
+				break;
+			case 'h':
+				print_usage(argv[0]);
+				return 0;
+			default:
+				print_usage(argv[0]);
+				return 2;
+		}
+	}
+	if (optind >= argc) {
+		print_usage(argv[0]);
+		return 2;
+	}
+	if (recording_load(argv[optind]) < 0)
+		return 1;
+
+	if (list_only) {
+		print_recording();
+		return 0;
+	}
+
+	struct rlimit rlim;
+	getrlimit(RLIMIT_NOFILE, &rlim);
+	rlim.rlim_cur = rlim.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rlim);
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	if (fetch_devices() <= 0) {
+		fprintf(stderr, "Warning: no devices available at %s, device commands will fail\n", socket_path);
+	}
+	for (i = 0; i < num_sessions; i++) {
+		for (j = 0; j < sessions[i].num_events; j++) {
+			if (sessions[i].events[j].type == RECORD_COMMAND)
+				rewrite_command(&sessions[i], &sessions[i].events[j]);
+		}
+	}
+	for (i = 0; i < REPLAY_CHUNK_SIZE; i++)
+		pattern[i] = (unsigned char)(i & 0xFF);
+
+	double elapsed = replay_run();
+
+	struct metric *metrics = calloc(REPLAY_MAX_METRICS, sizeof(struct metric));
+	struct metric *base = NULL;
+	int base_count = 0;
+	int count = collect_metrics(metrics, elapsed);
+	if (compare_file) {
+		base = calloc(REPLAY_MAX_METRICS, sizeof(struct metric));
+		base_count = metrics_load(compare_file, base);
+		if (base_count < 0) {
+			fprintf(stderr, "Could not read %s, printing results only\n", compare_file);
+			free(base);
+			base = NULL;
+		}
+	}
+	int regressions = print_metrics(metrics, count, base, base_count, tolerance);
+	if (write_file) {
+		FILE *f = fopen(write_file, "w");
+		if (f) {
+			fprintf(f, "# muxreplay %s\n", argv[optind]);
+			for (i = 0; i < count; i++)
+				fprintf(f, "%s %.1f\n", metrics[i].name, metrics[i].value);
+			fclose(f);
+		} else {
+			fprintf(stderr, "Could not write %s: %s\n", write_file, strerror(errno));
+		}
+	}
+
+	free(base);
+	free(metrics);
+	for (i = 0; i < num_sessions; i++) {
+		for (j = 0; j < sessions[i].num_events; j++)
+			free(sessions[i].events[j].msg);
+		free(sessions[i].events);
+		free(sessions[i].ib_buf);
+	}
+	free(sessions);
+	for (i = 0; i < num_ops; i++)
+		free(ops[i].lat.values);
+	free(schedule_lag.values);
+	for (i = 0; i < num_targets; i++)
+		free(target_serials[i]);
+	free(target_serials);
+	free(target_ids);
+	for (i = 0; i < num_seen_serials; i++)
+		free(seen_serials[i]);
+	free(seen_serials);
+	free(seen_ids);
+
+	if (regressions > 0) {
+		printf("%d metric(s) regressed against %s\n", regressions, compare_file);
+		return 1;
+	}
+	return 0;
+}
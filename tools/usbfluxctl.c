@@ -208,6 +208,15 @@ static int handle_list(const char *arg)
 					plist_t devices = plist_dict_get_item(node, "Devices");
 					uint32_t num = plist_array_get_size(devices);
 					printf(" (%u)", num);
+					plist_t rtt = plist_dict_get_item(node, "RTT");
+					if (rtt) {
+						char *health = plist_dict_copy_string_val(node, "Health");
+						printf(" rtt %.1f ms jitter %.1f ms%s%s",
+							plist_dict_get_uint_val(node, "RTT") / 1000.0,
+							plist_dict_get_uint_val(node, "RTTJitter") / 1000.0,
+							(health) ? " " : "", (health) ? health : "");
+						free(health);
+					}
 					printf("\n");
 					uint32_t i = 0;
 					for (i = 0; i < num; i++) {
@@ -340,6 +349,26 @@ static int handle_listeners()
 	return 0;
 }
 
+static int handle_stats()
+{
+	char req_xml[] = "<plist version=\"1.0\"><dict><key>MessageType</key><string>Stats</string></dict></plist>";
+
+	plist_t pl = usbfluxd_query(req_xml);
+	if (pl) {
+		char *xml = NULL;
+		uint32_t xlen = 0;
+		plist_to_xml(pl, &xml, &xlen);
+		puts(xml);
+		free(xml);
+		plist_free(pl);
+	} else {
+		fprintf(stderr, "Failed to get statistics.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
 static void print_usage(const char *argv0)
 {
 	const char *cmd = strrchr(argv0, '/');
@@ -347,6 +376,7 @@ static void print_usage(const char *argv0)
 	printf("usage: %s add HOSTADDR[:PORT]\n", cmd);
 	printf("       %s del HOSTADDR[:PORT]\n", cmd);
 	printf("       %s list [xml]\n", cmd);	
+	printf("       %s stats\n", cmd);
 }
 
 int main(int argc, char **argv)
@@ -374,6 +404,8 @@ int main(int argc, char **argv)
 		result = handle_list(argv[2]);
 	} else if (strcmp(argv[1], "listeners") == 0) {
 		result = handle_listeners();
+	} else if (strcmp(argv[1], "stats") == 0) {
+		result = handle_stats();
 	} else {
 		print_usage(argv[0]);
 		return -1;
@@ -0,0 +1,93 @@
+-- usbfluxd.lua - Wireshark dissector for usbfluxd pcap-ng captures
+--
+-- Captures written by `usbfluxd -c FILE` use link type USER0 (147). Every
+-- frame starts with a 16 byte pseudo header (big endian) describing the
+-- session, followed by either a usbmuxd protocol message (control frames)
+-- or raw relayed bytes (data frames).
+--
+-- Install by copying this file into your Wireshark personal plugins
+-- directory (see Help -> About Wireshark -> Folders), or run
+--   wireshark -X lua_script:usbfluxd.lua capture.pcapng
+
+local usbfluxd = Proto("usbfluxd", "usbfluxd capture")
+
+local directions = {
+	[0] = "client -> usbfluxd",
+	[1] = "usbfluxd -> client",
+	[2] = "usbfluxd -> usbmuxd",
+	[3] = "usbmuxd -> usbfluxd",
+}
+local kinds = { [0] = "Control", [1] = "Data" }
+local msgtypes = {
+	[1] = "Result",
+	[2] = "Connect",
+	[3] = "Listen",
+	[4] = "Device Add",
+	[5] = "Device Remove",
+	[8] = "Plist",
+}
+
+local f = usbfluxd.fields
+f.version = ProtoField.uint8("usbfluxd.version", "Pseudo header version")
+f.direction = ProtoField.uint8("usbfluxd.direction", "Direction", base.DEC, directions)
+f.kind = ProtoField.uint8("usbfluxd.kind", "Kind", base.DEC, kinds)
+f.remote_id = ProtoField.uint8("usbfluxd.remote_id", "Remote instance id")
+f.client = ProtoField.uint32("usbfluxd.client", "Client number")
+f.device_id = ProtoField.uint32("usbfluxd.device_id", "Device id", base.HEX)
+f.fd = ProtoField.int32("usbfluxd.fd", "File descriptor")
+f.length = ProtoField.uint32("usbfluxd.mux.length", "Length")
+f.mux_version = ProtoField.uint32("usbfluxd.mux.version", "Protocol version")
+f.message = ProtoField.uint32("usbfluxd.mux.message", "Message", base.DEC, msgtypes)
+f.tag = ProtoField.uint32("usbfluxd.mux.tag", "Tag")
+f.result = ProtoField.uint32("usbfluxd.mux.result", "Result")
+f.data = ProtoField.bytes("usbfluxd.data", "Data")
+
+local xml = Dissector.get("xml")
+
+function usbfluxd.dissector(buf, pinfo, tree)
+	if buf:len() < 16 then
+		return 0
+	end
+	pinfo.cols.protocol = "usbfluxd"
+	local t = tree:add(usbfluxd, buf(0, 16), "usbfluxd session")
+	t:add(f.version, buf(0, 1))
+	t:add(f.direction, buf(1, 1))
+	t:add(f.kind, buf(2, 1))
+	t:add(f.remote_id, buf(3, 1))
+	t:add(f.client, buf(4, 4))
+	t:add(f.device_id, buf(8, 4))
+	t:add(f.fd, buf(12, 4))
+
+	local dir = directions[buf(1, 1):uint()] or "?"
+	local rest = buf(16)
+	if buf(2, 1):uint() == 1 then
+		pinfo.cols.info = string.format("%s data, %d bytes", dir, rest:len())
+		tree:add(f.data, rest)
+		return buf:len()
+	end
+
+	if rest:len() < 16 then
+		return buf:len()
+	end
+	local m = tree:add(usbfluxd, rest, "usbmuxd message")
+	m:add_le(f.length, rest(0, 4))
+	m:add_le(f.mux_version, rest(4, 4))
+	m:add_le(f.message, rest(8, 4))
+	m:add_le(f.tag, rest(12, 4))
+	local msg = rest(8, 4):le_uint()
+	pinfo.cols.info = string.format("%s %s, tag %d", dir, msgtypes[msg] or tostring(msg), rest(12, 4):le_uint())
+	if rest:len() > 16 then
+		local payload = rest(16)
+		if msg == 8 and xml then
+			xml:call(payload:tvb(), pinfo, m)
+		elseif msg == 1 and payload:len() >= 4 then
+			m:add_le(f.result, payload(0, 4))
+		else
+			m:add(f.data, payload)
+		end
+	end
+	return buf:len()
+end
+
+local wtap_encap = DissectorTable.get("wtap_encap")
+wtap_encap:add(wtap.USER0, usbfluxd)
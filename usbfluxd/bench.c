@@ -0,0 +1,1000 @@
+/*
+ * bench.c
+ *
+ * Microbenchmarks for the protocol encode/decode paths and the core data
+ * structures of usbfluxd, plus an attach/detach storm scenario (-S). client.c
+ * and usbmux_remote.c are compiled into this translation unit so their static
+ * functions can be timed in isolation.
+ *
+ * Copyright (C) 2026 Corellium LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "client.c"
+#include "usbmux_remote.c"
+
+#include <getopt.h>
+#include <time.h>
+
+#define BENCH_MAX_RESULTS 128
+
+/* {{{ allocation counting */
+#ifdef __GLIBC__
+#define BENCH_COUNT_ALLOCS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static uint64_t alloc_count = 0;
+
+void *malloc(size_t size)
+{
+	alloc_count++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	alloc_count++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	alloc_count++;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+#else
+static uint64_t alloc_count = 0;
+#endif
+/* }}} */
+
+struct bench_ctx {
+	int n;				// synthetic device list / collection size
+	struct mux_client *client;
+	struct usbmuxd_header *msg;	// prepared client command
+	plist_t dev;			// single Attached message
+	struct collection col;
+	struct list_node list;
+	void **elements;
+	struct fdlist fds;
+};
+
+typedef void (*bench_func_t)(struct bench_ctx *ctx, uint64_t iterations);
+
+struct bench_result {
+	char name[96];
+	double ns_per_op;
+	double allocs_per_op;
+};
+
+struct baseline_entry {
+	char name[96];
+	double ns_per_op;
+	double allocs_per_op;
+};
+
+static unsigned int min_time_ms = 200;
+static const char *filter = NULL;
+static struct bench_result results[BENCH_MAX_RESULTS];
+static int num_results = 0;
+
+static uint64_t nstime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* {{{ fixtures */
+static struct mux_client *bench_client_new(uint32_t proto_version)
+{
+	struct mux_client *client = calloc(1, sizeof(struct mux_client));
+	list_init(&client->node);
+	list_init(&client->state_node);
+	client->fd = -1;
+	msgqueue_init(&client->outq);
+	client->ib_buf = malloc(CMD_BUF_SIZE);
+	client->ib_capacity = CMD_BUF_SIZE;
+	client->state = CLIENT_COMMAND;
+	client->events = POLLIN;
+	client->proto_version = proto_version;
+	return client;
+}
+
+static void bench_client_free(struct mux_client *client)
+{
+	if (!client)
+		return;
+	msgqueue_free(&client->outq);
+	free(client->ib_buf);
+	plist_free(client->info);
+	free(client);
+}
+
+static plist_t bench_device_plist(int index)
+{
+	char serial[48];
+	struct device_info di;
+	snprintf(serial, sizeof(serial), "00008030-%016X", index + 1);
+	di.id = (1 << 24) | (index + 1);
+	di.serial = serial;
+	di.location = 0x14100000 + index;
+	di.pid = 0x12a8;
+	di.speed = 480000000;
+	return create_device_attached_plist(&di);
+}
+
+static void bench_set_devices(int count)
+{
+	int i;
+	plist_free(remote_device_list);
+	remote_device_list = plist_new_dict();
+	for (i = 0; i < count; i++) {
+		plist_t dev = bench_device_plist(i);
+		char s_devid[16];
+		snprintf(s_devid, sizeof(s_devid), "0x%08x", (1 << 24) | (i + 1));
+		plist_dict_set_item(remote_device_list, s_devid, dev);
+	}
+	device_list_cache_invalidate();
+}
+
+static struct usbmuxd_header *bench_plist_message(const char *message_type)
+{
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "BundleID", plist_new_string("com.apple.dt.Xcode"));
+	plist_dict_set_item(dict, "ClientVersionString", plist_new_string("usbmuxd-471.8.1"));
+	plist_dict_set_item(dict, "MessageType", plist_new_string(message_type));
+	plist_dict_set_item(dict, "ProgName", plist_new_string("Xcode"));
+	plist_dict_set_item(dict, "kLibUSBMuxVersion", plist_new_uint(3));
+	char *xml = NULL;
+	uint32_t xmlsize = 0;
+	plist_to_xml(dict, &xml, &xmlsize);
+	plist_free(dict);
+
+	struct usbmuxd_header *hdr = malloc(sizeof(struct usbmuxd_header) + xmlsize);
+	hdr->length = sizeof(struct usbmuxd_header) + xmlsize;
+	hdr->version = 1;
+	hdr->message = MESSAGE_PLIST;
+	hdr->tag = 1;
+	memcpy((char*)hdr + sizeof(struct usbmuxd_header), xml, xmlsize);
+	free(xml);
+	return hdr;
+}
+/* }}} */
+
+/* {{{ benchmarks */
+static void bench_send_result(struct bench_ctx *ctx, uint64_t iterations)
+{
+	uint64_t i;
+	for (i = 0; i < iterations; i++) {
+		msgqueue_clear(&ctx->client->outq);
+		send_result(ctx->client, 1, RESULT_OK);
+	}
+}
+
+static void bench_notify_device_add(struct bench_ctx *ctx, uint64_t iterations)
+{
+	uint64_t i;
+	for (i = 0; i < iterations; i++) {
+		msgqueue_clear(&ctx->client->outq);
+		notify_device_add(ctx->client, ctx->dev);
+	}
+}
+
+/* queue a Detached event and deliver it to a single listener */
+static void bench_device_event_remove(struct bench_ctx *ctx, uint64_t iterations)
+{
+	uint64_t i;
+	for (i = 0; i < iterations; i++) {
+		msgqueue_clear(&ctx->client->outq);
+		client_device_remove(0x01000001);
+		client_device_events_flush();
+	}
+}
+
+static void bench_client_command(struct bench_ctx *ctx, uint64_t iterations)
+{
+	uint64_t i;
+	for (i = 0; i < iterations; i++) {
+		msgqueue_clear(&ctx->client->outq);
+		ctx->client->state = CLIENT_COMMAND;
+		client_command(ctx->client, ctx->msg);
+	}
+}
+
+/* add one element to a collection holding n, then remove it again */
+static void bench_collection_add_remove(struct bench_ctx *ctx, uint64_t iterations)
+{
+	uint64_t i;
+	void *element = &ctx->col;
+	for (i = 0; i < iterations; i++) {
+		collection_add(&ctx->col, element);
+		collection_remove(&ctx->col, element);
+	}
+}
+
+/* add one element to a list holding n, then remove it again */
+static void bench_list_add_remove(struct bench_ctx *ctx, uint64_t iterations)
+{
+	uint64_t i;
+	struct list_node node;
+	for (i = 0; i < iterations; i++) {
+		list_add_tail(&ctx->list, &node);
+		list_del(&node);
+	}
+}
+
+/* arm and cancel a timer while n others are pending */
+static void bench_timer_set_cancel(struct bench_ctx *ctx, uint64_t iterations)
+{
+	uint64_t i;
+	struct timer timer;
+	timer_init(&timer, NULL);
+	for (i = 0; i < iterations; i++) {
+		timer_set(&timer, (i * 7919) % 600000);
+		timer_cancel(&timer);
+	}
+}
+
+/* rebuild a poll set of n descriptors, as main_loop does every iteration */
+static void bench_fdlist_rebuild(struct bench_ctx *ctx, uint64_t iterations)
+{
+	uint64_t i;
+	int j;
+	for (i = 0; i < iterations; i++) {
+		fdlist_reset(&ctx->fds);
+		for (j = 0; j < ctx->n; j++) {
+			fdlist_add(&ctx->fds, FD_CLIENT, j, POLLIN);
+		}
+	}
+}
+/* }}} */
+
+static void bench_run(const char *name, int n, bench_func_t func, struct bench_ctx *ctx)
+{
+	char fullname[96];
+	if (n > 0) {
+		snprintf(fullname, sizeof(fullname), "%s/%d", name, n);
+	} else {
+		snprintf(fullname, sizeof(fullname), "%s", name);
+	}
+	if (filter && !strstr(fullname, filter))
+		return;
+	if (num_results >= BENCH_MAX_RESULTS)
+		return;
+
+	/* warm up (fills buffers to their steady state size) and calibrate */
+	uint64_t iterations = 1;
+	uint64_t elapsed = 0;
+	uint64_t target = (uint64_t)min_time_ms * 1000000ULL;
+	func(ctx, 1);
+	while (1) {
+		uint64_t start = nstime();
+		func(ctx, iterations);
+		elapsed = nstime() - start;
+		if (elapsed >= target / 10 || iterations >= (1ULL << 32))
+			break;
+		iterations *= 4;
+	}
+	if (elapsed > 0 && elapsed < target) {
+		iterations = (uint64_t)((double)iterations * target / elapsed) + 1;
+	}
+
+	uint64_t allocs_before = alloc_count;
+	uint64_t start = nstime();
+	func(ctx, iterations);
+	elapsed = nstime() - start;
+	uint64_t allocs = alloc_count - allocs_before;
+
+	struct bench_result *res = &results[num_results++];
+	snprintf(res->name, sizeof(res->name), "%s", fullname);
+	res->ns_per_op = (double)elapsed / iterations;
+	res->allocs_per_op = (double)allocs / iterations;
+}
+
+static void run_client_benchmarks(const int *sizes, int num_sizes)
+{
+	struct bench_ctx ctx;
+	int v, s;
+	memset(&ctx, '\0', sizeof(ctx));
+
+	ctx.dev = bench_device_plist(0);
+	for (v = 0; v <= 1; v++) {
+		const char *suffix = (v == 1) ? "plist" : "binary";
+		char name[64];
+		ctx.client = bench_client_new(v);
+		snprintf(name, sizeof(name), "send_result/%s", suffix);
+		bench_run(name, 0, bench_send_result, &ctx);
+		snprintf(name, sizeof(name), "notify_device_add/%s", suffix);
+		bench_run(name, 0, bench_notify_device_add, &ctx);
+		ctx.client->state = CLIENT_LISTEN;
+		client_link(ctx.client);
+		snprintf(name, sizeof(name), "device_event_remove/%s", suffix);
+		bench_run(name, 0, bench_device_event_remove, &ctx);
+		client_unlink(ctx.client);
+		bench_client_free(ctx.client);
+	}
+	plist_free(ctx.dev);
+	ctx.dev = NULL;
+
+	/* plist parsing and dispatch without any device dependent work */
+	ctx.client = bench_client_new(1);
+	ctx.msg = bench_plist_message("NoSuchCommand");
+	bench_run("client_command/unknown", 0, bench_client_command, &ctx);
+	free(ctx.msg);
+
+	for (s = 0; s < num_sizes; s++) {
+		ctx.n = sizes[s];
+		bench_set_devices(ctx.n);
+		ctx.msg = bench_plist_message("ListDevices");
+		bench_run("client_command/ListDevices", ctx.n, bench_client_command, &ctx);
+		free(ctx.msg);
+		ctx.msg = bench_plist_message("Listen");
+		bench_run("client_command/Listen", ctx.n, bench_client_command, &ctx);
+		free(ctx.msg);
+	}
+	ctx.msg = NULL;
+	bench_client_free(ctx.client);
+	bench_set_devices(0);
+}
+
+static void run_util_benchmarks(const int *sizes, int num_sizes)
+{
+	struct bench_ctx ctx;
+	int s, i;
+	memset(&ctx, '\0', sizeof(ctx));
+
+	for (s = 0; s < num_sizes; s++) {
+		ctx.n = sizes[s];
+		ctx.elements = calloc(ctx.n, sizeof(void*));
+		collection_init(&ctx.col);
+		for (i = 0; i < ctx.n; i++) {
+			ctx.elements[i] = malloc(1);
+			collection_add(&ctx.col, ctx.elements[i]);
+		}
+		bench_run("collection_add_remove", ctx.n, bench_collection_add_remove, &ctx);
+		for (i = 0; i < ctx.n; i++) {
+			collection_remove(&ctx.col, ctx.elements[i]);
+			free(ctx.elements[i]);
+		}
+		collection_free(&ctx.col);
+		free(ctx.elements);
+
+		struct list_node *nodes = calloc(ctx.n, sizeof(struct list_node));
+		list_init(&ctx.list);
+		for (i = 0; i < ctx.n; i++) {
+			list_add_tail(&ctx.list, &nodes[i]);
+		}
+		bench_run("list_add_remove", ctx.n, bench_list_add_remove, &ctx);
+		free(nodes);
+
+		struct timer *timers = calloc(ctx.n, sizeof(struct timer));
+		for (i = 0; i < ctx.n; i++) {
+			timer_init(&timers[i], NULL);
+			timer_set(&timers[i], ((uint64_t)i * 7919) % 600000);
+		}
+		bench_run("timer_set_cancel", ctx.n, bench_timer_set_cancel, &ctx);
+		for (i = 0; i < ctx.n; i++) {
+			timer_cancel(&timers[i]);
+		}
+		free(timers);
+
+		fdlist_create(&ctx.fds);
+		bench_run("fdlist_rebuild", ctx.n, bench_fdlist_rebuild, &ctx);
+		fdlist_free(&ctx.fds);
+	}
+}
+
+/* {{{ attach/detach storm scenario */
+/*
+ * Replays mass device events from a number of remote instances through
+ * remote_handle_command_result() and usbmux_remote_dispose() into a set of
+ * CLIENT_LISTEN clients. Every round runs four phases:
+ *   attach  every remote announces all of its devices
+ *   detach  every device is unplugged again (rack reboot)
+ *   attach  all devices come back
+ *   drop    every remote instance goes away (usbmux_remote_dispose)
+ * Listeners do not drain their output buffer within a phase, as is the
+ * case for a slow reader or when all events are queued in the same loop
+ * iteration; the queues are emptied between phases.
+ */
+#define STORM_MAX_METRICS 32
+
+enum storm_phase_type {
+	STORM_ATTACH = 0,
+	STORM_DETACH,
+	STORM_DROP,
+	STORM_NUM_PHASES
+};
+
+static const char *storm_phase_names[STORM_NUM_PHASES] = { "attach", "detach", "drop" };
+
+struct storm_config {
+	int devices;		// per remote
+	int listeners;
+	int remotes;
+	int rounds;
+};
+
+struct storm_phase {
+	uint64_t *lat;		// fan-out latency samples in ns
+	int num_lat;
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+	uint64_t events;	// device events, each fanned out to all listeners
+	uint64_t allocs;
+	uint32_t peak_ob;	// largest queue of a single listener
+	uint64_t peak_ob_total;	// sum over all listeners
+	uint64_t peak_ob_mem;	// buffer memory held by all listeners, shared buffers counted once
+};
+
+struct storm_metric {
+	char name[48];
+	double value;
+};
+
+static struct storm_metric storm_metrics[STORM_MAX_METRICS];
+static int num_storm_metrics = 0;
+
+static uint64_t cputime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int storm_parse_config(const char *str, struct storm_config *cfg)
+{
+	int n = sscanf(str, "%d,%d,%d,%d", &cfg->devices, &cfg->listeners, &cfg->remotes, &cfg->rounds);
+	if (n < 3 || cfg->devices < 1 || cfg->devices > 0xFFFFFF || cfg->listeners < 0 || cfg->remotes < 1 || cfg->remotes > 254)
+		return -1;
+	if (n < 4 || cfg->rounds < 1)
+		cfg->rounds = 3;
+	return 0;
+}
+
+/* a device event as received from a remote, including the usbmuxd header */
+static struct usbmuxd_header *storm_remote_message(plist_t dict)
+{
+	char *xml = NULL;
+	uint32_t xmlsize = 0;
+	plist_to_xml(dict, &xml, &xmlsize);
+	struct usbmuxd_header *hdr = malloc(sizeof(struct usbmuxd_header) + xmlsize);
+	hdr->length = sizeof(struct usbmuxd_header) + xmlsize;
+	hdr->version = 1;
+	hdr->message = MESSAGE_PLIST;
+	hdr->tag = 0;
+	memcpy((char*)hdr + sizeof(struct usbmuxd_header), xml, xmlsize);
+	free(xml);
+	return hdr;
+}
+
+static struct remote_mux *storm_remote_new(int index)
+{
+	int fd = open("/dev/null", O_RDWR);
+	if (fd < 0)
+		return NULL;
+	struct remote_mux *remote = remote_mux_new_with_fd(fd);
+	if (!remote)
+		return NULL;
+	remote->host = strdup("storm");
+	remote->port = 5000 + index;
+	remote->is_listener = 1;
+	remote->id = get_new_remote_id();
+	set_remote_id_used(remote->id, 1);
+	remote_set_state(remote, REMOTE_LISTEN);
+	remote_link(remote);
+	return remote;
+}
+
+static void storm_phase_begin(uint64_t *wall, uint64_t *cpu, uint64_t *allocs)
+{
+	*allocs = alloc_count;
+	*cpu = cputime();
+	*wall = nstime();
+}
+
+static void storm_phase_end(struct storm_phase *phase, uint64_t wall, uint64_t cpu, uint64_t allocs)
+{
+	phase->wall_ns += nstime() - wall;
+	phase->cpu_ns += cputime() - cpu;
+	phase->allocs += alloc_count - allocs;
+
+	/* account the listener queues, then let the listeners "read" them */
+	uint64_t total = 0;
+	double mem = 0;
+	LIST_FOREACH(struct mux_client *client, &client_list, struct mux_client, node) {
+		struct msgqueue *q = &client->outq;
+		uint32_t i;
+		if (q->size > phase->peak_ob)
+			phase->peak_ob = q->size;
+		total += q->size;
+		for (i = 0; i < q->count; i++) {
+			struct msgbuf *buf = q->entries[(q->head + i) % q->capacity].buf;
+			mem += (double)buf->capacity / buf->refcount;
+		}
+		msgqueue_clear(q);
+	} ENDFOREACH
+	if (total > phase->peak_ob_total)
+		phase->peak_ob_total = total;
+	if ((uint64_t)mem > phase->peak_ob_mem)
+		phase->peak_ob_mem = (uint64_t)mem;
+}
+
+static void storm_deliver(struct storm_phase *phase, struct remote_mux **remotes, struct usbmuxd_header **msgs, const struct storm_config *cfg)
+{
+	uint64_t wall, cpu, allocs;
+	int r, d;
+	storm_phase_begin(&wall, &cpu, &allocs);
+	/* one message per remote and loop iteration, as remote_process_recv()
+	 * handles them; latency is until all listeners have the event queued */
+	for (d = 0; d < cfg->devices; d++) {
+		uint64_t start = nstime();
+		for (r = 0; r < cfg->remotes; r++) {
+			remote_handle_command_result(remotes[r], msgs[r * cfg->devices + d]);
+		}
+		client_device_events_flush();
+		uint64_t elapsed = nstime() - start;
+		for (r = 0; r < cfg->remotes; r++) {
+			phase->lat[phase->num_lat++] = elapsed;
+		}
+	}
+	phase->events += (uint64_t)cfg->devices * cfg->remotes;
+	storm_phase_end(phase, wall, cpu, allocs);
+}
+
+static void storm_drop(struct storm_phase *phase, struct remote_mux **remotes, const struct storm_config *cfg)
+{
+	uint64_t wall, cpu, allocs;
+	int r;
+	storm_phase_begin(&wall, &cpu, &allocs);
+	for (r = 0; r < cfg->remotes; r++) {
+		/* latency until the last listener has the last Detached queued */
+		uint64_t start = nstime();
+		usbmux_remote_dispose(remotes[r]);
+		client_device_events_flush();
+		phase->lat[phase->num_lat++] = nstime() - start;
+		remotes[r] = NULL;
+	}
+	phase->events += (uint64_t)cfg->devices * cfg->remotes;
+	storm_phase_end(phase, wall, cpu, allocs);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(uint64_t *sorted, int count, double pct)
+{
+	if (count == 0)
+		return 0;
+	int idx = (int)(pct / 100.0 * (count - 1) + 0.5);
+	return sorted[idx] / 1000.0;
+}
+
+static void storm_metric_add(const char *phase, const char *name, double value)
+{
+	if (num_storm_metrics >= STORM_MAX_METRICS)
+		return;
+	struct storm_metric *m = &storm_metrics[num_storm_metrics++];
+	if (phase) {
+		snprintf(m->name, sizeof(m->name), "%s.%s", phase, name);
+	} else {
+		snprintf(m->name, sizeof(m->name), "%s", name);
+	}
+	m->value = value;
+}
+
+static void storm_run(const struct storm_config *cfg)
+{
+	struct storm_phase phases[STORM_NUM_PHASES];
+	struct mux_client **listeners = calloc(cfg->listeners, sizeof(struct mux_client*));
+	struct remote_mux **remotes = calloc(cfg->remotes, sizeof(struct remote_mux*));
+	int num_msgs = cfg->devices * cfg->remotes;
+	struct usbmuxd_header **attach_msgs = calloc(num_msgs, sizeof(struct usbmuxd_header*));
+	struct usbmuxd_header **detach_msgs = calloc(num_msgs, sizeof(struct usbmuxd_header*));
+	int i, r, d, p;
+
+	memset(phases, '\0', sizeof(phases));
+	phases[STORM_ATTACH].lat = malloc(sizeof(uint64_t) * num_msgs * 2 * cfg->rounds);
+	phases[STORM_DETACH].lat = malloc(sizeof(uint64_t) * num_msgs * cfg->rounds);
+	phases[STORM_DROP].lat = malloc(sizeof(uint64_t) * cfg->remotes * cfg->rounds);
+
+	for (r = 0; r < cfg->remotes; r++) {
+		for (d = 0; d < cfg->devices; d++) {
+			char serial[48];
+			struct device_info di;
+			snprintf(serial, sizeof(serial), "00008030-%08X%08X", r + 1, d + 1);
+			di.id = d + 1;
+			di.serial = serial;
+			di.location = 0x14100000 + d;
+			di.pid = 0x12a8;
+			di.speed = 480000000;
+			plist_t dev = create_device_attached_plist(&di);
+			attach_msgs[r * cfg->devices + d] = storm_remote_message(dev);
+			plist_free(dev);
+
+			plist_t dict = plist_new_dict();
+			plist_dict_set_item(dict, "MessageType", plist_new_string("Detached"));
+			plist_dict_set_item(dict, "DeviceID", plist_new_uint(d + 1));
+			detach_msgs[r * cfg->devices + d] = storm_remote_message(dict);
+			plist_free(dict);
+		}
+	}
+
+	plist_free(remote_device_list);
+	remote_device_list = plist_new_dict();
+	for (i = 0; i < cfg->listeners; i++) {
+		listeners[i] = bench_client_new(1);
+		listeners[i]->state = CLIENT_LISTEN;
+		client_link(listeners[i]);
+	}
+
+	for (i = 0; i < cfg->rounds; i++) {
+		for (r = 0; r < cfg->remotes; r++) {
+			remotes[r] = storm_remote_new(r);
+			if (!remotes[r]) {
+				fprintf(stderr, "Could not set up remote %d: %s\n", r, strerror(errno));
+				exit(2);
+			}
+		}
+		storm_deliver(&phases[STORM_ATTACH], remotes, attach_msgs, cfg);
+		storm_deliver(&phases[STORM_DETACH], remotes, detach_msgs, cfg);
+		storm_deliver(&phases[STORM_ATTACH], remotes, attach_msgs, cfg);
+		storm_drop(&phases[STORM_DROP], remotes, cfg);
+	}
+
+	for (i = 0; i < cfg->listeners; i++) {
+		client_unlink(listeners[i]);
+		bench_client_free(listeners[i]);
+	}
+
+	printf("storm: %d remotes x %d devices, %d listeners, %d rounds\n", cfg->remotes, cfg->devices, cfg->listeners, cfg->rounds);
+	printf("%-8s %8s %10s %10s %10s %10s %10s %12s %12s\n", "phase", "events", "wall_ms", "cpu_ms", "p50_us", "p99_us", "max_us", "allocs/event", "peak_ob_kb");
+	for (p = 0; p < STORM_NUM_PHASES; p++) {
+		struct storm_phase *phase = &phases[p];
+		const char *name = storm_phase_names[p];
+		qsort(phase->lat, phase->num_lat, sizeof(uint64_t), compare_u64);
+		double p50 = percentile_us(phase->lat, phase->num_lat, 50);
+		double p99 = percentile_us(phase->lat, phase->num_lat, 99);
+		double max = percentile_us(phase->lat, phase->num_lat, 100);
+		double allocs = (phase->events > 0) ? (double)phase->allocs / phase->events : 0;
+		printf("%-8s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f", name, (unsigned long long)phase->events,
+			phase->wall_ns / 1e6, phase->cpu_ns / 1e6, p50, p99, max);
+#ifdef BENCH_COUNT_ALLOCS
+		printf(" %12.2f", allocs);
+#else
+		printf(" %12s", "-");
+#endif
+		printf(" %12.1f\n", phase->peak_ob / 1024.0);
+
+		storm_metric_add(name, "p50_us", p50);
+		storm_metric_add(name, "p99_us", p99);
+		storm_metric_add(name, "max_us", max);
+		storm_metric_add(name, "cpu_ms", phase->cpu_ns / 1e6 / cfg->rounds);
+#ifdef BENCH_COUNT_ALLOCS
+		storm_metric_add(name, "allocs_per_event", allocs);
+#endif
+		storm_metric_add(name, "peak_ob_kb", phase->peak_ob / 1024.0);
+		storm_metric_add(name, "peak_ob_total_kb", phase->peak_ob_total / 1024.0);
+		storm_metric_add(name, "peak_ob_mem_kb", phase->peak_ob_mem / 1024.0);
+		free(phase->lat);
+	}
+	printf("drop latency is per remote instance; cpu_ms budgets are per round\n");
+
+	for (i = 0; i < num_msgs; i++) {
+		free(attach_msgs[i]);
+		free(detach_msgs[i]);
+	}
+	free(attach_msgs);
+	free(detach_msgs);
+	free(remotes);
+	free(listeners);
+}
+
+/*
+ * Budget files hold a "scenario DEVICES,LISTENERS,REMOTES[,ROUNDS]" line
+ * and "metric max" lines, see storm.budget.
+ */
+static int storm_load_budget(const char *filename, char *scenario, size_t scenario_len, struct storm_metric **budgets, int *num_budgets)
+{
+	FILE *f = fopen(filename, "r");
+	if (!f)
+		return -1;
+	char line[256];
+	int capacity = STORM_MAX_METRICS;
+	*budgets = malloc(sizeof(struct storm_metric) * capacity);
+	*num_budgets = 0;
+	while (fgets(line, sizeof(line), f)) {
+		char name[48];
+		char value[64];
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%47s %63s", name, value) != 2)
+			continue;
+		if (!strcmp(name, "scenario")) {
+			snprintf(scenario, scenario_len, "%s", value);
+		} else if (*num_budgets < capacity) {
+			struct storm_metric *b = &(*budgets)[(*num_budgets)++];
+			snprintf(b->name, sizeof(b->name), "%s", name);
+			b->value = strtod(value, NULL);
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+static int storm_check_budgets(struct storm_metric *budgets, int num_budgets)
+{
+	int i, j;
+	int exceeded = 0;
+	printf("%-28s %12s %12s\n", "metric", "value", "budget");
+	for (i = 0; i < num_storm_metrics; i++) {
+		struct storm_metric *m = &storm_metrics[i];
+		struct storm_metric *b = NULL;
+		for (j = 0; j < num_budgets; j++) {
+			if (!strcmp(budgets[j].name, m->name)) {
+				b = &budgets[j];
+				break;
+			}
+		}
+		printf("%-28s %12.2f", m->name, m->value);
+		if (b) {
+			printf(" %12.2f", b->value);
+			if (m->value > b->value) {
+				printf("  OVER BUDGET");
+				exceeded++;
+			}
+		}
+		printf("\n");
+	}
+	return exceeded;
+}
+/* }}} */
+
+/* {{{ baseline handling */
+static int baseline_load(const char *filename, struct baseline_entry **entries)
+{
+	FILE *f = fopen(filename, "r");
+	if (!f)
+		return -1;
+	char line[256];
+	int count = 0;
+	int capacity = 64;
+	*entries = malloc(sizeof(struct baseline_entry) * capacity);
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (count == capacity) {
+			capacity *= 2;
+			*entries = realloc(*entries, sizeof(struct baseline_entry) * capacity);
+		}
+		struct baseline_entry *e = &(*entries)[count];
+		if (sscanf(line, "%95s %lf %lf", e->name, &e->ns_per_op, &e->allocs_per_op) == 3)
+			count++;
+	}
+	fclose(f);
+	return count;
+}
+
+static int baseline_write(const char *filename)
+{
+	FILE *f = fopen(filename, "w");
+	int i;
+	if (!f) {
+		fprintf(stderr, "Could not write baseline to %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	fprintf(f, "# usbfluxd-bench baseline: name ns/op allocs/op\n");
+	for (i = 0; i < num_results; i++) {
+		fprintf(f, "%s %.1f %.2f\n", results[i].name, results[i].ns_per_op, results[i].allocs_per_op);
+	}
+	fclose(f);
+	return 0;
+}
+
+static struct baseline_entry *baseline_find(struct baseline_entry *entries, int count, const char *name)
+{
+	int i;
+	for (i = 0; i < count; i++) {
+		if (!strcmp(entries[i].name, name))
+			return &entries[i];
+	}
+	return NULL;
+}
+/* }}} */
+
+static int print_results(struct baseline_entry *baseline, int baseline_count, double tolerance)
+{
+	int i;
+	int regressions = 0;
+	printf("%-36s %12s %10s", "benchmark", "ns/op", "allocs/op");
+	if (baseline)
+		printf(" %12s %8s %10s", "base ns/op", "delta", "base allocs");
+	printf("\n");
+	for (i = 0; i < num_results; i++) {
+		struct bench_result *res = &results[i];
+		printf("%-36s %12.1f", res->name, res->ns_per_op);
+#ifdef BENCH_COUNT_ALLOCS
+		printf(" %10.2f", res->allocs_per_op);
+#else
+		printf(" %10s", "-");
+#endif
+		struct baseline_entry *e = (baseline) ? baseline_find(baseline, baseline_count, res->name) : NULL;
+		if (e) {
+			double delta = (e->ns_per_op > 0) ? (res->ns_per_op - e->ns_per_op) * 100.0 / e->ns_per_op : 0;
+			int slower = (tolerance > 0 && delta > tolerance);
+			int more_allocs = 0;
+#ifdef BENCH_COUNT_ALLOCS
+			more_allocs = (res->allocs_per_op > e->allocs_per_op + 0.01);
+#endif
+			printf(" %12.1f %+7.1f%% %10.2f", e->ns_per_op, delta, e->allocs_per_op);
+			if (slower || more_allocs) {
+				printf("  REGRESSION");
+				regressions++;
+			}
+		} else if (baseline) {
+			printf(" %12s", "(new)");
+		}
+		printf("\n");
+	}
+	return regressions;
+}
+
+static void print_usage(const char *argv0)
+{
+	const char *cmd = strrchr(argv0, '/');
+	cmd = (cmd) ? cmd+1 : argv0;
+	printf("Usage: %s [OPTIONS]\n", cmd);
+	printf("Runs the usbfluxd microbenchmarks.\n\n");
+	printf("  -b, --baseline FILE\tcompare against a stored baseline\n");
+	printf("  -w, --write FILE\twrite the results as a new baseline\n");
+	printf("  -f, --filter STR\tonly run benchmarks containing STR\n");
+	printf("  -t, --time MS\t\tminimum run time per benchmark (default 200)\n");
+	printf("  -r, --tolerance PCT\tfail if ns/op regressed by more than PCT percent\n");
+	printf("                 \t(allocs/op increases always fail a comparison)\n");
+	printf("  -S, --storm D,L,R[,N]\trun the attach/detach storm scenario instead: R remotes\n");
+	printf("                 \twith D devices each, L listeners, N rounds (default 3)\n");
+	printf("  -B, --budget FILE\tcheck the storm results against a budget file, which\n");
+	printf("                 \talso provides the scenario unless -S is given\n");
+	printf("  -h, --help\t\tprints usage information\n");
+}
+
+int main(int argc, char **argv)
+{
+	static struct option longopts[] = {
+		{"baseline", required_argument, NULL, 'b'},
+		{"write", required_argument, NULL, 'w'},
+		{"filter", required_argument, NULL, 'f'},
+		{"time", required_argument, NULL, 't'},
+		{"tolerance", required_argument, NULL, 'r'},
+		{"storm", required_argument, NULL, 'S'},
+		{"budget", required_argument, NULL, 'B'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	static const int sizes[] = { 1, 10, 100, 1000 };
+	const char *baseline_file = NULL;
+	const char *write_file = NULL;
+	const char *storm_arg = NULL;
+	const char *budget_file = NULL;
+	double tolerance = 0;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "b:w:f:t:r:S:B:h", longopts, NULL)) != -1) {
+		switch (c) {
+			case 'b':
+				baseline_file = optarg;
+				break;
+			case 'w':
+				write_file = optarg;
+				break;
+			case 'f':
+				filter = optarg;
+				break;
+			case 't':
+				min_time_ms = (unsigned int)strtoul(optarg, NULL, 10);
+				break;
+			case 'r':
+				tolerance = strtod(optarg, NULL);
+				break;
+			case 'S':
+				storm_arg = optarg;
+				break;
+			case 'B':
+				budget_file = optarg;
+				break;
+			case 'h':
+				print_usage(argv[0]);
+				return 0;
+			default:
+				print_usage(argv[0]);
+				return 2;
+		}
+	}
+
+	log_level = LL_FATAL;
+	timers_init();
+	remote_lists_init();
+	client_init();
+
+	if (storm_arg || budget_file) {
+		struct storm_config cfg;
+		struct storm_metric *budgets = NULL;
+		int num_budgets = 0;
+		char scenario[64] = "";
+		if (budget_file && storm_load_budget(budget_file, scenario, sizeof(scenario), &budgets, &num_budgets) < 0) {
+			fprintf(stderr, "Could not read budget file %s: %s\n", budget_file, strerror(errno));
+			return 2;
+		}
+		if (storm_arg)
+			snprintf(scenario, sizeof(scenario), "%s", storm_arg);
+		if (storm_parse_config(scenario, &cfg) < 0) {
+			fprintf(stderr, "Invalid storm scenario '%s', expected DEVICES,LISTENERS,REMOTES[,ROUNDS]\n", scenario);
+			free(budgets);
+			return 2;
+		}
+		storm_run(&cfg);
+		int exceeded = storm_check_budgets(budgets, num_budgets);
+		free(budgets);
+		client_shutdown();
+		plist_free(remote_device_list);
+		remote_device_list = NULL;
+		if (exceeded > 0) {
+			printf("%d metric(s) over budget in %s\n", exceeded, budget_file);
+			return 1;
+		}
+		return 0;
+	}
+
+	run_client_benchmarks(sizes, sizeof(sizes) / sizeof(sizes[0]));
+	run_util_benchmarks(sizes, sizeof(sizes) / sizeof(sizes[0]));
+
+	struct baseline_entry *baseline = NULL;
+	int baseline_count = 0;
+	if (baseline_file) {
+		baseline_count = baseline_load(baseline_file, &baseline);
+		if (baseline_count < 0) {
+			fprintf(stderr, "Could not read baseline %s, printing results only\n", baseline_file);
+			baseline = NULL;
+		}
+	}
+	int regressions = print_results(baseline, baseline_count, tolerance);
+	free(baseline);
+
+	if (write_file && baseline_write(write_file) == 0)
+		printf("Baseline written to %s\n", write_file);
+
+	client_shutdown();
+	plist_free(remote_device_list);
+	remote_device_list = NULL;
+
+	if (regressions > 0) {
+		printf("%d benchmark(s) regressed against %s\n", regressions, baseline_file);
+		return 1;
+	}
+	return 0;
+}
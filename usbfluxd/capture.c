@@ -0,0 +1,557 @@
+/*
+ * capture.c
+ *
+ * Copyright (C) 2026 Corellium LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "capture.h"
+#include "log.h"
+#include "utils.h"
+#include "timer.h"
+
+/* Frames are appended to a batch buffer on the event loop thread and the
+ * filled batches are written to disk by a separate writer thread. If the
+ * writer falls behind and no free batch is available, frames are dropped
+ * (and counted) rather than stalling the relay. */
+#define CAPTURE_BATCH_SIZE	0x100000
+#define CAPTURE_BATCHES		8
+#define CAPTURE_FLUSH_MS	100
+
+#define PCAPNG_SHB		0x0A0D0D0A
+#define PCAPNG_IDB		0x00000001
+#define PCAPNG_EPB		0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC	0x1A2B3C4D
+
+struct capture_batch {
+	unsigned char *buf;
+	uint32_t size;
+};
+
+int capture_enabled = 0;
+
+static char *capture_filename = NULL;
+static FILE *capture_file = NULL;
+static uint64_t capture_file_size = 0;
+
+/* options */
+static uint32_t opt_device_id = 0;
+static int opt_remote_id = -1;
+static char *opt_progname = NULL;
+static int opt_data = 0;
+static uint32_t opt_snaplen = 0;
+static uint64_t opt_max_size = 64ULL * 1024 * 1024;
+static unsigned int opt_max_files = 4;
+
+static pthread_t th_writer;
+static pthread_mutex_t capture_mutex;
+static pthread_cond_t capture_cond;
+static int writer_should_exit = 0;
+
+/* free and filled batches, both protected by capture_mutex */
+static struct capture_batch *free_batches[CAPTURE_BATCHES];
+static int free_count = 0;
+static struct capture_batch *full_batches[CAPTURE_BATCHES];
+static int full_head = 0;
+static int full_count = 0;
+
+/* batch currently being filled, owned by the event loop thread */
+static struct capture_batch *cur_batch = NULL;
+static struct timer flush_timer;	// hands cur_batch over once it is CAPTURE_FLUSH_MS old
+
+/* counters */
+static uint64_t cnt_frames = 0;
+static uint64_t cnt_bytes = 0;
+static uint64_t cnt_dropped = 0;
+
+/* counters of the writer thread */
+struct capture_write_counts {
+	uint64_t written;
+	uint64_t rotations;
+	uint64_t write_errors;
+};
+static struct capture_write_counts write_counts;	// protected by capture_mutex
+
+static int capture_write_header(FILE *f)
+{
+	uint32_t shb[7];
+	shb[0] = PCAPNG_SHB;
+	shb[1] = sizeof(shb);
+	shb[2] = PCAPNG_BYTE_ORDER_MAGIC;
+	shb[3] = 1;		// major version 1, minor version 0
+	shb[4] = 0xFFFFFFFF;	// section length unknown
+	shb[5] = 0xFFFFFFFF;
+	shb[6] = sizeof(shb);
+
+	uint32_t idb[5];
+	idb[0] = PCAPNG_IDB;
+	idb[1] = sizeof(idb);
+	idb[2] = CAPTURE_LINKTYPE;	// link type, reserved 0
+	idb[3] = opt_snaplen;
+	idb[4] = sizeof(idb);
+
+	if (fwrite(shb, sizeof(shb), 1, f) != 1 || fwrite(idb, sizeof(idb), 1, f) != 1) {
+		return -1;
+	}
+	capture_file_size = sizeof(shb) + sizeof(idb);
+	return 0;
+}
+
+static FILE *capture_open_file(void)
+{
+	FILE *f = fopen(capture_filename, "wb");
+	if (!f) {
+		usbfluxd_log(LL_ERROR, "%s: Could not open capture file '%s': %s", __func__, capture_filename, strerror(errno));
+		return NULL;
+	}
+	if (capture_write_header(f) < 0) {
+		usbfluxd_log(LL_ERROR, "%s: Could not write to capture file '%s': %s", __func__, capture_filename, strerror(errno));
+		fclose(f);
+		return NULL;
+	}
+	return f;
+}
+
+/* rename file -> file.1 -> file.2 ..., dropping the oldest one */
+static void capture_rotate(struct capture_write_counts *counts)
+{
+	unsigned int i;
+	size_t len = strlen(capture_filename) + 12;
+	char *from = malloc(len);
+	char *to = malloc(len);
+
+	fclose(capture_file);
+	capture_file = NULL;
+
+	/* without the names the file is started over */
+	if (from && to) {
+		for (i = opt_max_files - 1; i > 0; i--) {
+			if (i == 1) {
+				snprintf(from, len, "%s", capture_filename);
+			} else {
+				snprintf(from, len, "%s.%u", capture_filename, i - 1);
+			}
+			snprintf(to, len, "%s.%u", capture_filename, i);
+			rename(from, to);
+		}
+	}
+	free(from);
+	free(to);
+
+	counts->rotations++;
+	capture_file = capture_open_file();
+}
+
+static void capture_write_batch(struct capture_batch *batch, struct capture_write_counts *counts)
+{
+	if (!capture_file) {
+		counts->write_errors++;
+		return;
+	}
+	if (fwrite(batch->buf, 1, batch->size, capture_file) != batch->size) {
+		counts->write_errors++;
+		usbfluxd_log(LL_ERROR, "%s: Failed to write capture file: %s", __func__, strerror(errno));
+		return;
+	}
+	fflush(capture_file);
+	capture_file_size += batch->size;
+	counts->written += batch->size;
+	if (opt_max_size > 0 && capture_file_size >= opt_max_size) {
+		if (opt_max_files > 1) {
+			capture_rotate(counts);
+		} else {
+			/* no rotation configured; start over */
+			fclose(capture_file);
+			counts->rotations++;
+			capture_file = capture_open_file();
+		}
+	}
+}
+
+static void *capture_writer_thread(void *data)
+{
+	pthread_mutex_lock(&capture_mutex);
+	while (1) {
+		while (full_count == 0 && !writer_should_exit) {
+			pthread_cond_wait(&capture_cond, &capture_mutex);
+		}
+		if (full_count == 0 && writer_should_exit) {
+			break;
+		}
+		struct capture_batch *batch = full_batches[full_head];
+		full_head = (full_head + 1) % CAPTURE_BATCHES;
+		full_count--;
+		pthread_mutex_unlock(&capture_mutex);
+
+		struct capture_write_counts counts = { 0, 0, 0 };
+		capture_write_batch(batch, &counts);
+		batch->size = 0;
+
+		pthread_mutex_lock(&capture_mutex);
+		write_counts.written += counts.written;
+		write_counts.rotations += counts.rotations;
+		write_counts.write_errors += counts.write_errors;
+		free_batches[free_count++] = batch;
+	}
+	pthread_mutex_unlock(&capture_mutex);
+	return NULL;
+}
+
+/* hand the current batch over to the writer thread */
+static void capture_submit(void)
+{
+	if (!cur_batch || cur_batch->size == 0)
+		return;
+	pthread_mutex_lock(&capture_mutex);
+	full_batches[(full_head + full_count) % CAPTURE_BATCHES] = cur_batch;
+	full_count++;
+	cur_batch = (free_count > 0) ? free_batches[--free_count] : NULL;
+	pthread_cond_signal(&capture_cond);
+	pthread_mutex_unlock(&capture_mutex);
+	timer_cancel(&flush_timer);
+}
+
+static void capture_flush_timer_cb(struct timer *timer)
+{
+	capture_submit();
+}
+
+static struct capture_batch *capture_get_batch(void)
+{
+	if (!cur_batch) {
+		pthread_mutex_lock(&capture_mutex);
+		if (free_count > 0) {
+			cur_batch = free_batches[--free_count];
+		}
+		pthread_mutex_unlock(&capture_mutex);
+	}
+	return cur_batch;
+}
+
+static int capture_parse_options(const char *options)
+{
+	enum { OPT_DEVICE = 0, OPT_REMOTE, OPT_PROG, OPT_DATA, OPT_SNAPLEN, OPT_SIZE, OPT_FILES };
+	char *const tokens[] = {
+		[OPT_DEVICE] = (char *)"device",
+		[OPT_REMOTE] = (char *)"remote",
+		[OPT_PROG] = (char *)"prog",
+		[OPT_DATA] = (char *)"data",
+		[OPT_SNAPLEN] = (char *)"snaplen",
+		[OPT_SIZE] = (char *)"size",
+		[OPT_FILES] = (char *)"files",
+		NULL
+	};
+	char *opts;
+	char *p;
+	char *value;
+	int res = 0;
+
+	if (!options)
+		return 0;
+
+	opts = strdup(options);
+	p = opts;
+	while (*p != '\0' && res == 0) {
+		int opt = getsubopt(&p, tokens, &value);
+		if (opt != OPT_DATA && opt >= 0 && !value) {
+			usbfluxd_log(LL_ERROR, "Capture option '%s' requires a value", tokens[opt]);
+			res = -1;
+			break;
+		}
+		switch (opt) {
+			case OPT_DEVICE:
+				opt_device_id = strtoul(value, NULL, 0);
+				break;
+			case OPT_REMOTE:
+				opt_remote_id = (int)strtol(value, NULL, 0);
+				break;
+			case OPT_PROG:
+				free(opt_progname);
+				opt_progname = strdup(value);
+				break;
+			case OPT_DATA:
+				opt_data = 1;
+				break;
+			case OPT_SNAPLEN:
+				opt_snaplen = strtoul(value, NULL, 0);
+				break;
+			case OPT_SIZE:
+				opt_max_size = strtoull(value, NULL, 0) * 1024 * 1024;
+				break;
+			case OPT_FILES:
+				opt_max_files = strtoul(value, NULL, 0);
+				if (opt_max_files < 1)
+					opt_max_files = 1;
+				break;
+			default:
+				usbfluxd_log(LL_ERROR, "Unknown capture option '%s'", value);
+				res = -1;
+				break;
+		}
+	}
+	free(opts);
+	return res;
+}
+
+/**
+ * Start capturing relayed traffic to a pcap-ng file.
+ *
+ * @param filename The capture file to write.
+ * @param options Comma separated list of options, may be NULL:
+ *   device=ID, remote=ID, prog=NAME (filters), data (also capture relayed
+ *   payloads), snaplen=BYTES, size=MB (rotate after), files=N (keep N files).
+ * @return 0 on success, -1 on error.
+ */
+int capture_init(const char *filename, const char *options)
+{
+	int i;
+
+	if (capture_parse_options(options) < 0) {
+		return -1;
+	}
+
+	capture_filename = strdup(filename);
+	if (!capture_filename) {
+		free(opt_progname);
+		opt_progname = NULL;
+		return -1;
+	}
+	capture_file = capture_open_file();
+	if (!capture_file) {
+		free(capture_filename);
+		capture_filename = NULL;
+		free(opt_progname);
+		opt_progname = NULL;
+		return -1;
+	}
+
+	pthread_mutex_init(&capture_mutex, NULL);
+	timer_init(&flush_timer, capture_flush_timer_cb);
+	pthread_cond_init(&capture_cond, NULL);
+	for (i = 0; i < CAPTURE_BATCHES; i++) {
+		struct capture_batch *batch = malloc(sizeof(struct capture_batch));
+		if (!batch)
+			break;
+		batch->buf = malloc(CAPTURE_BATCH_SIZE);
+		if (!batch->buf) {
+			free(batch);
+			break;
+		}
+		batch->size = 0;
+		free_batches[free_count++] = batch;
+	}
+	writer_should_exit = 0;
+	if (free_count < CAPTURE_BATCHES) {
+		usbfluxd_log(LL_ERROR, "%s: Failed to allocate capture buffers", __func__);
+		goto error;
+	}
+	if (pthread_create(&th_writer, NULL, capture_writer_thread, NULL) != 0) {
+		usbfluxd_log(LL_ERROR, "%s: Failed to create capture writer thread", __func__);
+		goto error;
+	}
+
+	capture_enabled = 1;
+	usbfluxd_log(LL_NOTICE, "Capturing %s to %s", (opt_data) ? "control frames and data" : "control frames", capture_filename);
+
+	return 0;
+
+error:
+	for (i = 0; i < free_count; i++) {
+		free(free_batches[i]->buf);
+		free(free_batches[i]);
+	}
+	free_count = 0;
+	fclose(capture_file);
+	capture_file = NULL;
+	pthread_cond_destroy(&capture_cond);
+	pthread_mutex_destroy(&capture_mutex);
+	free(capture_filename);
+	capture_filename = NULL;
+	free(opt_progname);
+	opt_progname = NULL;
+	return -1;
+}
+
+void capture_shutdown(void)
+{
+	int i;
+
+	if (!capture_enabled)
+		return;
+	capture_enabled = 0;
+
+	capture_submit();
+	pthread_mutex_lock(&capture_mutex);
+	writer_should_exit = 1;
+	pthread_cond_signal(&capture_cond);
+	pthread_mutex_unlock(&capture_mutex);
+	pthread_join(th_writer, NULL);
+
+	if (cur_batch) {
+		free_batches[free_count++] = cur_batch;
+		cur_batch = NULL;
+	}
+	for (i = 0; i < free_count; i++) {
+		free(free_batches[i]->buf);
+		free(free_batches[i]);
+	}
+	free_count = 0;
+
+	if (capture_file) {
+		fclose(capture_file);
+		capture_file = NULL;
+	}
+	usbfluxd_log(LL_NOTICE, "Capture finished: %llu frames, %llu bytes written, %llu frames dropped",
+		(unsigned long long)cnt_frames, (unsigned long long)write_counts.written, (unsigned long long)cnt_dropped);
+
+	pthread_cond_destroy(&capture_cond);
+	pthread_mutex_destroy(&capture_mutex);
+	free(capture_filename);
+	capture_filename = NULL;
+	free(opt_progname);
+	opt_progname = NULL;
+}
+
+static int capture_matches(const struct capture_meta *meta, enum capture_kind kind)
+{
+	if (kind == CAPTURE_DATA && !opt_data)
+		return 0;
+	if (opt_device_id && meta->device_id != opt_device_id)
+		return 0;
+	if (opt_remote_id >= 0 && meta->remote_id != opt_remote_id)
+		return 0;
+	if (opt_progname && (!meta->progname || strcmp(meta->progname, opt_progname) != 0))
+		return 0;
+	return 1;
+}
+
+/**
+ * Append a frame to the capture if it matches the configured filters.
+ * The frame consists of hdr followed by payload; either may be NULL.
+ */
+void capture_frame(const struct capture_meta *meta, enum capture_direction dir, enum capture_kind kind, const void *hdr, uint32_t hdr_len, const void *payload, uint32_t payload_len)
+{
+	if (!capture_enabled || !capture_matches(meta, kind))
+		return;
+
+	struct capture_pseudo_hdr ph;
+	ph.version = CAPTURE_PSEUDO_HDR_VERSION;
+	ph.direction = dir;
+	ph.kind = kind;
+	ph.remote_id = (meta->remote_id >= 0) ? (uint8_t)meta->remote_id : 0xFF;
+	ph.client_number = htonl(meta->client_number);
+	ph.device_id = htonl(meta->device_id);
+	ph.fd = (int32_t)htonl((uint32_t)meta->fd);
+
+	uint32_t orig_len = sizeof(ph) + hdr_len + payload_len;
+	uint32_t cap_len = orig_len;
+	if (opt_snaplen > 0 && cap_len > opt_snaplen)
+		cap_len = opt_snaplen;
+	if (cap_len > CAPTURE_BATCH_SIZE - 64)
+		cap_len = CAPTURE_BATCH_SIZE - 64;
+	uint32_t padded = (cap_len + 3) & ~3;
+	uint32_t block_len = 28 + padded + 4;
+
+	struct capture_batch *batch = capture_get_batch();
+	if (batch && batch->size + block_len > CAPTURE_BATCH_SIZE) {
+		capture_submit();
+		batch = cur_batch;
+	}
+	if (!batch) {
+		cnt_dropped++;
+		return;
+	}
+
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	uint64_t ts = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+	unsigned char *p = batch->buf + batch->size;
+	uint32_t epb[7];
+	epb[0] = PCAPNG_EPB;
+	epb[1] = block_len;
+	epb[2] = 0;	// interface id
+	epb[3] = (uint32_t)(ts >> 32);
+	epb[4] = (uint32_t)ts;
+	epb[5] = cap_len;
+	epb[6] = orig_len;
+	memcpy(p, epb, sizeof(epb));
+	p += sizeof(epb);
+
+	uint32_t left = cap_len;
+	uint32_t n = (left < sizeof(ph)) ? left : sizeof(ph);
+	memcpy(p, &ph, n);
+	p += n;
+	left -= n;
+	if (hdr && left > 0) {
+		n = (left < hdr_len) ? left : hdr_len;
+		memcpy(p, hdr, n);
+		p += n;
+		left -= n;
+	}
+	if (payload && left > 0) {
+		n = (left < payload_len) ? left : payload_len;
+		memcpy(p, payload, n);
+		p += n;
+		left -= n;
+	}
+	memset(p, 0, padded - cap_len);
+	p += padded - cap_len;
+	memcpy(p, &block_len, sizeof(block_len));
+
+	if (batch->size == 0)
+		timer_set(&flush_timer, CAPTURE_FLUSH_MS);
+	batch->size += block_len;
+	cnt_frames++;
+	cnt_bytes += orig_len;
+}
+
+plist_t capture_copy_stats(void)
+{
+	/* the writer thread only runs while capturing */
+	struct capture_write_counts counts;
+	if (capture_enabled) {
+		pthread_mutex_lock(&capture_mutex);
+		counts = write_counts;
+		pthread_mutex_unlock(&capture_mutex);
+	} else {
+		counts = write_counts;
+	}
+
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "Enabled", plist_new_bool(capture_enabled));
+	plist_dict_set_item(dict, "Frames", plist_new_uint(cnt_frames));
+	plist_dict_set_item(dict, "Bytes", plist_new_uint(cnt_bytes));
+	plist_dict_set_item(dict, "Dropped", plist_new_uint(cnt_dropped));
+	plist_dict_set_item(dict, "BytesWritten", plist_new_uint(counts.written));
+	plist_dict_set_item(dict, "Rotations", plist_new_uint(counts.rotations));
+	plist_dict_set_item(dict, "WriteErrors", plist_new_uint(counts.write_errors));
+	return dict;
+}
@@ -0,0 +1,72 @@
+/*
+ * capture.h
+ *
+ * Copyright (C) 2026 Corellium LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <plist/plist.h>
+
+/* pcap-ng link type used for captured frames (LINKTYPE_USER0) */
+#define CAPTURE_LINKTYPE 147
+
+#define CAPTURE_PSEUDO_HDR_VERSION 1
+
+enum capture_direction {
+	CAPTURE_FROM_CLIENT = 0,
+	CAPTURE_TO_CLIENT,
+	CAPTURE_TO_REMOTE,
+	CAPTURE_FROM_REMOTE
+};
+
+enum capture_kind {
+	CAPTURE_CONTROL = 0,	// framed usbmuxd protocol message
+	CAPTURE_DATA		// relayed payload of a connected session
+};
+
+/* Pseudo header preceding every captured frame, all fields big endian. */
+struct capture_pseudo_hdr {
+	uint8_t version;
+	uint8_t direction;
+	uint8_t kind;
+	uint8_t remote_id;
+	uint32_t client_number;
+	uint32_t device_id;
+	int32_t fd;
+} __attribute__((__packed__));
+
+/* Describes the session a frame belongs to; used for filtering. */
+struct capture_meta {
+	int fd;
+	uint32_t client_number;	// 0xFFFFFFFF when not associated with a client
+	uint32_t device_id;	// 0 when unknown
+	int remote_id;		// -1 when unknown
+	const char *progname;	// NULL when unknown
+};
+
+extern int capture_enabled;
+
+int capture_init(const char *filename, const char *options);
+void capture_shutdown(void);
+
+void capture_frame(const struct capture_meta *meta, enum capture_direction dir, enum capture_kind kind, const void *hdr, uint32_t hdr_len, const void *payload, uint32_t payload_len);
+
+plist_t capture_copy_stats(void);
+
+#endif
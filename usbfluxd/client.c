@@ -46,9 +46,15 @@
 #include "client.h"
 
 #include "usbmux_remote.h"
+#include "stats.h"
+#include "probes.h"
+#include "capture.h"
+#include "record.h"
+#include "plistscan.h"
+#include "plistfmt.h"
 
 #define CMD_BUF_SIZE	0x10000
-#define REPLY_BUF_SIZE	0x10000
+#define QUEUE_LIMIT	0x100000	// default per client output queue limit
 
 enum client_state {
 	CLIENT_COMMAND,		// waiting for command
@@ -60,10 +66,10 @@ enum client_state {
 };
 
 struct mux_client {
+	struct list_node node;		// client_list
+	struct list_node state_node;	// client_states[state]
 	int fd;
-	unsigned char *ob_buf;
-	uint32_t ob_size;
-	uint32_t ob_capacity;
+	struct msgqueue outq;
 	unsigned char *ib_buf;
 	uint32_t ib_size;
 	uint32_t ib_capacity;
@@ -77,6 +83,8 @@ struct mux_client {
 	uint32_t last_command;
 	uint32_t number;
 	plist_t info;
+	int resync_pending;	// resynchronized, output queue not drained since
+	uint64_t resync_mark;	// least bytes queued since the resync
 };
 
 enum {
@@ -89,9 +97,42 @@ enum {
 	CMD_READ_BUID
 };
 
-static struct collection client_list;
-pthread_mutex_t client_list_mutex;
+/* Client state is only touched by the main loop thread. */
+static struct list_node client_list;
+static struct list_node client_states[CLIENT_DEAD + 1];	// clients by state
+static struct fdtable client_fds;
 static uint32_t client_number = 0;
+static struct msgbuf *device_list_cache = NULL;	// encoded ListDevices reply payload
+static uint64_t queue_limit = QUEUE_LIMIT;
+
+/* counters */
+static uint64_t cnt_resyncs = 0;
+static uint64_t cnt_slow_disconnects = 0;
+static uint64_t cnt_throttled = 0;
+
+static void client_link(struct mux_client *client)
+{
+	list_add_tail(&client_list, &client->node);
+	list_add_tail(&client_states[client->state], &client->state_node);
+	fdtable_set(&client_fds, client->fd, client);
+}
+
+static void client_unlink(struct mux_client *client)
+{
+	list_del(&client->node);
+	list_del(&client->state_node);
+	fdtable_clear(&client_fds, client->fd, client);
+}
+
+static void client_set_state(struct mux_client *client, enum client_state state)
+{
+	USBFLUXD_PROBE3(client_state, client->fd, client->state, state);
+	client->state = state;
+	if (!list_empty(&client->state_node)) {
+		list_del(&client->state_node);
+		list_add_tail(&client_states[state], &client->state_node);
+	}
+}
 
 /**
  * Receive raw data from the client socket.
@@ -200,9 +241,7 @@ int client_accept(int listenfd)
 	memset(client, 0, sizeof(struct mux_client));
 
 	client->fd = cfd;
-	client->ob_buf = malloc(REPLY_BUF_SIZE);
-	client->ob_size = 0;
-	client->ob_capacity = REPLY_BUF_SIZE;
+	msgqueue_init(&client->outq);
 	client->ib_buf = malloc(CMD_BUF_SIZE);
 	client->ib_size = 0;
 	client->ib_capacity = CMD_BUF_SIZE;
@@ -210,10 +249,12 @@ int client_accept(int listenfd)
 	client->events = POLLIN;
 	client->info = NULL;
 
-	pthread_mutex_lock(&client_list_mutex);
 	client->number = client_number++;
-	collection_add(&client_list, client);
-	pthread_mutex_unlock(&client_list_mutex);
+	client_link(client);
+
+	USBFLUXD_PROBE2(client_accept, cfd, client->number);
+	if (record_enabled)
+		record_client_open(client->number);
 
 #ifdef SO_PEERCRED
 	if (log_level >= LL_INFO) {
@@ -239,11 +280,16 @@ void client_close(struct mux_client *client)
                      client->fd);
 	if(client->state == CLIENT_CONNECTING1 || client->state == CLIENT_CONNECTING2) {
 		usbfluxd_log(LL_INFO, "Client died mid-connect, aborting device %d connection", client->connect_device);
-		client->state = CLIENT_DEAD;
+		client_set_state(client, CLIENT_DEAD);
+		if (!client->remote)
+			usbmux_remote_cancel_connect(client);
 #if 0
 		device_abort_connect(client->connect_device, client);
 #endif /* 0 */
 	}
+	if (record_enabled)
+		record_client_close(client->number);
+	usbmux_remote_forget_client(client);
 	close(client->fd);
 	if (client->remote) {
 		usbmux_remote_clear_client(client->remote);
@@ -251,49 +297,127 @@ void client_close(struct mux_client *client)
                              (void *)client, (void *)client->remote);
 		usbmux_remote_notify_client_close(client->remote);
 	}
-	free(client->ob_buf);
+	msgqueue_free(&client->outq);
 	free(client->ib_buf);
 	plist_free(client->info);
-	pthread_mutex_lock(&client_list_mutex);
-	collection_remove(&client_list, client);
-	pthread_mutex_unlock(&client_list_mutex);
+	client_unlink(client);
 	free(client);
 }
 
+/**
+ * Fill in the capture filter attributes of a client session.
+ *
+ * @param client The client, may be NULL.
+ * @param meta Receives the attributes.
+ */
+void client_capture_meta(struct mux_client *client, struct capture_meta *meta)
+{
+	memset(meta, '\0', sizeof(struct capture_meta));
+	meta->client_number = 0xFFFFFFFF;
+	meta->remote_id = -1;
+	meta->fd = -1;
+	if (!client)
+		return;
+	meta->fd = client->fd;
+	meta->client_number = client->number;
+	meta->device_id = (uint32_t)client->connect_device;
+	if (client->remote)
+		meta->remote_id = client->remote->id;
+	if (client->info) {
+		plist_t n = plist_dict_get_item(client->info, "ProgName");
+		if (n)
+			meta->progname = plist_get_string_ptr(n, NULL);
+	}
+}
+
+static void client_capture(struct mux_client *client, enum capture_direction dir, enum capture_kind kind, const void *hdr, uint32_t hdr_len, const void *payload, uint32_t payload_len)
+{
+	struct capture_meta meta;
+	client_capture_meta(client, &meta);
+	capture_frame(&meta, dir, kind, hdr, hdr_len, payload, payload_len);
+}
+
 void client_get_fds(struct fdlist *list)
 {
-	pthread_mutex_lock(&client_list_mutex);
-	FOREACH(struct mux_client *client, &client_list) {
+	LIST_FOREACH(struct mux_client *client, &client_list, struct mux_client, node) {
 		fdlist_add(list, FD_CLIENT, client->fd, client->events);
 	} ENDFOREACH
-	pthread_mutex_unlock(&client_list_mutex);
+}
+
+static const char *client_state_name(enum client_state state)
+{
+	switch (state) {
+		case CLIENT_COMMAND:
+			return "COMMAND";
+		case CLIENT_LISTEN:
+			return "LISTEN";
+		case CLIENT_CONNECTING1:
+			return "CONNECTING1";
+		case CLIENT_CONNECTING2:
+			return "CONNECTING2";
+		case CLIENT_CONNECTED:
+			return "CONNECTED";
+		case CLIENT_DEAD:
+			return "DEAD";
+		default:
+			return "UNKNOWN";
+	}
+}
+
+/**
+ * Record what identifies the client that owns the given fd.
+ *
+ * @param fd The client socket fd.
+ * @param ident Receives the client number and state.
+ * @return 0 on success, -1 if no client with that fd exists.
+ */
+int client_identify(int fd, struct client_ident *ident)
+{
+	struct mux_client *lc = fdtable_get(&client_fds, fd);
+	if (!lc)
+		return -1;
+	ident->number = lc->number;
+	ident->state = lc->state;
+	return 0;
+}
+
+/**
+ * Write a short human readable description of a client identified with
+ * client_identify() into buf, for diagnostic output. The client might
+ * have been closed in the meantime.
+ *
+ * @param fd The client socket fd.
+ * @param ident What client_identify() returned for fd.
+ * @param buf Buffer receiving the description.
+ * @param len Size of buf.
+ */
+void client_describe(int fd, const struct client_ident *ident, char *buf, size_t len)
+{
+	struct mux_client *lc = fdtable_get(&client_fds, fd);
+	char *progname = NULL;
+	if (lc && lc->number == ident->number) {
+		plist_t n = (lc->info) ? plist_dict_get_item(lc->info, "ProgName") : NULL;
+		if (n) {
+			plist_get_string_val(n, &progname);
+		}
+	}
+	snprintf(buf, len, "client %u fd %d state %s (%s)", ident->number, fd, client_state_name((enum client_state)ident->state),
+		(progname) ? progname : (lc && lc->number == ident->number) ? "unknown" : "closed");
+	free(progname);
 }
 
 static int send_pkt_raw(struct mux_client *client, void *buffer, unsigned int length)
 {
 	usbfluxd_log(LL_DEBUG, "send_pkt_raw fd %d buffer_length %d", client->fd, length);
 
-	uint32_t available = client->ob_capacity - client->ob_size;
-	/* the output buffer _should_ be large enough, but just in case */
-	if(available < length) {
-		unsigned char* new_buf;
-		uint32_t new_size = ((client->ob_capacity + length + 4096) / 4096) * 4096;
-		usbfluxd_log(LL_DEBUG, "%s: Enlarging client %d output buffer %d -> %d", __func__, client->fd, client->ob_capacity, new_size);
-		new_buf = realloc(client->ob_buf, new_size);
-		if (!new_buf) {
-			usbfluxd_log(LL_FATAL, "%s: Failed to realloc.", __func__);
-			return -1;
-		}
-		client->ob_buf = new_buf;
-		client->ob_capacity = new_size;
+	if (msgqueue_write(&client->outq, buffer, length) < 0) {
+		usbfluxd_log(LL_FATAL, "%s: Failed to allocate output buffer.", __func__);
+		return -1;
 	}
-	memcpy(client->ob_buf + client->ob_size, buffer, length);
-	client->ob_size += length;
 	client->events |= POLLOUT;
 	return length;
 }
 
-
 static int send_pkt(struct mux_client *client, uint32_t tag, enum usbmuxd_msgtype msg, void *payload, int payload_length)
 {
 	struct usbmuxd_header hdr;
@@ -303,24 +427,43 @@ static int send_pkt(struct mux_client *client, uint32_t tag, enum usbmuxd_msgtyp
 	hdr.tag = tag;
 	usbfluxd_log(LL_DEBUG, "send_pkt fd %d tag %d msg %d payload_length %d", client->fd, tag, msg, payload_length);
 
-	uint32_t available = client->ob_capacity - client->ob_size;
-	/* the output buffer _should_ be large enough, but just in case */
-	if(available < hdr.length) {
-		unsigned char* new_buf;
-		uint32_t new_size = ((client->ob_capacity + hdr.length + 4096) / 4096) * 4096;
-		usbfluxd_log(LL_DEBUG, "%s: Enlarging client %d output buffer %d -> %d", __func__, client->fd, client->ob_capacity, new_size);
-		new_buf = realloc(client->ob_buf, new_size);
-		if (!new_buf) {
-			usbfluxd_log(LL_FATAL, "%s: Failed to realloc.", __func__);
-			return -1;
-		}
-		client->ob_buf = new_buf;
-		client->ob_capacity = new_size;
+	unsigned char *ptr = msgqueue_reserve(&client->outq, hdr.length);
+	if (!ptr) {
+		usbfluxd_log(LL_FATAL, "%s: Failed to allocate output buffer.", __func__);
+		return -1;
 	}
-	memcpy(client->ob_buf + client->ob_size, &hdr, sizeof(hdr));
+	memcpy(ptr, &hdr, sizeof(hdr));
 	if(payload && payload_length)
-		memcpy(client->ob_buf + client->ob_size + sizeof(hdr), payload, payload_length);
-	client->ob_size += hdr.length;
+		memcpy(ptr + sizeof(hdr), payload, payload_length);
+	if (capture_enabled)
+		client_capture(client, CAPTURE_TO_CLIENT, CAPTURE_CONTROL, &hdr, sizeof(hdr), payload, payload_length);
+	client->events |= POLLOUT;
+	return hdr.length;
+}
+
+/* like send_pkt(), but the payload is shared with other clients instead of copied */
+static int send_pkt_shared(struct mux_client *client, uint32_t tag, enum usbmuxd_msgtype msg, struct msgbuf *payload)
+{
+	struct usbmuxd_header hdr;
+	hdr.version = client->proto_version;
+	hdr.length = sizeof(hdr) + payload->size;
+	hdr.message = msg;
+	hdr.tag = tag;
+	usbfluxd_log(LL_DEBUG, "%s fd %d tag %d msg %d payload_length %d", __func__, client->fd, tag, msg, payload->size);
+
+	uint64_t queued = client->outq.size;
+	if (msgqueue_write(&client->outq, &hdr, sizeof(hdr)) < 0) {
+		usbfluxd_log(LL_FATAL, "%s: Failed to allocate output buffer.", __func__);
+		return -1;
+	}
+	if (msgqueue_push(&client->outq, payload, 0, payload->size) < 0) {
+		/* a header without its payload would break the stream */
+		msgqueue_truncate(&client->outq, queued);
+		usbfluxd_log(LL_FATAL, "%s: Failed to allocate output buffer.", __func__);
+		return -1;
+	}
+	if (capture_enabled)
+		client_capture(client, CAPTURE_TO_CLIENT, CAPTURE_CONTROL, &hdr, sizeof(hdr), payload->data, payload->size);
 	client->events |= POLLOUT;
 	return hdr.length;
 }
@@ -340,16 +483,55 @@ static int send_plist_pkt(struct mux_client *client, uint32_t tag, plist_t plist
 	return res;
 }
 
+/* the v1 messages sent most, with a slot for their one integer */
+static const char result_template[] = PLISTFMT_HEAD PLISTFMT_STRING("MessageType", "Result") PLISTFMT_INTEGER_OPEN("Number");
+static const char detached_template[] = PLISTFMT_HEAD PLISTFMT_STRING("MessageType", "Detached") PLISTFMT_INTEGER_OPEN("DeviceID");
+static const char uint_template_tail[] = PLISTFMT_INTEGER_CLOSE PLISTFMT_TAIL;
+
+#define UINT_MESSAGE_MAX_LEN	(PLISTFMT_LEN(detached_template) + PLISTFMT_UINT_MAX_LEN + PLISTFMT_LEN(uint_template_tail))
+
+static uint32_t uint_message_length(uint32_t head_len, uint64_t value)
+{
+	return head_len + plistfmt_uint_length(value) + PLISTFMT_LEN(uint_template_tail);
+}
+
+static void uint_message_encode(char *out, const char *head, uint32_t head_len, uint64_t value)
+{
+	memcpy(out, head, head_len);
+	out = plistfmt_put_uint(out + head_len, value);
+	memcpy(out, uint_template_tail, PLISTFMT_LEN(uint_template_tail));
+}
+
+/* like send_pkt(), but the message is encoded straight into the output queue */
+static int send_uint_message(struct mux_client *client, uint32_t tag, const char *head, uint32_t head_len, uint64_t value)
+{
+	struct usbmuxd_header hdr;
+	uint32_t payload_length = uint_message_length(head_len, value);
+	hdr.version = client->proto_version;
+	hdr.length = sizeof(hdr) + payload_length;
+	hdr.message = MESSAGE_PLIST;
+	hdr.tag = tag;
+	usbfluxd_log(LL_DEBUG, "%s fd %d tag %d payload_length %d", __func__, client->fd, tag, payload_length);
+
+	unsigned char *ptr = msgqueue_reserve(&client->outq, hdr.length);
+	if (!ptr) {
+		usbfluxd_log(LL_FATAL, "%s: Failed to allocate output buffer.", __func__);
+		return -1;
+	}
+	memcpy(ptr, &hdr, sizeof(hdr));
+	uint_message_encode((char*)ptr + sizeof(hdr), head, head_len, value);
+	if (capture_enabled)
+		client_capture(client, CAPTURE_TO_CLIENT, CAPTURE_CONTROL, &hdr, sizeof(hdr), ptr + sizeof(hdr), payload_length);
+	client->events |= POLLOUT;
+	return hdr.length;
+}
+
 static int send_result(struct mux_client *client, uint32_t tag, uint32_t result)
 {
 	int res = -1;
 	if (client->proto_version == 1) {
 		/* XML plist packet */
-		plist_t dict = plist_new_dict();
-		plist_dict_set_item(dict, "MessageType", plist_new_string("Result"));
-		plist_dict_set_item(dict, "Number", plist_new_uint(result));
-		res = send_plist_pkt(client, tag, dict);
-		plist_free(dict);
+		res = send_uint_message(client, tag, result_template, PLISTFMT_LEN(result_template), result);
 	} else {
 		/* binary packet */
 		res = send_pkt(client, tag, MESSAGE_RESULT, &result, sizeof(uint32_t));
@@ -384,17 +566,25 @@ int client_notify_connect(struct mux_client *client, enum usbmuxd_result result)
 	if(send_result(client, client->connect_tag, result) < 0)
 		return -1;
 	if(result == RESULT_OK) {
-		client->state = CLIENT_CONNECTING2;
+		client_set_state(client, CLIENT_CONNECTING2);
 		client->events = POLLOUT; // wait for the result packet to go through
 		// no longer need this
 		free(client->ib_buf);
 		client->ib_buf = NULL;
 	} else {
-		client->state = CLIENT_COMMAND;
+		client_set_state(client, CLIENT_COMMAND);
 	}
 	return 0;
 }
 
+/* answer a request that was forwarded to a remote which failed to reply */
+int client_notify_result(struct mux_client *client, uint32_t tag, enum usbmuxd_result result)
+{
+	if(client->state == CLIENT_DEAD)
+		return -1;
+	return send_result(client, tag, result);
+}
+
 void client_notify_remote_close(struct mux_client *client)
 {
 	usbfluxd_log(LL_DEBUG, "%s %p", __func__, (void *)client);
@@ -403,17 +593,29 @@ void client_notify_remote_close(struct mux_client *client)
 
 static int send_device_list(struct mux_client *client, uint32_t tag)
 {
-	int res = -1;
-	plist_t dict = plist_new_dict();
-	plist_t devices = NULL;
-
-	devices = usbmux_remote_copy_device_list();
-
-	plist_dict_set_item(dict, "DeviceList", devices);
-	res = send_plist_pkt(client, tag, dict);
-	plist_free(dict);
-
-	return res;
+	/* the cache is dropped when device events are delivered */
+	client_device_events_flush();
+	if (!device_list_cache) {
+		plist_t dict = plist_new_dict();
+		plist_dict_set_item(dict, "DeviceList", usbmux_remote_copy_device_list());
+		char *xml = NULL;
+		uint32_t xmlsize = 0;
+		plist_to_xml(dict, &xml, &xmlsize);
+		plist_free(dict);
+		if (!xml) {
+			usbfluxd_log(LL_ERROR, "%s: Could not convert plist to xml", __func__);
+			return -1;
+		}
+		device_list_cache = msgbuf_new(xmlsize);
+		if (device_list_cache) {
+			memcpy(device_list_cache->data, xml, xmlsize);
+			device_list_cache->size = xmlsize;
+		}
+		free(xml);
+		if (!device_list_cache)
+			return -1;
+	}
+	return send_pkt_shared(client, tag, MESSAGE_PLIST, device_list_cache);
 }
 
 static int send_listener_list(struct mux_client *client, uint32_t tag)
@@ -423,55 +625,51 @@ static int send_listener_list(struct mux_client *client, uint32_t tag)
 	plist_t dict = plist_new_dict();
 	plist_t listeners = plist_new_array();
 
-	pthread_mutex_lock(&client_list_mutex);
-	FOREACH(struct mux_client *lc, &client_list) {
-		if (lc->state == CLIENT_LISTEN) {
-			plist_t n = NULL;
-			plist_t l = plist_new_dict();
-			plist_dict_set_item(l, "Blacklisted", plist_new_bool(0));
-			n = NULL;
-			if (lc->info) {
-				n = plist_dict_get_item(lc->info, "BundleID");
-			}
-			if (n) {
-				plist_dict_set_item(l, "BundleID", plist_copy(n));
-			}
-			plist_dict_set_item(l, "ConnType", plist_new_uint(0));
-
-			n = NULL;
-			char *progname = NULL;
-			if (lc->info) {
-				n = plist_dict_get_item(lc->info, "ProgName");
-			}
-			if (n) {
-				plist_get_string_val(n, &progname);
-			}
-			if (!progname) {
-				progname = strdup("unknown");
-			}
-   			size_t idstring_len = (strlen(progname) + 12UL);
-			char *idstring = malloc(idstring_len);
-			snprintf(idstring, idstring_len, "%u-%s", client->number, progname);
-
-			plist_dict_set_item(l, "ID String", plist_new_string(idstring));
-			free(idstring);
-			plist_dict_set_item(l, "ProgName", plist_new_string(progname));
-			free(progname);
-
-			n = NULL;
-			uint64_t version = 0;
-			if (lc->info) {
-				n = plist_dict_get_item(lc->info, "kLibUSBMuxVersion");
-			}
-			if (n) {
-				plist_get_uint_val(n, &version);
-			}
-			plist_dict_set_item(l, "kLibUSBMuxVersion", plist_new_uint(version));
+	LIST_FOREACH(struct mux_client *lc, &client_states[CLIENT_LISTEN], struct mux_client, state_node) {
+		plist_t n = NULL;
+		plist_t l = plist_new_dict();
+		plist_dict_set_item(l, "Blacklisted", plist_new_bool(0));
+		n = NULL;
+		if (lc->info) {
+			n = plist_dict_get_item(lc->info, "BundleID");
+		}
+		if (n) {
+			plist_dict_set_item(l, "BundleID", plist_copy(n));
+		}
+		plist_dict_set_item(l, "ConnType", plist_new_uint(0));
 
-			plist_array_append_item(listeners, l);
+		n = NULL;
+		char *progname = NULL;
+		if (lc->info) {
+			n = plist_dict_get_item(lc->info, "ProgName");
+		}
+		if (n) {
+			plist_get_string_val(n, &progname);
+		}
+		if (!progname) {
+			progname = strdup("unknown");
 		}
+		size_t idstring_len = (strlen(progname) + 12UL);
+		char *idstring = malloc(idstring_len);
+		snprintf(idstring, idstring_len, "%u-%s", client->number, progname);
+
+		plist_dict_set_item(l, "ID String", plist_new_string(idstring));
+		free(idstring);
+		plist_dict_set_item(l, "ProgName", plist_new_string(progname));
+		free(progname);
+
+		n = NULL;
+		uint64_t version = 0;
+		if (lc->info) {
+			n = plist_dict_get_item(lc->info, "kLibUSBMuxVersion");
+		}
+		if (n) {
+			plist_get_uint_val(n, &version);
+		}
+		plist_dict_set_item(l, "kLibUSBMuxVersion", plist_new_uint(version));
+
+		plist_array_append_item(listeners, l);
 	} ENDFOREACH
-	pthread_mutex_unlock(&client_list_mutex);
 
 	plist_dict_set_item(dict, "ListenerList", listeners);
 	res = send_plist_pkt(client, tag, dict);
@@ -493,6 +691,58 @@ static int send_instances(struct mux_client *client, uint32_t tag)
 	return res;
 }
 
+static int send_stats(struct mux_client *client, uint32_t tag)
+{
+	int res = -1;
+
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "Stats", stats_copy_plist());
+	res = send_plist_pkt(client, tag, dict);
+	plist_free(dict);
+
+	return res;
+}
+
+static void device_record_from_plist(plist_t dev, struct usbmuxd_device_record *dmsg)
+{
+	plist_t node;
+	uint64_t u64val = 0;
+	char *strval = NULL;
+
+	memset(dmsg, 0, sizeof(struct usbmuxd_device_record));
+
+	node = plist_dict_get_item(dev, "DeviceID");
+	if (node) {
+		plist_get_uint_val(node, &u64val);
+		dmsg->device_id = (uint32_t)u64val;
+	}
+
+	node = plist_access_path(dev, 2, "Properties", "SerialNumber");
+	if (node) {
+		strval = NULL;
+		plist_get_string_val(node, &strval);
+		if (strval) {
+			strncpy(dmsg->serial_number, strval, sizeof(dmsg->serial_number) - 1);
+			free(strval);
+		}
+	}
+	dmsg->serial_number[255] = 0;
+
+	node = plist_access_path(dev, 2, "Properties", "LocationID");
+	if (node) {
+		u64val = 0;
+		plist_get_uint_val(node, &u64val);
+		dmsg->location = (uint32_t)u64val;
+	}
+
+	node = plist_access_path(dev, 2, "Properties", "ProductID");
+	if (node) {
+		u64val = 0;
+		plist_get_uint_val(node, &u64val);
+		dmsg->product_id = (uint16_t)u64val;
+	}
+}
+
 static int notify_device_add(struct mux_client *client, plist_t dev)
 {
 	int res = -1;
@@ -503,43 +753,7 @@ static int notify_device_add(struct mux_client *client, plist_t dev)
 	} else {
 		/* binary packet */
 		struct usbmuxd_device_record dmsg;
-		plist_t node;
-		uint64_t u64val = 0;
-		char *strval = NULL;
-
-		memset(&dmsg, 0, sizeof(dmsg));
-
-		node = plist_dict_get_item(dev, "DeviceID");
-		if (node) {
-			plist_get_uint_val(node, &u64val);
-			dmsg.device_id = (uint32_t)u64val;
-		}
-
-		node = plist_access_path(dev, 2, "Properties", "SerialNumber");
-		if (node) {
-			strval = NULL;
-			plist_get_string_val(node, &strval);
-			if (strval) {
-				strncpy(dmsg.serial_number, strval, 256);
-				free(strval);
-			}
-		}
-		dmsg.serial_number[255] = 0;
-
-		node = plist_access_path(dev, 2, "Properties", "LocationID");
-		if (node) {
-			u64val = 0;
-			plist_get_uint_val(node, &u64val);
-			dmsg.location = (uint32_t)u64val;
-		}
-
-		node = plist_access_path(dev, 2, "Properties", "ProductID");
-		if (node) {
-			u64val = 0;
-			plist_get_uint_val(node, &u64val);
-			dmsg.product_id = (uint16_t)u64val;
-		}
-
+		device_record_from_plist(dev, &dmsg);
 		res = send_pkt(client, 0, MESSAGE_DEVICE_ADD, &dmsg, sizeof(dmsg));
 	}
 	return res;
@@ -550,11 +764,7 @@ static int notify_device_remove(struct mux_client *client, uint32_t device_id)
 	int res = -1;
 	if (client->proto_version == 1) {
 		/* XML plist packet */
-		plist_t dict = plist_new_dict();
-		plist_dict_set_item(dict, "MessageType", plist_new_string("Detached"));
-		plist_dict_set_item(dict, "DeviceID", plist_new_uint(device_id));
-		res = send_plist_pkt(client, 0, dict);
-		plist_free(dict);
+		res = send_uint_message(client, 0, detached_template, PLISTFMT_LEN(detached_template), device_id);
 	} else {
 		/* binary packet */
 		res = send_pkt(client, 0, MESSAGE_DEVICE_REMOVE, &device_id, sizeof(uint32_t));
@@ -564,7 +774,9 @@ static int notify_device_remove(struct mux_client *client, uint32_t device_id)
 
 static int start_listen(struct mux_client *client)
 {
-	client->state = CLIENT_LISTEN;
+	/* deliver queued events first, they are already part of the device list */
+	client_device_events_flush();
+	client_set_state(client, CLIENT_LISTEN);
 	usbfluxd_log(LL_DEBUG, "Client %d now LISTENING", client->fd);
 	plist_t devices = usbmux_remote_copy_device_list();
 	uint32_t i;
@@ -595,6 +807,8 @@ static char* plist_dict_copy_string_val(plist_t dict, const char* key)
 
 int client_send_packet_data(struct mux_client *client, struct usbmuxd_header *hdr, void *payload, uint32_t payload_size)
 {
+	if (capture_enabled)
+		client_capture(client, CAPTURE_TO_CLIENT, CAPTURE_CONTROL, hdr, sizeof(struct usbmuxd_header), payload, payload_size);
 	int res = send_pkt_raw(client, hdr, sizeof(struct usbmuxd_header));
 	if (payload_size > 0) {
 		res = send_pkt_raw(client, payload, payload_size);
@@ -602,50 +816,463 @@ int client_send_packet_data(struct mux_client *client, struct usbmuxd_header *hd
 	return res;
 }
 
-static void update_client_info(struct mux_client *client, plist_t dict)
+/* A plist command of a client. The payload is scanned for its fields and
+ * only parsed into a dict when the command forwards it, or when the scanner
+ * can not handle it. */
+struct client_request {
+	const char *payload;
+	uint32_t payload_size;
+	int num_fields;			// -1 if the payload was parsed instead
+	struct plistscan_field fields[PLISTSCAN_MAX_FIELDS];
+	plist_t dict;
+};
+
+static plist_t client_request_dict(struct client_request *req)
 {
-	plist_t node = NULL;
-	char *strval = NULL;
+	if (!req->dict)
+		plist_from_xml(req->payload, req->payload_size, &req->dict);
+	return req->dict;
+}
+
+static char *client_request_copy_string(struct client_request *req, const char *key)
+{
+	if (req->num_fields >= 0)
+		return plistscan_copy_string(plistscan_find(req->fields, req->num_fields, key));
+	return plist_dict_copy_string_val(req->dict, key);
+}
+
+/* returns 0 if the request has an integer value for key */
+static int client_request_get_uint(struct client_request *req, const char *key, uint64_t *value)
+{
+	*value = 0;
+	if (req->num_fields >= 0)
+		return plistscan_get_uint(plistscan_find(req->fields, req->num_fields, key), value);
+	plist_t node = plist_dict_get_item(req->dict, key);
+	if (!node || plist_get_node_type(node) != PLIST_UINT)
+		return -1;
+	plist_get_uint_val(node, value);
+	return 0;
+}
+
+static const char *client_info_strings[] = { "BundleID", "ClientVersionString", "ProgName" };
+
+/* clients send the same info with every command, it is kept if unchanged */
+static int client_info_changed(struct mux_client *client, struct client_request *req)
+{
+	unsigned int i;
+	uint64_t u64val = 0;
+	if (!client->info || req->num_fields < 0)
+		return 1;
+	for (i = 0; i < sizeof(client_info_strings) / sizeof(client_info_strings[0]); i++) {
+		plist_t node = plist_dict_get_item(client->info, client_info_strings[i]);
+		const struct plistscan_field *field = plistscan_find(req->fields, req->num_fields, client_info_strings[i]);
+		if (field && field->type != PLISTSCAN_STRING)
+			field = NULL;
+		if (!node != !field)
+			return 1;
+		if (node && !plistscan_string_equals(field, plist_get_string_ptr(node, NULL)))
+			return 1;
+	}
+	plist_t node = plist_dict_get_item(client->info, "kLibUSBMuxVersion");
+	int found = (client_request_get_uint(req, "kLibUSBMuxVersion", &u64val) == 0);
+	if (!node != !found)
+		return 1;
+	if (node) {
+		uint64_t current = 0;
+		plist_get_uint_val(node, &current);
+		if (current != u64val)
+			return 1;
+	}
+	return 0;
+}
+
+static void update_client_info(struct mux_client *client, struct client_request *req)
+{
+	unsigned int i;
 	uint64_t u64val = 0;
+
+	if (!client_info_changed(client, req))
+		return;
 	plist_t info = plist_new_dict();
+	for (i = 0; i < sizeof(client_info_strings) / sizeof(client_info_strings[0]); i++) {
+		char *strval = client_request_copy_string(req, client_info_strings[i]);
+		if (strval) {
+			plist_dict_set_item(info, client_info_strings[i], plist_new_string(strval));
+			free(strval);
+		}
+	}
+	if (client_request_get_uint(req, "kLibUSBMuxVersion", &u64val) == 0) {
+		plist_dict_set_item(info, "kLibUSBMuxVersion", plist_new_uint(u64val));
+	}
+	plist_free(client->info);
+	client->info = info;
+}
 
-	node = plist_dict_get_item(dict, "BundleID");
-	if (node && (plist_get_node_type(node) == PLIST_STRING)) {
-		plist_get_string_val(node, &strval);
-		plist_dict_set_item(info, "BundleID", plist_new_string(strval));
-		free(strval);
+static int client_cmd_listen(struct mux_client *client, struct usbmuxd_header *hdr, struct client_request *req)
+{
+	if (send_result(client, hdr->tag, 0) < 0)
+		return -1;
+	return start_listen(client);
+}
+
+static int client_cmd_connect(struct mux_client *client, struct usbmuxd_header *hdr, struct client_request *req)
+{
+	int res;
+	uint64_t val = 0;
+	uint16_t portnum = 0;
+	uint32_t device_id = 0;
+
+	// get device id
+	if (client_request_get_uint(req, "DeviceID", &val) < 0) {
+		usbfluxd_log(LL_ERROR, "Received connect request without device_id!");
+		if (send_result(client, hdr->tag, RESULT_BADDEV) < 0)
+			return -1;
+		return 0;
 	}
+	device_id = (uint32_t)val;
 
-	strval = NULL;
-	node = plist_dict_get_item(dict, "ClientVersionString");
-	if (node && (plist_get_node_type(node) == PLIST_STRING)) {
-		plist_get_string_val(node, &strval);
-		plist_dict_set_item(info, "ClientVersionString", plist_new_string(strval));
-		free(strval);
+	// get port number
+	if (client_request_get_uint(req, "PortNumber", &val) < 0) {
+		usbfluxd_log(LL_ERROR, "Received connect request without port number!");
+		if (send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0)
+			return -1;
+		return 0;
 	}
+	portnum = (uint16_t)val;
 
-	strval = NULL;
-	node = plist_dict_get_item(dict, "ProgName");
-	if (node && (plist_get_node_type(node) == PLIST_STRING)) {
-		plist_get_string_val(node, &strval);
-		plist_dict_set_item(info, "ProgName", plist_new_string(strval));
-		free(strval);
+	usbfluxd_log(LL_DEBUG, "Client %d connection request to device %d port %d", client->fd, device_id, ntohs(portnum));
+
+	/* the request is forwarded as it is */
+	plist_t dict = client_request_dict(req);
+	if (!dict) {
+		usbfluxd_log(LL_ERROR, "Could not parse plist from payload!");
+		return -1;
+	}
+	res = usbmux_remote_connect(device_id, hdr->tag, dict, client);
+	if(res < 0) {
+		if (send_result(client, hdr->tag, -res) < 0)
+			return -1;
+	} else {
+		client->connect_tag = hdr->tag;
+		client->connect_device = device_id;
+		client_set_state(client, CLIENT_CONNECTING1);
 	}
+	return 0;
+}
 
-	u64val = 0;
-	node = plist_dict_get_item(dict, "kLibUSBMuxVersion");
-	if (node && (plist_get_node_type(node) == PLIST_UINT)) {
-		plist_get_uint_val(node, &u64val);
-		plist_dict_set_item(info, "kLibUSBMuxVersion", plist_new_uint(u64val));
+static int client_cmd_list_devices(struct mux_client *client, struct usbmuxd_header *hdr, struct client_request *req)
+{
+	if (send_device_list(client, hdr->tag) < 0)
+		return -1;
+	return 0;
+}
+
+static int client_cmd_list_listeners(struct mux_client *client, struct usbmuxd_header *hdr, struct client_request *req)
+{
+	if (send_listener_list(client, hdr->tag) < 0)
+		return -1;
+	return 0;
+}
+
+static int client_cmd_read_buid(struct mux_client *client, struct usbmuxd_header *hdr, struct client_request *req)
+{
+	struct msgbuf *cached = usbmux_remote_cached_buid();
+	if (cached) {
+		if (send_pkt_shared(client, hdr->tag, MESSAGE_PLIST, cached) < 0)
+			return -1;
+		return 0;
 	}
-	plist_free(client->info);
-	client->info = info;
+	usbmux_remote_read_buid(hdr->tag, client);
+	return 0;
+}
+
+static int client_cmd_read_pair_record(struct mux_client *client, struct usbmuxd_header *hdr, struct client_request *req)
+{
+	int res;
+	char* record_id = client_request_copy_string(req, "PairRecordID");
+	if (!record_id) {
+		usbfluxd_log(LL_ERROR, "Received ReadPairRecord request without PairRecordID!");
+		if (send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0)
+			return -1;
+		return 0;
+	}
+	struct msgbuf *cached = usbmux_remote_cached_pair_record(record_id);
+	if (cached) {
+		free(record_id);
+		if (send_pkt_shared(client, hdr->tag, MESSAGE_PLIST, cached) < 0)
+			return -1;
+		return 0;
+	}
+	res = usbmux_remote_read_pair_record(record_id, hdr->tag, client);
+	free(record_id);
+	if (res < 0)
+		return -1;
+	return 0;
+}
+
+static int client_cmd_save_pair_record(struct mux_client *client, struct usbmuxd_header *hdr, struct client_request *req)
+{
+	int res;
+	/* the request is forwarded as it is */
+	plist_t dict = client_request_dict(req);
+	if (!dict) {
+		usbfluxd_log(LL_ERROR, "Could not parse plist from payload!");
+		return -1;
+	}
+	char* record_id = client_request_copy_string(req, "PairRecordID");
+	if (!record_id) {
+		usbfluxd_log(LL_ERROR, "Received SavePairRecord request without PairRecordID!");
+		if (send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0)
+			return -1;
+		return 0;
+	}
+	res = usbmux_remote_save_pair_record(record_id, dict, hdr->tag, client);
+	free(record_id);
+	if (res < 0)
+		return -1;
+	return 0;
+}
+
+static int client_cmd_delete_pair_record(struct mux_client *client, struct usbmuxd_header *hdr, struct client_request *req)
+{
+	int res;
+	char* record_id = client_request_copy_string(req, "PairRecordID");
+	if (!record_id) {
+		usbfluxd_log(LL_ERROR, "Received DeletePairRecord request without PairRecordID!");
+		if (send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0)
+			return -1;
+		return 0;
+	}
+	res = usbmux_remote_delete_pair_record(record_id, hdr->tag, client);
+	free(record_id);
+	if (res < 0)
+		return -1;
+	return 0;
+}
+
+static int client_cmd_instances(struct mux_client *client, struct usbmuxd_header *hdr, struct client_request *req)
+{
+	if (send_instances(client, hdr->tag) < 0)
+		return -1;
+	return 0;
+}
+
+static int client_cmd_stats(struct mux_client *client, struct usbmuxd_header *hdr, struct client_request *req)
+{
+	if (send_stats(client, hdr->tag) < 0)
+		return -1;
+	return 0;
+}
+
+static int client_cmd_add_instance(struct mux_client *client, struct usbmuxd_header *hdr, struct client_request *req)
+{
+	char* hostaddr = client_request_copy_string(req, "HostAddress");
+	if (!hostaddr) {
+		usbfluxd_log(LL_ERROR, "Received AddInstance request without host address!");
+		if (send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0)
+			return -1;
+		return 0;
+	}
+	uint64_t val = 0;
+	uint16_t portnum = 0;
+	if (client_request_get_uint(req, "PortNumber", &val) < 0) {
+		usbfluxd_log(LL_ERROR, "Received AddInstance request without port number!");
+		free(hostaddr);
+		if (send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0)
+			return -1;
+		return 0;
+	}
+	portnum = (uint16_t)val;
+
+	int rv = usbmux_remote_add_remote(hostaddr, portnum);
+	if (rv < 0) {
+		int rc = RESULT_CONNREFUSED;
+		if (rv == -2) {
+			usbfluxd_log(LL_ERROR, "Failed to add remote %s:%u (already present)", hostaddr, portnum);
+			rc = RESULT_BADDEV;
+		} else {
+			usbfluxd_log(LL_ERROR, "Failed to add remote %s:%u", hostaddr, portnum);
+		}
+		free(hostaddr);
+		if (send_result(client, hdr->tag, rc) < 0)
+			return -1;
+		return 0;
+	}
+	free(hostaddr);
+	if (send_result(client, hdr->tag, RESULT_OK) < 0)
+		return -1;
+	return 0;
+}
+
+static int client_cmd_remove_instance(struct mux_client *client, struct usbmuxd_header *hdr, struct client_request *req)
+{
+	char* hostaddr = client_request_copy_string(req, "HostAddress");
+	if (!hostaddr) {
+		usbfluxd_log(LL_ERROR, "Received RemoveInstance request without host address!");
+		if (send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0)
+			return -1;
+		return 0;
+	}
+	uint64_t val = 0;
+	uint16_t portnum = 0;
+	if (client_request_get_uint(req, "PortNumber", &val) < 0) {
+		usbfluxd_log(LL_ERROR, "Received RemoveInstance request without port number!");
+		free(hostaddr);
+		if (send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0)
+			return -1;
+		return 0;
+	}
+	portnum = (uint16_t)val;
+
+	if (usbmux_remote_remove_remote(hostaddr, portnum) < 0) {
+		usbfluxd_log(LL_ERROR, "Failed to remove remote %s:%u", hostaddr, portnum);
+		free(hostaddr);
+		if (send_result(client, hdr->tag, RESULT_BADDEV) < 0)
+			return -1;
+		return 0;
+	}
+	free(hostaddr);
+	if (send_result(client, hdr->tag, RESULT_OK) < 0)
+		return -1;
+	return 0;
+}
+
+typedef int (*client_command_func)(struct mux_client *client, struct usbmuxd_header *hdr, struct client_request *req);
+
+struct client_command_entry {
+	const char *name;
+	uint32_t name_len;
+	client_command_func func;
+};
+
+#define CLIENT_COMMAND_ENTRY(name, func)	{ name, sizeof(name) - 1, func }
+
+static const struct client_command_entry client_commands[] = {
+	CLIENT_COMMAND_ENTRY("Listen", client_cmd_listen),
+	CLIENT_COMMAND_ENTRY("Connect", client_cmd_connect),
+	CLIENT_COMMAND_ENTRY("ListDevices", client_cmd_list_devices),
+	CLIENT_COMMAND_ENTRY("ListListeners", client_cmd_list_listeners),
+	CLIENT_COMMAND_ENTRY("ReadBUID", client_cmd_read_buid),
+	CLIENT_COMMAND_ENTRY("ReadPairRecord", client_cmd_read_pair_record),
+	CLIENT_COMMAND_ENTRY("SavePairRecord", client_cmd_save_pair_record),
+	CLIENT_COMMAND_ENTRY("DeletePairRecord", client_cmd_delete_pair_record),
+	CLIENT_COMMAND_ENTRY("Instances", client_cmd_instances),
+	CLIENT_COMMAND_ENTRY("Stats", client_cmd_stats),
+	CLIENT_COMMAND_ENTRY("AddInstance", client_cmd_add_instance),
+	CLIENT_COMMAND_ENTRY("RemoveInstance", client_cmd_remove_instance),
+};
+
+#define COMMAND_HASH_SIZE	64	// power of two, at least twice the number of commands
+
+/* open addressing, filled by client_init() */
+static const struct client_command_entry *command_hash[COMMAND_HASH_SIZE];
+
+static uint32_t command_hash_key(const char *name, uint32_t len)
+{
+	uint32_t hash = 2166136261u;
+	uint32_t i;
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void command_hash_init(void)
+{
+	unsigned int i;
+	memset(command_hash, '\0', sizeof(command_hash));
+	for (i = 0; i < sizeof(client_commands) / sizeof(client_commands[0]); i++) {
+		uint32_t slot = command_hash_key(client_commands[i].name, client_commands[i].name_len) & (COMMAND_HASH_SIZE - 1);
+		while (command_hash[slot])
+			slot = (slot + 1) & (COMMAND_HASH_SIZE - 1);
+		command_hash[slot] = &client_commands[i];
+	}
+}
+
+static const struct client_command_entry *command_lookup(const char *name, uint32_t len)
+{
+	uint32_t slot = command_hash_key(name, len) & (COMMAND_HASH_SIZE - 1);
+	while (command_hash[slot]) {
+		const struct client_command_entry *cmd = command_hash[slot];
+		if (cmd->name_len == len && memcmp(cmd->name, name, len) == 0)
+			return cmd;
+		slot = (slot + 1) & (COMMAND_HASH_SIZE - 1);
+	}
+	return NULL;
+}
+
+static int client_plist_command(struct mux_client *client, struct usbmuxd_header *hdr)
+{
+	struct client_request req;
+	const char *name = NULL;
+	uint32_t name_len = 0;
+	char *message = NULL;
+	int res;
+
+	req.payload = (char*)(hdr) + sizeof(struct usbmuxd_header);
+	req.payload_size = hdr->length - sizeof(struct usbmuxd_header);
+	req.dict = NULL;
+	req.num_fields = plistscan_dict(req.payload, req.payload_size, req.fields, PLISTSCAN_MAX_FIELDS);
+	if (req.num_fields >= 0) {
+		const struct plistscan_field *field = plistscan_find(req.fields, req.num_fields, "MessageType");
+		if (field && field->type == PLISTSCAN_STRING && !memchr(field->text, '&', field->text_len)) {
+			name = field->text;
+			name_len = field->text_len;
+		} else {
+			message = plistscan_copy_string(field);
+		}
+	} else {
+		if (!client_request_dict(&req)) {
+			usbfluxd_log(LL_ERROR, "Could not parse plist from payload!");
+			return -1;
+		}
+		message = plist_dict_copy_string_val(req.dict, "MessageType");
+	}
+	if (message) {
+		name = message;
+		name_len = strlen(message);
+	}
+	if (!name) {
+		usbfluxd_log(LL_ERROR, "Could not read valid MessageType node from plist!");
+		plist_free(req.dict);
+		return -1;
+	}
+	const struct client_command_entry *cmd = command_lookup(name, name_len);
+	if (!cmd && !message) {
+		message = strndup(name, name_len);
+		name = message;
+	}
+
+	update_client_info(client, &req);
+	if (capture_enabled) {
+		struct capture_meta meta;
+		uint64_t u64val = 0;
+		client_capture_meta(client, &meta);
+		if (client_request_get_uint(&req, "DeviceID", &u64val) == 0)
+			meta.device_id = (uint32_t)u64val;
+		capture_frame(&meta, CAPTURE_FROM_CLIENT, CAPTURE_CONTROL, hdr, hdr->length, NULL, 0);
+	}
+	USBFLUXD_PROBE3(client_plist_command, client->fd, (cmd) ? cmd->name : message, hdr->tag);
+	usbfluxd_log(LL_DEBUG, "%s: Message is %.*s client fd %d", __func__, (int)name_len, name, client->fd);
+	if (cmd) {
+		res = cmd->func(client, hdr, &req);
+	} else {
+		usbfluxd_log(LL_ERROR, "Unexpected command '%s' received!", message);
+		res = (send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0) ? -1 : 0;
+	}
+	free(message);
+	plist_free(req.dict);
+	return res;
 }
 
 static int client_command(struct mux_client *client, struct usbmuxd_header *hdr)
 {
 	int res;
 	usbfluxd_log(LL_DEBUG, "Client command in fd %d len %d ver %d msg %d tag %d", client->fd, hdr->length, hdr->version, hdr->message, hdr->tag);
+	USBFLUXD_PROBE4(client_command, client->fd, hdr->message, hdr->tag, hdr->length);
+	if (record_enabled)
+		record_command(client->number, hdr, hdr->length);
 
 	if(client->state != CLIENT_COMMAND) {
 		usbfluxd_log(LL_ERROR, "Client %d command received in the wrong state", client->fd);
@@ -662,228 +1289,15 @@ static int client_command(struct mux_client *client, struct usbmuxd_header *hdr)
 	}
 
 	struct usbmuxd_connect_request *ch;
-	char *payload;
-	uint32_t payload_size;
+
+	/* plist messages are captured once the ProgName they carry is known */
+	if (capture_enabled && hdr->message != MESSAGE_PLIST)
+		client_capture(client, CAPTURE_FROM_CLIENT, CAPTURE_CONTROL, hdr, hdr->length, NULL, 0);
 
 	switch(hdr->message) {
 		case MESSAGE_PLIST:
 			client->proto_version = 1;
-			payload = (char*)(hdr) + sizeof(struct usbmuxd_header);
-			payload_size = hdr->length - sizeof(struct usbmuxd_header);
-			plist_t dict = NULL;
-			plist_from_xml(payload, payload_size, &dict);
-			if (!dict) {
-				usbfluxd_log(LL_ERROR, "Could not parse plist from payload!");
-				return -1;
-			} else {
-				char *message = NULL;
-				plist_t node = plist_dict_get_item(dict, "MessageType");
-				if (!node || plist_get_node_type(node) != PLIST_STRING) {
-					usbfluxd_log(LL_ERROR, "Could not read valid MessageType node from plist!");
-					plist_free(dict);
-					return -1;
-				}
-				plist_get_string_val(node, &message);
-				if (!message) {
-					usbfluxd_log(LL_ERROR, "Could not extract MessageType from plist!");
-					plist_free(dict);
-					return -1;
-				}
-				update_client_info(client, dict);
-				usbfluxd_log(LL_DEBUG, "%s: Message is %s client fd %d", __func__, message, client->fd);
-				if (!strcmp(message, "Listen")) {
-					free(message);
-					plist_free(dict);
-					if (send_result(client, hdr->tag, 0) < 0)
-						return -1;
-					return start_listen(client);
-				} else if (!strcmp(message, "Connect")) {
-					uint64_t val;
-					uint16_t portnum = 0;
-					uint32_t device_id = 0;
-					free(message);
-					// get device id
-					node = plist_dict_get_item(dict, "DeviceID");
-					if (!node) {
-						usbfluxd_log(LL_ERROR, "Received connect request without device_id!");
-						plist_free(dict);
-						if (send_result(client, hdr->tag, RESULT_BADDEV) < 0)
-							return -1;
-						return 0;
-					}
-					val = 0;
-					plist_get_uint_val(node, &val);
-					device_id = (uint32_t)val;
-
-					// get port number
-					node = plist_dict_get_item(dict, "PortNumber");
-					if (!node) {
-						usbfluxd_log(LL_ERROR, "Received connect request without port number!");
-						plist_free(dict);
-						if (send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0)
-							return -1;
-						return 0;
-					}
-					val = 0;
-					plist_get_uint_val(node, &val);
-					portnum = (uint16_t)val;
-
-					usbfluxd_log(LL_DEBUG, "Client %d connection request to device %d port %d", client->fd, device_id, ntohs(portnum));
-
-					res = usbmux_remote_connect(device_id, hdr->tag, dict, client);
-					plist_free(dict);
-					if(res < 0) {
-						if (send_result(client, hdr->tag, -res) < 0)
-							return -1;
-					} else {
-						client->connect_tag = hdr->tag;
-						client->connect_device = device_id;
-						client->state = CLIENT_CONNECTING1;
-					}
-					return 0;
-				} else if (!strcmp(message, "ListDevices")) {
-					free(message);
-					plist_free(dict);
-					if (send_device_list(client, hdr->tag) < 0)
-						return -1;
-					return 0;
-				} else if (!strcmp(message, "ListListeners")) {
-					free(message);
-					plist_free(dict);
-					if (send_listener_list(client, hdr->tag) < 0)
-						return -1;
-					return 0;
-				} else if (!strcmp(message, "ReadBUID")) {
-					free(message);
-					res = usbmux_remote_read_buid(hdr->tag, client);
-					plist_free(dict);
-					return 0;
-				} else if (!strcmp(message, "ReadPairRecord")) {
-					free(message);
-					char* record_id = plist_dict_copy_string_val(dict, "PairRecordID");
-					plist_free(dict);
-					res = usbmux_remote_read_pair_record(record_id, hdr->tag, client);
-					free(record_id);
-					if (res < 0)
-						return -1;
-					return 0;
-				} else if (!strcmp(message, "SavePairRecord")) {
-					free(message);
-					char* record_id = plist_dict_copy_string_val(dict, "PairRecordID");
-					res = usbmux_remote_save_pair_record(record_id, dict, hdr->tag, client);
-					plist_free(dict);
-					if (res < 0)
-						return -1;
-					return 0;
-				} else if (!strcmp(message, "DeletePairRecord")) {
-					free(message);
-					char* record_id = plist_dict_copy_string_val(dict, "PairRecordID");
-					plist_free(dict);
-					res = usbmux_remote_delete_pair_record(record_id, hdr->tag, client);
-					free(record_id);
-					if (res < 0)
-						return -1;
-					return 0;
-				} else if (!strcmp(message, "Instances")) {
-					free(message);
-					plist_free(dict);
-					if (send_instances(client, hdr->tag) < 0)
-						return -1;
-					return 0;
-				} else if (!strcmp(message, "AddInstance")) {
-					free(message);
-					char* hostaddr = plist_dict_copy_string_val(dict, "HostAddress");
-					if (!hostaddr) {
-						usbfluxd_log(LL_ERROR, "Received AddInstance request without host address!");
-						plist_free(dict);
-						if (send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0)
-							return -1;
-						return 0;
-					}
-					uint64_t val;
-					uint16_t portnum = 0;
-					node = plist_dict_get_item(dict, "PortNumber");
-					if (!node) {
-						usbfluxd_log(LL_ERROR, "Received AddInstance request without port number!");
-						plist_free(dict);
-						free(hostaddr);
-						if (send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0)
-							return -1;
-						return 0;
-					}
-					val = 0;
-					plist_get_uint_val(node, &val);
-					portnum = (uint16_t)val;
-
-					int rv = usbmux_remote_add_remote(hostaddr, portnum);
-					if (rv < 0) {
-						int rc = RESULT_CONNREFUSED;
-						if (rv == -2) {
-							usbfluxd_log(LL_ERROR, "Failed to add remote %s:%u (already present)", hostaddr, portnum);
-							rc = RESULT_BADDEV;
-						} else {
-							usbfluxd_log(LL_ERROR, "Failed to add remote %s:%u", hostaddr, portnum);
-						}
-						free(hostaddr);
-						plist_free(dict);
-						if (send_result(client, hdr->tag, rc) < 0)
-							return -1;
-						return 0;
-					}
-					free(hostaddr);
-					plist_free(dict);
-					if (send_result(client, hdr->tag, RESULT_OK) < 0)
-						return -1;
-					return 0;
-				} else if (!strcmp(message, "RemoveInstance")) {
-					free(message);
-					char* hostaddr = plist_dict_copy_string_val(dict, "HostAddress");
-					if (!hostaddr) {
-						usbfluxd_log(LL_ERROR, "Received RemoveInstance request without host address!");
-						plist_free(dict);
-						if (send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0)
-							return -1;
-						return 0;
-					}
-					uint64_t val;
-					uint16_t portnum = 0;
-					node = plist_dict_get_item(dict, "PortNumber");
-					if (!node) {
-						usbfluxd_log(LL_ERROR, "Received RemoveInstance request without port number!");
-						plist_free(dict);
-						free(hostaddr);
-						if (send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0)
-							return -1;
-						return 0;
-					}
-					val = 0;
-					plist_get_uint_val(node, &val);
-					portnum = (uint16_t)val;
-
-					if (usbmux_remote_remove_remote(hostaddr, portnum) < 0) {
-						usbfluxd_log(LL_ERROR, "Failed to remove remote %s:%u", hostaddr, portnum);
-						free(hostaddr);
-						plist_free(dict);
-						if (send_result(client, hdr->tag, RESULT_BADDEV) < 0)
-							return -1;
-						return 0;
-					}
-					free(hostaddr);
-					plist_free(dict);
-					if (send_result(client, hdr->tag, RESULT_OK) < 0)
-						return -1;
-					return 0;
-				} else {
-					usbfluxd_log(LL_ERROR, "Unexpected command '%s' received!", message);
-					free(message);
-					plist_free(dict);
-					if (send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0)
-						return -1;
-					return 0;
-				}
-			}
-			// should not be reached?!
-			return -1;
+			return client_plist_command(client, hdr);
 		case MESSAGE_LISTEN:
 			if(send_result(client, hdr->tag, 0) < 0)
 				return -1;
@@ -903,7 +1317,7 @@ static int client_command(struct mux_client *client, struct usbmuxd_header *hdr)
 			} else {
 				client->connect_tag = hdr->tag;
 				client->connect_device = ch->device_id;
-				client->state = CLIENT_CONNECTING1;
+				client_set_state(client, CLIENT_CONNECTING1);
 			}
 			return 0;
 		default:
@@ -918,34 +1332,36 @@ static int client_command(struct mux_client *client, struct usbmuxd_header *hdr)
 static void process_send(struct mux_client *client)
 {
 	usbfluxd_log(LL_DEBUG, "%s", __func__);
-	int res;
-	if (!client->ob_size) {
+	ssize_t res;
+	if (!client->outq.size) {
 		usbfluxd_log(LL_WARNING, "Client %d OUT process but nothing to send?", client->fd);
 		client->events &= ~POLLOUT;
 		return;
 	}
-	res = send(client->fd, client->ob_buf, client->ob_size, 0);
-	usbfluxd_log(LL_DEBUG, "%s: sent %d (of %d)", __func__, res, client->ob_size);
+	res = msgqueue_send(&client->outq, client->fd);
+	usbfluxd_log(LL_DEBUG, "%s: sent %zd (%llu left)", __func__, res, (unsigned long long)client->outq.size);
+	if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;
+	}
 	if (res <= 0) {
-		usbfluxd_log(LL_ERROR, "Send to client fd %d failed: %d %s", client->fd, res, strerror(errno));
+		usbfluxd_log(LL_ERROR, "Send to client fd %d failed: %zd %s", client->fd, res, strerror(errno));
 		client_close(client);
 		return;
 	}
-	if ((uint32_t)res == client->ob_size) {
-		client->ob_size = 0;
+	if (client->state == CLIENT_COMMAND && client->outq.size <= queue_limit) {
+		client->events |= POLLIN;
+	}
+	if (client->outq.size == 0) {
 		client->events &= ~POLLOUT;
+		client->resync_pending = 0;
 		if (client->state == CLIENT_CONNECTING2) {
 			usbfluxd_log(LL_DEBUG, "Client %d switching to CONNECTED state, remote %d", client->fd, client->remote->fd);
-			client->state = CLIENT_CONNECTED;
+			client_set_state(client, CLIENT_CONNECTED);
 			client->events = client->devents;
 			// no longer need this
-			free(client->ob_buf);
-			client->ob_buf = NULL;
+			msgqueue_free(&client->outq);
 			client->events |= POLLIN; //POLLOUT;
 		}
-	} else {
-		client->ob_size -= res;
-		memmove(client->ob_buf, client->ob_buf + res, client->ob_size);
 	}
 }
 static void process_recv(struct mux_client *client)
@@ -953,8 +1369,19 @@ static void process_recv(struct mux_client *client)
 	usbfluxd_log(LL_DEBUG, "%s fd %d", __func__, client->fd);
 	int res;
 	int did_read = 0;
+	if (client->state == CLIENT_COMMAND && client->outq.size > queue_limit) {
+		/* not reading the replies, stop taking commands until it does */
+		usbfluxd_log(LL_DEBUG, "Client %d has %llu bytes of replies queued, pausing", client->fd, (unsigned long long)client->outq.size);
+		cnt_throttled++;
+		client->events &= ~POLLIN;
+		return;
+	}
 	if(client->ib_size < sizeof(struct usbmuxd_header)) {
 		res = recv(client->fd, client->ib_buf + client->ib_size, sizeof(struct usbmuxd_header) - client->ib_size, 0);
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			/* stale readiness, e.g. the fd was reused within this loop iteration */
+			return;
+		}
 		if(res <= 0) {
 			if(res < 0)
 				usbfluxd_log(LL_ERROR, "Receive from client fd %d failed: %s", client->fd, strerror(errno));
@@ -983,6 +1410,9 @@ static void process_recv(struct mux_client *client)
 		if(did_read)
 			return; //maybe we would block, so defer to next loop
 		res = recv(client->fd, client->ib_buf + client->ib_size, hdr->length - client->ib_size, 0);
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
 		if(res < 0) {
 			usbfluxd_log(LL_ERROR, "Receive from client fd %d failed: %s", client->fd, strerror(errno));
 			client_close(client);
@@ -1003,15 +1433,7 @@ static void process_recv(struct mux_client *client)
 
 void client_process(int fd, short events)
 {
-	struct mux_client *client = NULL;
-	pthread_mutex_lock(&client_list_mutex);
-	FOREACH(struct mux_client *lc, &client_list) {
-		if(lc->fd == fd) {
-			client = lc;
-			break;
-		}
-	} ENDFOREACH
-	pthread_mutex_unlock(&client_list_mutex);
+	struct mux_client *client = fdtable_get(&client_fds, fd);
 
 	if(!client) {
 		usbfluxd_log(LL_DEBUG, "client_process: fd %d not found in client list", fd);
@@ -1029,7 +1451,12 @@ void client_process(int fd, short events)
 			usbfluxd_log(LL_DEBUG, "read from client %d to remote buffer", client->fd);
 			int s = client_read(client, client->remote->ob_buf + client->remote->ob_size, client->remote->ob_capacity - client->remote->ob_size);
 			usbfluxd_log(LL_DEBUG, "client read returned %d", s);
+			USBFLUXD_PROBE2(relay_client_read, client->fd, s);
 			if (s > 0) {
+				if (capture_enabled)
+					client_capture(client, CAPTURE_FROM_CLIENT, CAPTURE_DATA, NULL, 0, client->remote->ob_buf + client->remote->ob_size, s);
+				if (record_enabled)
+					record_data(client->number, RECORD_DATA_UP, s);
 				client->remote->ob_size += s;
 				client->remote->events |= POLLOUT;
 				client->events &= ~POLLIN;
@@ -1043,11 +1470,16 @@ void client_process(int fd, short events)
 			if (client->remote->ib_size > 0) {
 				usbfluxd_log(LL_DEBUG, "sending %d bytes to client", client->remote->ib_size);
 				int res = client_write(client, client->remote->ib_buf, client->remote->ib_size);
+				USBFLUXD_PROBE2(relay_client_write, client->fd, res);
 				if(res <= 0) {
 					usbfluxd_log(LL_ERROR, "Send to client fd %d failed: %d %s", client->fd, res, strerror(errno));
 					client_close(client);
 					return;
 				}
+				if (capture_enabled)
+					client_capture(client, CAPTURE_TO_CLIENT, CAPTURE_DATA, NULL, 0, client->remote->ib_buf, res);
+				if (record_enabled)
+					record_data(client->number, RECORD_DATA_DOWN, res);
 				if((uint32_t)res == client->remote->ib_size) {
 					client->remote->ib_size = 0;
 					client->events &= ~POLLOUT;
@@ -1067,33 +1499,386 @@ void client_process(int fd, short events)
 	}
 }
 
-void client_device_add(plist_t dev)
+/* {{{ device event coalescing */
+/*
+ * Device events from the remotes are queued and delivered to the listening
+ * clients once per main loop iteration. Each batch is encoded once per
+ * protocol version into a buffer that is shared by the output queues of all
+ * listeners. An Attached event that is followed by a Detached event for the same
+ * device before the batch goes out cancels out, repeated events collapse.
+ */
+struct device_event {
+	uint32_t device_id;
+	enum usbmuxd_msgtype type;	// MESSAGE_DEVICE_ADD or MESSAGE_DEVICE_REMOVE
+	plist_t dev;			// copy of the Attached message
+	int reannounce;			// Attached for a device the listeners know
+};
+
+struct device_event_queue {
+	struct device_event *events;
+	int count;
+	int capacity;
+};
+
+static struct device_event_queue event_queues[2];
+static int active_queue = 0;
+static int device_events_active = 0;
+
+static void device_event_queue_add(enum usbmuxd_msgtype type, uint32_t device_id, plist_t dev, int reannounce)
 {
-	pthread_mutex_lock(&client_list_mutex);
-	usbfluxd_log(LL_DEBUG, "%s", __func__);
-	FOREACH(struct mux_client *client, &client_list) {
-		if (client->state == CLIENT_LISTEN)
+	if (!device_events_active) {
+		return;
+	}
+	struct device_event_queue *queue = &event_queues[active_queue];
+	int i;
+	for (i = queue->count - 1; i >= 0; i--) {
+		if (queue->events[i].device_id == device_id)
+			break;
+	}
+	if (i >= 0 && queue->events[i].type == type) {
+		/* repeated event, only the latest properties matter */
+		if (type == MESSAGE_DEVICE_ADD) {
+			plist_free(queue->events[i].dev);
+			queue->events[i].dev = plist_copy(dev);
+		}
+	} else if (i >= 0 && type == MESSAGE_DEVICE_REMOVE && queue->events[i].reannounce) {
+		/* the listeners know the device, they still need the Detached */
+		plist_free(queue->events[i].dev);
+		queue->events[i].dev = NULL;
+		queue->events[i].type = MESSAGE_DEVICE_REMOVE;
+		queue->events[i].reannounce = 0;
+	} else if (i >= 0 && type == MESSAGE_DEVICE_REMOVE) {
+		/* attached and detached again before anyone was told */
+		plist_free(queue->events[i].dev);
+		memmove(&queue->events[i], &queue->events[i+1], sizeof(struct device_event) * (queue->count - i - 1));
+		queue->count--;
+	} else {
+		if (queue->count == queue->capacity) {
+			queue->capacity = (queue->capacity) ? queue->capacity * 2 : 64;
+			queue->events = realloc(queue->events, sizeof(struct device_event) * queue->capacity);
+		}
+		struct device_event *ev = &queue->events[queue->count++];
+		ev->device_id = device_id;
+		ev->type = type;
+		ev->dev = (type == MESSAGE_DEVICE_ADD) ? plist_copy(dev) : NULL;
+		ev->reannounce = reannounce;
+	}
+}
+
+static int event_batch_append(struct msgbuf **batch, uint32_t version, enum usbmuxd_msgtype msg, const void *payload, uint32_t payload_length)
+{
+	struct usbmuxd_header hdr;
+	hdr.version = version;
+	hdr.length = sizeof(hdr) + payload_length;
+	hdr.message = msg;
+	hdr.tag = 0;
+	if (msgbuf_append(batch, &hdr, sizeof(hdr)) < 0 || msgbuf_append(batch, payload, payload_length) < 0) {
+		usbfluxd_log(LL_FATAL, "%s: Failed to realloc.", __func__);
+		return -1;
+	}
+	return 0;
+}
+
+/* encode the queued events once for all listeners using proto_version */
+static struct msgbuf *event_batch_encode(uint32_t proto_version, struct device_event_queue *queue)
+{
+	struct msgbuf *batch = msgbuf_new(4096);
+	int i;
+	if (!batch)
+		return NULL;
+	for (i = 0; i < queue->count; i++) {
+		struct device_event *ev = &queue->events[i];
+		if (proto_version == 1 && ev->type == MESSAGE_DEVICE_REMOVE) {
+			/* XML plist packet */
+			char detached[UINT_MESSAGE_MAX_LEN];
+			uint_message_encode(detached, detached_template, PLISTFMT_LEN(detached_template), ev->device_id);
+			event_batch_append(&batch, proto_version, MESSAGE_PLIST, detached, uint_message_length(PLISTFMT_LEN(detached_template), ev->device_id));
+		} else if (proto_version == 1) {
+			/* XML plist packet */
+			char *xml = NULL;
+			uint32_t xmlsize = 0;
+			plist_to_xml(ev->dev, &xml, &xmlsize);
+			if (xml) {
+				event_batch_append(&batch, proto_version, MESSAGE_PLIST, xml, xmlsize);
+				free(xml);
+			} else {
+				usbfluxd_log(LL_ERROR, "%s: Could not convert plist to xml", __func__);
+			}
+		} else if (ev->type == MESSAGE_DEVICE_ADD) {
+			/* binary packet */
+			struct usbmuxd_device_record dmsg;
+			device_record_from_plist(ev->dev, &dmsg);
+			event_batch_append(&batch, proto_version, MESSAGE_DEVICE_ADD, &dmsg, sizeof(dmsg));
+		} else {
+			event_batch_append(&batch, proto_version, MESSAGE_DEVICE_REMOVE, &ev->device_id, sizeof(uint32_t));
+		}
+	}
+	return batch;
+}
+
+static void client_capture_batch(struct mux_client *client, struct msgbuf *batch)
+{
+	uint32_t offset = 0;
+	while (offset + sizeof(struct usbmuxd_header) <= batch->size) {
+		struct usbmuxd_header *hdr = (struct usbmuxd_header*)(batch->data + offset);
+		client_capture(client, CAPTURE_TO_CLIENT, CAPTURE_CONTROL, hdr, sizeof(struct usbmuxd_header), hdr + 1, hdr->length - sizeof(struct usbmuxd_header));
+		offset += hdr->length;
+	}
+}
+
+/* device ID of a queued Attached or Detached message, -1 for other messages */
+static int64_t queued_event_device_id(const unsigned char *frame, uint32_t length)
+{
+	struct usbmuxd_header hdr;
+	const unsigned char *payload = frame + sizeof(hdr);
+	uint32_t payload_length = length - sizeof(hdr);
+	uint32_t device_id = 0;
+	int64_t res = -1;
+
+	memcpy(&hdr, frame, sizeof(hdr));
+	if (hdr.message == MESSAGE_DEVICE_ADD || hdr.message == MESSAGE_DEVICE_REMOVE) {
+		/* the device ID comes first in both */
+		if (payload_length >= sizeof(uint32_t)) {
+			memcpy(&device_id, payload, sizeof(uint32_t));
+			res = device_id;
+		}
+	} else if (hdr.message == MESSAGE_PLIST) {
+		plist_t dict = NULL;
+		plist_from_xml((const char*)payload, payload_length, &dict);
+		plist_t node = (dict) ? plist_dict_get_item(dict, "MessageType") : NULL;
+		const char *message = (node && plist_get_node_type(node) == PLIST_STRING) ? plist_get_string_ptr(node, NULL) : NULL;
+		if (message && (!strcmp(message, "Attached") || !strcmp(message, "Detached"))) {
+			uint64_t u64val = 0;
+			node = plist_dict_get_item(dict, "DeviceID");
+			if (node)
+				plist_get_uint_val(node, &u64val);
+			res = (uint32_t)u64val;
+		}
+		plist_free(dict);
+	}
+	return res;
+}
+
+static int compare_device_id(const void *a, const void *b)
+{
+	uint32_t ia = *(const uint32_t*)a;
+	uint32_t ib = *(const uint32_t*)b;
+	return (ia > ib) - (ia < ib);
+}
+
+/*
+ * Replace the unsent device events of a listener that fell behind by
+ * Detached messages for every device they mention, followed by Attached
+ * messages for those of them that are in the current device list. The
+ * message that is partially sent and queued messages that are not device
+ * events are kept.
+ */
+static void listener_resync(struct mux_client *client, struct device_event_queue *pending)
+{
+	struct msgqueue *queue = &client->outq;
+	uint64_t behind = queue->size;
+	uint64_t keep = 0;
+	struct msgbuf *kept = NULL;
+	uint32_t *ids = malloc(sizeof(uint32_t) * (pending->count + 64));
+	uint32_t num_ids = 0;
+	uint32_t ids_capacity = pending->count + 64;
+	uint32_t i, j;
+	int attached = 0;
+
+	/* the pending events have not been queued yet */
+	for (i = 0; i < (uint32_t)pending->count; i++) {
+		ids[num_ids++] = pending->events[i].device_id;
+	}
+
+	/* listener queues only hold complete messages per entry */
+	for (i = 0; i < queue->count; i++) {
+		struct msgqueue_entry *entry = &queue->entries[(queue->head + i) % queue->capacity];
+		uint32_t pos = entry->start;
+		while (pos + sizeof(struct usbmuxd_header) <= entry->end) {
+			const unsigned char *frame = entry->buf->data + pos;
+			struct usbmuxd_header hdr;
+			memcpy(&hdr, frame, sizeof(hdr));
+			if (hdr.length < sizeof(hdr) || pos + hdr.length > entry->end)
+				break;
+			pos += hdr.length;
+			if (pos <= entry->offset)
+				continue;	// sent already
+			if (pos - hdr.length < entry->offset) {
+				keep = pos - entry->offset;	// partially sent
+				continue;
+			}
+			int64_t device_id = queued_event_device_id(frame, hdr.length);
+			if (device_id < 0) {
+				if (!kept)
+					kept = msgbuf_new(hdr.length);
+				if (kept)
+					msgbuf_append(&kept, frame, hdr.length);
+			} else {
+				if (num_ids == ids_capacity) {
+					ids_capacity *= 2;
+					ids = realloc(ids, sizeof(uint32_t) * ids_capacity);
+				}
+				ids[num_ids++] = (uint32_t)device_id;
+			}
+		}
+		if (pos < entry->offset) {
+			/* no message boundary found, keep the rest of the entry */
+			keep = entry->end - entry->offset;
+		}
+	}
+
+	if (num_ids > 0) {
+		qsort(ids, num_ids, sizeof(uint32_t), compare_device_id);
+		for (i = 1, j = 1; i < num_ids; i++) {
+			if (ids[i] != ids[j-1])
+				ids[j++] = ids[i];
+		}
+		num_ids = j;
+	}
+
+	msgqueue_truncate(queue, keep);
+	if (kept) {
+		msgqueue_write(queue, kept->data, kept->size);
+		msgbuf_unref(kept);
+	}
+	for (i = 0; i < num_ids; i++) {
+		notify_device_remove(client, ids[i]);
+	}
+	plist_t devices = usbmux_remote_copy_device_list();
+	for (i = 0; num_ids > 0 && i < plist_array_get_size(devices); i++) {
+		plist_t dev = plist_array_get_item(devices, i);
+		plist_t node = plist_dict_get_item(dev, "DeviceID");
+		uint64_t u64val = 0;
+		if (node)
+			plist_get_uint_val(node, &u64val);
+		uint32_t device_id = (uint32_t)u64val;
+		if (bsearch(&device_id, ids, num_ids, sizeof(uint32_t), compare_device_id)) {
 			notify_device_add(client, dev);
+			attached++;
+		}
+	}
+	plist_free(devices);
+	free(ids);
+
+	client->resync_pending = 1;
+	client->resync_mark = queue->size;
+	client->events |= POLLOUT;
+	cnt_resyncs++;
+	usbfluxd_log(LL_NOTICE, "Client %d fell behind by %llu bytes, resynchronized %u devices (%d attached), %llu bytes queued now",
+		client->fd, (unsigned long long)behind, num_ids, attached, (unsigned long long)queue->size);
+}
+
+static void device_list_cache_invalidate(void)
+{
+	msgbuf_unref(device_list_cache);
+	device_list_cache = NULL;
+}
+
+/**
+ * Deliver the queued device events to all listening clients. Called once
+ * per main loop iteration, and before a client starts listening.
+ */
+void client_device_events_flush(void)
+{
+	struct device_event_queue *queue = &event_queues[active_queue];
+	if (queue->count == 0) {
+		return;
+	}
+	active_queue ^= 1;
+
+	int listeners = 0;
+	int i;
+	struct msgbuf *batches[2] = { NULL, NULL };	// binary, plist
+	struct collection slow_clients = { NULL, 0 };	// allocated on first use
+	struct collection failed_clients = { NULL, 0 };
+	device_list_cache_invalidate();
+	LIST_FOREACH(struct mux_client *client, &client_states[CLIENT_LISTEN], struct mux_client, state_node) {
+		if (client->resync_pending) {
+			if (client->outq.size < client->resync_mark)
+				client->resync_mark = client->outq.size;
+			if (client->outq.size > client->resync_mark + queue_limit) {
+				/* fell behind again before it caught up */
+				collection_add(&slow_clients, client);
+				continue;
+			}
+		} else if (client->outq.size > queue_limit) {
+			listener_resync(client, queue);
+			listeners++;
+			continue;
+		}
+		struct msgbuf **batch = &batches[(client->proto_version == 1) ? 1 : 0];
+		if (!*batch)
+			*batch = event_batch_encode(client->proto_version, queue);
+		if (!*batch)
+			continue;
+		if (msgqueue_push(&client->outq, *batch, 0, (*batch)->size) < 0) {
+			/* the listener would miss the events */
+			usbfluxd_log(LL_FATAL, "%s: Failed to allocate output buffer.", __func__);
+			collection_add(&failed_clients, client);
+			continue;
+		}
+		client->events |= POLLOUT;
+		if (capture_enabled)
+			client_capture_batch(client, *batch);
+		listeners++;
 	} ENDFOREACH
-	pthread_mutex_unlock(&client_list_mutex);
+	usbfluxd_log(LL_DEBUG, "%s: %d device events to %d listeners", __func__, queue->count, listeners);
+
+	FOREACH(struct mux_client *client, &slow_clients) {
+		usbfluxd_log(LL_WARNING, "Disconnecting client %d: %llu bytes behind again after resync", client->fd, (unsigned long long)client->outq.size);
+		cnt_slow_disconnects++;
+		client_close(client);
+	} ENDFOREACH
+	collection_free(&slow_clients);
+	FOREACH(struct mux_client *client, &failed_clients) {
+		usbfluxd_log(LL_WARNING, "Disconnecting client %d: device events could not be queued", client->fd);
+		client_close(client);
+	} ENDFOREACH
+	collection_free(&failed_clients);
+
+	msgbuf_unref(batches[0]);
+	msgbuf_unref(batches[1]);
+	for (i = 0; i < queue->count; i++) {
+		plist_free(queue->events[i].dev);
+	}
+	queue->count = 0;
+}
+
+static uint32_t device_plist_id(plist_t dev)
+{
+	uint64_t u64val = 0;
+	plist_t node = plist_dict_get_item(dev, "DeviceID");
+	if (node)
+		plist_get_uint_val(node, &u64val);
+	return (uint32_t)u64val;
+}
+
+void client_device_add(plist_t dev)
+{
+	uint32_t device_id = device_plist_id(dev);
+	usbfluxd_log(LL_DEBUG, "%s: id %d", __func__, device_id);
+	device_event_queue_add(MESSAGE_DEVICE_ADD, device_id, dev, 0);
+}
+
+/* a device the listeners were told about is announced again */
+void client_device_update(plist_t dev)
+{
+	uint32_t device_id = device_plist_id(dev);
+	usbfluxd_log(LL_DEBUG, "%s: id %d", __func__, device_id);
+	device_event_queue_add(MESSAGE_DEVICE_ADD, device_id, dev, 1);
 }
 
 void client_device_remove(uint32_t device_id)
 {
-	pthread_mutex_lock(&client_list_mutex);
 	usbfluxd_log(LL_DEBUG, "client_device_remove: id %d", device_id);
-	FOREACH(struct mux_client *client, &client_list) {
-		if (client->state == CLIENT_LISTEN)
-			notify_device_remove(client, device_id);
-	} ENDFOREACH
-	pthread_mutex_unlock(&client_list_mutex);
+	device_event_queue_add(MESSAGE_DEVICE_REMOVE, device_id, NULL, 0);
 }
+/* }}} */
 
 void client_remote_unset(struct remote_mux *remote)
 {
-	pthread_mutex_lock(&client_list_mutex);
 	usbfluxd_log(LL_DEBUG, "%s: %p", __func__, (void *)remote);
-	FOREACH(struct mux_client *client, &client_list) {
+	LIST_FOREACH(struct mux_client *client, &client_list, struct mux_client, node) {
 		if (client->remote == remote) {
 			usbfluxd_log(LL_DEBUG,
                                      "Removing remote %p from client %p",
@@ -1101,22 +1886,58 @@ void client_remote_unset(struct remote_mux *remote)
 			client->remote = NULL;
 		}
 	} ENDFOREACH
-	pthread_mutex_unlock(&client_list_mutex);
+}
+
+/**
+ * Set the number of bytes a client may have queued before it is
+ * considered slow. Listeners are resynchronized and then disconnected,
+ * command clients stop being read from.
+ */
+void client_set_queue_limit(uint64_t limit)
+{
+	queue_limit = limit;
+}
+
+plist_t client_copy_stats(void)
+{
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "QueueLimit", plist_new_uint(queue_limit));
+	plist_dict_set_item(dict, "Resyncs", plist_new_uint(cnt_resyncs));
+	plist_dict_set_item(dict, "SlowDisconnects", plist_new_uint(cnt_slow_disconnects));
+	plist_dict_set_item(dict, "Throttled", plist_new_uint(cnt_throttled));
+	return dict;
 }
 
 void client_init(void)
 {
 	usbfluxd_log(LL_DEBUG, "client_init");
-	collection_init(&client_list);
-	pthread_mutex_init(&client_list_mutex, NULL);
+	int i;
+	list_init(&client_list);
+	for (i = 0; i <= CLIENT_DEAD; i++) {
+		list_init(&client_states[i]);
+	}
+	fdtable_init(&client_fds);
+	command_hash_init();
+	device_events_active = 1;
 }
 
 void client_shutdown(void)
 {
 	usbfluxd_log(LL_DEBUG, "client_shutdown");
-	FOREACH(struct mux_client *client, &client_list) {
+	int i, j;
+	LIST_FOREACH(struct mux_client *client, &client_list, struct mux_client, node) {
 		client_close(client);
 	} ENDFOREACH
-	pthread_mutex_destroy(&client_list_mutex);
-	collection_free(&client_list);
+	fdtable_free(&client_fds);
+
+	/* events queued from here on have nobody to go to */
+	device_events_active = 0;
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < event_queues[i].count; j++) {
+			plist_free(event_queues[i].events[j].dev);
+		}
+		free(event_queues[i].events);
+		memset(&event_queues[i], '\0', sizeof(struct device_event_queue));
+	}
+	device_list_cache_invalidate();
 }
@@ -22,6 +22,7 @@
 #define CLIENT_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include "usbmuxd-proto.h"
 #include "usbmux_remote.h"
 
@@ -35,6 +36,13 @@ struct device_info {
 
 struct mux_client;
 struct remote_mux;
+struct capture_meta;
+
+/* what identifies a client, cheap to take before dispatching its fd */
+struct client_ident {
+	uint32_t number;
+	int state;
+};
 
 int client_read(struct mux_client *client, void *buffer, uint32_t len);
 int client_write(struct mux_client *client, void *buffer, uint32_t len);
@@ -46,17 +54,25 @@ void client_set_remote(struct mux_client *client, struct remote_mux *remote);
 void client_clear_remote(struct mux_client *client);
 void client_remote_unset(struct remote_mux *remote);
 int client_notify_connect(struct mux_client *client, enum usbmuxd_result result);
+int client_notify_result(struct mux_client *client, uint32_t tag, enum usbmuxd_result result);
 void client_notify_remote_close(struct mux_client *client);
 int client_send_plist_pkt(struct mux_client *client, plist_t plist);
 int client_send_packet_data(struct mux_client *client, struct usbmuxd_header *hdr, void *payload, uint32_t payload_size);
 
 void client_device_add(plist_t dev);
+void client_device_update(plist_t dev);
 void client_device_remove(uint32_t device_id);
+void client_device_events_flush(void);
 
 int client_accept(int fd);
 void client_get_fds(struct fdlist *list);
 void client_process(int fd, short events);
 void client_usbmux_process(int fd, short events);
+int client_identify(int fd, struct client_ident *ident);
+void client_describe(int fd, const struct client_ident *ident, char *buf, size_t len);
+void client_capture_meta(struct mux_client *client, struct capture_meta *meta);
+void client_set_queue_limit(uint64_t limit);
+plist_t client_copy_stats(void);
 
 void client_init(void);
 void client_shutdown(void);
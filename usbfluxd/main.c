@@ -46,12 +46,20 @@
 #include <getopt.h>
 #include <pwd.h>
 #include <grp.h>
+#ifdef HAVE_SYS_SIGNALFD_H
+#include <sys/signalfd.h>
+#endif
 
 #include "log.h"
 #include "client.h"
 #include "socket.h"
 #include "usbmuxd-proto.h"
 #include "usbmux_remote.h"
+#include "stats.h"
+#include "capture.h"
+#include "record.h"
+#include "timer.h"
+#include "paircache.h"
 
 int should_exit;
 int should_discover;
@@ -62,11 +70,26 @@ static int daemon_pipe;
 static int renamed = 0;
 static int opt_no_usbmuxd = 0;
 static int opt_no_mdns = 0;
+static int opt_profile = 0;
+static unsigned int opt_stall_ms = 100;
+static char *opt_capture_file = NULL;
+static char *opt_capture_opts = NULL;
+static char *opt_record_file = NULL;
+static unsigned long opt_queue_limit_kb = 0;
+static long opt_heartbeat_ms = -1;
+static unsigned long opt_heartbeat_misses = 0;
+static long opt_reconnect_grace_ms = -1;
+static unsigned long opt_connect_limits[4] = { 0, 0, 0, 0 };
+static char *opt_request_timeouts = NULL;
+static long opt_cache_ttl = -1;
+static long opt_cache_buid_ttl = -1;
+static char *opt_cache_file = NULL;
 
 static char *remote_host = NULL;
 static uint16_t remote_port = 0;
 
 static int report_to_parent = 0;
+static int signal_fd = -1;
 
 static void handle_signal(int sig)
 {
@@ -95,6 +118,24 @@ static void set_signal_handlers(void)
 	sigaction(SIGTERM, &sa, NULL);
 	sigaction(SIGUSR1, &sa, NULL);
 	sigaction(SIGUSR2, &sa, NULL);
+
+#ifdef HAVE_SYS_SIGNALFD_H
+	// Where available, the signals stay masked and are read from the main loop.
+	signal_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd < 0) {
+		usbfluxd_log(LL_WARNING, "signalfd failed: %s", strerror(errno));
+	}
+#endif
+}
+
+static void handle_signal_fd(void)
+{
+#ifdef HAVE_SYS_SIGNALFD_H
+	struct signalfd_siginfo info;
+	while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+		handle_signal(info.ssi_signo);
+	}
+#endif
 }
 
 #ifndef HAVE_PPOLL
@@ -102,7 +143,7 @@ static int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *timeout
 {
 	int ready;
 	sigset_t origmask;
-	int to = timeout->tv_sec*1000 + timeout->tv_nsec/1000000;
+	int to = (timeout) ? timeout->tv_sec*1000 + timeout->tv_nsec/1000000 : -1;
 
 	sigprocmask(SIG_SETMASK, sigmask, &origmask);
 	ready = poll(fds, nfds, to);
@@ -126,16 +167,23 @@ static int main_loop(int listenfd)
 	fdlist_create(&pollfds);
 	while(!should_exit) {
 		usbfluxd_log(LL_FLOOD, "main_loop iteration");
-		to = 500;
+		loop_stats_iteration_begin();
 		fdlist_reset(&pollfds);
 		fdlist_add(&pollfds, FD_LISTEN, listenfd, POLLIN);
+		if (signal_fd >= 0)
+			fdlist_add(&pollfds, FD_SIGNAL, signal_fd, POLLIN);
 		client_get_fds(&pollfds);
 		usbmux_remote_get_fds(&pollfds);
 		usbfluxd_log(LL_FLOOD, "fd count is %d", pollfds.count);
 
+		/* sleep until an fd becomes ready or the next timer is due */
+		to = timers_get_timeout();
 		tspec.tv_sec = to / 1000;
 		tspec.tv_nsec = (to % 1000) * 1000000;
-		cnt = ppoll(pollfds.fds, pollfds.count, &tspec, &empty_sigset);
+		loop_stats_poll_begin();
+		cnt = ppoll(pollfds.fds, pollfds.count, (to < 0) ? NULL : &tspec, (signal_fd >= 0) ? NULL : &empty_sigset);
+		loop_stats_poll_end(cnt);
+		timers_update_clock();
 		usbfluxd_log(LL_FLOOD, "poll() returned %d", cnt);
 		if(cnt == -1) {
 			if(errno == EINTR) {
@@ -149,6 +197,7 @@ static int main_loop(int listenfd)
 		} else {
 			for(i=0; i<pollfds.count; i++) {
 				if(pollfds.fds[i].revents) {
+					loop_stats_dispatch_begin(pollfds.owners[i], pollfds.fds[i].fd);
 					if(pollfds.owners[i] == FD_LISTEN) {
 						if(client_accept(listenfd) < 0) {
 							usbfluxd_log(LL_FATAL, "client_accept() failed");
@@ -162,9 +211,16 @@ static int main_loop(int listenfd)
 					if(pollfds.owners[i] == FD_REMOTE) {
 						usbmux_remote_process(pollfds.fds[i].fd, pollfds.fds[i].revents);
 					}
+					if(pollfds.owners[i] == FD_SIGNAL) {
+						handle_signal_fd();
+					}
+					loop_stats_dispatch_end();
 				}
 			}
 		}
+		timers_run();
+		client_device_events_flush();
+		loop_stats_iteration_end();
 	}
 	fdlist_free(&pollfds);
 	return 0;
@@ -286,6 +342,35 @@ static void print_usage(int argc, char **argv, int is_error)
 	  "  -r, --remote\t\tConnect to the specified remote usbmuxd, specified as host:port.\n" \
 	  "  -n, --no-usbmuxd\tRun even if local usbmuxd is not available.\n" \
 	  "  -m, --no-mdns\tDisable automatic detection via mDNS.\n" \
+	  "  -p, --profile\t\tCollect event loop statistics and report stalls.\n" \
+	  "  -s, --stall-threshold MS\tLog loop iterations busy longer than MS ms (implies -p).\n" \
+	  "  -c, --capture FILE\tWrite relayed usbmuxd frames to a pcap-ng file.\n" \
+	  "  -C, --capture-opts OPTS\tComma separated capture options: device=ID,\n" \
+	  "                  \tremote=ID, prog=NAME, data, snaplen=N, size=MB, files=N.\n" \
+	  "  -R, --record FILE\tRecord client commands and relayed byte counts for\n" \
+	  "                  \treplay with muxreplay.\n" \
+	  "  -q, --queue-limit KB\tOutput queued for a client before it counts as slow\n" \
+	  "                  \t(default 1024). Slow listeners are resynchronized, then\n" \
+	  "                  \tdisconnected.\n" \
+	  "  -b, --heartbeat MS[,N]\tHeartbeat interval of remote instances (default\n" \
+	  "                  \t5000, 0 disables). A remote is closed after N missed\n" \
+	  "                  \tbeats in a row (default 3).\n" \
+	  "  -g, --reconnect-grace MS\tReconnect remote instances that lost their\n" \
+	  "                  \tconnection for up to MS ms while keeping their devices\n" \
+	  "                  \t(default 30000, 0 disables).\n" \
+	  "  -a, --connect-limit N[,TOTAL[,QUEUE[,MS]]]\tConnects to a remote instance\n" \
+	  "                  \twaiting for their result (default 8), in total (32).\n" \
+	  "                  \tMore connects wait in a queue of QUEUE entries (256)\n" \
+	  "                  \tfor up to MS ms (10000).\n" \
+	  "  -t, --request-timeout CMD=MS[,...]\tTime a remote has to reply to a\n" \
+	  "                  \tforwarded Connect (default 10000), ReadBUID,\n" \
+	  "                  \tReadPairRecord, SavePairRecord or DeletePairRecord\n" \
+	  "                  \t(5000), or all of them. 0 waits forever.\n" \
+	  "  -k, --cache-ttl SEC[,BUID_SEC]\tAnswer ReadPairRecord from a cache for\n" \
+	  "                  \tSEC seconds (default 60) and ReadBUID for BUID_SEC\n" \
+	  "                  \tseconds (600). 0 disables caching.\n" \
+	  "  -K, --cache-file FILE\tKeep the pair record and BUID cache across\n" \
+	  "                  \trestarts in FILE.\n" \
 	  "  -V, --version\t\tPrint version information and exit.\n" \
 	  "\n"
 	);
@@ -301,11 +386,23 @@ static void parse_opts(int argc, char **argv)
 		{"remote", required_argument, NULL, 'r'},
 		{"no-usbmuxd", 0, NULL, 'n'},
 		{"no-mdns", 0, NULL, 'm'},
+		{"profile", 0, NULL, 'p'},
+		{"stall-threshold", required_argument, NULL, 's'},
+		{"capture", required_argument, NULL, 'c'},
+		{"capture-opts", required_argument, NULL, 'C'},
+		{"record", required_argument, NULL, 'R'},
+		{"queue-limit", required_argument, NULL, 'q'},
+		{"heartbeat", required_argument, NULL, 'b'},
+		{"reconnect-grace", required_argument, NULL, 'g'},
+		{"connect-limit", required_argument, NULL, 'a'},
+		{"request-timeout", required_argument, NULL, 't'},
+		{"cache-ttl", required_argument, NULL, 'k'},
+		{"cache-file", required_argument, NULL, 'K'},
 		{NULL, 0, NULL, 0}
 	};
 	int c;
 
-	const char* opts_spec = "hfvVr:nm";
+	const char* opts_spec = "hfvVr:nmps:c:C:R:q:b:g:a:t:k:K:";
 
 	while (1) {
 		c = getopt_long(argc, argv, opts_spec, longopts, (int *) 0);
@@ -332,6 +429,64 @@ static void parse_opts(int argc, char **argv)
 		case 'm':
 			opt_no_mdns = 1;
 			break;
+		case 'p':
+			opt_profile = 1;
+			break;
+		case 's':
+			opt_profile = 1;
+			opt_stall_ms = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			free(opt_capture_file);
+			opt_capture_file = strdup(optarg);
+			break;
+		case 'C':
+			free(opt_capture_opts);
+			opt_capture_opts = strdup(optarg);
+			break;
+		case 'R':
+			free(opt_record_file);
+			opt_record_file = strdup(optarg);
+			break;
+		case 'q':
+			opt_queue_limit_kb = strtoul(optarg, NULL, 10);
+			break;
+		case 'b': {
+			char *comma = NULL;
+			opt_heartbeat_ms = strtol(optarg, &comma, 10);
+			if (comma && *comma == ',') {
+				opt_heartbeat_misses = strtoul(comma + 1, NULL, 10);
+			}
+			break;
+		}
+		case 'g':
+			opt_reconnect_grace_ms = strtol(optarg, NULL, 10);
+			break;
+		case 'a': {
+			char *p = optarg;
+			int i;
+			for (i = 0; i < 4 && p && *p; i++) {
+				opt_connect_limits[i] = strtoul(p, &p, 10);
+				if (*p != ',')
+					break;
+				p++;
+			}
+			break;
+		}
+		case 't':
+			free(opt_request_timeouts);
+			opt_request_timeouts = strdup(optarg);
+			break;
+		case 'k': {
+			char *comma = NULL;
+			opt_cache_ttl = strtol(optarg, &comma, 10);
+			opt_cache_buid_ttl = (comma && *comma == ',') ? strtol(comma + 1, NULL, 10) : ((opt_cache_ttl == 0) ? 0 : -1);
+			break;
+		}
+		case 'K':
+			free(opt_cache_file);
+			opt_cache_file = strdup(optarg);
+			break;
 		case 'r': {
 			if (remote_host != NULL) {
 				free(remote_host);
@@ -467,7 +622,46 @@ int main(int argc, char *argv[])
 	if(listenfd < 0)
 		goto terminate;
 
+	timers_init();
+	loop_stats_init(opt_profile, opt_stall_ms);
+	if (opt_capture_file) {
+		if (capture_init(opt_capture_file, opt_capture_opts) < 0) {
+			usbfluxd_log(LL_ERROR, "ERROR: Failed to start capture to %s", opt_capture_file);
+		}
+	}
+	if (opt_record_file) {
+		if (record_init(opt_record_file) < 0) {
+			usbfluxd_log(LL_ERROR, "ERROR: Failed to start recording to %s", opt_record_file);
+		}
+	}
 	client_init();
+	if (opt_queue_limit_kb > 0)
+		client_set_queue_limit((uint64_t)opt_queue_limit_kb * 1024);
+	if (opt_heartbeat_ms >= 0)
+		usbmux_remote_set_heartbeat((uint32_t)opt_heartbeat_ms, (uint32_t)opt_heartbeat_misses);
+	if (opt_reconnect_grace_ms >= 0)
+		usbmux_remote_set_reconnect_grace((uint32_t)opt_reconnect_grace_ms);
+	if (opt_request_timeouts) {
+		char *saveptr = NULL;
+		char *item = strtok_r(opt_request_timeouts, ",", &saveptr);
+		while (item) {
+			char *eq = strchr(item, '=');
+			if (eq) {
+				*eq = '\0';
+			}
+			if (!eq || usbmux_remote_set_request_timeout(item, strtoul(eq + 1, NULL, 10)) < 0) {
+				usbfluxd_log(LL_WARNING, "Ignoring invalid request timeout '%s'", item);
+			}
+			item = strtok_r(NULL, ",", &saveptr);
+		}
+		free(opt_request_timeouts);
+		opt_request_timeouts = NULL;
+	}
+	usbmux_remote_set_connect_limits((uint32_t)opt_connect_limits[0], (uint32_t)opt_connect_limits[1], (uint32_t)opt_connect_limits[2], (uint32_t)opt_connect_limits[3]);
+	if (opt_cache_ttl >= 0 || opt_cache_buid_ttl >= 0)
+		paircache_set_ttl((opt_cache_ttl >= 0) ? opt_cache_ttl * 1000 : -1, (opt_cache_buid_ttl >= 0) ? opt_cache_buid_ttl * 1000 : -1);
+	if (opt_cache_file)
+		paircache_set_file(opt_cache_file);
 	usbmux_remote_init(opt_no_mdns);
 
 	usbfluxd_log(LL_NOTICE, "Initialization complete");
@@ -487,8 +681,12 @@ int main(int argc, char *argv[])
 		usbfluxd_log(LL_FATAL, "main_loop failed");
 
 	usbfluxd_log(LL_NOTICE, "usbfluxd shutting down");
+	loop_stats_log_summary();
 	client_shutdown();
 	usbmux_remote_shutdown();
+	paircache_shutdown();
+	capture_shutdown();
+	record_shutdown();
 	usbfluxd_log(LL_NOTICE, "Shutdown complete");
 
 terminate:
@@ -502,6 +700,10 @@ terminate:
 	log_disable_syslog();
 
 	free(remote_host);
+	free(opt_capture_file);
+	free(opt_capture_opts);
+	free(opt_record_file);
+	free(opt_cache_file);
 
 	if (res < 0)
 		res = -res;
@@ -0,0 +1,333 @@
+/*
+ * paircache.c
+ *
+ * Copyright (C) 2026 Corellium LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "paircache.h"
+#include "log.h"
+#include "utils.h"
+#include "timer.h"
+
+#define PAIRCACHE_RECORD_TTL_MS	60000	// pair records change when a device is paired again
+#define PAIRCACHE_BUID_TTL_MS	600000	// the BUID of an instance practically never changes
+#define PAIRCACHE_MAX_ENTRIES	1024
+#define PAIRCACHE_FILE_VERSION	1
+
+struct paircache_entry {
+	struct list_node node;		// cache_list, oldest first
+	char *instance;
+	char *record_id;		// NULL for the BUID
+	struct msgbuf *reply;
+	uint64_t expires;		// timer_now() based
+};
+
+/* only used by the main loop thread */
+static struct list_node cache_list = { &cache_list, &cache_list };
+static uint32_t cache_count = 0;
+static uint32_t record_ttl = PAIRCACHE_RECORD_TTL_MS;
+static uint32_t buid_ttl = PAIRCACHE_BUID_TTL_MS;
+static char *cache_file = NULL;
+static uint64_t cache_generation = 1;
+
+/* counters */
+static uint64_t cnt_hits = 0;
+static uint64_t cnt_misses = 0;
+static uint64_t cnt_fills = 0;
+static uint64_t cnt_stale_fills = 0;
+static uint64_t cnt_invalidations = 0;
+static uint64_t cnt_expired = 0;
+static uint64_t cnt_evictions = 0;
+
+static void paircache_entry_free(struct paircache_entry *entry)
+{
+	list_del(&entry->node);
+	cache_count--;
+	free(entry->instance);
+	free(entry->record_id);
+	msgbuf_unref(entry->reply);
+	free(entry);
+}
+
+static struct paircache_entry *paircache_find(const char *instance, const char *record_id)
+{
+	LIST_FOREACH(struct paircache_entry *entry, &cache_list, struct paircache_entry, node) {
+		if (strcmp(entry->instance, instance) != 0)
+			continue;
+		if ((!record_id && !entry->record_id) || (record_id && entry->record_id && strcmp(entry->record_id, record_id) == 0))
+			return entry;
+	} ENDFOREACH
+	return NULL;
+}
+
+static void paircache_add(const char *instance, const char *record_id, const void *payload, uint32_t length, uint64_t ttl)
+{
+	struct paircache_entry *entry = paircache_find(instance, record_id);
+	if (entry) {
+		paircache_entry_free(entry);
+	}
+	if (cache_count >= PAIRCACHE_MAX_ENTRIES) {
+		cnt_evictions++;
+		paircache_entry_free(list_entry(cache_list.next, struct paircache_entry, node));
+	}
+	entry = calloc(1, sizeof(struct paircache_entry));
+	if (!entry)
+		return;
+	entry->reply = msgbuf_new(length);
+	if (!entry->reply) {
+		free(entry);
+		return;
+	}
+	memcpy(entry->reply->data, payload, length);
+	entry->reply->size = length;
+	entry->instance = strdup(instance);
+	entry->record_id = (record_id) ? strdup(record_id) : NULL;
+	if (!entry->instance || (record_id && !entry->record_id)) {
+		free(entry->instance);
+		free(entry->record_id);
+		msgbuf_unref(entry->reply);
+		free(entry);
+		return;
+	}
+	entry->expires = timer_now() + ttl;
+	list_add_tail(&cache_list, &entry->node);
+	cache_count++;
+}
+
+static char *paircache_copy_string(plist_t dict, const char *key)
+{
+	char *str = NULL;
+	plist_t node = plist_dict_get_item(dict, key);
+	if (node && plist_get_node_type(node) == PLIST_STRING)
+		plist_get_string_val(node, &str);
+	return str;
+}
+
+static void paircache_load(const char *filename)
+{
+	plist_t dict = NULL;
+	if (!plist_read_from_filename(&dict, filename) || !dict) {
+		if (errno != ENOENT)
+			usbfluxd_log(LL_WARNING, "%s: Could not read %s", __func__, filename);
+		return;
+	}
+	uint64_t version = 0;
+	plist_t node = plist_dict_get_item(dict, "Version");
+	if (node && plist_get_node_type(node) == PLIST_UINT)
+		plist_get_uint_val(node, &version);
+	plist_t entries = plist_dict_get_item(dict, "Entries");
+	if (version != PAIRCACHE_FILE_VERSION || !entries || plist_get_node_type(entries) != PLIST_ARRAY) {
+		usbfluxd_log(LL_WARNING, "%s: Ignoring %s, unknown format", __func__, filename);
+		plist_free(dict);
+		return;
+	}
+	uint64_t now = (uint64_t)time(NULL);
+	uint32_t i, loaded = 0;
+	for (i = 0; i < plist_array_get_size(entries); i++) {
+		plist_t item = plist_array_get_item(entries, i);
+		char *instance = paircache_copy_string(item, "Instance");
+		char *record_id = paircache_copy_string(item, "RecordID");
+		char *data = NULL;
+		uint64_t length = 0;
+		uint64_t expires = 0;
+		node = plist_dict_get_item(item, "Reply");
+		if (node && plist_get_node_type(node) == PLIST_DATA)
+			plist_get_data_val(node, &data, &length);
+		node = plist_dict_get_item(item, "Expires");
+		if (node && plist_get_node_type(node) == PLIST_UINT)
+			plist_get_uint_val(node, &expires);
+		/* never keep an entry longer than the configured TTL */
+		uint64_t ttl = (record_id) ? record_ttl : buid_ttl;
+		if (instance && data && expires > now && ttl > 0) {
+			if ((expires - now) * 1000 < ttl)
+				ttl = (expires - now) * 1000;
+			paircache_add(instance, record_id, data, (uint32_t)length, ttl);
+			loaded++;
+		}
+		free(instance);
+		free(record_id);
+		free(data);
+	}
+	plist_free(dict);
+	usbfluxd_log(LL_INFO, "%s: Loaded %u cached replies from %s", __func__, loaded, filename);
+}
+
+/* Written to a temporary file first and renamed, readable by root only
+ * since pair records contain the host private key. */
+static void paircache_save(const char *filename)
+{
+	uint64_t now = timer_now();
+	uint64_t wall = (uint64_t)time(NULL);
+	plist_t entries = plist_new_array();
+	LIST_FOREACH(struct paircache_entry *entry, &cache_list, struct paircache_entry, node) {
+		if (entry->expires <= now)
+			continue;
+		plist_t item = plist_new_dict();
+		plist_dict_set_item(item, "Instance", plist_new_string(entry->instance));
+		if (entry->record_id)
+			plist_dict_set_item(item, "RecordID", plist_new_string(entry->record_id));
+		plist_dict_set_item(item, "Reply", plist_new_data((const char*)entry->reply->data, entry->reply->size));
+		plist_dict_set_item(item, "Expires", plist_new_uint(wall + (entry->expires - now + 999) / 1000));
+		plist_array_append_item(entries, item);
+	} ENDFOREACH
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "Version", plist_new_uint(PAIRCACHE_FILE_VERSION));
+	plist_dict_set_item(dict, "Entries", entries);
+	char *bin = NULL;
+	uint32_t length = 0;
+	plist_to_bin(dict, &bin, &length);
+	plist_free(dict);
+	if (!bin) {
+		usbfluxd_log(LL_ERROR, "%s: Could not convert plist to binary", __func__);
+		return;
+	}
+
+	char *tmpname = string_concat(filename, ".tmp", NULL);
+	int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	ssize_t written = -1;
+	if (fd >= 0) {
+		written = write(fd, bin, length);
+		if (close(fd) < 0)
+			written = -1;
+	}
+	if (written != (ssize_t)length || rename(tmpname, filename) < 0) {
+		usbfluxd_log(LL_ERROR, "%s: Could not write %s: %s", __func__, filename, strerror(errno));
+		unlink(tmpname);
+	}
+	free(tmpname);
+	free(bin);
+}
+
+void paircache_shutdown(void)
+{
+	if (cache_file) {
+		paircache_save(cache_file);
+		free(cache_file);
+		cache_file = NULL;
+	}
+	LIST_FOREACH(struct paircache_entry *entry, &cache_list, struct paircache_entry, node) {
+		paircache_entry_free(entry);
+	} ENDFOREACH
+}
+
+/**
+ * Set how long pair records and BUIDs are answered from the cache. 0 turns
+ * caching off for the respective replies, a negative value keeps the
+ * current setting.
+ */
+void paircache_set_ttl(long pair_record_ms, long buid_ms)
+{
+	if (pair_record_ms >= 0)
+		record_ttl = (uint32_t)pair_record_ms;
+	if (buid_ms >= 0)
+		buid_ttl = (uint32_t)buid_ms;
+}
+
+/**
+ * Keep the cache across restarts in filename. The entries still valid are
+ * loaded now, and the cache is written back on shutdown.
+ */
+int paircache_set_file(const char *filename)
+{
+	free(cache_file);
+	cache_file = strdup(filename);
+	if (!cache_file)
+		return -1;
+	paircache_load(cache_file);
+	return 0;
+}
+
+/* returns the cached reply payload, or NULL on a miss */
+struct msgbuf *paircache_get(const char *instance, const char *record_id)
+{
+	if (!instance || ((record_id) ? record_ttl : buid_ttl) == 0)
+		return NULL;
+	struct paircache_entry *entry = paircache_find(instance, record_id);
+	if (entry && timer_now() >= entry->expires) {
+		cnt_expired++;
+		paircache_entry_free(entry);
+		entry = NULL;
+	}
+	if (!entry) {
+		cnt_misses++;
+		return NULL;
+	}
+	cnt_hits++;
+	return entry->reply;
+}
+
+/**
+ * Store a reply. generation is the value of paircache_generation() when the
+ * request was sent, a reply to a request that raced with an invalidation is
+ * not stored.
+ */
+void paircache_put(const char *instance, const char *record_id, const void *payload, uint32_t length, uint64_t generation)
+{
+	uint32_t ttl = (record_id) ? record_ttl : buid_ttl;
+	if (!instance || ttl == 0)
+		return;
+	if (generation != cache_generation) {
+		cnt_stale_fills++;
+		return;
+	}
+	paircache_add(instance, record_id, payload, length, ttl);
+	cnt_fills++;
+}
+
+/* a pair record was saved or deleted, on whatever instance has it */
+void paircache_invalidate(const char *record_id)
+{
+	if (!record_id)
+		return;
+	cache_generation++;
+	cnt_invalidations++;
+	LIST_FOREACH(struct paircache_entry *entry, &cache_list, struct paircache_entry, node) {
+		if (entry->record_id && strcmp(entry->record_id, record_id) == 0) {
+			paircache_entry_free(entry);
+		}
+	} ENDFOREACH
+}
+
+uint64_t paircache_generation(void)
+{
+	return cache_generation;
+}
+
+plist_t paircache_copy_stats(void)
+{
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "Entries", plist_new_uint(cache_count));
+	plist_dict_set_item(dict, "Hits", plist_new_uint(cnt_hits));
+	plist_dict_set_item(dict, "Misses", plist_new_uint(cnt_misses));
+	plist_dict_set_item(dict, "Fills", plist_new_uint(cnt_fills));
+	plist_dict_set_item(dict, "StaleFills", plist_new_uint(cnt_stale_fills));
+	plist_dict_set_item(dict, "Invalidations", plist_new_uint(cnt_invalidations));
+	plist_dict_set_item(dict, "Expired", plist_new_uint(cnt_expired));
+	plist_dict_set_item(dict, "Evictions", plist_new_uint(cnt_evictions));
+	return dict;
+}
@@ -0,0 +1,46 @@
+/*
+ * paircache.h
+ *
+ * Copyright (C) 2026 Corellium LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef PAIRCACHE_H
+#define PAIRCACHE_H
+
+#include <stdint.h>
+#include <plist/plist.h>
+
+#include "utils.h"
+
+/*
+ * Cache of ReadPairRecord and ReadBUID replies. Entries are keyed by the
+ * usbmuxd instance that answered ("local" or host:port, remote ids are not
+ * stable across restarts) and the PairRecordID, or NULL for the BUID of the
+ * instance. The cached value is the reply payload as sent by the instance.
+ */
+
+void paircache_shutdown(void);
+void paircache_set_ttl(long pair_record_ms, long buid_ms);
+int paircache_set_file(const char *filename);
+
+struct msgbuf *paircache_get(const char *instance, const char *record_id);
+void paircache_put(const char *instance, const char *record_id, const void *payload, uint32_t length, uint64_t generation);
+void paircache_invalidate(const char *record_id);
+uint64_t paircache_generation(void);
+
+plist_t paircache_copy_stats(void);
+
+#endif
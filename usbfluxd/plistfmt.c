@@ -0,0 +1,95 @@
+/*
+ * plistfmt.c
+ *
+ * Copyright (C) 2026 Corellium LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "plistfmt.h"
+
+/* number of decimal digits of value */
+uint32_t plistfmt_uint_length(uint64_t value)
+{
+	uint32_t len = 1;
+	while (value >= 10) {
+		value /= 10;
+		len++;
+	}
+	return len;
+}
+
+/* write value in decimal, returns the position after it */
+char *plistfmt_put_uint(char *out, uint64_t value)
+{
+	uint32_t len = plistfmt_uint_length(value);
+	char *p = out + len;
+	do {
+		*--p = (char)('0' + value % 10);
+		value /= 10;
+	} while (value > 0);
+	return out + len;
+}
+
+/* length of str once it is escaped for a <string> element */
+uint32_t plistfmt_string_length(const char *str)
+{
+	uint32_t len = 0;
+	for (; *str; str++) {
+		switch (*str) {
+			case '&':
+				len += 5;
+				break;
+			case '<':
+			case '>':
+				len += 4;
+				break;
+			default:
+				len++;
+				break;
+		}
+	}
+	return len;
+}
+
+/* write str escaped like plist_to_xml() does, returns the position after it */
+char *plistfmt_put_string(char *out, const char *str)
+{
+	for (; *str; str++) {
+		switch (*str) {
+			case '&':
+				memcpy(out, "&amp;", 5);
+				out += 5;
+				break;
+			case '<':
+				memcpy(out, "&lt;", 4);
+				out += 4;
+				break;
+			case '>':
+				memcpy(out, "&gt;", 4);
+				out += 4;
+				break;
+			default:
+				*out++ = *str;
+				break;
+		}
+	}
+	return out;
+}
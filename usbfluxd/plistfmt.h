@@ -0,0 +1,60 @@
+/*
+ * plistfmt.h
+ *
+ * Copyright (C) 2026 Corellium LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef PLISTFMT_H
+#define PLISTFMT_H
+
+#include <stdint.h>
+
+/*
+ * Templates for XML plist dicts in the format plist_to_xml() writes them,
+ * so messages can be put together from string literals at compile time.
+ * Keys have to be given in the order plist_dict_set_item() added them. The
+ * _OPEN/_CLOSE pairs leave a slot for a value that is filled in with
+ * plistfmt_put_uint() or plistfmt_put_string(). Literal values are not
+ * escaped and must not contain '&', '<' or '>'.
+ */
+
+#define PLISTFMT_HEAD \
+	"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n" \
+	"<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n" \
+	"<plist version=\"1.0\">\n" \
+	"<dict>\n"
+#define PLISTFMT_TAIL			"</dict>\n</plist>\n"
+
+#define PLISTFMT_STRING(key, value)	"\t<key>" key "</key>\n\t<string>" value "</string>\n"
+#define PLISTFMT_INTEGER(key, value)	"\t<key>" key "</key>\n\t<integer>" value "</integer>\n"
+#define PLISTFMT_STRING_OPEN(key)	"\t<key>" key "</key>\n\t<string>"
+#define PLISTFMT_STRING_CLOSE		"</string>\n"
+#define PLISTFMT_INTEGER_OPEN(key)	"\t<key>" key "</key>\n\t<integer>"
+#define PLISTFMT_INTEGER_CLOSE		"</integer>\n"
+
+/* for numeric macros in templates */
+#define PLISTFMT_STR(x)			#x
+#define PLISTFMT_XSTR(x)		PLISTFMT_STR(x)
+
+#define PLISTFMT_LEN(tmpl)		((uint32_t)sizeof(tmpl) - 1)
+#define PLISTFMT_UINT_MAX_LEN		20
+
+uint32_t plistfmt_uint_length(uint64_t value);
+char *plistfmt_put_uint(char *out, uint64_t value);
+uint32_t plistfmt_string_length(const char *str);
+char *plistfmt_put_string(char *out, const char *str);
+
+#endif
@@ -0,0 +1,338 @@
+/*
+ * plistscan.c
+ *
+ * Copyright (C) 2026 Corellium LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "plistscan.h"
+
+#define LIT(s)	s, (sizeof(s) - 1)
+
+static const char *skip_ws(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+		p++;
+	return p;
+}
+
+static int match(const char *p, const char *end, const char *lit, size_t len)
+{
+	return (size_t)(end - p) >= len && memcmp(p, lit, len) == 0;
+}
+
+/* returns the position after the next occurrence of lit, or NULL */
+static const char *skip_past(const char *p, const char *end, const char *lit, size_t len)
+{
+	while ((p = memchr(p, lit[0], end - p)) != NULL) {
+		if (match(p, end, lit, len))
+			return p + len;
+		p++;
+	}
+	return NULL;
+}
+
+/* p is at the '<' of a value element, returns the position after it */
+static const char *skip_element(const char *p, const char *end)
+{
+	const char *gt = memchr(p, '>', end - p);
+	if (!gt || p[1] == '/' || p[1] == '!' || p[1] == '?')
+		return NULL;
+	if (gt[-1] == '/')
+		return gt + 1;
+	int depth = 1;
+	p = gt + 1;
+	while (depth > 0) {
+		p = memchr(p, '<', end - p);
+		if (!p || p + 1 >= end || p[1] == '!' || p[1] == '?')
+			return NULL;
+		gt = memchr(p, '>', end - p);
+		if (!gt)
+			return NULL;
+		if (p[1] == '/')
+			depth--;
+		else if (gt[-1] != '/')
+			depth++;
+		p = gt + 1;
+	}
+	return p;
+}
+
+/* text up to the closing tag, which must follow right after it */
+static const char *scan_text(const char *p, const char *end, const char *close, size_t close_len, struct plistscan_field *field)
+{
+	const char *q = memchr(p, '<', end - p);
+	if (!q || !match(q, end, close, close_len))
+		return NULL;
+	field->text = p;
+	field->text_len = (uint32_t)(q - p);
+	return q + close_len;
+}
+
+/**
+ * Scan the top level dict of an XML plist. The scan is driven by memchr(),
+ * which the C library implements with vector instructions.
+ *
+ * @return The number of fields found, or -1 if the payload has to be parsed
+ *     with libplist instead.
+ */
+int plistscan_dict(const char *xml, uint32_t length, struct plistscan_field *fields, int max_fields)
+{
+	const char *p = xml;
+	const char *end = xml + length;
+	int count = 0;
+
+	while (end > p && end[-1] == '\0')
+		end--;
+
+	/* XML declaration, DOCTYPE and comments in front of the plist */
+	while (1) {
+		p = skip_ws(p, end);
+		if (match(p, end, LIT("<?"))) {
+			p = skip_past(p, end, LIT("?>"));
+		} else if (match(p, end, LIT("<!--"))) {
+			p = skip_past(p, end, LIT("-->"));
+		} else if (match(p, end, LIT("<!DOCTYPE"))) {
+			const char *gt = memchr(p, '>', end - p);
+			if (gt && memchr(p, '[', gt - p))
+				return -1;
+			p = (gt) ? gt + 1 : NULL;
+		} else {
+			break;
+		}
+		if (!p)
+			return -1;
+	}
+	if (!match(p, end, LIT("<plist")))
+		return -1;
+	p = memchr(p, '>', end - p);
+	if (!p || p[-1] == '/')
+		return -1;
+	p = skip_ws(p + 1, end);
+
+	if (match(p, end, LIT("<dict/>"))) {
+		p += 7;
+	} else if (match(p, end, LIT("<dict>"))) {
+		p += 6;
+		while (1) {
+			struct plistscan_field field;
+			p = skip_ws(p, end);
+			if (match(p, end, LIT("</dict>"))) {
+				p += 7;
+				break;
+			}
+			if (!match(p, end, LIT("<key>")))
+				return -1;
+			p += 5;
+			const char *q = memchr(p, '<', end - p);
+			if (!q || !match(q, end, LIT("</key>")) || memchr(p, '&', q - p))
+				return -1;
+			field.key = p;
+			field.key_len = (uint32_t)(q - p);
+			p = skip_ws(q + 6, end);
+
+			if (match(p, end, LIT("<string>"))) {
+				field.type = PLISTSCAN_STRING;
+				p = scan_text(p + 8, end, LIT("</string>"), &field);
+			} else if (match(p, end, LIT("<string/>"))) {
+				field.type = PLISTSCAN_STRING;
+				field.text = p;
+				field.text_len = 0;
+				p += 9;
+			} else if (match(p, end, LIT("<integer>"))) {
+				field.type = PLISTSCAN_INTEGER;
+				p = scan_text(p + 9, end, LIT("</integer>"), &field);
+			} else if (p + 1 < end && *p == '<') {
+				field.type = PLISTSCAN_OTHER;
+				field.text = NULL;
+				field.text_len = 0;
+				p = skip_element(p, end);
+			} else {
+				return -1;
+			}
+			if (!p || count >= max_fields)
+				return -1;
+			fields[count++] = field;
+		}
+	} else {
+		return -1;
+	}
+
+	p = skip_ws(p, end);
+	if (!match(p, end, LIT("</plist>")))
+		return -1;
+	if (skip_ws(p + 8, end) != end)
+		return -1;
+	return count;
+}
+
+/* the last field with the key, like a dict built from the payload has it */
+const struct plistscan_field *plistscan_find(const struct plistscan_field *fields, int count, const char *key)
+{
+	size_t len = strlen(key);
+	int i;
+	for (i = count - 1; i >= 0; i--) {
+		if (fields[i].key_len == len && memcmp(fields[i].key, key, len) == 0)
+			return &fields[i];
+	}
+	return NULL;
+}
+
+/**
+ * Get the value of an integer field. Negative values wrap around like
+ * plist_get_uint_val() returns them.
+ *
+ * @return 0 on success, -1 if the field is no valid integer.
+ */
+int plistscan_get_uint(const struct plistscan_field *field, uint64_t *value)
+{
+	if (!field || field->type != PLISTSCAN_INTEGER)
+		return -1;
+	const char *p = skip_ws(field->text, field->text + field->text_len);
+	const char *end = field->text + field->text_len;
+	while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r'))
+		end--;
+	int negative = 0;
+	if (p < end && *p == '-') {
+		negative = 1;
+		p++;
+	}
+	if (p == end || end - p > 20)
+		return -1;
+	uint64_t val = 0;
+	for (; p < end; p++) {
+		if (*p < '0' || *p > '9')
+			return -1;
+		val = val * 10 + (uint64_t)(*p - '0');
+	}
+	*value = (negative) ? (uint64_t)0 - val : val;
+	return 0;
+}
+
+static char *utf8_put(char *out, uint32_t cp)
+{
+	if (cp < 0x80) {
+		*out++ = (char)cp;
+	} else if (cp < 0x800) {
+		*out++ = (char)(0xC0 | (cp >> 6));
+		*out++ = (char)(0x80 | (cp & 0x3F));
+	} else if (cp < 0x10000) {
+		*out++ = (char)(0xE0 | (cp >> 12));
+		*out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+		*out++ = (char)(0x80 | (cp & 0x3F));
+	} else {
+		*out++ = (char)(0xF0 | (cp >> 18));
+		*out++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+		*out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+		*out++ = (char)(0x80 | (cp & 0x3F));
+	}
+	return out;
+}
+
+/**
+ * Copy the value of a string field with its entities decoded.
+ *
+ * @return A string the caller has to free, or NULL if the field is no
+ *     string or has an invalid entity.
+ */
+char *plistscan_copy_string(const struct plistscan_field *field)
+{
+	if (!field || field->type != PLISTSCAN_STRING)
+		return NULL;
+	/* decoding never makes the text longer */
+	char *str = malloc(field->text_len + 1);
+	if (!str)
+		return NULL;
+	const char *p = field->text;
+	const char *end = field->text + field->text_len;
+	char *out = str;
+	while (p < end) {
+		const char *amp = memchr(p, '&', end - p);
+		if (!amp) {
+			memcpy(out, p, end - p);
+			out += end - p;
+			break;
+		}
+		memcpy(out, p, amp - p);
+		out += amp - p;
+		const char *semi = memchr(amp, ';', end - amp);
+		if (!semi)
+			goto invalid;
+		size_t len = semi - amp - 1;
+		if (len == 2 && memcmp(amp + 1, "lt", 2) == 0) {
+			*out++ = '<';
+		} else if (len == 2 && memcmp(amp + 1, "gt", 2) == 0) {
+			*out++ = '>';
+		} else if (len == 3 && memcmp(amp + 1, "amp", 3) == 0) {
+			*out++ = '&';
+		} else if (len == 4 && memcmp(amp + 1, "quot", 4) == 0) {
+			*out++ = '"';
+		} else if (len == 4 && memcmp(amp + 1, "apos", 4) == 0) {
+			*out++ = '\'';
+		} else if (len >= 2 && len <= 8 && amp[1] == '#') {
+			/* the UTF-8 encoding is shorter than the reference */
+			uint32_t cp = 0;
+			const char *d = amp + 2;
+			int hex = (*d == 'x');
+			if (hex)
+				d++;
+			if (d == semi)
+				goto invalid;
+			for (; d < semi; d++) {
+				if (*d >= '0' && *d <= '9')
+					cp = cp * (hex ? 16 : 10) + (uint32_t)(*d - '0');
+				else if (hex && *d >= 'a' && *d <= 'f')
+					cp = cp * 16 + (uint32_t)(*d - 'a' + 10);
+				else if (hex && *d >= 'A' && *d <= 'F')
+					cp = cp * 16 + (uint32_t)(*d - 'A' + 10);
+				else
+					goto invalid;
+			}
+			if (cp == 0 || cp > 0x10FFFF)
+				goto invalid;
+			out = utf8_put(out, cp);
+		} else {
+			goto invalid;
+		}
+		p = semi + 1;
+	}
+	*out = '\0';
+	return str;
+
+invalid:
+	free(str);
+	return NULL;
+}
+
+/* whether field is a string with the value str */
+int plistscan_string_equals(const struct plistscan_field *field, const char *str)
+{
+	if (!field || field->type != PLISTSCAN_STRING)
+		return 0;
+	if (memchr(field->text, '&', field->text_len)) {
+		char *decoded = plistscan_copy_string(field);
+		int equal = (decoded && strcmp(decoded, str) == 0);
+		free(decoded);
+		return equal;
+	}
+	return strlen(str) == field->text_len && memcmp(field->text, str, field->text_len) == 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * plistscan.h
+ *
+ * Copyright (C) 2026 Corellium LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef PLISTSCAN_H
+#define PLISTSCAN_H
+
+#include <stdint.h>
+
+/*
+ * Scanner for the XML plist dicts usbmuxd clients send. It finds the keys
+ * of the top level dict and the text of their string and integer values
+ * without building a plist. Payloads it does not understand (binary
+ * plists, comments or CDATA inside the dict, ...) are rejected, the caller
+ * then parses them with libplist.
+ */
+
+#define PLISTSCAN_MAX_FIELDS	16
+
+enum plistscan_type {
+	PLISTSCAN_STRING,
+	PLISTSCAN_INTEGER,
+	PLISTSCAN_OTHER		// any other value, its text is not kept
+};
+
+struct plistscan_field {
+	const char *key;	// not terminated, points into the payload
+	uint32_t key_len;
+	enum plistscan_type type;
+	const char *text;	// raw value text, entities not decoded
+	uint32_t text_len;
+};
+
+int plistscan_dict(const char *xml, uint32_t length, struct plistscan_field *fields, int max_fields);
+const struct plistscan_field *plistscan_find(const struct plistscan_field *fields, int count, const char *key);
+
+int plistscan_get_uint(const struct plistscan_field *field, uint64_t *value);
+char *plistscan_copy_string(const struct plistscan_field *field);
+int plistscan_string_equals(const struct plistscan_field *field, const char *str);
+
+#endif
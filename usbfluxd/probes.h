@@ -0,0 +1,45 @@
+/*
+ * probes.h
+ *
+ * Copyright (C) 2026 Corellium LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* USDT static tracepoints, compiled in with ./configure --enable-usdt.
+ * All probes use the provider name "usbfluxd"; see tools/bpftrace/ for
+ * example scripts. Without --enable-usdt the macros expand to nothing and
+ * their arguments are not evaluated. */
+#ifndef PROBES_H
+#define PROBES_H
+
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define USBFLUXD_PROBE1(name, a1) \
+	DTRACE_PROBE1(usbfluxd, name, a1)
+#define USBFLUXD_PROBE2(name, a1, a2) \
+	DTRACE_PROBE2(usbfluxd, name, a1, a2)
+#define USBFLUXD_PROBE3(name, a1, a2, a3) \
+	DTRACE_PROBE3(usbfluxd, name, a1, a2, a3)
+#define USBFLUXD_PROBE4(name, a1, a2, a3, a4) \
+	DTRACE_PROBE4(usbfluxd, name, a1, a2, a3, a4)
+#else
+#define USBFLUXD_PROBE1(name, a1) do {} while (0)
+#define USBFLUXD_PROBE2(name, a1, a2) do {} while (0)
+#define USBFLUXD_PROBE3(name, a1, a2, a3) do {} while (0)
+#define USBFLUXD_PROBE4(name, a1, a2, a3, a4) do {} while (0)
+#endif /* ENABLE_USDT */
+
+#endif
@@ -0,0 +1,263 @@
+/*
+ * record.c
+ *
+ * Copyright (C) 2026 Corellium LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "record.h"
+#include "log.h"
+#include "utils.h"
+#include "timer.h"
+
+/* Relayed byte counts are coalesced per client and direction for up to
+ * RECORD_COALESCE_MS so bulk transfers only produce a few records per
+ * second instead of one per read. */
+#define RECORD_COALESCE_MS	10
+#define RECORD_FLUSH_MS		1000
+#define RECORD_DATA_SLOTS	64
+#define RECORD_BUF_SIZE		0x10000
+
+struct record_data_slot {
+	int used;
+	uint32_t client_number;
+	enum record_type type;
+	uint64_t bytes;
+	uint64_t since;
+};
+
+int record_enabled = 0;
+
+/* only used by the main loop thread, writes arm the timers */
+static FILE *record_file = NULL;
+static uint64_t last_ts = 0;
+static struct timer coalesce_timer;	// writes out data slots RECORD_COALESCE_MS old
+static struct timer flush_timer;	// flushes the file RECORD_FLUSH_MS after a write
+static struct record_data_slot data_slots[RECORD_DATA_SLOTS];
+
+/* counters */
+static uint64_t cnt_records = 0;
+static uint64_t cnt_bytes = 0;
+static uint64_t cnt_write_errors = 0;
+
+static unsigned char *put_uvarint(unsigned char *p, uint64_t val)
+{
+	while (val >= 0x80) {
+		*p++ = (unsigned char)(val | 0x80);
+		val >>= 7;
+	}
+	*p++ = (unsigned char)val;
+	return p;
+}
+
+static void put_u16le(unsigned char *p, uint16_t val)
+{
+	p[0] = val & 0xFF;
+	p[1] = val >> 8;
+}
+
+static void put_u64le(unsigned char *p, uint64_t val)
+{
+	int i;
+	for (i = 0; i < 8; i++) {
+		p[i] = (unsigned char)(val >> (i * 8));
+	}
+}
+
+static void record_write(enum record_type type, uint32_t client_number, uint64_t value, const void *payload, uint32_t payload_len)
+{
+	unsigned char hdr[32];
+	unsigned char *p = hdr;
+	uint64_t now = ustime64();
+
+	*p++ = (unsigned char)type;
+	p = put_uvarint(p, now - last_ts);
+	p = put_uvarint(p, client_number);
+	if (type == RECORD_COMMAND || type == RECORD_DATA_UP || type == RECORD_DATA_DOWN) {
+		p = put_uvarint(p, value);
+	}
+	last_ts = now;
+
+	if (fwrite(hdr, p - hdr, 1, record_file) != 1 || (payload_len > 0 && fwrite(payload, payload_len, 1, record_file) != 1)) {
+		if (cnt_write_errors++ == 0) {
+			usbfluxd_log(LL_ERROR, "%s: Failed to write recording: %s", __func__, strerror(errno));
+		}
+		return;
+	}
+	cnt_records++;
+	cnt_bytes += (p - hdr) + payload_len;
+	if (!timer_pending(&flush_timer))
+		timer_set(&flush_timer, RECORD_FLUSH_MS);
+}
+
+static void record_flush_slot(struct record_data_slot *slot)
+{
+	if (!slot->used)
+		return;
+	record_write(slot->type, slot->client_number, slot->bytes, NULL, 0);
+	slot->used = 0;
+}
+
+static void record_flush_client(uint32_t client_number)
+{
+	int i;
+	for (i = 0; i < RECORD_DATA_SLOTS; i++) {
+		if (data_slots[i].used && data_slots[i].client_number == client_number)
+			record_flush_slot(&data_slots[i]);
+	}
+}
+
+/* write out the byte counts coalesced for RECORD_COALESCE_MS */
+static void record_coalesce_timer_cb(struct timer *timer)
+{
+	int i;
+	uint64_t now = timer_now();
+	uint64_t next = 0;
+	for (i = 0; i < RECORD_DATA_SLOTS; i++) {
+		if (!data_slots[i].used)
+			continue;
+		if (now - data_slots[i].since >= RECORD_COALESCE_MS) {
+			record_flush_slot(&data_slots[i]);
+		} else if (next == 0 || data_slots[i].since + RECORD_COALESCE_MS < next) {
+			next = data_slots[i].since + RECORD_COALESCE_MS;
+		}
+	}
+	if (next)
+		timer_set_at(timer, next);
+}
+
+static void record_flush_timer_cb(struct timer *timer)
+{
+	fflush(record_file);
+}
+
+/**
+ * Start recording client commands and relayed byte volumes.
+ *
+ * @param filename The recording to write, see record.h for the format.
+ * @return 0 on success, -1 on error.
+ */
+int record_init(const char *filename)
+{
+	unsigned char hdr[RECORD_HEADER_SIZE];
+	struct timeval tv;
+
+	record_file = fopen(filename, "wb");
+	if (!record_file) {
+		usbfluxd_log(LL_ERROR, "%s: Could not open %s: %s", __func__, filename, strerror(errno));
+		return -1;
+	}
+	setvbuf(record_file, NULL, _IOFBF, RECORD_BUF_SIZE);
+
+	gettimeofday(&tv, NULL);
+	memcpy(hdr, RECORD_MAGIC, 4);
+	put_u16le(hdr + 4, RECORD_VERSION);
+	put_u16le(hdr + 6, 0);
+	put_u64le(hdr + 8, (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+	if (fwrite(hdr, sizeof(hdr), 1, record_file) != 1) {
+		usbfluxd_log(LL_ERROR, "%s: Could not write to %s: %s", __func__, filename, strerror(errno));
+		fclose(record_file);
+		record_file = NULL;
+		return -1;
+	}
+
+	memset(data_slots, '\0', sizeof(data_slots));
+	last_ts = ustime64();
+	timer_init(&coalesce_timer, record_coalesce_timer_cb);
+	timer_init(&flush_timer, record_flush_timer_cb);
+	record_enabled = 1;
+	usbfluxd_log(LL_NOTICE, "Recording client traffic to %s", filename);
+
+	return 0;
+}
+
+void record_shutdown(void)
+{
+	int i;
+
+	if (!record_enabled)
+		return;
+
+	record_enabled = 0;
+	for (i = 0; i < RECORD_DATA_SLOTS; i++) {
+		record_flush_slot(&data_slots[i]);
+	}
+	timer_cancel(&coalesce_timer);
+	timer_cancel(&flush_timer);
+	fclose(record_file);
+	record_file = NULL;
+
+	usbfluxd_log(LL_NOTICE, "Recording finished: %llu records, %llu bytes written",
+		(unsigned long long)cnt_records, (unsigned long long)cnt_bytes);
+}
+
+void record_client_open(uint32_t client_number)
+{
+	if (!record_enabled)
+		return;
+	record_write(RECORD_OPEN, client_number, 0, NULL, 0);
+}
+
+void record_client_close(uint32_t client_number)
+{
+	if (!record_enabled)
+		return;
+	record_flush_client(client_number);
+	record_write(RECORD_CLOSE, client_number, 0, NULL, 0);
+}
+
+/**
+ * Record a framed command as received from a client, header included.
+ */
+void record_command(uint32_t client_number, const void *msg, uint32_t length)
+{
+	if (!record_enabled)
+		return;
+	record_write(RECORD_COMMAND, client_number, length, msg, length);
+}
+
+/**
+ * Account relayed bytes of a connected session. type is either
+ * RECORD_DATA_UP or RECORD_DATA_DOWN.
+ */
+void record_data(uint32_t client_number, enum record_type type, uint32_t bytes)
+{
+	if (!record_enabled || bytes == 0)
+		return;
+	struct record_data_slot *slot = &data_slots[(client_number * 2 + (type == RECORD_DATA_DOWN)) % RECORD_DATA_SLOTS];
+	if (slot->used && (slot->client_number != client_number || slot->type != type)) {
+		record_flush_slot(slot);
+	}
+	if (!slot->used) {
+		slot->used = 1;
+		slot->client_number = client_number;
+		slot->type = type;
+		slot->bytes = 0;
+		slot->since = timer_now();
+		if (!timer_pending(&coalesce_timer))
+			timer_set(&coalesce_timer, RECORD_COALESCE_MS);
+	}
+	slot->bytes += bytes;
+}
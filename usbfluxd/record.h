@@ -0,0 +1,65 @@
+/*
+ * record.h
+ *
+ * Copyright (C) 2026 Corellium LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+
+/*
+ * Traffic recording format, read back by tools/muxreplay.
+ *
+ * The file starts with a 16 byte header: the magic "UFXR", a little endian
+ * uint16 version, a uint16 reserved field and the little endian uint64 wall
+ * clock time (microseconds since the epoch) the recording started at.
+ *
+ * It is followed by records of the form
+ *   uint8    type (enum record_type)
+ *   uvarint  microseconds since the previous record
+ *   uvarint  client number
+ * and, depending on the type,
+ *   RECORD_COMMAND:    uvarint length, followed by the framed usbmuxd message
+ *   RECORD_DATA_UP,
+ *   RECORD_DATA_DOWN:  uvarint number of relayed bytes
+ * where uvarint is an unsigned LEB128 encoded integer.
+ */
+#define RECORD_MAGIC "UFXR"
+#define RECORD_VERSION 1
+#define RECORD_HEADER_SIZE 16
+
+enum record_type {
+	RECORD_OPEN = 1,	// client connected
+	RECORD_CLOSE,		// client disconnected
+	RECORD_COMMAND,		// framed command received from the client
+	RECORD_DATA_UP,		// bytes relayed from the client to the device
+	RECORD_DATA_DOWN	// bytes relayed from the device to the client
+};
+
+extern int record_enabled;
+
+/* The record functions may only be called from the main loop. */
+int record_init(const char *filename);
+void record_shutdown(void);
+
+void record_client_open(uint32_t client_number);
+void record_client_close(uint32_t client_number);
+void record_command(uint32_t client_number, const void *msg, uint32_t length);
+void record_data(uint32_t client_number, enum record_type type, uint32_t bytes);
+
+#endif
@@ -256,6 +256,87 @@ int socket_create_unix(const char *socket_path)
 	return listenfd;
 }
 
+/**
+ * Enable TCP keepalive on a connected socket, so a peer that went away
+ * without closing the connection is noticed after idle + interval * count
+ * seconds instead of the system default of two hours.
+ *
+ * @return 0 on success, -1 if keepalive could not be enabled.
+ */
+int socket_set_keepalive(int sfd, int idle, int interval, int count)
+{
+	int yes = 1;
+
+	if (setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void*)&yes, sizeof(int)) == -1) {
+		usbfluxd_log(LL_WARNING, "%s: setsockopt SO_KEEPALIVE: %s", __func__, strerror(errno));
+		return -1;
+	}
+#if defined(TCP_KEEPIDLE)
+	setsockopt(sfd, IPPROTO_TCP, TCP_KEEPIDLE, (void*)&idle, sizeof(int));
+#elif defined(TCP_KEEPALIVE)
+	setsockopt(sfd, IPPROTO_TCP, TCP_KEEPALIVE, (void*)&idle, sizeof(int));
+#endif
+#ifdef TCP_KEEPINTVL
+	setsockopt(sfd, IPPROTO_TCP, TCP_KEEPINTVL, (void*)&interval, sizeof(int));
+#endif
+#ifdef TCP_KEEPCNT
+	setsockopt(sfd, IPPROTO_TCP, TCP_KEEPCNT, (void*)&count, sizeof(int));
+#endif
+	return 0;
+}
+
+/**
+ * Start a non-blocking TCP connect to the given address. Completion is
+ * signalled by the returned fd becoming writable; SO_ERROR then holds the
+ * result.
+ *
+ * @return The new socket, or -1 with errno set if the connect failed
+ *   right away.
+ */
+int socket_connect_addr_nonblock(const struct sockaddr *addr, socklen_t addrlen)
+{
+	int pfd;
+	int err;
+
+	pfd = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+	if (pfd < 0) {
+		return -1;
+	}
+	if (fcntl(pfd, F_SETFL, O_NONBLOCK) < 0 || fcntl(pfd, F_SETFD, FD_CLOEXEC) < 0) {
+		err = errno;
+		close(pfd);
+		errno = err;
+		return -1;
+	}
+#ifdef SO_NOSIGPIPE
+	int yes = 1;
+	setsockopt(pfd, SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(int));
+#endif
+	if (connect(pfd, addr, addrlen) < 0 && errno != EINPROGRESS) {
+		err = errno;
+		close(pfd);
+		errno = err;
+		return -1;
+	}
+	return pfd;
+}
+
+/**
+ * Start a non-blocking connect to the peer of a connected TCP socket, to
+ * probe that the host still accepts connections without a name lookup.
+ * See socket_connect_addr_nonblock().
+ */
+int socket_connect_peer_nonblock(int sfd)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+
+	if (getpeername(sfd, (struct sockaddr*)&addr, &addrlen) < 0) {
+		return -1;
+	}
+	return socket_connect_addr_nonblock((struct sockaddr*)&addr, addrlen);
+}
+
 int socket_close(int sfd)
 {
 	return close(sfd);
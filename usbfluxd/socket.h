@@ -21,11 +21,15 @@
 
 #include <stdint.h>
 #include <sys/time.h>
+#include <sys/socket.h>
 
 int socket_connect_unix(const char *filename);
 int socket_connect(const char *addr, uint16_t port);
 int socket_connect_timeout(const char *addr, uint16_t port, struct timeval *timeout);
 int socket_create_unix(const char *socket_path);
+int socket_set_keepalive(int sfd, int idle, int interval, int count);
+int socket_connect_addr_nonblock(const struct sockaddr *addr, socklen_t addrlen);
+int socket_connect_peer_nonblock(int sfd);
 int socket_close(int sfd);
 
 #endif
@@ -0,0 +1,274 @@
+/*
+ * stats.c
+ *
+ * Copyright (C) 2026 Corellium LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "stats.h"
+#include "log.h"
+#include "client.h"
+#include "usbmux_remote.h"
+#include "capture.h"
+#include "paircache.h"
+
+int loop_stats_enabled = 0;
+
+static struct loop_stats loop_stats;
+static uint64_t stall_threshold_us = 0;
+
+/* the object behind a dispatched fd, described only when needed */
+struct dispatch_object {
+	enum fdowner owner;
+	int fd;
+	int known;
+	union {
+		struct client_ident client;
+		struct remote_ident remote;
+	} ident;
+};
+
+/* per iteration / per dispatch scratch state */
+static uint64_t iter_start;
+static uint64_t iter_poll_us;
+static uint64_t poll_start;
+static int iter_ready;
+static uint64_t disp_start;
+static struct dispatch_object disp_obj;
+static uint64_t iter_max_us;
+static struct dispatch_object iter_max_obj;
+
+void loop_stats_init(int enabled, unsigned int stall_threshold_ms)
+{
+	memset(&loop_stats, '\0', sizeof(loop_stats));
+	loop_stats.max_dispatch_fd = -1;
+	loop_stats_enabled = enabled;
+	stall_threshold_us = (uint64_t)stall_threshold_ms * 1000;
+	if (enabled) {
+		usbfluxd_log(LL_NOTICE, "Event loop profiling enabled, stall threshold %u ms", stall_threshold_ms);
+	}
+}
+
+void loop_stats_iteration_begin(void)
+{
+	if (!loop_stats_enabled)
+		return;
+	iter_start = ustime64();
+	iter_poll_us = 0;
+	iter_ready = 0;
+	iter_max_us = 0;
+	iter_max_obj.fd = -1;
+}
+
+void loop_stats_poll_begin(void)
+{
+	if (!loop_stats_enabled)
+		return;
+	poll_start = ustime64();
+}
+
+static int ready_bucket(int ready)
+{
+	int bucket = 0;
+	int limit = 1;
+	while (ready > limit && bucket < STATS_READY_BUCKETS-1) {
+		limit <<= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+void loop_stats_poll_end(int ready)
+{
+	if (!loop_stats_enabled)
+		return;
+	iter_poll_us = ustime64() - poll_start;
+	loop_stats.poll_us += iter_poll_us;
+	iter_ready = ready;
+	if (ready > 0) {
+		loop_stats.wakeups++;
+		loop_stats.ready_hist[ready_bucket(ready)]++;
+	} else if (ready == 0) {
+		loop_stats.timeouts++;
+	} else {
+		loop_stats.interrupts++;
+	}
+}
+
+static void dispatch_object_describe(const struct dispatch_object *obj, char *buf, size_t len)
+{
+	switch (obj->owner) {
+		case FD_CLIENT:
+			if (obj->known)
+				client_describe(obj->fd, &obj->ident.client, buf, len);
+			else
+				snprintf(buf, len, "client fd %d (unknown)", obj->fd);
+			break;
+		case FD_REMOTE:
+			if (obj->known)
+				usbmux_remote_describe(obj->fd, &obj->ident.remote, buf, len);
+			else
+				snprintf(buf, len, "remote fd %d (unknown)", obj->fd);
+			break;
+		case FD_LISTEN:
+			snprintf(buf, len, "listen fd %d", obj->fd);
+			break;
+		case FD_SIGNAL:
+			snprintf(buf, len, "signal fd %d", obj->fd);
+			break;
+		default:
+			snprintf(buf, len, "fd %d owner %d", obj->fd, obj->owner);
+			break;
+	}
+}
+
+void loop_stats_dispatch_begin(enum fdowner owner, int fd)
+{
+	if (!loop_stats_enabled)
+		return;
+	disp_obj.owner = owner;
+	disp_obj.fd = fd;
+	/* identify the object before dispatching since it might be gone afterwards */
+	switch (owner) {
+		case FD_CLIENT:
+			disp_obj.known = (client_identify(fd, &disp_obj.ident.client) == 0);
+			break;
+		case FD_REMOTE:
+			disp_obj.known = (usbmux_remote_identify(fd, &disp_obj.ident.remote) == 0);
+			break;
+		default:
+			disp_obj.known = 1;
+			break;
+	}
+	disp_start = ustime64();
+}
+
+void loop_stats_dispatch_end(void)
+{
+	if (!loop_stats_enabled)
+		return;
+	uint64_t elapsed = ustime64() - disp_start;
+	loop_stats.dispatch_us += elapsed;
+	switch (disp_obj.owner) {
+		case FD_LISTEN:
+			loop_stats.accept_us += elapsed;
+			loop_stats.accept_calls++;
+			break;
+		case FD_CLIENT:
+			loop_stats.client_us += elapsed;
+			loop_stats.client_calls++;
+			break;
+		case FD_REMOTE:
+			loop_stats.remote_us += elapsed;
+			loop_stats.remote_calls++;
+			break;
+		default:
+			break;
+	}
+	if (elapsed > iter_max_us) {
+		iter_max_us = elapsed;
+		iter_max_obj = disp_obj;
+	}
+	if (elapsed > loop_stats.max_dispatch_us) {
+		loop_stats.max_dispatch_us = elapsed;
+		loop_stats.max_dispatch_fd = disp_obj.fd;
+		dispatch_object_describe(&disp_obj, loop_stats.max_dispatch_desc, sizeof(loop_stats.max_dispatch_desc));
+	}
+}
+
+void loop_stats_iteration_end(void)
+{
+	if (!loop_stats_enabled)
+		return;
+	loop_stats.iterations++;
+	uint64_t busy = ustime64() - iter_start - iter_poll_us;
+	if (stall_threshold_us > 0 && busy > stall_threshold_us) {
+		loop_stats.stalls++;
+		if (iter_max_obj.fd >= 0) {
+			char iter_max_desc[128];
+			dispatch_object_describe(&iter_max_obj, iter_max_desc, sizeof(iter_max_desc));
+			usbfluxd_log(LL_WARNING, "Event loop stall: iteration busy for %llu ms (threshold %llu ms), %d fds ready, longest dispatch %llu us on %s",
+				(unsigned long long)(busy / 1000), (unsigned long long)(stall_threshold_us / 1000), iter_ready,
+				(unsigned long long)iter_max_us, iter_max_desc);
+		} else {
+			usbfluxd_log(LL_WARNING, "Event loop stall: iteration busy for %llu ms (threshold %llu ms) outside of fd dispatch",
+				(unsigned long long)(busy / 1000), (unsigned long long)(stall_threshold_us / 1000));
+		}
+	}
+}
+
+void loop_stats_log_summary(void)
+{
+	if (!loop_stats_enabled)
+		return;
+	usbfluxd_log(LL_NOTICE, "Event loop: %llu iterations, %llu wakeups, %llu timeouts, %llu interrupts, %llu stalls",
+		(unsigned long long)loop_stats.iterations, (unsigned long long)loop_stats.wakeups,
+		(unsigned long long)loop_stats.timeouts, (unsigned long long)loop_stats.interrupts,
+		(unsigned long long)loop_stats.stalls);
+	usbfluxd_log(LL_NOTICE, "Event loop: %llu us in poll, %llu us dispatching (accept %llu us/%llu, client %llu us/%llu, remote %llu us/%llu)",
+		(unsigned long long)loop_stats.poll_us, (unsigned long long)loop_stats.dispatch_us,
+		(unsigned long long)loop_stats.accept_us, (unsigned long long)loop_stats.accept_calls,
+		(unsigned long long)loop_stats.client_us, (unsigned long long)loop_stats.client_calls,
+		(unsigned long long)loop_stats.remote_us, (unsigned long long)loop_stats.remote_calls);
+	if (loop_stats.max_dispatch_fd >= 0) {
+		usbfluxd_log(LL_NOTICE, "Event loop: longest dispatch %llu us on %s",
+			(unsigned long long)loop_stats.max_dispatch_us, loop_stats.max_dispatch_desc);
+	}
+}
+
+plist_t stats_copy_plist(void)
+{
+	plist_t dict = plist_new_dict();
+	plist_t loop = plist_new_dict();
+	int i;
+
+	plist_dict_set_item(loop, "Enabled", plist_new_bool(loop_stats_enabled));
+	plist_dict_set_item(loop, "Iterations", plist_new_uint(loop_stats.iterations));
+	plist_dict_set_item(loop, "Wakeups", plist_new_uint(loop_stats.wakeups));
+	plist_dict_set_item(loop, "Timeouts", plist_new_uint(loop_stats.timeouts));
+	plist_dict_set_item(loop, "Interrupts", plist_new_uint(loop_stats.interrupts));
+	plist_dict_set_item(loop, "PollTime", plist_new_uint(loop_stats.poll_us));
+	plist_dict_set_item(loop, "DispatchTime", plist_new_uint(loop_stats.dispatch_us));
+	plist_dict_set_item(loop, "AcceptTime", plist_new_uint(loop_stats.accept_us));
+	plist_dict_set_item(loop, "AcceptCalls", plist_new_uint(loop_stats.accept_calls));
+	plist_dict_set_item(loop, "ClientTime", plist_new_uint(loop_stats.client_us));
+	plist_dict_set_item(loop, "ClientCalls", plist_new_uint(loop_stats.client_calls));
+	plist_dict_set_item(loop, "RemoteTime", plist_new_uint(loop_stats.remote_us));
+	plist_dict_set_item(loop, "RemoteCalls", plist_new_uint(loop_stats.remote_calls));
+	plist_t hist = plist_new_array();
+	for (i = 0; i < STATS_READY_BUCKETS; i++) {
+		plist_array_append_item(hist, plist_new_uint(loop_stats.ready_hist[i]));
+	}
+	plist_dict_set_item(loop, "ReadyHistogram", hist);
+	plist_dict_set_item(loop, "MaxDispatchTime", plist_new_uint(loop_stats.max_dispatch_us));
+	if (loop_stats.max_dispatch_fd >= 0) {
+		plist_dict_set_item(loop, "MaxDispatchObject", plist_new_string(loop_stats.max_dispatch_desc));
+	}
+	plist_dict_set_item(loop, "Stalls", plist_new_uint(loop_stats.stalls));
+	plist_dict_set_item(dict, "Loop", loop);
+	plist_dict_set_item(dict, "Capture", capture_copy_stats());
+	plist_dict_set_item(dict, "Clients", client_copy_stats());
+	plist_dict_set_item(dict, "Remotes", usbmux_remote_copy_stats());
+	plist_dict_set_item(dict, "PairCache", paircache_copy_stats());
+
+	return dict;
+}
@@ -0,0 +1,65 @@
+/*
+ * stats.h
+ *
+ * Copyright (C) 2026 Corellium LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <plist/plist.h>
+
+#include "utils.h"
+
+/* ready fd histogram buckets: 1, 2, 3-4, 5-8, ..., 513+ */
+#define STATS_READY_BUCKETS 11
+
+struct loop_stats {
+	uint64_t iterations;
+	uint64_t wakeups;		// ppoll() returned ready fds
+	uint64_t timeouts;		// ppoll() timed out
+	uint64_t interrupts;		// ppoll() returned -1
+	uint64_t poll_us;		// time spent blocked in ppoll()
+	uint64_t dispatch_us;		// time spent handling ready fds
+	uint64_t accept_us;
+	uint64_t accept_calls;
+	uint64_t client_us;
+	uint64_t client_calls;
+	uint64_t remote_us;
+	uint64_t remote_calls;
+	uint64_t ready_hist[STATS_READY_BUCKETS];
+	uint64_t max_dispatch_us;
+	int max_dispatch_fd;
+	char max_dispatch_desc[128];
+	uint64_t stalls;
+};
+
+extern int loop_stats_enabled;
+
+void loop_stats_init(int enabled, unsigned int stall_threshold_ms);
+
+void loop_stats_iteration_begin(void);
+void loop_stats_poll_begin(void);
+void loop_stats_poll_end(int ready);
+void loop_stats_dispatch_begin(enum fdowner owner, int fd);
+void loop_stats_dispatch_end(void);
+void loop_stats_iteration_end(void);
+
+void loop_stats_log_summary(void);
+plist_t stats_copy_plist(void);
+
+#endif
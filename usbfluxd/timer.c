@@ -0,0 +1,251 @@
+/*
+ * timer.c
+ *
+ * Copyright (C) 2026 Corellium LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "timer.h"
+
+/* Hierarchical timer wheel: TIMER_LEVELS levels of TIMER_SLOTS slots, each
+ * level TIMER_SLOTS times coarser than the one below. Level 0 has 1 ms
+ * slots, level 1 64 ms, level 2 4 s and level 3 about 4.5 min, so the
+ * wheel covers about 4.7 hours; later timers are parked in the last level
+ * and re-filed when it comes around. Setting and cancelling a timer is
+ * O(1); a timer moves down at most TIMER_LEVELS - 1 times before it
+ * fires. Per level a bitmap of the non-empty slots lets timers_run skip
+ * idle stretches and timers_get_timeout find the next expiry without
+ * walking the slots. */
+#define TIMER_SLOT_BITS	6
+#define TIMER_SLOTS	(1 << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK	(TIMER_SLOTS - 1)
+#define TIMER_LEVELS	4
+#define TIMER_RANGE	((uint64_t)1 << (TIMER_SLOT_BITS * TIMER_LEVELS))
+
+#define LEVEL_SHIFT(level) (TIMER_SLOT_BITS * (level))
+
+static struct list_node wheel[TIMER_LEVELS][TIMER_SLOTS];
+static uint64_t wheel_used[TIMER_LEVELS];	// bitmap of non-empty slots
+static uint64_t wheel_time = 0;		// next tick to process
+static uint64_t clock_now = 0;		// cached per loop iteration
+static uint32_t timer_count = 0;
+
+void timers_init(void)
+{
+	int level, slot;
+	for (level = 0; level < TIMER_LEVELS; level++) {
+		for (slot = 0; slot < TIMER_SLOTS; slot++) {
+			list_init(&wheel[level][slot]);
+		}
+		wheel_used[level] = 0;
+	}
+	clock_now = mstime64();
+	wheel_time = clock_now;
+	timer_count = 0;
+}
+
+/**
+ * Refresh the cached clock. Called once per main loop iteration after
+ * poll returns, so everything handled in that iteration sees the same
+ * time without reading the clock again.
+ */
+void timers_update_clock(void)
+{
+	clock_now = mstime64();
+}
+
+uint64_t timer_now(void)
+{
+	return clock_now;
+}
+
+uint32_t timers_pending(void)
+{
+	return timer_count;
+}
+
+static void timer_enqueue(struct timer *timer)
+{
+	uint64_t expires = timer->expires;
+	int level;
+
+	if (expires < wheel_time)
+		expires = wheel_time;
+	if (expires - wheel_time >= TIMER_RANGE)
+		expires = wheel_time + TIMER_RANGE - 1;
+	for (level = 0; level < TIMER_LEVELS - 1; level++) {
+		if (expires - wheel_time < ((uint64_t)1 << LEVEL_SHIFT(level + 1)))
+			break;
+	}
+	int slot = (expires >> LEVEL_SHIFT(level)) & TIMER_SLOT_MASK;
+	list_add_tail(&wheel[level][slot], &timer->node);
+	wheel_used[level] |= (uint64_t)1 << slot;
+	timer->slot = level * TIMER_SLOTS + slot;
+}
+
+static void timer_dequeue(struct timer *timer)
+{
+	int level = timer->slot / TIMER_SLOTS;
+	int slot = timer->slot % TIMER_SLOTS;
+	list_del(&timer->node);
+	if (list_empty(&wheel[level][slot]))
+		wheel_used[level] &= ~((uint64_t)1 << slot);
+}
+
+void timer_init(struct timer *timer, timer_cb_t cb)
+{
+	list_init(&timer->node);
+	timer->expires = 0;
+	timer->slot = 0;
+	timer->cb = cb;
+}
+
+int timer_pending(const struct timer *timer)
+{
+	return !list_empty(&timer->node);
+}
+
+/**
+ * (Re)arm a timer to fire at the given timer_now() based time. Times in
+ * the past fire on the next timers_run.
+ */
+void timer_set_at(struct timer *timer, uint64_t expires)
+{
+	if (timer_pending(timer)) {
+		timer_dequeue(timer);
+	} else {
+		timer_count++;
+	}
+	timer->expires = expires;
+	timer_enqueue(timer);
+}
+
+/**
+ * (Re)arm a timer to fire delay ms from now.
+ */
+void timer_set(struct timer *timer, uint64_t delay)
+{
+	timer_set_at(timer, clock_now + delay);
+}
+
+void timer_cancel(struct timer *timer)
+{
+	if (!timer_pending(timer))
+		return;
+	timer_dequeue(timer);
+	timer_count--;
+}
+
+/* move all timers of a non-empty slot over to list */
+static void timer_splice(struct list_node *list, struct list_node *slot)
+{
+	list->next = slot->next;
+	list->prev = slot->prev;
+	list->next->prev = list;
+	list->prev->next = list;
+	list_init(slot);
+}
+
+/* move the timers of the current slot of level down, wheel_time must be
+ * at the start of that slot */
+static void timer_cascade(int level)
+{
+	int slot = (wheel_time >> LEVEL_SHIFT(level)) & TIMER_SLOT_MASK;
+	if (slot == 0 && level + 1 < TIMER_LEVELS)
+		timer_cascade(level + 1);
+	if (!(wheel_used[level] & ((uint64_t)1 << slot)))
+		return;
+	struct list_node pending;
+	timer_splice(&pending, &wheel[level][slot]);
+	wheel_used[level] &= ~((uint64_t)1 << slot);
+	LIST_FOREACH(struct timer *timer, &pending, struct timer, node) {
+		list_del(&timer->node);
+		timer_enqueue(timer);
+	} ENDFOREACH
+}
+
+/**
+ * Fire all timers that expired up to the cached clock.
+ */
+void timers_run(void)
+{
+	if (timer_count == 0) {
+		wheel_time = clock_now + 1;
+		return;
+	}
+	while (wheel_time <= clock_now) {
+		int slot = wheel_time & TIMER_SLOT_MASK;
+		if (slot == 0)
+			timer_cascade(1);
+		if (!(wheel_used[0] & ((uint64_t)1 << slot))) {
+			/* nothing due in this tick, skip ahead to the next used
+			 * slot or the next cascade, whichever comes first */
+			uint64_t mask = wheel_used[0] & (~(uint64_t)0 << slot);
+			uint64_t next = (mask) ? (wheel_time & ~(uint64_t)TIMER_SLOT_MASK) + __builtin_ctzll(mask) : (wheel_time | TIMER_SLOT_MASK) + 1;
+			wheel_time = (next <= clock_now) ? next : clock_now + 1;
+			continue;
+		}
+		wheel_time++;
+		/* timers re-armed by a callback can land in this slot again,
+		 * for the next round, so only fire the ones there now */
+		struct list_node expired;
+		timer_splice(&expired, &wheel[0][slot]);
+		wheel_used[0] &= ~((uint64_t)1 << slot);
+		while (!list_empty(&expired)) {
+			struct timer *timer = list_entry(expired.next, struct timer, node);
+			list_del(&timer->node);
+			timer_count--;
+			timer->cb(timer);
+		}
+	}
+}
+
+/**
+ * Milliseconds until the next timer is due, or -1 if none is pending. For
+ * timers on the upper levels this is the time they get moved down, which
+ * is never later than when they expire.
+ */
+int timers_get_timeout(void)
+{
+	uint64_t due = 0;
+	int level;
+
+	if (timer_count == 0)
+		return -1;
+	for (level = 0; level < TIMER_LEVELS; level++) {
+		uint64_t used = wheel_used[level];
+		if (!used)
+			continue;
+		uint64_t span = (uint64_t)1 << LEVEL_SHIFT(level);
+		uint64_t start = (wheel_time + span - 1) & ~(span - 1);
+		int first = (start >> LEVEL_SHIFT(level)) & TIMER_SLOT_MASK;
+		/* rotate so the slot processed next is bit 0 */
+		uint64_t rotated = (first) ? (used >> first) | (used << (TIMER_SLOTS - first)) : used;
+		uint64_t t = start + (uint64_t)__builtin_ctzll(rotated) * span;
+		if (due == 0 || t < due)
+			due = t;
+	}
+	uint64_t now = mstime64();
+	if (due <= now)
+		return 0;
+	return (due - now > 0x7FFFFFFF) ? 0x7FFFFFFF : (int)(due - now);
+}
@@ -0,0 +1,53 @@
+/*
+ * timer.h
+ *
+ * Copyright (C) 2026 Corellium LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+#include "utils.h"
+
+struct timer;
+typedef void (*timer_cb_t)(struct timer *timer);
+
+/* A timer is embedded in the object it belongs to, the callback gets back
+ * to that object with list_entry(). Timers are only used from the main
+ * loop thread and have millisecond resolution. */
+struct timer {
+	struct list_node node;	// wheel slot
+	uint64_t expires;	// timer_now() based
+	uint16_t slot;		// level * TIMER_SLOTS + slot, while pending
+	timer_cb_t cb;
+};
+
+void timers_init(void);
+void timers_update_clock(void);
+uint64_t timer_now(void);
+int timers_get_timeout(void);
+void timers_run(void);
+uint32_t timers_pending(void);
+
+void timer_init(struct timer *timer, timer_cb_t cb);
+void timer_set(struct timer *timer, uint64_t delay);
+void timer_set_at(struct timer *timer, uint64_t expires);
+void timer_cancel(struct timer *timer);
+int timer_pending(const struct timer *timer);
+
+#endif
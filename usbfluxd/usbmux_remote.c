@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 
@@ -55,16 +56,192 @@
 #include "utils.h"
 #include "log.h"
 #include "socket.h"
+#include "probes.h"
+#include "capture.h"
+#include "timer.h"
+#include "paircache.h"
+#include "plistfmt.h"
 
 #define REPLY_BUF_SIZE	0x10000
-
-static struct collection remote_list;
-pthread_mutex_t remote_list_mutex;
+#define REMOTE_CHECK_MS		10000	// probe TCP listeners idle for this long
+#define REMOTE_CHECK_JITTER_MS	2000	// spread the probes of listeners added together
+#define REMOTE_PROBE_TIMEOUT_MS	2000
+#define REMOTE_PROBE_RATE	20	// probes started per second at most
+#define REMOTE_PROBES_MAX	16	// probes in flight at most
+#define REMOTE_PROBE_DEFER_MS	250	// retry a rate limited probe after 250-500 ms
+#define REMOTE_KEEPALIVE_IDLE	10	// TCP keepalive, in seconds
+#define REMOTE_KEEPALIVE_INTVL	5
+#define REMOTE_KEEPALIVE_CNT	3
+#define REMOTE_BEAT_MS		5000	// heartbeat interval of TCP listeners
+#define REMOTE_BEAT_MISSES	3	// missed beats in a row until a listener is closed
+#define REMOTE_RECONNECT_GRACE_MS	30000	// listeners keep their id and devices this long
+#define REMOTE_RECONNECT_MIN_MS		250	// reconnect backoff, doubled per attempt
+#define REMOTE_RECONNECT_MAX_MS		8000
+#define REMOTE_CONNECT_TIMEOUT_MS	5000
+#define REMOTE_RESYNC_MS		1000	// for the devices to be announced again
+#define REMOTE_BREAKER_FAILURES		3	// connect failures in a row that open the breaker
+#define REMOTE_BREAKER_OPEN_MS		2000	// first open period, doubled per failed trial
+#define REMOTE_BREAKER_OPEN_MAX_MS	60000
+#define REMOTE_ADMIT_PER_REMOTE		8	// connects waiting for their result per remote
+#define REMOTE_ADMIT_GLOBAL		32	// and in total
+#define REMOTE_ADMIT_QUEUE		256	// connects queued over the limits at most
+#define REMOTE_ADMIT_WAIT_MS		10000	// time a connect may wait in the queue
+#define REMOTE_REQUEST_TIMEOUT_MS	5000	// for the reply to a pair record or BUID request
+#define REMOTE_CONNECT_RESULT_MS	10000	// for the result of a Connect
+
+/* Remote state is only touched by the main loop thread. The mDNS monitor
+ * posts its results to remote_cmdq instead. */
+static struct list_node remote_list;
+static struct list_node remote_states[REMOTE_DEAD + 1];	// remotes by state
+static struct fdtable remote_fds;
+static struct cmdqueue remote_cmdq = { NULL, -1, -1 };
 extern pthread_mutex_t gethostbyname_mutex;
 static plist_t remote_device_list = NULL;
 static uint8_t remote_id_map[32];
 static int opt_no_mdns = 0;
 
+/* reachability probes */
+static uint32_t probes_in_flight = 0;
+static uint32_t probe_tokens = REMOTE_PROBE_RATE;
+static uint64_t probe_refill_time = 0;
+static uint64_t cnt_probes = 0;
+static uint64_t cnt_probe_failures = 0;
+static uint64_t cnt_probes_deferred = 0;
+
+/* heartbeat */
+static uint32_t beat_interval = REMOTE_BEAT_MS;
+static uint32_t beat_max_missed = REMOTE_BEAT_MISSES;
+static uint64_t cnt_beats = 0;
+static uint64_t cnt_beats_missed = 0;
+
+/* reconnection */
+static uint32_t reconnect_grace = REMOTE_RECONNECT_GRACE_MS;
+static uint64_t cnt_reconnects = 0;
+static uint64_t cnt_reconnects_expired = 0;
+static uint64_t cnt_resync_removed = 0;
+
+/* circuit breakers */
+static uint64_t cnt_breaker_trips = 0;
+static uint64_t cnt_breaker_rejects = 0;
+
+/* connect admission */
+struct remote_connect_wait {
+	struct list_node node;		// admit_queue
+	struct mux_client *client;
+	uint32_t device_id;
+	uint32_t tag;
+	plist_t req;
+	uint64_t queued_at;		// in us
+	uint64_t deadline;		// timer_now() based
+};
+static uint32_t admit_per_remote = REMOTE_ADMIT_PER_REMOTE;
+static uint32_t admit_global = REMOTE_ADMIT_GLOBAL;
+static uint32_t admit_queue_max = REMOTE_ADMIT_QUEUE;
+static uint32_t admit_wait = REMOTE_ADMIT_WAIT_MS;
+static uint32_t admit_in_flight = 0;
+static uint16_t admit_in_flight_by_id[256];
+static uint32_t admit_queue_len = 0;
+static uint16_t admit_queued_by_id[256];
+static struct list_node admit_queue;
+static struct timer admit_timer;
+static uint64_t cnt_admitted = 0;
+static uint64_t cnt_admit_queued = 0;
+static uint64_t cnt_admit_rejects = 0;
+static uint64_t cnt_admit_timeouts = 0;
+static uint64_t cnt_admit_wait_us = 0;
+static uint64_t max_admit_wait_us = 0;
+
+/* request deadlines, by command */
+static const char *request_names[REMOTE_CMD_CONNECT + 1] = {
+	NULL, "Listen", "ReadPairRecord", "SavePairRecord", "DeletePairRecord", "ReadBUID", "Connect"
+};
+static uint32_t request_timeout[REMOTE_CMD_CONNECT + 1] = {
+	0, 0, REMOTE_REQUEST_TIMEOUT_MS, REMOTE_REQUEST_TIMEOUT_MS, REMOTE_REQUEST_TIMEOUT_MS, REMOTE_REQUEST_TIMEOUT_MS, REMOTE_CONNECT_RESULT_MS
+};
+static uint64_t cnt_request_timeouts[REMOTE_CMD_CONNECT + 1];
+
+/* control connections, one per instance */
+struct remote_request {
+	struct list_node node;		// requests of the control connection
+	struct mux_client *client;	// NULL once the client went away
+	uint32_t client_tag;
+	uint32_t tag;			// on the control connection
+	enum remote_command command;
+	char *record_id;		// PairRecordID of pair record requests
+	uint64_t generation;		// paircache_generation() when it was sent
+	uint64_t deadline;		// timer_now() based, 0 for none
+};
+static struct remote_mux *remote_controls[256];
+static uint32_t control_pending = 0;
+static uint64_t cnt_control_opened = 0;
+static uint64_t cnt_control_requests = 0;
+
+static void remote_check_timer_cb(struct timer *timer);
+static void remote_probe_stop(struct remote_mux *remote);
+static void remote_beat_timer_cb(struct timer *timer);
+static void remote_beat_stop(struct remote_mux *remote);
+static void remote_reconnect_timer_cb(struct timer *timer);
+static void remote_reconnect_now(struct remote_mux *remote);
+static int remote_can_reconnect(struct remote_mux *remote);
+static void remote_admit_release(struct remote_mux *remote);
+static void remote_admit_timer_cb(struct timer *timer);
+static void remote_request_timer_cb(struct timer *timer);
+static void remote_close(struct remote_mux *remote);
+static void remote_control_release(struct remote_mux *remote);
+
+static uint64_t remote_check_delay(void)
+{
+	return REMOTE_CHECK_MS + random() % REMOTE_CHECK_JITTER_MS;
+}
+
+/* Only TCP listeners are probed, a failed probe takes the devices of the
+ * instance with it. Sessions fail on their own. */
+static void remote_check_arm(struct remote_mux *remote)
+{
+	if (remote->is_listener && !remote->is_unix && remote->host)
+		timer_set(&remote->check_timer, remote_check_delay());
+}
+
+static void remote_lists_init(void)
+{
+	int i;
+	list_init(&remote_list);
+	for (i = 0; i <= REMOTE_DEAD; i++) {
+		list_init(&remote_states[i]);
+	}
+	fdtable_init(&remote_fds);
+	list_init(&admit_queue);
+	timer_init(&admit_timer, remote_admit_timer_cb);
+}
+
+static void remote_link(struct remote_mux *remote)
+{
+	list_add_tail(&remote_list, &remote->node);
+	list_add_tail(&remote_states[remote->state], &remote->state_node);
+	fdtable_set(&remote_fds, remote->fd, remote);
+}
+
+static void remote_unlink(struct remote_mux *remote)
+{
+	list_del(&remote->node);
+	list_del(&remote->state_node);
+	fdtable_clear(&remote_fds, remote->fd, remote);
+	remote_admit_release(remote);
+}
+
+static void remote_set_state(struct remote_mux *remote, enum remote_state state)
+{
+	USBFLUXD_PROBE4(remote_state, remote->fd, remote->id, remote->state, state);
+	if (remote->state == REMOTE_CONNECTING1 && state != REMOTE_CONNECTING1) {
+		remote_admit_release(remote);
+	}
+	remote->state = state;
+	if (!list_empty(&remote->state_node)) {
+		list_del(&remote->state_node);
+		list_add_tail(&remote_states[state], &remote->state_node);
+	}
+}
+
 static void set_remote_id_used(uint8_t idval, int used)
 {
 	if (used) {
@@ -129,7 +306,11 @@ static struct remote_mux* remote_mux_new_with_fd(int fd)
 	struct remote_mux* remote = malloc(sizeof(struct remote_mux));
 	memset(remote, 0, sizeof(struct remote_mux));
 
+	list_init(&remote->node);
+	list_init(&remote->state_node);
 	remote->fd = fd;
+	remote->probe_fd = -1;
+	msgqueue_init(&remote->outq);
 	remote->ob_buf = malloc(REPLY_BUF_SIZE);
 	remote->ob_size = 0;
 	remote->ob_capacity = REPLY_BUF_SIZE;
@@ -139,7 +320,13 @@ static struct remote_mux* remote_mux_new_with_fd(int fd)
 	remote->events = POLLIN;
 	remote->state = REMOTE_COMMAND;
 	remote->last_command = -1;
-	remote->last_active = mstime64();
+	remote->last_active = timer_now();
+	timer_init(&remote->check_timer, remote_check_timer_cb);
+	remote->hb.fd = -1;
+	timer_init(&remote->hb.timer, remote_beat_timer_cb);
+	timer_init(&remote->reconnect_timer, remote_reconnect_timer_cb);
+	timer_init(&remote->request_timer, remote_request_timer_cb);
+	list_init(&remote->requests);
 
 	usbfluxd_log(LL_INFO, "New Remote fd %d", fd);
 
@@ -172,6 +359,11 @@ static struct remote_mux* remote_mux_new_with_host(const char *hostname, uint16_
 	if (r) {
 		r->host = strdup(hostname);
 		r->port = port;
+		r->addrlen = sizeof(r->addr);
+		if (getpeername(fd, (struct sockaddr*)&r->addr, &r->addrlen) < 0) {
+			r->addrlen = 0;
+		}
+		socket_set_keepalive(fd, REMOTE_KEEPALIVE_IDLE, REMOTE_KEEPALIVE_INTVL, REMOTE_KEEPALIVE_CNT);
 	}
 	return r;
 }
@@ -181,15 +373,32 @@ static struct remote_mux* remote_mux_new_with_host(const char *hostname, uint16_
 #define PLIST_CLIENT_VERSION_STRING PLIST_PROGNAME " " VERSION
 #define PLIST_LIBUSBMUX_VERSION 3
 
-static plist_t create_plist_message(const char* message_type)
+/* requests to an instance, with the keys a libusbmuxd client sends */
+#define REQUEST_TEMPLATE(message_type) \
+	PLISTFMT_HEAD \
+	PLISTFMT_STRING("BundleID", PLIST_BUNDLE_ID) \
+	PLISTFMT_STRING("ClientVersionString", PLIST_CLIENT_VERSION_STRING) \
+	PLISTFMT_STRING("MessageType", message_type) \
+	PLISTFMT_STRING("ProgName", PLIST_PROGNAME) \
+	PLISTFMT_INTEGER("kLibUSBMuxVersion", PLISTFMT_XSTR(PLIST_LIBUSBMUX_VERSION))
+
+static const char listen_request[] = REQUEST_TEMPLATE("Listen") PLISTFMT_TAIL;
+static const char list_devices_request[] = REQUEST_TEMPLATE("ListDevices") PLISTFMT_TAIL;
+static const char read_buid_request[] = REQUEST_TEMPLATE("ReadBUID") PLISTFMT_TAIL;
+/* followed by the PairRecordID */
+static const char read_pair_record_request[] = REQUEST_TEMPLATE("ReadPairRecord") PLISTFMT_STRING_OPEN("PairRecordID");
+static const char delete_pair_record_request[] = REQUEST_TEMPLATE("DeletePairRecord") PLISTFMT_STRING_OPEN("PairRecordID");
+static const char record_id_tail[] = PLISTFMT_STRING_CLOSE PLISTFMT_TAIL;
+
+static void remote_capture(struct remote_mux *remote, uint32_t device_id, enum capture_direction dir, const void *hdr, uint32_t hdr_len, const void *payload, uint32_t payload_len)
 {
-	plist_t plist = plist_new_dict();
-	plist_dict_set_item(plist, "BundleID", plist_new_string(PLIST_BUNDLE_ID));
-	plist_dict_set_item(plist, "ClientVersionString", plist_new_string(PLIST_CLIENT_VERSION_STRING));
-	plist_dict_set_item(plist, "MessageType", plist_new_string(message_type));
-	plist_dict_set_item(plist, "ProgName", plist_new_string(PLIST_PROGNAME));
-	plist_dict_set_item(plist, "kLibUSBMuxVersion", plist_new_uint(PLIST_LIBUSBMUX_VERSION));
-	return plist;
+	struct capture_meta meta;
+	client_capture_meta(remote->client, &meta);
+	meta.fd = remote->fd;
+	meta.remote_id = remote->id;
+	if (device_id)
+		meta.device_id = device_id;
+	capture_frame(&meta, dir, CAPTURE_CONTROL, hdr, hdr_len, payload, payload_len);
 }
 
 static int remote_send_pkt(struct remote_mux *remote, uint32_t tag, enum usbmuxd_msgtype msg, void *payload, int payload_length)
@@ -201,24 +410,50 @@ static int remote_send_pkt(struct remote_mux *remote, uint32_t tag, enum usbmuxd
 	hdr.tag = tag;
 	usbfluxd_log(LL_DEBUG, "%s fd %d tag %d msg %d payload_length %d", __func__, remote->fd, tag, msg, payload_length);
 
-	uint32_t available = remote->ob_capacity - remote->ob_size;
-	/* the output buffer _should_ be large enough, but just in case */
-	if (available < hdr.length) {
-		unsigned char* new_buf;
-		uint32_t new_size = ((remote->ob_capacity + hdr.length + 4096) / 4096) * 4096;
-		usbfluxd_log(LL_DEBUG, "%s: Enlarging remote %d output buffer %d -> %d", __func__, remote->fd, remote->ob_capacity, new_size);
-		new_buf = realloc(remote->ob_buf, new_size);
-		if (!new_buf) {
-			usbfluxd_log(LL_FATAL, "%s: Failed to realloc.", __func__);
-			return -1;
-		}
-		remote->ob_buf = new_buf;
-		remote->ob_capacity = new_size;
+	unsigned char *ptr = msgqueue_reserve(&remote->outq, hdr.length);
+	if (!ptr) {
+		usbfluxd_log(LL_FATAL, "%s: Failed to allocate output buffer.", __func__);
+		return -1;
 	}
-	memcpy(remote->ob_buf + remote->ob_size, &hdr, sizeof(hdr));
+	memcpy(ptr, &hdr, sizeof(hdr));
 	if (payload && payload_length)
-		memcpy(remote->ob_buf + remote->ob_size + sizeof(hdr), payload, payload_length);
-	remote->ob_size += hdr.length;
+		memcpy(ptr + sizeof(hdr), payload, payload_length);
+	if (capture_enabled)
+		remote_capture(remote, 0, CAPTURE_TO_REMOTE, &hdr, sizeof(hdr), payload, payload_length);
+	remote->events |= POLLOUT;
+	return hdr.length;
+}
+
+/**
+ * Send a request template straight into the output queue. If record_id is
+ * given, the template ends in the slot for the PairRecordID.
+ */
+static int remote_send_request(struct remote_mux *remote, uint32_t tag, const char *tmpl, uint32_t tmpl_len, const char *record_id)
+{
+	struct usbmuxd_header hdr;
+	uint32_t payload_length = tmpl_len;
+	if (record_id)
+		payload_length += plistfmt_string_length(record_id) + PLISTFMT_LEN(record_id_tail);
+	hdr.version = 1;
+	hdr.length = sizeof(hdr) + payload_length;
+	hdr.message = MESSAGE_PLIST;
+	hdr.tag = tag;
+	usbfluxd_log(LL_DEBUG, "%s fd %d tag %d payload_length %d", __func__, remote->fd, tag, payload_length);
+
+	unsigned char *ptr = msgqueue_reserve(&remote->outq, hdr.length);
+	if (!ptr) {
+		usbfluxd_log(LL_FATAL, "%s: Failed to allocate output buffer.", __func__);
+		return -1;
+	}
+	memcpy(ptr, &hdr, sizeof(hdr));
+	char *out = (char*)ptr + sizeof(hdr);
+	memcpy(out, tmpl, tmpl_len);
+	if (record_id) {
+		out = plistfmt_put_string(out + tmpl_len, record_id);
+		memcpy(out, record_id_tail, PLISTFMT_LEN(record_id_tail));
+	}
+	if (capture_enabled)
+		remote_capture(remote, 0, CAPTURE_TO_REMOTE, &hdr, sizeof(hdr), ptr + sizeof(hdr), payload_length);
 	remote->events |= POLLOUT;
 	return hdr.length;
 }
@@ -242,9 +477,7 @@ static int remote_send_listen_packet(struct remote_mux *remote)
 {
 	int res = 0;
 
-	plist_t plist = create_plist_message("Listen");
-	res = remote_send_plist_pkt(remote, 0, plist);
-	plist_free(plist);
+	res = remote_send_request(remote, 0, listen_request, PLISTFMT_LEN(listen_request), NULL);
 
 	if (res > 0) {
 		remote->last_command = REMOTE_CMD_LISTEN;
@@ -252,50 +485,392 @@ static int remote_send_listen_packet(struct remote_mux *remote)
 	return res;
 }
 
-int usbmux_remote_connect(uint32_t device_id, uint32_t tag, plist_t req_plist, struct mux_client *client)
+static const char *remote_breaker_name(enum breaker_state state)
+{
+	switch (state) {
+		case BREAKER_CLOSED:
+			return "Closed";
+		case BREAKER_OPEN:
+			return "Open";
+		case BREAKER_HALF_OPEN:
+			return "HalfOpen";
+		default:
+			return "Unknown";
+	}
+}
+
+/* The clock is read directly, a failed connect may have blocked the loop
+ * for its full timeout. */
+static int remote_breaker_allow(struct remote_mux *listener)
+{
+	struct remote_breaker *br = &listener->breaker;
+	if (br->state == BREAKER_CLOSED) {
+		return 1;
+	}
+	if (br->state == BREAKER_OPEN && mstime64() >= br->open_until) {
+		usbfluxd_log(LL_INFO, "%s: Trying a connect to %s:%d again", __func__, listener->host, listener->port);
+		br->state = BREAKER_HALF_OPEN;
+		return 1;
+	}
+	br->rejects++;
+	cnt_breaker_rejects++;
+	return 0;
+}
+
+static void remote_breaker_result(struct remote_mux *listener, int ok)
+{
+	struct remote_breaker *br = &listener->breaker;
+	if (ok) {
+		if (br->state != BREAKER_CLOSED) {
+			usbfluxd_log(LL_NOTICE, "%s: %s:%d accepts connections again", __func__, listener->host, listener->port);
+		}
+		br->state = BREAKER_CLOSED;
+		br->failures = 0;
+		br->trips = 0;
+		return;
+	}
+	br->failures++;
+	if (br->state == BREAKER_HALF_OPEN || br->failures >= REMOTE_BREAKER_FAILURES) {
+		uint64_t period = REMOTE_BREAKER_OPEN_MAX_MS;
+		if (br->trips < 16 && ((uint64_t)REMOTE_BREAKER_OPEN_MS << br->trips) < period) {
+			period = (uint64_t)REMOTE_BREAKER_OPEN_MS << br->trips;
+		}
+		br->trips++;
+		br->state = BREAKER_OPEN;
+		br->open_until = mstime64() + period;
+		cnt_breaker_trips++;
+		usbfluxd_log(LL_NOTICE, "%s: %u connects to %s:%d failed, failing connects for %llu ms", __func__, br->failures, listener->host, listener->port, (unsigned long long)period);
+	}
+}
+
+/* the listener of a remote instance, also while it reconnects */
+static struct remote_mux *remote_instance_find(uint8_t remote_mux_id)
+{
+	LIST_FOREACH(struct remote_mux *r, &remote_list, struct remote_mux, node) {
+		if (r->id == remote_mux_id && r->is_listener && (r->state == REMOTE_LISTEN || r->lost_at)) {
+			return r;
+		}
+	} ENDFOREACH
+	return NULL;
+}
+
+/**
+ * Open a new connection to a remote instance for a client request. Fails
+ * right away while the instance reconnects its listener, or while its
+ * circuit breaker is open after repeated connect failures.
+ */
+static struct remote_mux *remote_mux_new_for_instance(struct remote_mux *listener)
+{
+	if (listener->state != REMOTE_LISTEN) {
+		usbfluxd_log(LL_INFO, "%s: %s:%d is reconnecting", __func__, listener->host, listener->port);
+		return NULL;
+	}
+	if (!remote_breaker_allow(listener)) {
+		usbfluxd_log(LL_DEBUG, "%s: Circuit breaker for %s:%d is open", __func__, listener->host, listener->port);
+		return NULL;
+	}
+	struct remote_mux *remote = remote_mux_new_with_host(listener->host, listener->port);
+	remote_breaker_result(listener, remote != NULL);
+	if (remote) {
+		remote->id = listener->id;
+	}
+	return remote;
+}
+
+/**
+ * Limit the connects to remote instances that wait for their result, per
+ * instance and in total. Connects over the limit wait in a FIFO queue of
+ * queue_max entries for at most wait_ms. 0 keeps the current value.
+ */
+void usbmux_remote_set_connect_limits(uint32_t per_remote, uint32_t global, uint32_t queue_max, uint32_t wait_ms)
+{
+	if (per_remote > 0)
+		admit_per_remote = per_remote;
+	if (global > 0)
+		admit_global = global;
+	if (queue_max > 0)
+		admit_queue_max = queue_max;
+	if (wait_ms > 0)
+		admit_wait = wait_ms;
+}
+
+static int remote_admit_full(uint8_t remote_mux_id)
+{
+	return (admit_in_flight >= admit_global || admit_in_flight_by_id[remote_mux_id] >= admit_per_remote);
+}
+
+static void remote_admit_take(struct remote_mux *remote)
+{
+	remote->admitted = 1;
+	admit_in_flight++;
+	admit_in_flight_by_id[remote->id]++;
+	cnt_admitted++;
+}
+
+/* The connect got its result or was closed, the next queued one is started
+ * from the main loop. */
+static void remote_admit_release(struct remote_mux *remote)
+{
+	if (!remote->admitted)
+		return;
+	remote->admitted = 0;
+	admit_in_flight--;
+	admit_in_flight_by_id[remote->id]--;
+	if (admit_queue_len > 0) {
+		timer_set(&admit_timer, 0);
+	}
+}
+
+static void remote_connect_wait_free(struct remote_connect_wait *wait)
+{
+	list_del(&wait->node);
+	admit_queue_len--;
+	admit_queued_by_id[wait->device_id >> 24]--;
+	plist_free(wait->req);
+	free(wait);
+}
+
+/**
+ * Set how long a request forwarded for a client may wait for the reply,
+ * by MessageType, or "all". 0 waits forever. Returns -1 for an unknown
+ * command.
+ */
+int usbmux_remote_set_request_timeout(const char *command, uint32_t timeout_ms)
+{
+	int i;
+	int found = 0;
+	for (i = REMOTE_CMD_READ_PAIR_RECORD; i <= REMOTE_CMD_CONNECT; i++) {
+		if (!strcmp(command, "all") || !strcmp(command, request_names[i])) {
+			request_timeout[i] = timeout_ms;
+			found = 1;
+		}
+	}
+	return (found) ? 0 : -1;
+}
+
+static void remote_request_start(struct remote_mux *remote, enum remote_command command, uint32_t tag)
+{
+	remote->request_tag = tag;
+	if (request_timeout[command] > 0) {
+		timer_set(&remote->request_timer, request_timeout[command]);
+	}
+}
+
+/* the request timer of a control connection runs for the earliest deadline */
+static void remote_control_arm(struct remote_mux *remote)
+{
+	uint64_t deadline = 0;
+	LIST_FOREACH(struct remote_request *req, &remote->requests, struct remote_request, node) {
+		if (req->deadline && (!deadline || req->deadline < deadline))
+			deadline = req->deadline;
+	} ENDFOREACH
+	if (deadline) {
+		timer_set_at(&remote->request_timer, deadline);
+	} else {
+		timer_cancel(&remote->request_timer);
+	}
+}
+
+static void remote_control_timeout(struct remote_mux *remote)
+{
+	uint64_t now = timer_now();
+	LIST_FOREACH(struct remote_request *req, &remote->requests, struct remote_request, node) {
+		if (req->deadline && req->deadline <= now) {
+			cnt_request_timeouts[req->command]++;
+			usbfluxd_log(LL_NOTICE, "%s: %s request to remote %d timed out after %u ms, closing control fd %d", __func__, request_names[req->command], remote->id, request_timeout[req->command], remote->fd);
+		}
+	} ENDFOREACH
+	/* the replies can not be matched up anymore, fail all of its requests */
+	remote_close(remote);
+}
+
+/* The remote did not reply in time. The client gets an error result and the
+ * connection is closed, it is in an unknown state. */
+static void remote_request_timer_cb(struct timer *timer)
+{
+	struct remote_mux *remote = list_entry(timer, struct remote_mux, request_timer);
+	if (remote->is_control) {
+		remote_control_timeout(remote);
+		return;
+	}
+	struct mux_client *client = remote->client;
+	if (remote->state != REMOTE_CONNECTING1) {
+		return;
+	}
+	cnt_request_timeouts[REMOTE_CMD_CONNECT]++;
+	usbfluxd_log(LL_NOTICE, "%s: Connect request to remote %d timed out after %u ms, closing remote fd %d", __func__, remote->id, request_timeout[REMOTE_CMD_CONNECT], remote->fd);
+	if (remote->id != 0) {
+		/* a remote that does not answer connects counts as failing */
+		struct remote_mux *listener = remote_instance_find(remote->id);
+		if (listener) {
+			remote_breaker_result(listener, 0);
+		}
+	}
+	if (client) {
+		client_clear_remote(client);
+		remote->client = NULL;
+	}
+	remote_close(remote);
+	if (client) {
+		client_notify_connect(client, RESULT_CONNREFUSED);
+	}
+}
+
+static int remote_connect_start(uint32_t device_id, uint32_t tag, plist_t req_plist, struct mux_client *client)
 {
 	uint8_t remote_mux_id = (device_id >> 24);
 	struct remote_mux *remote = NULL;
-	pthread_mutex_lock(&remote_list_mutex);
 	if (remote_mux_id == 0) {
 		/* make a new local connection */
 		remote = remote_mux_new_with_unix_socket(USBMUXD_RENAMED_SOCKET);
 	} else {
-		/* for remotes find the host:port first, then make a new connection */
-		FOREACH(struct remote_mux *r, &remote_list) {
-			if (r->id == remote_mux_id && r->state == REMOTE_LISTEN) {
-				remote = remote_mux_new_with_host(r->host, r->port);
-				break;
-			}	
-		} ENDFOREACH
+		/* for remotes find the instance first, then make a new connection */
+		struct remote_mux *listener = remote_instance_find(remote_mux_id);
+		if (listener) {
+			remote = remote_mux_new_for_instance(listener);
+			if (!remote) {
+				return -RESULT_CONNREFUSED;
+			}
+		}
 	}
 	if (remote) {
 		remote->id = remote_mux_id;
-		remote->state = REMOTE_CONNECTING1;
+		remote_set_state(remote, REMOTE_CONNECTING1);
 		remote->client = client;
 		client_set_remote(client, remote);
-		collection_add(&remote_list, remote);
+		remote_link(remote);
+		if (remote_mux_id != 0) {
+			remote_admit_take(remote);
+		}
 	}
-	pthread_mutex_unlock(&remote_list_mutex);
 
 	if (!remote) {
 		usbfluxd_log(LL_ERROR, "%s: Could not find remote mux device for id %d", __func__, device_id);
 		return -1;
 	}
 
+	USBFLUXD_PROBE3(connect_start, remote->fd, device_id, tag);
+
 	plist_t req = plist_copy(req_plist);
 	plist_dict_set_item(req, "DeviceID", plist_new_uint(device_id & 0xFFFFFF));
+	remote_request_start(remote, REMOTE_CMD_CONNECT, tag);
 	remote_send_plist_pkt(remote, 0, req);
 	plist_free(req);
 
-	return 0;	
+	return 0;
+}
+
+/* Start the queued connects that fit into the limits, in the order they
+ * arrived, and fail the ones that waited too long. */
+static void remote_admit_timer_cb(struct timer *timer)
+{
+	uint64_t now = timer_now();
+	LIST_FOREACH(struct remote_connect_wait *wait, &admit_queue, struct remote_connect_wait, node) {
+		uint8_t remote_mux_id = (wait->device_id >> 24);
+		struct mux_client *client = wait->client;
+		if (now >= wait->deadline) {
+			cnt_admit_timeouts++;
+			usbfluxd_log(LL_NOTICE, "%s: Connect to device %d waited %u ms for admission, giving up", __func__, wait->device_id, admit_wait);
+			remote_connect_wait_free(wait);
+			client_notify_connect(client, RESULT_CONNREFUSED);
+			continue;
+		}
+		if (admit_in_flight >= admit_global)
+			break;
+		if (admit_in_flight_by_id[remote_mux_id] >= admit_per_remote)
+			continue;
+		uint64_t waited = ustime64() - wait->queued_at;
+		cnt_admit_wait_us += waited;
+		if (waited > max_admit_wait_us)
+			max_admit_wait_us = waited;
+		uint32_t device_id = wait->device_id;
+		uint32_t tag = wait->tag;
+		plist_t req = wait->req;
+		wait->req = NULL;
+		remote_connect_wait_free(wait);
+		int res = remote_connect_start(device_id, tag, req, client);
+		plist_free(req);
+		if (res < 0) {
+			client_notify_connect(client, -res);
+		}
+	} ENDFOREACH
+	if (admit_queue_len > 0) {
+		/* all entries wait equally long, the first one expires first */
+		struct remote_connect_wait *first = list_entry(admit_queue.next, struct remote_connect_wait, node);
+		timer_set_at(timer, first->deadline);
+	}
 }
 
-int usbmux_remote_read_buid(uint32_t tag, struct mux_client *client)
+/* a client closed while its connect was queued */
+void usbmux_remote_cancel_connect(struct mux_client *client)
 {
-	struct remote_mux *remote = NULL;
-	uint32_t remote_mux_id = 0; // fall back to local
-	pthread_mutex_lock(&remote_list_mutex);
+	LIST_FOREACH(struct remote_connect_wait *wait, &admit_queue, struct remote_connect_wait, node) {
+		if (wait->client == client) {
+			remote_connect_wait_free(wait);
+			break;
+		}
+	} ENDFOREACH
+}
+
+/**
+ * Connect a client to a device. Connects to remote instances over the
+ * admission limits are queued, their result is sent when they were started
+ * or timed out.
+ */
+int usbmux_remote_connect(uint32_t device_id, uint32_t tag, plist_t req_plist, struct mux_client *client)
+{
+	uint8_t remote_mux_id = (device_id >> 24);
+	if (remote_mux_id != 0 && (remote_admit_full(remote_mux_id) || admit_queued_by_id[remote_mux_id] > 0)) {
+		struct remote_mux *listener = remote_instance_find(remote_mux_id);
+		/* nothing to wait for if the instance is down, fail fast */
+		if (listener && listener->state == REMOTE_LISTEN && listener->breaker.state == BREAKER_CLOSED) {
+			if (admit_queue_len >= admit_queue_max) {
+				cnt_admit_rejects++;
+				usbfluxd_log(LL_NOTICE, "%s: %u connects queued, rejecting connect to device %d", __func__, admit_queue_len, device_id);
+				return -RESULT_CONNREFUSED;
+			}
+			struct remote_connect_wait *wait = calloc(1, sizeof(struct remote_connect_wait));
+			if (!wait) {
+				usbfluxd_log(LL_ERROR, "%s: Out of memory", __func__);
+				return -RESULT_CONNREFUSED;
+			}
+			wait->client = client;
+			wait->device_id = device_id;
+			wait->tag = tag;
+			wait->req = plist_copy(req_plist);
+			wait->queued_at = ustime64();
+			wait->deadline = timer_now() + admit_wait;
+			list_add_tail(&admit_queue, &wait->node);
+			if (admit_queue_len++ == 0) {
+				timer_set_at(&admit_timer, wait->deadline);
+			}
+			admit_queued_by_id[remote_mux_id]++;
+			cnt_admit_queued++;
+			usbfluxd_log(LL_DEBUG, "%s: Connect to device %d queued, %u connects to remote %d in flight", __func__, device_id, admit_in_flight_by_id[remote_mux_id], remote_mux_id);
+			return 0;
+		}
+	}
+	return remote_connect_start(device_id, tag, req_plist, client);
+}
+
+/* the instance a cached reply of remote_mux_id is stored for */
+static const char *remote_cache_instance(uint8_t remote_mux_id, char *buf, size_t size)
+{
+	if (remote_mux_id == 0) {
+		return "local";
+	}
+	struct remote_mux *listener = remote_instance_find(remote_mux_id);
+	if (!listener || !listener->host) {
+		return NULL;
+	}
+	snprintf(buf, size, "%s:%d", listener->host, listener->port);
+	return buf;
+}
+
+/* ReadBUID is answered by the instance of the first device listed */
+static uint8_t remote_id_for_buid(void)
+{
+	uint8_t remote_mux_id = 0; // fall back to local
 	plist_dict_iter iter = NULL;
 	plist_dict_new_iter(remote_device_list, &iter);
 	if (iter) {
@@ -309,37 +884,190 @@ int usbmux_remote_read_buid(uint32_t tag, struct mux_client *client)
 		free(key);
 		free(iter);
 	}
+	return remote_mux_id;
+}
+
+struct msgbuf *usbmux_remote_cached_buid(void)
+{
+	char buf[300];
+	return paircache_get(remote_cache_instance(remote_id_for_buid(), buf, sizeof(buf)), NULL);
+}
+
+static struct remote_mux *remote_control_get(uint8_t remote_mux_id)
+{
+	struct remote_mux *remote = remote_controls[remote_mux_id];
+	if (remote && remote->state == REMOTE_COMMAND) {
+		return remote;
+	}
+	remote = NULL;
 	if (remote_mux_id == 0) {
 		remote = remote_mux_new_with_unix_socket(USBMUXD_RENAMED_SOCKET);
 	} else {
-		FOREACH(struct remote_mux *r, &remote_list) {
-			if (r->state == REMOTE_LISTEN && r->id == remote_mux_id) {
-				remote = remote_mux_new_with_host(r->host, r->port);
-				break;
-			}
-		} ENDFOREACH
+		struct remote_mux *listener = remote_instance_find(remote_mux_id);
+		if (listener) {
+			remote = remote_mux_new_for_instance(listener);
+		}
 	}
-	if (remote) {
-		client_set_remote(client, remote);
-		collection_add(&remote_list, remote);
+	if (!remote) {
+		return NULL;
 	}
-	pthread_mutex_unlock(&remote_list_mutex);
+	remote->id = remote_mux_id;
+	remote->is_control = 1;
+	remote->next_tag = 1;
+	remote_link(remote);
+	remote_controls[remote_mux_id] = remote;
+	cnt_control_opened++;
+	usbfluxd_log(LL_INFO, "%s: Opened control connection fd %d to remote %d", __func__, remote->fd, remote_mux_id);
+	return remote;
+}
 
+/**
+ * Forward a control command of a client to an instance. The commands of all
+ * clients share one connection per instance, they are told apart by the tag,
+ * which is replaced by one of the connection. msg is only used for
+ * SavePairRecord, the other requests are built from their templates.
+ */
+static int remote_control_request(uint8_t remote_mux_id, enum remote_command command, plist_t msg, const char *record_id, uint32_t tag, struct mux_client *client)
+{
+	struct remote_mux *remote = remote_control_get(remote_mux_id);
 	if (!remote) {
-		usbfluxd_log(LL_ERROR, "%s: ERROR: Could not determine remote to read BUID from?!", __func__);
+		usbfluxd_log(LL_ERROR, "%s: ERROR: Could not determine remote for %s request?!", __func__, request_names[command]);
 		return -1;
 	}
+	struct remote_request *req = calloc(1, sizeof(struct remote_request));
+	if (!req) {
+		usbfluxd_log(LL_ERROR, "%s: Out of memory", __func__);
+		return -1;
+	}
+	req->client = client;
+	req->client_tag = tag;
+	req->tag = remote->next_tag++;
+	if (remote->next_tag == 0)
+		remote->next_tag = 1;
+	req->command = command;
+	req->record_id = (record_id) ? strdup(record_id) : NULL;
+	req->generation = paircache_generation();
+	if (request_timeout[command] > 0)
+		req->deadline = timer_now() + request_timeout[command];
+	int res;
+	switch (command) {
+		case REMOTE_CMD_READ_BUID:
+			res = remote_send_request(remote, req->tag, read_buid_request, PLISTFMT_LEN(read_buid_request), NULL);
+			break;
+		case REMOTE_CMD_READ_PAIR_RECORD:
+			res = remote_send_request(remote, req->tag, read_pair_record_request, PLISTFMT_LEN(read_pair_record_request), record_id);
+			break;
+		case REMOTE_CMD_DELETE_PAIR_RECORD:
+			res = remote_send_request(remote, req->tag, delete_pair_record_request, PLISTFMT_LEN(delete_pair_record_request), record_id);
+			break;
+		default:
+			/* the request of the client is forwarded */
+			res = remote_send_plist_pkt(remote, req->tag, msg);
+			break;
+	}
+	if (res < 0) {
+		free(req->record_id);
+		free(req);
+		return -1;
+	}
+	list_add_tail(&remote->requests, &req->node);
+	control_pending++;
+	cnt_control_requests++;
+	if (req->deadline && !timer_pending(&remote->request_timer)) {
+		timer_set_at(&remote->request_timer, req->deadline);
+	} else if (req->deadline) {
+		remote_control_arm(remote);
+	}
+	return 0;
+}
 
-	plist_t msg = create_plist_message("ReadBUID");
-	int res = remote_send_plist_pkt(remote, tag, msg);
-	plist_free(msg);
+static void remote_request_free(struct remote_request *req)
+{
+	list_del(&req->node);
+	control_pending--;
+	free(req->record_id);
+	free(req);
+}
 
-	if (res > 0) {
-		remote->last_command = REMOTE_CMD_READ_BUID;
-		remote->client = client;
-		return 0;
+static void remote_control_reply(struct remote_mux *remote, struct usbmuxd_header *hdr, char *payload, uint32_t payload_size, plist_t plist_msg)
+{
+	struct remote_request *req = NULL;
+	LIST_FOREACH(struct remote_request *r, &remote->requests, struct remote_request, node) {
+		if (r->tag == hdr->tag) {
+			req = r;
+			break;
+		}
+	} ENDFOREACH
+	if (!req) {
+		usbfluxd_log(LL_WARNING, "%s: Unexpected reply with tag %u on control fd %d", __func__, hdr->tag, remote->fd);
+		return;
+	}
+	char buf[300];
+	switch (req->command) {
+		case REMOTE_CMD_READ_BUID:
+			if (plist_msg && plist_dict_get_item(plist_msg, "BUID")) {
+				paircache_put(remote_cache_instance(remote->id, buf, sizeof(buf)), NULL, payload, payload_size, req->generation);
+			}
+			break;
+		case REMOTE_CMD_READ_PAIR_RECORD:
+			if (plist_msg && req->record_id && plist_dict_get_item(plist_msg, "PairRecordData")) {
+				paircache_put(remote_cache_instance(remote->id, buf, sizeof(buf)), req->record_id, payload, payload_size, req->generation);
+			}
+			break;
+		case REMOTE_CMD_SAVE_PAIR_RECORD:
+		case REMOTE_CMD_DELETE_PAIR_RECORD:
+			/* again, for reads that were answered while this was pending */
+			if (req->record_id)
+				paircache_invalidate(req->record_id);
+			break;
+		default:
+			break;
 	}
-	return -1;
+	if (req->client) {
+		hdr->tag = req->client_tag;
+		client_send_packet_data(req->client, hdr, payload, payload_size);
+	}
+	int had_deadline = (req->deadline != 0);
+	remote_request_free(req);
+	if (had_deadline)
+		remote_control_arm(remote);
+}
+
+/* the control connection is closed, its outstanding requests fail */
+static void remote_control_release(struct remote_mux *remote)
+{
+	if (!remote->is_control)
+		return;
+	if (remote_controls[remote->id] == remote)
+		remote_controls[remote->id] = NULL;
+	LIST_FOREACH(struct remote_request *req, &remote->requests, struct remote_request, node) {
+		struct mux_client *client = req->client;
+		uint32_t tag = req->client_tag;
+		remote_request_free(req);
+		if (client)
+			client_notify_result(client, tag, RESULT_BADDEV);
+	} ENDFOREACH
+}
+
+/* a client closed, replies to its outstanding requests are dropped */
+void usbmux_remote_forget_client(struct mux_client *client)
+{
+	int i;
+	if (control_pending == 0)
+		return;
+	for (i = 0; i < 256; i++) {
+		if (!remote_controls[i])
+			continue;
+		LIST_FOREACH(struct remote_request *req, &remote_controls[i]->requests, struct remote_request, node) {
+			if (req->client == client)
+				req->client = NULL;
+		} ENDFOREACH
+	}
+}
+
+int usbmux_remote_read_buid(uint32_t tag, struct mux_client *client)
+{
+	return remote_control_request(remote_id_for_buid(), REMOTE_CMD_READ_BUID, NULL, NULL, tag, client);
 }
 
 struct match_device_context {
@@ -362,160 +1090,66 @@ static int match_device(const char* key, const plist_t value, void *context)
 	return 0;
 }
 
-int usbmux_remote_read_pair_record(const char *record_id, uint32_t tag, struct mux_client *client)
+struct msgbuf *usbmux_remote_cached_pair_record(const char *record_id)
 {
+	char buf[300];
 	struct match_device_context matchctx = { record_id, 0 };
-	struct remote_mux *remote = NULL;
-	pthread_mutex_lock(&remote_list_mutex);
+	if (!record_id)
+		return NULL;
 	plist_dict_foreach(remote_device_list, match_device, &matchctx);
-	if (matchctx.device_id == 0) {
-		usbfluxd_log(LL_DEBUG, "%s: ReadPairRecord request for non-connected device %s. Forwardning to local usbmuxd.", __func__, record_id);
-		remote = remote_mux_new_with_unix_socket(USBMUXD_RENAMED_SOCKET);
-	} else {
-		uint8_t remote_mux_id = matchctx.device_id >> 24;
-		if (remote_mux_id == 0) {
-			remote = remote_mux_new_with_unix_socket(USBMUXD_RENAMED_SOCKET);
-		} else {
-			FOREACH(struct remote_mux *r, &remote_list) {
-				if (r->state == REMOTE_LISTEN && r->id == remote_mux_id) {
-					remote = remote_mux_new_with_host(r->host, r->port);
-					break;
-				}
-			} ENDFOREACH
-		}
-	}
-	if (remote) {
-		client_set_remote(client, remote);
-		collection_add(&remote_list, remote);
-	}
-	pthread_mutex_unlock(&remote_list_mutex);
-	if (!remote) {
-		usbfluxd_log(LL_ERROR, "%s: ERROR: Could not determine remote for device_id %d?!", __func__, matchctx.device_id);
-		return -1;
-	}
-
-	plist_t msg = create_plist_message("ReadPairRecord");
-	plist_dict_set_item(msg, "PairRecordID", plist_new_string(record_id));
-	int res = remote_send_plist_pkt(remote, tag, msg);
-	plist_free(msg);
-
-	if (res > 0) {
-		remote->last_command = REMOTE_CMD_READ_PAIR_RECORD;
-		remote->client = client;
-		return 0;
-	}
-	return -1;
+	return paircache_get(remote_cache_instance(matchctx.device_id >> 24, buf, sizeof(buf)), record_id);
 }
 
-int usbmux_remote_save_pair_record(const char *record_id, plist_t req_plist, uint32_t tag, struct mux_client *client)
+/* pair records are handled by the instance of the device, or the local one */
+static uint8_t remote_id_for_record(const char *record_id)
 {
 	struct match_device_context matchctx = { record_id, 0 };
-	struct remote_mux *remote = NULL;
-	pthread_mutex_lock(&remote_list_mutex);
 	plist_dict_foreach(remote_device_list, match_device, &matchctx);
 	if (matchctx.device_id == 0) {
-		usbfluxd_log(LL_DEBUG, "%s: SavePairRecord request for non-connected device %s. Forwarding to local usbmuxd.", __func__, record_id);
-		remote = remote_mux_new_with_unix_socket(USBMUXD_RENAMED_SOCKET);
-	} else {
-		uint8_t remote_mux_id = matchctx.device_id >> 24;
-		if (remote_mux_id == 0) {
-			remote = remote_mux_new_with_unix_socket(USBMUXD_RENAMED_SOCKET);
-		} else {
-			FOREACH(struct remote_mux *r, &remote_list) {
-				if (r->state == REMOTE_LISTEN && r->id == remote_mux_id) {
-					remote = remote_mux_new_with_host(r->host, r->port);
-					break;
-				}
-			} ENDFOREACH
-		}
-	}
-	if (remote) {
-		client_set_remote(client, remote);
-		collection_add(&remote_list, remote);
+		usbfluxd_log(LL_DEBUG, "%s: Pair record request for non-connected device %s. Forwarding to local usbmuxd.", __func__, record_id);
 	}
-	pthread_mutex_unlock(&remote_list_mutex);
-	if (!remote) {
-		usbfluxd_log(LL_ERROR, "%s: ERROR: Could not determine remote for device_id %d?!", __func__, matchctx.device_id);
-		return -1;
-	}
-
-	int res = remote_send_plist_pkt(remote, tag, req_plist);
-	if (res > 0) {
-		remote->last_command = REMOTE_CMD_SAVE_PAIR_RECORD;
-		remote->client = client;
-		return 0;
-	}
-	return -1;
+	return matchctx.device_id >> 24;
 }
 
-int usbmux_remote_delete_pair_record(const char *record_id, uint32_t tag, struct mux_client *client)
+int usbmux_remote_read_pair_record(const char *record_id, uint32_t tag, struct mux_client *client)
 {
-	struct match_device_context matchctx = { record_id, 0 };
-	struct remote_mux *remote = NULL;
-	pthread_mutex_lock(&remote_list_mutex);
-	plist_dict_foreach(remote_device_list, match_device, &matchctx);
-	if (matchctx.device_id == 0) {
-		usbfluxd_log(LL_DEBUG, "%s: DeletePairRecord request for non-connected device %s. Forwarding to local usbmuxd.", __func__, record_id);
-		remote = remote_mux_new_with_unix_socket(USBMUXD_RENAMED_SOCKET);
-	} else {
-		uint8_t remote_mux_id = matchctx.device_id >> 24;
-		if (remote_mux_id == 0) {
-			remote = remote_mux_new_with_unix_socket(USBMUXD_RENAMED_SOCKET);
-		} else {
-			FOREACH(struct remote_mux *r, &remote_list) {
-				if (r->state == REMOTE_LISTEN && r->id == remote_mux_id) {
-					remote = remote_mux_new_with_host(r->host, r->port);
-					break;
-				}
-			} ENDFOREACH
-		}
-	}
-	if (remote) {
-		client_set_remote(client, remote);
-		collection_add(&remote_list, remote);
-	}
-	pthread_mutex_unlock(&remote_list_mutex);
-	if (!remote) {
-		usbfluxd_log(LL_ERROR, "%s: ERROR: Could not determine remote for device_id %d?!", __func__, matchctx.device_id);
-		return -1;
-	}
+	return remote_control_request(remote_id_for_record(record_id), REMOTE_CMD_READ_PAIR_RECORD, NULL, record_id, tag, client);
+}
 
-	plist_t msg = create_plist_message("DeletePairRecord");
-	plist_dict_set_item(msg, "PairRecordID", plist_new_string(record_id));
-	int res = remote_send_plist_pkt(remote, tag, msg);
-	plist_free(msg);
+int usbmux_remote_save_pair_record(const char *record_id, plist_t req_plist, uint32_t tag, struct mux_client *client)
+{
+	paircache_invalidate(record_id);
+	return remote_control_request(remote_id_for_record(record_id), REMOTE_CMD_SAVE_PAIR_RECORD, req_plist, record_id, tag, client);
+}
 
-	if (res > 0) {
-		remote->last_command = REMOTE_CMD_DELETE_PAIR_RECORD;
-		remote->client = client;
-		return 0;
-	}
-	return -1;
+int usbmux_remote_delete_pair_record(const char *record_id, uint32_t tag, struct mux_client *client)
+{
+	paircache_invalidate(record_id);
+	return remote_control_request(remote_id_for_record(record_id), REMOTE_CMD_DELETE_PAIR_RECORD, NULL, record_id, tag, client);
 }
 
 static int remote_mux_service_add(const char *service_name, const char *host_name, uint16_t port)
 {
 	int res = -1;
 	struct remote_mux *remote = NULL;
-	pthread_mutex_lock(&remote_list_mutex);
-	FOREACH(struct remote_mux *r, &remote_list) {
+	LIST_FOREACH(struct remote_mux *r, &remote_list, struct remote_mux, node) {
 		if (!r->is_unix && r->is_listener && ((strcmp(r->service_name, service_name) == 0) || ((strcmp(r->host, host_name) == 0) && (r->port == port)))) {
 			remote = r;
 			break;
 		}
 	} ENDFOREACH
 	if (remote) {
-		pthread_mutex_unlock(&remote_list_mutex);
+		remote_reconnect_now(remote);
 		return -2;
 	}
 	remote = remote_mux_new_with_host(host_name, port);
 	if (remote) {
 		uint8_t new_remote_id = get_new_remote_id();
 		if (new_remote_id == 0) {
-			pthread_mutex_unlock(&remote_list_mutex);
 			usbfluxd_log(LL_ERROR, "%s: Too many remotes. Release others before adding more.", __func__);
 			close(remote->fd);
 			free(remote->host);
+			msgqueue_free(&remote->outq);
 			free(remote->ob_buf);
 			free(remote->ib_buf);
 			free(remote);
@@ -525,59 +1159,108 @@ static int remote_mux_service_add(const char *service_name, const char *host_nam
 		remote->id = new_remote_id;
 		remote->service_name = strdup(service_name);
 		remote->is_listener = 1;
-		collection_add(&remote_list, remote);
+		remote_link(remote);
 		set_remote_id_used(new_remote_id, 1);
+		remote_check_arm(remote);
 		remote_send_listen_packet(remote);
 		res = 0;
 	}
-	pthread_mutex_unlock(&remote_list_mutex);
 	return res;
 }
 
 static void remote_mark_dead(struct remote_mux *remote)
 {
 	/* mark as dead, and all others with same remote id */
-	remote->state = REMOTE_DEAD;
-	FOREACH(struct remote_mux *r, &remote_list) {
-		if (r->id == remote->id) {
-			r->state = REMOTE_DEAD;
-		}
-	} ENDFOREACH
-	/* pick the first remote found to trigger a dummy event so the deads are reaped in usbmux_remote_process */
-	struct remote_mux *rem = NULL;
-	FOREACH(struct remote_mux *r, &remote_list) {
-		if (r->state != REMOTE_DEAD) {
-			r->events |= POLLOUT;
-			rem = r;
-			break;
+	remote_set_state(remote, REMOTE_DEAD);
+	LIST_FOREACH(struct remote_mux *r, &remote_list, struct remote_mux, node) {
+		if (r->id == remote->id && r->state != REMOTE_DEAD) {
+			remote_set_state(r, REMOTE_DEAD);
 		}
 	} ENDFOREACH
-	if (!rem) {
-		/* only if no remote is left, do the cleanup here */
-		usbfluxd_log(LL_DEBUG, "%s: no remote left, reaping dead remotes", __func__);
-		FOREACH(struct remote_mux *r, &remote_list) {
-			usbmux_remote_dispose(r);
-		} ENDFOREACH
-	}
+	/* the dead remotes are reaped in usbmux_remote_get_fds */
 }
 
 static int remote_mux_service_remove(const char *service_name, const char *host_name, uint16_t port)
 {
 	int res = -1;
-	pthread_mutex_lock(&remote_list_mutex);
 	struct remote_mux *remote = NULL;
-	FOREACH(struct remote_mux *r, &remote_list) {
+	LIST_FOREACH(struct remote_mux *r, &remote_list, struct remote_mux, node) {
 		if (!r->is_unix && r->is_listener && ((service_name && (strcmp(r->service_name, service_name) == 0)) || (host_name && (strcmp(r->host, host_name) == 0) && (r->port == port)))) {
 			remote = r;
 			break;
 		}
-	} ENDFOREACH
-	if (remote) {
-		remote_mark_dead(remote);
-		res = 0;
+	} ENDFOREACH
+	if (remote) {
+		remote->removed = 1;
+		remote_mark_dead(remote);
+		res = 0;
+	}
+	return res;
+}
+
+enum remote_post_type {
+	POST_SERVICE_ADD,
+	POST_SERVICE_REMOVE
+};
+
+/* work posted to the main loop by other threads */
+struct remote_post {
+	struct cmdqueue_entry entry;
+	enum remote_post_type type;
+	char *service_name;
+	char *host;
+	uint16_t port;
+};
+
+static void remote_post_free(struct remote_post *post)
+{
+	free(post->service_name);
+	free(post->host);
+	free(post);
+}
+
+#if (defined HAVE_CFNETWORK) || (defined HAVE_AVAHI_CLIENT)
+static void remote_post_service(enum remote_post_type type, const char *service_name, const char *host_name, uint16_t port)
+{
+	struct remote_post *post = calloc(1, sizeof(struct remote_post));
+	if (!post) {
+		usbfluxd_log(LL_ERROR, "%s: Out of memory", __func__);
+		return;
+	}
+	post->type = type;
+	post->service_name = strdup(service_name);
+	post->host = (host_name) ? strdup(host_name) : NULL;
+	post->port = port;
+	cmdqueue_post(&remote_cmdq, &post->entry);
+}
+#endif
+
+static void remote_run_posted(void)
+{
+	struct cmdqueue_entry *entry = cmdqueue_take(&remote_cmdq);
+	while (entry) {
+		struct remote_post *post = (struct remote_post*)entry;
+		entry = entry->next;
+		switch (post->type) {
+			case POST_SERVICE_ADD: {
+				int res = remote_mux_service_add(post->service_name, post->host, post->port);
+				if (res == 0) {
+					usbfluxd_log(LL_NOTICE, "%s: Added service %s", __func__, post->service_name);
+				} else if (res == -2) {
+					usbfluxd_log(LL_DEBUG, "%s: Remote service %s (%s:%d) is already present. Not adding.", __func__, post->service_name, post->host, post->port);
+				} else {
+					usbfluxd_log(LL_ERROR, "%s: Failed to add remote service %s (%s:%d)", __func__, post->service_name, post->host, post->port);
+				}
+				break; }
+			case POST_SERVICE_REMOVE: {
+				int res = remote_mux_service_remove(post->service_name, NULL, 0);
+				usbfluxd_log(LL_NOTICE, "%s: Removed service %s (%d)", __func__, post->service_name, res);
+				break; }
+			default:
+				break;
+		}
+		remote_post_free(post);
 	}
-	pthread_mutex_unlock(&remote_list_mutex);
-	return res;
 }
 
 #ifdef HAVE_CFNETWORK
@@ -682,8 +1365,7 @@ static void service_browse_cb(CFNetServiceBrowserRef browser, CFOptionFlags flag
 				}
 				service_name[0] = '\0';
 				CFStringGetCString(cf_service, service_name, len+1, kCFStringEncodingASCII);
-				int res = remote_mux_service_remove(service_name, NULL, 0);
-				usbfluxd_log(LL_NOTICE, "%s: Removed service %s (%d)", __func__, service_name, res);
+				remote_post_service(POST_SERVICE_REMOVE, service_name, NULL, 0);
 				free(service_name);
 			}
 		} else {
@@ -713,14 +1395,7 @@ static void service_browse_cb(CFNetServiceBrowserRef browser, CFOptionFlags flag
 				}
 				service_name[0] = '\0';
 				CFStringGetCString(cf_service, service_name, len+1, kCFStringEncodingASCII);
-				int res = remote_mux_service_add(service_name, host_name, port);
-				if (res == 0) {
-					usbfluxd_log(LL_NOTICE, "%s: Added service %s", __func__, service_name);
-				} else if (res == -2) {
-					usbfluxd_log(LL_DEBUG, "%s: Remote service %s is already present.", __func__, service_name);
-				} else {
-					usbfluxd_log(LL_ERROR, "%s: Failed to add remote service %s (%s:%d)", __func__, service_name, host_name, port);
-				}
+				remote_post_service(POST_SERVICE_ADD, service_name, host_name, port);
 				free(service_name);
 				free(host_name);
 			}
@@ -740,16 +1415,9 @@ static void service_resolve_cb(AvahiServiceResolver *r, AVAHI_GCC_UNUSED AvahiIf
 		case AVAHI_RESOLVER_FAILURE:
 			usbfluxd_log(LL_ERROR, "[avahi] Failed to resolve service '%s' of type '%s' in domain '%s': %s", service_name, type, domain, avahi_strerror(avahi_client_errno(avahi_service_resolver_get_client(r))));
 			break;
-		case AVAHI_RESOLVER_FOUND: {
-			int res = remote_mux_service_add(service_name, host_name, port);
-			if (res == 0) {
-				usbfluxd_log(LL_NOTICE, "%s: Added service %s", __func__, service_name);
-			} else if (res == -2) {
-				usbfluxd_log(LL_DEBUG, "%s: Remote service %s (%s:%d) is already present. Not adding.", __func__, service_name, host_name, port);
-			} else {
-				usbfluxd_log(LL_ERROR, "%s: Failed to add remote service %s (%s:%d)", __func__, service_name, host_name, port);
-			}
-			break; }
+		case AVAHI_RESOLVER_FOUND:
+			remote_post_service(POST_SERVICE_ADD, service_name, host_name, port);
+			break;
 		default:
 			break;
 	}
@@ -771,11 +1439,10 @@ static void service_browse_cb(AvahiServiceBrowser *b, AvahiIfIndex interface, Av
 			if (!(avahi_service_resolver_new(c, interface, protocol, service_name, type, domain, AVAHI_PROTO_UNSPEC, 0, service_resolve_cb, c)))
 				usbfluxd_log(LL_ERROR, "[avahi] Failed to resolve service '%s': %s", service_name, avahi_strerror(avahi_client_errno(c)));
 			break;
-		case AVAHI_BROWSER_REMOVE: {
+		case AVAHI_BROWSER_REMOVE:
 			usbfluxd_log(LL_DEBUG, "[avahi] REMOVE: service '%s' of type '%s' in domain '%s'", service_name, type, domain);
-			int res = remote_mux_service_remove(service_name, NULL, 0);
-			usbfluxd_log(LL_NOTICE, "%s: Removed service %s (%d)", __func__, service_name, res);
-			break; }
+			remote_post_service(POST_SERVICE_REMOVE, service_name, NULL, 0);
+			break;
 		case AVAHI_BROWSER_ALL_FOR_NOW:
 		case AVAHI_BROWSER_CACHE_EXHAUSTED:
 			usbfluxd_log(LL_DEBUG, "[avahi] Browser: %s", event == AVAHI_BROWSER_CACHE_EXHAUSTED ? "CACHE_EXHAUSTED" : "ALL_FOR_NOW");
@@ -877,9 +1544,12 @@ void usbmux_remote_init(int no_mdns)
 {
 	usbfluxd_log(LL_DEBUG, "%s", __func__);
 
-	collection_init(&remote_list);
+	remote_lists_init();
+	srandom((unsigned int)(getpid() ^ mstime64()));
+	if (cmdqueue_init(&remote_cmdq) < 0) {
+		usbfluxd_log(LL_ERROR, "%s: Could not create command queue, mDNS will not work", __func__);
+	}
 	pthread_mutex_init(&gethostbyname_mutex, NULL);
-	pthread_mutex_init(&remote_list_mutex, NULL);
 	remote_device_list = plist_new_dict();
 	memset(&remote_id_map, '\0', sizeof(remote_id_map));
 
@@ -887,13 +1557,12 @@ void usbmux_remote_init(int no_mdns)
 
 	struct remote_mux *remote = remote_mux_new_with_unix_socket(USBMUXD_RENAMED_SOCKET);
 	if (remote) {
-		pthread_mutex_lock(&remote_list_mutex);
 		remote->id = 0;
 		remote->is_listener = 1;
-		collection_add(&remote_list, remote);
+		remote_link(remote);
 		set_remote_id_used(0, 1);
+		remote_check_arm(remote);
 		remote_send_listen_packet(remote);
-		pthread_mutex_unlock(&remote_list_mutex);
 	}
 
 #if (defined HAVE_CFNETWORK) || (defined HAVE_AVAHI_CLIENT)
@@ -924,14 +1593,22 @@ void usbmux_remote_shutdown(void)
 		pthread_join(th_mdns_mon, NULL);
 #endif /* HAVE_AVAHI_CLIENT */
 	}
-	pthread_mutex_lock(&remote_list_mutex);
-	FOREACH(struct remote_mux *remote, &remote_list) {
+	struct cmdqueue_entry *entry = cmdqueue_take(&remote_cmdq);
+	while (entry) {
+		struct remote_post *post = (struct remote_post*)entry;
+		entry = entry->next;
+		remote_post_free(post);
+	}
+	cmdqueue_free(&remote_cmdq);
+	LIST_FOREACH(struct remote_connect_wait *wait, &admit_queue, struct remote_connect_wait, node) {
+		remote_connect_wait_free(wait);
+	} ENDFOREACH
+	timer_cancel(&admit_timer);
+	LIST_FOREACH(struct remote_mux *remote, &remote_list, struct remote_mux, node) {
 		usbmux_remote_dispose(remote);
 	} ENDFOREACH
-	pthread_mutex_unlock(&remote_list_mutex);
-	pthread_mutex_destroy(&remote_list_mutex);
 	pthread_mutex_destroy(&gethostbyname_mutex);
-	collection_free(&remote_list);
+	fdtable_free(&remote_fds);
 	plist_free(remote_device_list);
 	remote_device_list = NULL;
 }
@@ -946,12 +1623,21 @@ static void remote_close(struct remote_mux *remote)
 		device_abort_connect(client->connect_device, client);
 	}
 #endif /* 0 */
-	close(remote->fd);
+	if (remote->fd >= 0)
+		close(remote->fd);
 
-	collection_remove(&remote_list, remote);
+	remote_unlink(remote);
 
 	free(remote->host);	
 	free(remote->service_name);
+	remote_probe_stop(remote);
+	remote_beat_stop(remote);
+	timer_cancel(&remote->check_timer);
+	timer_cancel(&remote->reconnect_timer);
+	timer_cancel(&remote->request_timer);
+	remote_control_release(remote);
+	free(remote->resync_ids);
+	msgqueue_free(&remote->outq);
 	free(remote->ob_buf);
 	free(remote->ib_buf);
 	free(remote);
@@ -964,31 +1650,64 @@ void usbmux_remote_close(struct remote_mux *remote)
 	if (client) {
 		client_notify_remote_close(client);
 	} else {
-		pthread_mutex_lock(&remote_list_mutex);
 		remote_close(remote);
-		pthread_mutex_unlock(&remote_list_mutex);
 	}
 }
 
-static int remote_device_notify_remove(const char* key, const plist_t value, void *context)
+struct remote_ids_context {
+	uint8_t id;
+	uint32_t *ids;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+static int remote_device_collect(const char* key, const plist_t value, void *context)
 {
-	struct remote_mux *remote = (struct remote_mux*)context;
+	struct remote_ids_context *ctx = (struct remote_ids_context*)context;
 	uint32_t val = strtol(key, NULL, 16);
-	if ((val >> 24) == remote->id) {
-		client_device_remove(val);
-		plist_dict_remove_item(remote_device_list, key); // TODO: verify if this is safe
+	if ((val >> 24) == ctx->id) {
+		if (ctx->count == ctx->capacity) {
+			ctx->capacity = (ctx->capacity) ? ctx->capacity * 2 : 16;
+			ctx->ids = realloc(ctx->ids, ctx->capacity * sizeof(uint32_t));
+		}
+		ctx->ids[ctx->count++] = val;
 	}
 	return 0;
 }
 
+static void remote_device_detach(uint32_t devid)
+{
+	char s_devid[16];
+	snprintf(s_devid, sizeof(s_devid), "0x%08x", devid);
+	USBFLUXD_PROBE2(device_detach, devid >> 24, devid);
+	plist_dict_remove_item(remote_device_list, s_devid);
+	client_device_remove(devid);
+}
+
+/* The ids are collected first, items must not be removed while
+ * plist_dict_foreach iterates. */
+static void remote_device_detach_all(struct remote_mux *remote)
+{
+	uint32_t i;
+	struct remote_ids_context ctx = { remote->id, NULL, 0, 0 };
+	plist_dict_foreach(remote_device_list, remote_device_collect, &ctx);
+	for (i = 0; i < ctx.count; i++) {
+		remote_device_detach(ctx.ids[i]);
+	}
+	free(ctx.ids);
+}
+
 void usbmux_remote_dispose(struct remote_mux *remote)
 {
 	usbfluxd_log(LL_INFO, "%s: Disconnecting remote fd %d", __func__, remote->fd);
 
-	close(remote->fd);
+	if (remote->fd >= 0)
+		close(remote->fd);
 
-	plist_dict_foreach(remote_device_list, remote_device_notify_remove, (void*)remote);
-	collection_remove(&remote_list, remote);
+	/* the devices of an instance belong to its listener */
+	if (remote->is_listener)
+		remote_device_detach_all(remote);
+	remote_unlink(remote);
 	if (remote->client) {
 #if defined(HAVE_CLIENT_CLEAR_REMOTE) || defined(CLIENT_H)
 		client_clear_remote(remote->client);
@@ -1005,6 +1724,14 @@ void usbmux_remote_dispose(struct remote_mux *remote)
 
 	free(remote->host);
 	free(remote->service_name);
+	remote_probe_stop(remote);
+	remote_beat_stop(remote);
+	timer_cancel(&remote->check_timer);
+	timer_cancel(&remote->reconnect_timer);
+	timer_cancel(&remote->request_timer);
+	remote_control_release(remote);
+	free(remote->resync_ids);
+	msgqueue_free(&remote->outq);
 	free(remote->ob_buf);
 	free(remote->ib_buf);
 	free(remote);
@@ -1012,51 +1739,601 @@ void usbmux_remote_dispose(struct remote_mux *remote)
 
 static void usbmux_remote_mark_dead(struct remote_mux *remote)
 {
-	pthread_mutex_lock(&remote_list_mutex);
 	usbfluxd_log(LL_DEBUG, "%s: %p", __func__, (void *)remote);
-	remote_mark_dead(remote);
-	pthread_mutex_unlock(&remote_list_mutex);
+	if (!remote->is_listener || remote_can_reconnect(remote)) {
+		/* a failed session or control connection goes alone, the
+		 * listener keeps the instance, and sessions stay up while the
+		 * listener reconnects */
+		remote_set_state(remote, REMOTE_DEAD);
+	} else {
+		remote_mark_dead(remote);
+	}
 }
 
 void usbmux_remote_notify_client_close(struct remote_mux *remote)
 {
-	pthread_mutex_lock(&remote_list_mutex);
 	remote_close(remote);
-	pthread_mutex_unlock(&remote_list_mutex);
 }
 
-void *check_remote_func(void *data)
+/**
+ * Set how long a TCP listener that lost its connection keeps its remote id
+ * and devices while it is reconnected. 0 disposes it right away, which
+ * detaches all of its devices.
+ */
+void usbmux_remote_set_reconnect_grace(uint32_t grace_ms)
+{
+	reconnect_grace = grace_ms;
+}
+
+static int remote_can_reconnect(struct remote_mux *remote)
+{
+	return (reconnect_grace > 0 && remote->is_listener && !remote->is_unix && remote->host && remote->addrlen > 0 && !remote->removed);
+}
+
+static void remote_reconnect_close(struct remote_mux *remote)
+{
+	if (remote->fd >= 0) {
+		fdtable_clear(&remote_fds, remote->fd, remote);
+		close(remote->fd);
+		remote->fd = -1;
+	}
+	remote->events = 0;
+}
+
+/* exponential backoff with equal jitter, up to the end of the grace period */
+static void remote_reconnect_schedule(struct remote_mux *remote)
+{
+	uint64_t delay = REMOTE_RECONNECT_MAX_MS;
+	if (remote->reconnect_attempts < 16 && ((uint64_t)REMOTE_RECONNECT_MIN_MS << remote->reconnect_attempts) < delay) {
+		delay = (uint64_t)REMOTE_RECONNECT_MIN_MS << remote->reconnect_attempts;
+	}
+	remote->reconnect_attempts++;
+	delay = delay / 2 + random() % (delay / 2 + 1);
+	uint64_t deadline = remote->lost_at + reconnect_grace;
+	uint64_t now = timer_now();
+	if (now + delay > deadline) {
+		delay = (deadline > now) ? deadline - now : 0;
+	}
+	timer_set(&remote->reconnect_timer, delay);
+}
+
+/* Keep a listener that lost its connection with its id and devices, so
+ * clients do not see its devices go away, and reconnect it. */
+static void remote_suspend(struct remote_mux *remote)
+{
+	if (remote->lost_at == 0) {
+		remote->lost_at = timer_now();
+		remote->reconnect_attempts = 0;
+		usbfluxd_log(LL_NOTICE, "%s: Lost connection to %s:%d, reconnecting for up to %u ms", __func__, remote->host, remote->port, reconnect_grace);
+	}
+	remote_reconnect_close(remote);
+	remote_probe_stop(remote);
+	remote_beat_stop(remote);
+	remote->hb.pending = 0;
+	remote->hb.missed = 0;
+	timer_cancel(&remote->check_timer);
+	msgqueue_clear(&remote->outq);
+	remote->ib_size = 0;
+	remote->ob_size = 0;
+	remote->last_command = -1;
+	remote_set_state(remote, REMOTE_RECONNECTING);
+	remote_reconnect_schedule(remote);
+}
+
+/* A listener added again by mDNS or on request is retried right away. */
+static void remote_reconnect_now(struct remote_mux *remote)
+{
+	if (remote->state == REMOTE_RECONNECTING && remote->fd < 0) {
+		remote->reconnect_attempts = 0;
+		timer_set(&remote->reconnect_timer, 0);
+	}
+}
+
+/**
+ * A remote connection failed or was found dead. Listeners keep their id and
+ * devices and are reconnected for the grace period, anything else is
+ * disposed.
+ */
+static void remote_lost(struct remote_mux *remote)
 {
-	struct remote_mux *remote = (struct remote_mux*)data;
-	struct timeval timeout = { 2, 0 };
-	int openfd = remote->fd;
-	int checkfd = socket_connect_timeout(remote->host, remote->port, &timeout);
-	if (checkfd < 0) {
-		socket_close(openfd);
+	if (remote->is_control) {
+		/* the devices belong to the listener of the instance, only the
+		 * pending requests fail */
+		remote_close(remote);
+	} else if (remote_can_reconnect(remote)) {
+		remote_suspend(remote);
+	} else if (remote->is_listener) {
+		/* the control connection and the sessions of the id are reaped
+		 * with it, before the id is given to another instance */
+		remote_mark_dead(remote);
+		usbmux_remote_dispose(remote);
 	} else {
-		socket_close(checkfd);
+		usbmux_remote_dispose(remote);
 	}
-	return NULL;
 }
 
-void usbmux_remote_get_fds(struct fdlist *list)
+static void remote_reconnect_process(struct remote_mux *remote, short events)
 {
-	pthread_mutex_lock(&remote_list_mutex);
-	uint64_t now = mstime64();
-	FOREACH(struct remote_mux *remote, &remote_list) {
-		/* check if any remotes became unavailable due to network error */
-		if (!remote->is_unix && (now - remote->last_active) > 10000) {
-			if (remote->host && remote->port) {
-				pthread_t th;
-				if (pthread_create(&th, NULL, check_remote_func, remote) != 0) {
-					usbfluxd_log(LL_ERROR, "%s: Failed to create thread to check remote", __func__);
-				}
+	int err = 0;
+	socklen_t errlen = sizeof(err);
+	if (getsockopt(remote->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) {
+		err = errno;
+	} else if (err == 0 && !(events & POLLOUT)) {
+		err = ECONNABORTED;
+	}
+	if (err) {
+		usbfluxd_log(LL_INFO, "%s: Reconnecting to %s:%d failed: %s", __func__, remote->host, remote->port, strerror(err));
+		remote_reconnect_close(remote);
+		remote_reconnect_schedule(remote);
+		return;
+	}
+	cnt_reconnects++;
+	usbfluxd_log(LL_NOTICE, "%s: Reconnected to %s:%d, remote fd %d", __func__, remote->host, remote->port, remote->fd);
+	remote_breaker_result(remote, 1);
+	socket_set_keepalive(remote->fd, REMOTE_KEEPALIVE_IDLE, REMOTE_KEEPALIVE_INTVL, REMOTE_KEEPALIVE_CNT);
+	remote->events = POLLIN;
+	remote_set_state(remote, REMOTE_COMMAND);
+	remote->last_active = timer_now();
+	timer_set(&remote->check_timer, remote_check_delay());
+	/* the timeout for the Listen reply */
+	timer_set(&remote->reconnect_timer, REMOTE_CONNECT_TIMEOUT_MS);
+	remote_send_listen_packet(remote);
+}
+
+/* After a reconnect the remote announces its devices again. Devices that
+ * are not announced within REMOTE_RESYNC_MS are gone, the others were never
+ * detached for the clients. */
+static void remote_resync_start(struct remote_mux *remote)
+{
+	struct remote_ids_context ctx = { remote->id, NULL, 0, 0 };
+	plist_dict_foreach(remote_device_list, remote_device_collect, &ctx);
+	free(remote->resync_ids);
+	remote->resync_ids = ctx.ids;
+	remote->resync_count = ctx.count;
+	usbfluxd_log(LL_NOTICE, "%s: %s:%d is back after %llu ms, resynchronizing %u devices", __func__, remote->host, remote->port, (unsigned long long)(timer_now() - remote->lost_at), ctx.count);
+	remote->lost_at = 0;
+	remote->reconnect_attempts = 0;
+	timer_set(&remote->reconnect_timer, REMOTE_RESYNC_MS);
+}
+
+/* returns 1 if the device was known before the reconnect */
+static int remote_resync_confirm(struct remote_mux *remote, uint32_t devid)
+{
+	uint32_t i;
+	for (i = 0; i < remote->resync_count; i++) {
+		if (remote->resync_ids[i] == devid) {
+			remote->resync_ids[i] = remote->resync_ids[--remote->resync_count];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void remote_resync_finish(struct remote_mux *remote)
+{
+	uint32_t i;
+	if (remote->resync_count > 0) {
+		usbfluxd_log(LL_INFO, "%s: %u devices of %s:%d are gone", __func__, remote->resync_count, remote->host, remote->port);
+	}
+	for (i = 0; i < remote->resync_count; i++) {
+		remote_device_detach(remote->resync_ids[i]);
+	}
+	cnt_resync_removed += remote->resync_count;
+	free(remote->resync_ids);
+	remote->resync_ids = NULL;
+	remote->resync_count = 0;
+}
+
+/* Depending on the state: the next reconnect attempt or its timeout, the
+ * timeout for the Listen reply, or the end of the device resync. */
+static void remote_reconnect_timer_cb(struct timer *timer)
+{
+	struct remote_mux *remote = list_entry(timer, struct remote_mux, reconnect_timer);
+	if (remote->state == REMOTE_LISTEN) {
+		remote_resync_finish(remote);
+		return;
+	}
+	if (remote->state != REMOTE_RECONNECTING) {
+		usbfluxd_log(LL_NOTICE, "%s: %s:%d did not answer Listen", __func__, remote->host, remote->port);
+		usbmux_remote_mark_dead(remote);
+		return;
+	}
+	if (remote->fd >= 0) {
+		usbfluxd_log(LL_INFO, "%s: Reconnecting to %s:%d timed out", __func__, remote->host, remote->port);
+		remote_reconnect_close(remote);
+	}
+	if (timer_now() - remote->lost_at >= reconnect_grace) {
+		cnt_reconnects_expired++;
+		usbfluxd_log(LL_NOTICE, "%s: %s:%d did not come back within %u ms", __func__, remote->host, remote->port, reconnect_grace);
+		remote->removed = 1;
+		remote_mark_dead(remote);
+		return;
+	}
+	int fd = socket_connect_addr_nonblock((struct sockaddr*)&remote->addr, remote->addrlen);
+	if (fd < 0) {
+		usbfluxd_log(LL_INFO, "%s: Reconnecting to %s:%d failed: %s", __func__, remote->host, remote->port, strerror(errno));
+		remote_reconnect_schedule(remote);
+		return;
+	}
+	if (fdtable_set(&remote_fds, fd, remote) < 0) {
+		close(fd);
+		remote_reconnect_schedule(remote);
+		return;
+	}
+	remote->fd = fd;
+	remote->events = POLLOUT;
+	timer_set(timer, REMOTE_CONNECT_TIMEOUT_MS);
+}
+
+/* token bucket refilled with REMOTE_PROBE_RATE tokens per second */
+static int remote_probe_admit(uint64_t now)
+{
+	if (probes_in_flight >= REMOTE_PROBES_MAX) {
+		return 0;
+	}
+	uint64_t refill = (now - probe_refill_time) * REMOTE_PROBE_RATE / 1000;
+	if (refill > 0) {
+		probe_tokens = (probe_tokens + refill > REMOTE_PROBE_RATE) ? REMOTE_PROBE_RATE : probe_tokens + refill;
+		probe_refill_time = now;
+	}
+	if (probe_tokens == 0) {
+		return 0;
+	}
+	probe_tokens--;
+	return 1;
+}
+
+static void remote_probe_stop(struct remote_mux *remote)
+{
+	if (remote->probe_fd < 0)
+		return;
+	fdtable_clear(&remote_fds, remote->probe_fd, remote);
+	close(remote->probe_fd);
+	remote->probe_fd = -1;
+	probes_in_flight--;
+}
+
+static void remote_probe_done(struct remote_mux *remote, int err)
+{
+	remote_probe_stop(remote);
+	timer_cancel(&remote->check_timer);
+	if (err) {
+		cnt_probe_failures++;
+		usbfluxd_log(LL_NOTICE, "%s: %s:%d is not reachable (%s), closing remote fd %d", __func__, remote->host, remote->port, strerror(err), remote->fd);
+		remote_lost(remote);
+		return;
+	}
+	remote->last_active = timer_now();
+	timer_set(&remote->check_timer, remote_check_delay());
+}
+
+static void remote_probe_start(struct remote_mux *remote)
+{
+	cnt_probes++;
+	int pfd = socket_connect_peer_nonblock(remote->fd);
+	if (pfd < 0) {
+		remote_probe_done(remote, errno);
+		return;
+	}
+	if (fdtable_set(&remote_fds, pfd, remote) < 0) {
+		close(pfd);
+		remote_probe_done(remote, 0);
+		return;
+	}
+	remote->probe_fd = pfd;
+	probes_in_flight++;
+	timer_set(&remote->check_timer, REMOTE_PROBE_TIMEOUT_MS);
+}
+
+/* The probe connects to the address of the remote again. It completes
+ * when the probe fd turns writable, with the result in SO_ERROR. */
+static void remote_probe_process(struct remote_mux *remote, short events)
+{
+	int err = 0;
+	socklen_t errlen = sizeof(err);
+	if (getsockopt(remote->probe_fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) {
+		err = errno;
+	} else if (err == 0 && !(events & POLLOUT)) {
+		err = ECONNABORTED;
+	}
+	remote_probe_done(remote, err);
+}
+
+/* Probe that a TCP listener which has been idle for REMOTE_CHECK_MS is still
+ * reachable. While a probe is in flight the timer is its timeout. */
+static void remote_check_timer_cb(struct timer *timer)
+{
+	struct remote_mux *remote = list_entry(timer, struct remote_mux, check_timer);
+	uint64_t now = timer_now();
+	if (remote->probe_fd >= 0) {
+		remote_probe_done(remote, ETIMEDOUT);
+		return;
+	}
+	if (now - remote->last_active < REMOTE_CHECK_MS) {
+		timer_set_at(timer, remote->last_active + remote_check_delay());
+		return;
+	}
+	if (!remote_probe_admit(now)) {
+		cnt_probes_deferred++;
+		timer_set(timer, REMOTE_PROBE_DEFER_MS + random() % REMOTE_PROBE_DEFER_MS);
+		return;
+	}
+	remote_probe_start(remote);
+}
+
+/**
+ * Configure the heartbeat of TCP listeners. Every interval_ms a ListDevices
+ * request is sent on a separate command connection to the remote, since
+ * usbmuxd does not take commands on a listening connection. A listener
+ * that missed a beat counts as degraded and is closed after max_missed
+ * beats in a row went unanswered. An interval of 0 disables the heartbeat.
+ */
+void usbmux_remote_set_heartbeat(uint32_t interval_ms, uint32_t max_missed)
+{
+	beat_interval = interval_ms;
+	if (max_missed > 0)
+		beat_max_missed = max_missed;
+}
+
+static void remote_beat_close(struct remote_mux *remote)
+{
+	struct remote_heartbeat *hb = &remote->hb;
+	if (hb->fd < 0)
+		return;
+	fdtable_clear(&remote_fds, hb->fd, remote);
+	close(hb->fd);
+	hb->fd = -1;
+	hb->connecting = 0;
+	hb->hdr_size = 0;
+	hb->skip = 0;
+}
+
+static void remote_beat_stop(struct remote_mux *remote)
+{
+	remote_beat_close(remote);
+	timer_cancel(&remote->hb.timer);
+}
+
+static void remote_beat_send(struct remote_mux *remote)
+{
+	struct remote_heartbeat *hb = &remote->hb;
+	struct usbmuxd_header hdr;
+	hdr.length = sizeof(hdr) + PLISTFMT_LEN(list_devices_request);
+	hdr.version = 1;
+	hdr.message = MESSAGE_PLIST;
+	hdr.tag = ++hb->tag;
+	struct iovec iov[2] = { { &hdr, sizeof(hdr) }, { (void*)list_devices_request, PLISTFMT_LEN(list_devices_request) } };
+	hb->sent = ustime64();
+	ssize_t sent = writev(hb->fd, iov, 2);
+	if (sent != (ssize_t)hdr.length) {
+		usbfluxd_log(LL_INFO, "%s: Could not send heartbeat to %s:%d: %s", __func__, remote->host, remote->port, (sent < 0) ? strerror(errno) : "short write");
+		remote_beat_close(remote);
+	}
+}
+
+static void remote_beat_answered(struct remote_mux *remote)
+{
+	struct remote_heartbeat *hb = &remote->hb;
+	uint64_t rtt = ustime64() - hb->sent;
+
+	/* smoothed like the TCP retransmission timer, RFC 6298 */
+	if (hb->answered == 0) {
+		hb->srtt = rtt;
+		hb->rttvar = rtt / 2;
+	} else {
+		uint64_t delta = (rtt > hb->srtt) ? rtt - hb->srtt : hb->srtt - rtt;
+		hb->rttvar = (3 * hb->rttvar + delta) / 4;
+		hb->srtt = (7 * hb->srtt + rtt) / 8;
+	}
+	hb->last_rtt = rtt;
+	hb->answered++;
+	hb->pending = 0;
+	cnt_beats++;
+	if (hb->missed > 0) {
+		usbfluxd_log(LL_NOTICE, "%s: %s:%d is responding again after %u missed heartbeats, RTT %llu us", __func__, remote->host, remote->port, hb->missed, (unsigned long long)rtt);
+		hb->missed = 0;
+	}
+	remote->last_active = timer_now();
+}
+
+static void remote_beat_process(struct remote_mux *remote, short events)
+{
+	struct remote_heartbeat *hb = &remote->hb;
+	if (hb->connecting) {
+		int err = 0;
+		socklen_t errlen = sizeof(err);
+		if (getsockopt(hb->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) {
+			err = errno;
+		} else if (err == 0 && !(events & POLLOUT)) {
+			err = ECONNABORTED;
+		}
+		if (err) {
+			usbfluxd_log(LL_INFO, "%s: Heartbeat connection to %s:%d failed: %s", __func__, remote->host, remote->port, strerror(err));
+			remote_beat_close(remote);
+			return;
+		}
+		hb->connecting = 0;
+		remote_beat_send(remote);
+		return;
+	}
+	/* only the header of the reply is of interest */
+	while (hb->fd >= 0) {
+		ssize_t r;
+		if (hb->hdr_size < sizeof(hb->hdr)) {
+			r = recv(hb->fd, (char*)&hb->hdr + hb->hdr_size, sizeof(hb->hdr) - hb->hdr_size, 0);
+		} else {
+			char buf[4096];
+			r = recv(hb->fd, buf, (hb->skip < sizeof(buf)) ? hb->skip : sizeof(buf), 0);
+		}
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			return;
+		}
+		if (r <= 0) {
+			usbfluxd_log(LL_INFO, "%s: Heartbeat connection to %s:%d closed: %s", __func__, remote->host, remote->port, (r < 0) ? strerror(errno) : "EOF");
+			remote_beat_close(remote);
+			return;
+		}
+		if (hb->hdr_size < sizeof(hb->hdr)) {
+			hb->hdr_size += r;
+			if (hb->hdr_size < sizeof(hb->hdr))
+				continue;
+			if (hb->hdr.length < sizeof(hb->hdr)) {
+				usbfluxd_log(LL_ERROR, "%s: Invalid heartbeat reply length %u from %s:%d", __func__, hb->hdr.length, remote->host, remote->port);
+				remote_beat_close(remote);
+				return;
 			}
-			remote->last_active = now;
+			hb->skip = hb->hdr.length - sizeof(hb->hdr);
+		} else {
+			hb->skip -= r;
+		}
+		if (hb->skip == 0) {
+			hb->hdr_size = 0;
+			if (hb->pending && hb->hdr.tag == hb->tag)
+				remote_beat_answered(remote);
+		}
+	}
+}
+
+/* Send the next heartbeat unless the last one is still unanswered, which
+ * counts as a missed beat. */
+static void remote_beat_timer_cb(struct timer *timer)
+{
+	struct remote_mux *remote = list_entry(timer, struct remote_mux, hb.timer);
+	struct remote_heartbeat *hb = &remote->hb;
+	if (hb->pending) {
+		hb->missed++;
+		cnt_beats_missed++;
+		if (hb->missed >= beat_max_missed) {
+			usbfluxd_log(LL_NOTICE, "%s: %s:%d missed %u heartbeats, closing remote fd %d", __func__, remote->host, remote->port, hb->missed, remote->fd);
+			remote_lost(remote);
+			return;
+		}
+		if (hb->missed == 1) {
+			usbfluxd_log(LL_WARNING, "%s: %s:%d is degraded, heartbeat not answered within %u ms", __func__, remote->host, remote->port, beat_interval);
+		}
+	}
+	timer_set(timer, beat_interval);
+	if (hb->fd < 0) {
+		hb->pending = 1;
+		int fd = socket_connect_peer_nonblock(remote->fd);
+		if (fd < 0) {
+			usbfluxd_log(LL_INFO, "%s: Heartbeat connection to %s:%d failed: %s", __func__, remote->host, remote->port, strerror(errno));
+			return;
+		}
+		if (fdtable_set(&remote_fds, fd, remote) < 0) {
+			close(fd);
+			return;
 		}
-		fdlist_add(list, FD_REMOTE, remote->fd, remote->events);
+		hb->fd = fd;
+		hb->connecting = 1;
+	} else if (!hb->pending) {
+		hb->pending = 1;
+		remote_beat_send(remote);
+	}
+}
+
+void usbmux_remote_get_fds(struct fdlist *list)
+{
+	/* reap remotes marked dead since the last iteration */
+	LIST_FOREACH(struct remote_mux *remote, &remote_states[REMOTE_DEAD], struct remote_mux, state_node) {
+		remote_lost(remote);
+	} ENDFOREACH
+	LIST_FOREACH(struct remote_mux *remote, &remote_list, struct remote_mux, node) {
+		if (remote->fd >= 0)
+			fdlist_add(list, FD_REMOTE, remote->fd, remote->events);
+		if (remote->probe_fd >= 0)
+			fdlist_add(list, FD_REMOTE, remote->probe_fd, POLLOUT);
+		if (remote->hb.fd >= 0)
+			fdlist_add(list, FD_REMOTE, remote->hb.fd, (remote->hb.connecting) ? POLLOUT : POLLIN);
 	} ENDFOREACH
-	pthread_mutex_unlock(&remote_list_mutex);
+	if (remote_cmdq.fd >= 0)
+		fdlist_add(list, FD_REMOTE, remote_cmdq.fd, POLLIN);
+}
+
+static const char *remote_state_name(enum remote_state state)
+{
+	switch (state) {
+		case REMOTE_COMMAND:
+			return "COMMAND";
+		case REMOTE_LISTEN:
+			return "LISTEN";
+		case REMOTE_CONNECTING1:
+			return "CONNECTING1";
+		case REMOTE_CONNECTING2:
+			return "CONNECTING2";
+		case REMOTE_CONNECTED:
+			return "CONNECTED";
+		case REMOTE_RECONNECTING:
+			return "RECONNECTING";
+		case REMOTE_DEAD:
+			return "DEAD";
+		default:
+			return "UNKNOWN";
+	}
+}
+
+/**
+ * Record what identifies the remote connection that owns the given fd.
+ *
+ * @param fd The remote socket fd.
+ * @param ident Receives the remote id, state and which of its fds it is.
+ * @return 0 on success, -1 if no remote with that fd exists.
+ */
+int usbmux_remote_identify(int fd, struct remote_ident *ident)
+{
+	if (fd == remote_cmdq.fd) {
+		memset(ident, '\0', sizeof(*ident));
+		ident->kind = REMOTE_FD_COMMAND_QUEUE;
+		return 0;
+	}
+	struct remote_mux *remote = fdtable_get(&remote_fds, fd);
+	if (!remote)
+		return -1;
+	ident->id = remote->id;
+	ident->state = remote->state;
+	if (fd == remote->probe_fd)
+		ident->kind = REMOTE_FD_PROBE;
+	else if (fd == remote->hb.fd)
+		ident->kind = REMOTE_FD_HEARTBEAT;
+	else
+		ident->kind = REMOTE_FD_MUX;
+	ident->is_listener = remote->is_listener;
+	ident->is_control = remote->is_control;
+	return 0;
+}
+
+/**
+ * Write a short human readable description of a remote connection
+ * identified with usbmux_remote_identify() into buf, for diagnostic
+ * output. The host is only known while the remote still exists.
+ *
+ * @param fd The remote socket fd.
+ * @param ident What usbmux_remote_identify() returned for fd.
+ * @param buf Buffer receiving the description.
+ * @param len Size of buf.
+ */
+void usbmux_remote_describe(int fd, const struct remote_ident *ident, char *buf, size_t len)
+{
+	if (ident->kind == REMOTE_FD_COMMAND_QUEUE) {
+		snprintf(buf, len, "remote command queue fd %d", fd);
+		return;
+	}
+	struct remote_mux *remote = fdtable_get(&remote_fds, fd);
+	const char *host = NULL;
+	uint16_t port = 0;
+	if (remote && remote->id == ident->id && !remote->is_unix) {
+		host = remote->host;
+		port = remote->port;
+	}
+	if (ident->kind == REMOTE_FD_PROBE) {
+		snprintf(buf, len, "remote probe fd %d for %s:%u", fd, (host) ? host : "closed", port);
+	} else if (ident->kind == REMOTE_FD_HEARTBEAT) {
+		snprintf(buf, len, "remote heartbeat fd %d for %s:%u", fd, (host) ? host : "closed", port);
+	} else if (!host) {
+		snprintf(buf, len, "remote fd %d id %d %s state %s%s", fd, ident->id, (remote && remote->id == ident->id) ? "local" : "closed", remote_state_name(ident->state), (ident->is_listener) ? " listener" : (ident->is_control) ? " control" : "");
+	} else {
+		snprintf(buf, len, "remote fd %d id %d %s:%u state %s%s", fd, ident->id, host, port, remote_state_name(ident->state), (ident->is_listener) ? " listener" : (ident->is_control) ? " control" : "");
+	}
 }
 
 static int array_append_item_copy(const char *key, plist_t value, void *context)
@@ -1070,9 +2347,7 @@ static int array_append_item_copy(const char *key, plist_t value, void *context)
 plist_t usbmux_remote_copy_device_list()
 {
 	plist_t devices = plist_new_array();
-	pthread_mutex_lock(&remote_list_mutex);
 	plist_dict_foreach(remote_device_list, array_append_item_copy, devices);
-	pthread_mutex_unlock(&remote_list_mutex);
 	return devices;
 }
 
@@ -1102,15 +2377,38 @@ static int remote_device_get_for_instance(const char* key, const plist_t value,
 plist_t usbmux_remote_copy_instances()
 {
 	plist_t dict = plist_new_dict();
-	pthread_mutex_lock(&remote_list_mutex);
-	FOREACH(struct remote_mux *remote, &remote_list) {
-		if (remote->is_listener && remote->state == REMOTE_LISTEN) {
+	LIST_FOREACH(struct remote_mux *remote, &remote_list, struct remote_mux, node) {
+		/* reconnecting listeners still own their devices */
+		if (remote->is_listener && (remote->state == REMOTE_LISTEN || remote->lost_at)) {
 			plist_t entry = plist_new_dict();
 			plist_dict_set_item(entry, "IsUnix", plist_new_bool(remote->is_unix));
 			if (!remote->is_unix) {
 				plist_dict_set_item(entry, "ServiceName", plist_new_string(remote->service_name));
 				plist_dict_set_item(entry, "Host", plist_new_string(remote->host));
 				plist_dict_set_item(entry, "Port", plist_new_uint(remote->port));
+				if (beat_interval > 0) {
+					const char *health = "Unknown";
+					if (remote->lost_at) {
+						health = "Reconnecting";
+					} else if (remote->hb.missed > 0) {
+						health = "Degraded";
+					} else if (remote->hb.answered > 0) {
+						health = "OK";
+					}
+					plist_dict_set_item(entry, "Health", plist_new_string(health));
+					plist_dict_set_item(entry, "MissedHeartbeats", plist_new_uint(remote->hb.missed));
+				}
+				plist_dict_set_item(entry, "Breaker", plist_new_string(remote_breaker_name(remote->breaker.state)));
+				plist_dict_set_item(entry, "ConnectFailures", plist_new_uint(remote->breaker.failures));
+				plist_dict_set_item(entry, "BreakerRejects", plist_new_uint(remote->breaker.rejects));
+				plist_dict_set_item(entry, "ConnectsInFlight", plist_new_uint(admit_in_flight_by_id[remote->id]));
+				plist_dict_set_item(entry, "ConnectsQueued", plist_new_uint(admit_queued_by_id[remote->id]));
+				if (remote->hb.answered > 0) {
+					/* in microseconds */
+					plist_dict_set_item(entry, "RTT", plist_new_uint(remote->hb.srtt));
+					plist_dict_set_item(entry, "RTTJitter", plist_new_uint(remote->hb.rttvar));
+					plist_dict_set_item(entry, "LastRTT", plist_new_uint(remote->hb.last_rtt));
+				}
 			}
 			plist_t devices = plist_new_array();
 			struct remote_inst_info inst_info = { remote->id, devices };
@@ -1124,7 +2422,41 @@ plist_t usbmux_remote_copy_instances()
 			plist_dict_set_item(dict, id_str, entry);
 		}
 	} ENDFOREACH
-	pthread_mutex_unlock(&remote_list_mutex);
+	return dict;
+}
+
+plist_t usbmux_remote_copy_stats(void)
+{
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "Probes", plist_new_uint(cnt_probes));
+	plist_dict_set_item(dict, "ProbeFailures", plist_new_uint(cnt_probe_failures));
+	plist_dict_set_item(dict, "ProbesDeferred", plist_new_uint(cnt_probes_deferred));
+	plist_dict_set_item(dict, "ProbesInFlight", plist_new_uint(probes_in_flight));
+	plist_dict_set_item(dict, "Heartbeats", plist_new_uint(cnt_beats));
+	plist_dict_set_item(dict, "MissedHeartbeats", plist_new_uint(cnt_beats_missed));
+	plist_dict_set_item(dict, "Reconnects", plist_new_uint(cnt_reconnects));
+	plist_dict_set_item(dict, "ReconnectsExpired", plist_new_uint(cnt_reconnects_expired));
+	plist_dict_set_item(dict, "ResyncRemovedDevices", plist_new_uint(cnt_resync_removed));
+	plist_dict_set_item(dict, "BreakerTrips", plist_new_uint(cnt_breaker_trips));
+	plist_dict_set_item(dict, "BreakerRejects", plist_new_uint(cnt_breaker_rejects));
+	plist_dict_set_item(dict, "ConnectsInFlight", plist_new_uint(admit_in_flight));
+	plist_dict_set_item(dict, "ConnectsQueued", plist_new_uint(admit_queue_len));
+	plist_dict_set_item(dict, "ConnectsAdmitted", plist_new_uint(cnt_admitted));
+	plist_dict_set_item(dict, "ConnectsDelayed", plist_new_uint(cnt_admit_queued));
+	plist_dict_set_item(dict, "ConnectQueueRejects", plist_new_uint(cnt_admit_rejects));
+	plist_dict_set_item(dict, "ConnectQueueTimeouts", plist_new_uint(cnt_admit_timeouts));
+	/* in microseconds */
+	plist_dict_set_item(dict, "ConnectQueueTime", plist_new_uint(cnt_admit_wait_us));
+	plist_dict_set_item(dict, "MaxConnectQueueTime", plist_new_uint(max_admit_wait_us));
+	plist_t timeouts = plist_new_dict();
+	int i;
+	for (i = REMOTE_CMD_READ_PAIR_RECORD; i <= REMOTE_CMD_CONNECT; i++) {
+		plist_dict_set_item(timeouts, request_names[i], plist_new_uint(cnt_request_timeouts[i]));
+	}
+	plist_dict_set_item(dict, "RequestTimeouts", timeouts);
+	plist_dict_set_item(dict, "ControlConnectionsOpened", plist_new_uint(cnt_control_opened));
+	plist_dict_set_item(dict, "ControlRequests", plist_new_uint(cnt_control_requests));
+	plist_dict_set_item(dict, "ControlRequestsPending", plist_new_uint(control_pending));
 	return dict;
 }
 
@@ -1182,27 +2514,32 @@ static int remote_handle_command_result(struct remote_mux *remote, struct usbmux
 	char *payload = (char*)(hdr) + sizeof(struct usbmuxd_header);
 	uint32_t payload_size = hdr->length - sizeof(struct usbmuxd_header);
 
+	/* device events are captured below once the device id is known */
+	if (capture_enabled && remote->state != REMOTE_LISTEN)
+		remote_capture(remote, 0, CAPTURE_FROM_REMOTE, hdr, hdr->length, NULL, 0);
+
 	plist_t plist_msg = NULL;
 	if (hdr->message == MESSAGE_PLIST) {
 		plist_from_xml(payload, payload_size, &plist_msg);
 	}
 
-	if (remote->state == REMOTE_COMMAND) {
+	if (remote->state == REMOTE_COMMAND && remote->is_control) {
+		remote_control_reply(remote, hdr, payload, payload_size, plist_msg);
+	} else if (remote->state == REMOTE_COMMAND) {
 		if (remote->last_command == REMOTE_CMD_LISTEN) {
 			uint32_t result = message_get_result(hdr, payload, payload_size, plist_msg);
 			if (result == 0) {
-				remote->state = REMOTE_LISTEN;
+				remote_set_state(remote, REMOTE_LISTEN);
+				if (beat_interval > 0 && !remote->is_unix && remote->host) {
+					/* spread the heartbeats of listeners added together */
+					timer_set(&remote->hb.timer, random() % beat_interval);
+				}
+				if (remote->lost_at) {
+					remote_resync_start(remote);
+				}
 			} else {
 				usbfluxd_log(LL_ERROR, "%s: ERROR: command returned error %u", __func__, result);
 			}
-		} else if (remote->last_command == REMOTE_CMD_READ_BUID) {
-			client_send_packet_data(remote->client, hdr, payload, payload_size);
-		} else if (remote->last_command == REMOTE_CMD_READ_PAIR_RECORD) {
-			client_send_packet_data(remote->client, hdr, payload, payload_size);
-		} else if (remote->last_command == REMOTE_CMD_SAVE_PAIR_RECORD) {
-			client_send_packet_data(remote->client, hdr, payload, payload_size);
-		} else if (remote->last_command == REMOTE_CMD_DELETE_PAIR_RECORD) {
-			client_send_packet_data(remote->client, hdr, payload, payload_size);	
 		} else {
 			usbfluxd_log(LL_ERROR, "%s: ERROR: Unexpected message received in command state.", __func__);
 		}
@@ -1235,6 +2572,8 @@ static int remote_handle_command_result(struct remote_mux *remote, struct usbmux
 		}
 		char s_devid[16];
 		snprintf(s_devid, sizeof(s_devid), "0x%08x", devid);
+		if (capture_enabled)
+			remote_capture(remote, devid, CAPTURE_FROM_REMOTE, hdr, hdr->length, NULL, 0);
 		
 		if (type == MESSAGE_DEVICE_ADD) {
 			if (!plist_msg) {
@@ -1248,24 +2587,30 @@ static int remote_handle_command_result(struct remote_mux *remote, struct usbmux
 					plist_dict_set_item(props, "DeviceID", plist_new_uint(devid));
 				}
 			}
-			pthread_mutex_lock(&remote_list_mutex);
+			int known = (plist_dict_get_item(remote_device_list, s_devid) != NULL);
 			plist_t dev = plist_copy(plist_msg);
 			plist_dict_set_item(remote_device_list, s_devid, dev);
-			client_device_add(dev);
-			pthread_mutex_unlock(&remote_list_mutex);
+			/* devices still present after a reconnect were never detached */
+			if (!remote_resync_confirm(remote, devid)) {
+				USBFLUXD_PROBE2(device_attach, remote->id, devid);
+				if (known)
+					client_device_update(dev);
+				else
+					client_device_add(dev);
+			}
 		} else if (type == MESSAGE_DEVICE_REMOVE) {
-			pthread_mutex_lock(&remote_list_mutex);
-			plist_dict_remove_item(remote_device_list, s_devid);
-			client_device_remove(devid);
-			pthread_mutex_unlock(&remote_list_mutex);
+			remote_resync_confirm(remote, devid);
+			remote_device_detach(devid);
 		}		
 	} else if (remote->state == REMOTE_CONNECTING1) {
 		uint32_t result = message_get_result(hdr, payload, payload_size, plist_msg);
 		usbfluxd_log(LL_DEBUG, "%s: got result %d for Connect request from remote", __func__, result);
+		USBFLUXD_PROBE2(connect_done, remote->fd, result);
+		timer_cancel(&remote->request_timer);
 		client_notify_connect(remote->client, result);
 		if (result == 0) {
 			usbfluxd_log(LL_DEBUG, "Remote %d switching to CONNECTED state", remote->fd);
-			remote->state = REMOTE_CONNECTED;//ING2;
+			remote_set_state(remote, REMOTE_CONNECTED);//ING2;
 			remote->events = POLLIN | POLLOUT; // wait for the result packet to go through
 		}
 	}
@@ -1274,37 +2619,54 @@ static int remote_handle_command_result(struct remote_mux *remote, struct usbmux
 	return res;
 }
 
-static void remote_process_send(struct remote_mux *remote)
+/* returns -1 if the remote was closed and must not be touched anymore */
+static int remote_process_send(struct remote_mux *remote)
 {
 	usbfluxd_log(LL_DEBUG, "%s", __func__);
-	int res;
-	if(!remote->ob_size) {
+	ssize_t res;
+	int from_queue = (remote->outq.size > 0);
+	if (!from_queue && !remote->ob_size) {
 		usbfluxd_log(LL_DEBUG, "Remote %d OUT process but nothing to send?", remote->fd);
 		remote->events &= ~POLLOUT;
-		return;
+		return 0;
+	}
+	/* queued control messages go out before relayed data */
+	if (from_queue) {
+		usbfluxd_log(LL_DEBUG, "%s: sending %llu to usbmuxd (%d)", __func__, (unsigned long long)remote->outq.size, remote->fd);
+		res = msgqueue_send(&remote->outq, remote->fd);
+	} else {
+		usbfluxd_log(LL_DEBUG, "%s: sending %d to usbmuxd (%d)", __func__, remote->ob_size, remote->fd);
+		res = send(remote->fd, remote->ob_buf, remote->ob_size, 0);
+	}
+	usbfluxd_log(LL_DEBUG, "%s: returned %zd", __func__, res);
+	USBFLUXD_PROBE3(relay_remote_write, remote->fd, res, remote->state);
+	if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 0;
 	}
-	usbfluxd_log(LL_DEBUG, "%s: sending %d to usbmuxd (%d)", __func__, remote->ob_size, remote->fd);
-	res = send(remote->fd, remote->ob_buf, remote->ob_size, 0);
-	usbfluxd_log(LL_DEBUG, "%s: returned %d", __func__, res);
 	if(res <= 0) {
-		usbfluxd_log(LL_ERROR, "Send to remote fd %d failed: %d %s", remote->fd, res, strerror(errno));
+		usbfluxd_log(LL_ERROR, "Send to remote fd %d failed: %zd %s", remote->fd, res, strerror(errno));
 		usbmux_remote_close(remote);
-		return;
+		return -1;
 	}
-	remote->last_active = mstime64();
-	if((uint32_t)res == remote->ob_size) {
+	remote->last_active = timer_now();
+	if (!from_queue) {
+		if ((uint32_t)res < remote->ob_size) {
+			remote->ob_size -= res;
+			memmove(remote->ob_buf, remote->ob_buf + res, remote->ob_size);
+			return 0;
+		}
 		remote->ob_size = 0;
+	}
+	if (remote->outq.size == 0 && remote->ob_size == 0) {
 		remote->events &= ~POLLOUT;
 		if (remote->state == REMOTE_CONNECTING2) {
 			usbfluxd_log(LL_DEBUG, "Remote %d switching to CONNECTED state", remote->fd);
-			remote->state = REMOTE_CONNECTED;
+			remote_set_state(remote, REMOTE_CONNECTED);
 			remote->events = remote->devents;
 			remote->events |= POLLIN; //POLLOUT;
 		}
-	} else {
-		remote->ob_size -= res;
-		memmove(remote->ob_buf, remote->ob_buf + res, remote->ob_size);
 	}
+	return 0;
 }
 
 static void remote_process_recv(struct remote_mux *remote)
@@ -1314,6 +2676,10 @@ static void remote_process_recv(struct remote_mux *remote)
 	int did_read = 0;
 	if (remote->ib_size < sizeof(struct usbmuxd_header)) {
 		res = recv(remote->fd, remote->ib_buf + remote->ib_size, sizeof(struct usbmuxd_header) - remote->ib_size, 0);
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			/* stale readiness, e.g. the fd was reused within this loop iteration */
+			return;
+		}
 		if (res <= 0) {
 			if (res < 0)
 				usbfluxd_log(LL_ERROR, "Receive from usbmux fd %d failed: %s", remote->fd, strerror(errno));
@@ -1342,6 +2708,9 @@ static void remote_process_recv(struct remote_mux *remote)
 		if (did_read)
 			return; //maybe we would block, so defer to next loop
 		res = recv(remote->fd, remote->ib_buf + remote->ib_size, hdr->length - remote->ib_size, 0);
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
 		if (res < 0) {
 			usbfluxd_log(LL_ERROR, "Receive from usbmux fd %d failed: %s", remote->fd, strerror(errno));
 			usbmux_remote_mark_dead(remote);
@@ -1351,7 +2720,7 @@ static void remote_process_recv(struct remote_mux *remote)
 			usbmux_remote_mark_dead(remote);
 			return;
 		}
-		remote->last_active = mstime64();
+		remote->last_active = timer_now();
 		remote->ib_size += res;
 		if (remote->ib_size < hdr->length)
 			return;
@@ -1363,22 +2732,28 @@ static void remote_process_recv(struct remote_mux *remote)
 
 void usbmux_remote_process(int fd, short events)
 {
-	struct remote_mux *remote = NULL;
-	pthread_mutex_lock(&remote_list_mutex);
-	/* find matching remote, but also reap dead remotes */
-	FOREACH(struct remote_mux *rm, &remote_list) {
-		if (rm->state == REMOTE_DEAD) {
-			usbmux_remote_dispose(rm);
-		} else if (rm->fd == fd) {
-			remote = rm;
-			if (events == POLLNVAL) {
-				usbfluxd_log(LL_DEBUG, "%s: remote fd %d became invalid", __func__, fd);
-				usbmux_remote_dispose(rm);
-				remote = NULL;
-			}
-		}
-	} ENDFOREACH
-	pthread_mutex_unlock(&remote_list_mutex);
+	if (fd == remote_cmdq.fd) {
+		remote_run_posted();
+		return;
+	}
+	struct remote_mux *remote = fdtable_get(&remote_fds, fd);
+	if (remote && fd == remote->probe_fd) {
+		remote_probe_process(remote, events);
+		return;
+	}
+	if (remote && fd == remote->hb.fd) {
+		remote_beat_process(remote, events);
+		return;
+	}
+	if (remote && remote->state == REMOTE_RECONNECTING) {
+		remote_reconnect_process(remote, events);
+		return;
+	}
+	if (remote && events == POLLNVAL) {
+		usbfluxd_log(LL_DEBUG, "%s: remote fd %d became invalid", __func__, fd);
+		remote_lost(remote);
+		remote = NULL;
+	}
 
 	if(!remote) {
 		usbfluxd_log(LL_DEBUG, "%s: fd %d not found in remote mux list", __func__, fd);
@@ -1406,8 +2781,9 @@ void usbmux_remote_process(int fd, short events)
 				usbfluxd_log(LL_DEBUG, "%s: remote read returned 0", __func__);
 				remote->events &= ~POLLIN;
 			} else if (r > 0) {
-				remote->last_active = mstime64();
+				remote->last_active = timer_now();
 				usbfluxd_log(LL_DEBUG, "%s: read %d bytes from remote (fd %d) requested %u", __func__, r, remote->fd, remote->ib_capacity - remote->ib_size);
+				USBFLUXD_PROBE2(relay_remote_read, remote->fd, r);
 				remote->ib_size += r;
 #if 0
 				client_set_events(remote->client, POLLOUT);
@@ -1418,7 +2794,8 @@ void usbmux_remote_process(int fd, short events)
 		} else if (events & POLLOUT) {
 			// write to remote
 			usbfluxd_log(LL_DEBUG, "%s: sending %d bytes to remote (fd %d)", __func__, remote->ob_size, fd);
-			remote_process_send(remote);
+			if (remote_process_send(remote) < 0)
+				return;
 #if 0
 			client_set_events(remote->client, POLLIN);
 			client->events |= POLLIN;
@@ -1432,7 +2809,7 @@ void usbmux_remote_process(int fd, short events)
 		if (events & POLLIN) {
 			if (remote->state == REMOTE_CONNECTING2) {
 				usbfluxd_log(LL_DEBUG, "Remote %d switching to CONNECTED state", remote->fd);
-				remote->state = REMOTE_CONNECTED;
+				remote_set_state(remote, REMOTE_CONNECTED);
 				remote->events = remote->devents;
 				remote->events |= POLLIN; //POLLOUT;
 				return;
@@ -20,8 +20,11 @@
 #ifndef USBMUX_REMOTE_H
 #define USBMUX_REMOTE_H
 
+#include <sys/socket.h>
 #include "utils.h"
+#include "usbmuxd-proto.h"
 #include "client.h"
+#include "timer.h"
 
 #define USBMUXD_RENAMED_SOCKET "/var/run/usbmuxd.orig"
 
@@ -31,20 +34,76 @@ enum remote_state {
 	REMOTE_CONNECTING1,	// issued connection request
 	REMOTE_CONNECTING2,	// connection established, but waiting for response message to get sent
 	REMOTE_CONNECTED,	// connected
+	REMOTE_RECONNECTING,	// listener lost its connection, keeps its id and devices
 	REMOTE_DEAD
 };
 
+/* which of the fds of a remote is dispatched */
+enum remote_fd_kind {
+	REMOTE_FD_MUX,
+	REMOTE_FD_PROBE,
+	REMOTE_FD_HEARTBEAT,
+	REMOTE_FD_COMMAND_QUEUE
+};
+
+/* what identifies a remote, cheap to take before dispatching its fd */
+struct remote_ident {
+	int id;
+	enum remote_state state;
+	enum remote_fd_kind kind;
+	uint8_t is_listener;
+	uint8_t is_control;
+};
+
 enum remote_command {
 	REMOTE_CMD_LISTEN = 1,
 	REMOTE_CMD_READ_PAIR_RECORD,
 	REMOTE_CMD_SAVE_PAIR_RECORD,
 	REMOTE_CMD_DELETE_PAIR_RECORD,
-	REMOTE_CMD_READ_BUID
+	REMOTE_CMD_READ_BUID,
+	REMOTE_CMD_CONNECT
+};
+
+enum breaker_state {
+	BREAKER_CLOSED,			// connects go through
+	BREAKER_OPEN,			// connects fail right away
+	BREAKER_HALF_OPEN		// one trial connect decides
+};
+
+/* circuit breaker for new connections to a remote instance */
+struct remote_breaker {
+	enum breaker_state state;
+	uint32_t failures;		// connect failures in a row
+	uint32_t trips;			// failed trials in a row, for the backoff
+	uint64_t open_until;
+	uint64_t rejects;
+};
+
+/* application level heartbeat of a TCP listener */
+struct remote_heartbeat {
+	int fd;				// command connection to the remote, or -1
+	int connecting;
+	int pending;			// the last beat was not answered yet
+	uint32_t tag;
+	uint64_t sent;			// when the pending beat was sent, in us
+	uint32_t missed;		// beats missed in a row
+	struct usbmuxd_header hdr;	// reply being read
+	uint32_t hdr_size;
+	uint32_t skip;			// reply payload left to read
+	uint64_t srtt;			// smoothed round trip time, in us
+	uint64_t rttvar;		// round trip time variation, in us
+	uint64_t last_rtt;
+	uint64_t answered;
+	struct timer timer;
 };
 
 struct remote_mux {
+	struct list_node node;		// remote_list
+	struct list_node state_node;	// remote_states[state]
 	int fd;
-	unsigned char *ob_buf;
+	int probe_fd;			// reachability probe in flight, or -1
+	struct msgqueue outq;		// control messages to the remote
+	unsigned char *ob_buf;		// data relayed from the client
 	uint32_t ob_size;
 	uint32_t ob_capacity;
 	unsigned char *ib_buf;
@@ -61,15 +120,42 @@ struct remote_mux {
 	uint16_t port;
 	struct mux_client* client;
 	uint64_t last_active;
+	struct timer check_timer;	// idle reachability check, or probe timeout
+	struct remote_heartbeat hb;
+	struct remote_breaker breaker;
+	uint8_t admitted;		// counts against the connect admission limits
+	uint32_t request_tag;		// tag of the client request waiting for its reply
+	struct timer request_timer;	// deadline of that request
+	uint8_t is_control;		// persistent connection for the control commands
+	uint32_t next_tag;		// of the next request on a control connection
+	struct list_node requests;	// outstanding requests of a control connection
+	struct sockaddr_storage addr;	// peer address, to reconnect without a name lookup
+	socklen_t addrlen;
+	uint8_t removed;		// removed on request, do not reconnect
+	uint64_t lost_at;		// when a listener lost its connection, or 0
+	uint32_t reconnect_attempts;
+	struct timer reconnect_timer;	// next reconnect attempt, its timeout or the device resync
+	uint32_t *resync_ids;		// devices not announced again since reconnecting
+	uint32_t resync_count;
 };
 
 void usbmux_remote_init(int no_mdns);
+void usbmux_remote_set_heartbeat(uint32_t interval_ms, uint32_t max_missed);
+void usbmux_remote_set_reconnect_grace(uint32_t grace_ms);
+void usbmux_remote_set_connect_limits(uint32_t per_remote, uint32_t global, uint32_t queue_max, uint32_t wait_ms);
+int usbmux_remote_set_request_timeout(const char *command, uint32_t timeout_ms);
 void usbmux_remote_shutdown(void);
 
 plist_t usbmux_remote_copy_device_list();
 plist_t usbmux_remote_copy_instances();
+plist_t usbmux_remote_copy_stats(void);
 
 int usbmux_remote_connect(uint32_t device_id, uint32_t tag, plist_t req_plist, struct mux_client *client);
+void usbmux_remote_cancel_connect(struct mux_client *client);
+void usbmux_remote_forget_client(struct mux_client *client);
+
+struct msgbuf *usbmux_remote_cached_buid(void);
+struct msgbuf *usbmux_remote_cached_pair_record(const char *record_id);
 
 int usbmux_remote_read_buid(uint32_t tag, struct mux_client *client);
 int usbmux_remote_read_pair_record(const char *record_id, uint32_t tag, struct mux_client *client);
@@ -82,11 +168,11 @@ void usbmux_remote_dispose(struct remote_mux *remote);
 
 void usbmux_remote_notify_client_close(struct remote_mux *remote);
 
-void *check_remote_func(void *data);
-
 void usbmux_remote_get_fds(struct fdlist *list);
 
 void usbmux_remote_process(int fd, short events);
+int usbmux_remote_identify(int fd, struct remote_ident *ident);
+void usbmux_remote_describe(int fd, const struct remote_ident *ident, char *buf, size_t len);
 
 int usbmux_remote_add_remote(const char *host_name, uint16_t port);
 int usbmux_remote_remove_remote(const char *host_name, uint16_t port);
@@ -30,7 +30,13 @@
 #include <stdarg.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_EVENTFD_H
+# include <sys/eventfd.h>
+#endif
 #if defined(__APPLE__) || defined(HAVE_MACH_MACH_TIME_H)
 # include <mach/mach_time.h>
 #endif
@@ -138,6 +144,428 @@ void collection_copy(struct collection *dest, struct collection *src)
 	memcpy(dest->list, src->list, sizeof(void*) * src->capacity);
 }
 
+#define MSGQUEUE_BUF_SIZE 8192
+#define MSGQUEUE_BUF_MAX 0x100000
+#define MSGQUEUE_IOV_MAX 64
+
+/**
+ * Initialize a list head, or a node so that it is not on any list.
+ */
+void list_init(struct list_node *head)
+{
+	head->prev = head;
+	head->next = head;
+}
+
+void list_add_tail(struct list_node *head, struct list_node *node)
+{
+	node->prev = head->prev;
+	node->next = head;
+	head->prev->next = node;
+	head->prev = node;
+}
+
+/**
+ * Remove a node from the list it is on. Removing a node that is not on a
+ * list is a no-op.
+ */
+void list_del(struct list_node *node)
+{
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	list_init(node);
+}
+
+int list_empty(const struct list_node *head)
+{
+	return head->next == head;
+}
+
+void fdtable_init(struct fdtable *table)
+{
+	table->slots = NULL;
+	table->capacity = 0;
+}
+
+void fdtable_free(struct fdtable *table)
+{
+	free(table->slots);
+	fdtable_init(table);
+}
+
+/**
+ * Associate ptr with fd, growing the table as needed.
+ *
+ * @return 0 on success, -1 if fd is invalid or the table could not grow.
+ */
+int fdtable_set(struct fdtable *table, int fd, void *ptr)
+{
+	if (fd < 0)
+		return -1;
+	if (fd >= table->capacity) {
+		int capacity = (table->capacity) ? table->capacity : 64;
+		while (capacity <= fd)
+			capacity *= 2;
+		void **slots = realloc(table->slots, sizeof(void*) * capacity);
+		if (!slots)
+			return -1;
+		memset(&slots[table->capacity], '\0', sizeof(void*) * (capacity - table->capacity));
+		table->slots = slots;
+		table->capacity = capacity;
+	}
+	table->slots[fd] = ptr;
+	return 0;
+}
+
+void *fdtable_get(struct fdtable *table, int fd)
+{
+	if (fd < 0 || fd >= table->capacity)
+		return NULL;
+	return table->slots[fd];
+}
+
+/* only clears the slot if fd is still associated with ptr */
+void fdtable_clear(struct fdtable *table, int fd, void *ptr)
+{
+	if (fd >= 0 && fd < table->capacity && table->slots[fd] == ptr)
+		table->slots[fd] = NULL;
+}
+
+struct msgbuf *msgbuf_new(uint32_t capacity)
+{
+	struct msgbuf *buf = malloc(sizeof(struct msgbuf) + capacity);
+	if (!buf)
+		return NULL;
+	buf->refcount = 1;
+	buf->size = 0;
+	buf->capacity = capacity;
+	return buf;
+}
+
+struct msgbuf *msgbuf_ref(struct msgbuf *buf)
+{
+	buf->refcount++;
+	return buf;
+}
+
+void msgbuf_unref(struct msgbuf *buf)
+{
+	if (buf && --buf->refcount == 0)
+		free(buf);
+}
+
+/**
+ * Append data to a buffer that is not shared yet, enlarging it if needed.
+ *
+ * @return 0 on success, -1 if the buffer could not be enlarged.
+ */
+int msgbuf_append(struct msgbuf **buf, const void *data, uint32_t length)
+{
+	struct msgbuf *b = *buf;
+	if (b->capacity - b->size < length) {
+		uint32_t new_capacity = ((b->size + length + 4096) / 4096) * 4096;
+		b = realloc(b, sizeof(struct msgbuf) + new_capacity);
+		if (!b)
+			return -1;
+		b->capacity = new_capacity;
+		*buf = b;
+	}
+	memcpy(b->data + b->size, data, length);
+	b->size += length;
+	return 0;
+}
+
+void msgqueue_init(struct msgqueue *queue)
+{
+	memset(queue, '\0', sizeof(struct msgqueue));
+}
+
+/* drop a buffer that left the queue, keeping one private buffer around */
+static void msgqueue_release(struct msgqueue *queue, struct msgbuf *buf)
+{
+	if (buf->refcount == 1 && buf->capacity == MSGQUEUE_BUF_SIZE && !queue->spare) {
+		buf->size = 0;
+		queue->spare = buf;
+	} else {
+		msgbuf_unref(buf);
+	}
+}
+
+void msgqueue_clear(struct msgqueue *queue)
+{
+	while (queue->count > 0) {
+		msgqueue_release(queue, queue->entries[queue->head].buf);
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+	}
+	queue->head = 0;
+	queue->size = 0;
+}
+
+void msgqueue_free(struct msgqueue *queue)
+{
+	msgqueue_clear(queue);
+	free(queue->entries);
+	msgbuf_unref(queue->spare);
+	msgqueue_init(queue);
+}
+
+static struct msgqueue_entry *msgqueue_tail(struct msgqueue *queue)
+{
+	if (queue->count == 0)
+		return NULL;
+	return &queue->entries[(queue->head + queue->count - 1) % queue->capacity];
+}
+
+static struct msgqueue_entry *msgqueue_append_entry(struct msgqueue *queue)
+{
+	if (queue->count == queue->capacity) {
+		uint32_t new_capacity = (queue->capacity) ? queue->capacity * 2 : 8;
+		struct msgqueue_entry *entries = malloc(sizeof(struct msgqueue_entry) * new_capacity);
+		uint32_t i;
+		if (!entries)
+			return NULL;
+		for (i = 0; i < queue->count; i++) {
+			entries[i] = queue->entries[(queue->head + i) % queue->capacity];
+		}
+		free(queue->entries);
+		queue->entries = entries;
+		queue->capacity = new_capacity;
+		queue->head = 0;
+	}
+	queue->count++;
+	return msgqueue_tail(queue);
+}
+
+/**
+ * Reserve length bytes at the end of the queue, to be filled in by the
+ * caller. Small messages share a private buffer instead of getting one each.
+ *
+ * @return Pointer to the reserved space, or NULL on allocation failure.
+ */
+void *msgqueue_reserve(struct msgqueue *queue, uint32_t length)
+{
+	struct msgqueue_entry *tail = msgqueue_tail(queue);
+	struct msgbuf *buf;
+	if (tail && tail->buf->refcount == 1 && tail->end == tail->buf->size && tail->buf->capacity - tail->buf->size >= length) {
+		buf = tail->buf;
+	} else {
+		if (queue->spare && queue->spare->capacity >= length) {
+			buf = queue->spare;
+			queue->spare = NULL;
+		} else {
+			/* grow geometrically while a large backlog builds up */
+			uint64_t capacity = (queue->size > MSGQUEUE_BUF_SIZE) ? queue->size : MSGQUEUE_BUF_SIZE;
+			if (capacity > MSGQUEUE_BUF_MAX)
+				capacity = MSGQUEUE_BUF_MAX;
+			if (capacity < length)
+				capacity = length;
+			buf = msgbuf_new((uint32_t)capacity);
+			if (!buf)
+				return NULL;
+		}
+		tail = msgqueue_append_entry(queue);
+		if (!tail) {
+			msgbuf_unref(buf);
+			return NULL;
+		}
+		tail->buf = buf;
+		tail->start = buf->size;
+		tail->offset = buf->size;
+		tail->end = buf->size;
+	}
+	void *ptr = buf->data + buf->size;
+	buf->size += length;
+	tail->end += length;
+	queue->size += length;
+	return ptr;
+}
+
+int msgqueue_write(struct msgqueue *queue, const void *data, uint32_t length)
+{
+	void *ptr = msgqueue_reserve(queue, length);
+	if (!ptr)
+		return -1;
+	memcpy(ptr, data, length);
+	return 0;
+}
+
+/**
+ * Queue a slice of a buffer that is shared with other queues. The queue
+ * takes its own reference.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int msgqueue_push(struct msgqueue *queue, struct msgbuf *buf, uint32_t offset, uint32_t length)
+{
+	struct msgqueue_entry *entry = msgqueue_append_entry(queue);
+	if (!entry)
+		return -1;
+	entry->buf = msgbuf_ref(buf);
+	entry->start = offset;
+	entry->offset = offset;
+	entry->end = offset + length;
+	queue->size += length;
+	return 0;
+}
+
+/**
+ * Drop everything but the first keep bytes that are not sent yet.
+ */
+void msgqueue_truncate(struct msgqueue *queue, uint64_t keep)
+{
+	uint32_t i;
+	uint32_t count = 0;
+	for (i = 0; i < queue->count; i++) {
+		struct msgqueue_entry *entry = &queue->entries[(queue->head + i) % queue->capacity];
+		uint32_t len = entry->end - entry->offset;
+		if (keep >= len) {
+			keep -= len;
+			count++;
+		} else if (keep > 0) {
+			queue->size -= len - keep;
+			entry->end = entry->offset + (uint32_t)keep;
+			keep = 0;
+			count++;
+		} else {
+			queue->size -= len;
+			msgqueue_release(queue, entry->buf);
+		}
+	}
+	queue->count = count;
+	if (queue->count == 0)
+		queue->head = 0;
+}
+
+/**
+ * Send as much of the queue as the socket takes with a single writev().
+ *
+ * @return Same as writev(); the number of bytes sent, or -1 with errno set.
+ */
+ssize_t msgqueue_send(struct msgqueue *queue, int fd)
+{
+	struct iovec iov[MSGQUEUE_IOV_MAX];
+	uint32_t i;
+	int iovcnt = 0;
+	for (i = 0; i < queue->count && iovcnt < MSGQUEUE_IOV_MAX; i++) {
+		struct msgqueue_entry *entry = &queue->entries[(queue->head + i) % queue->capacity];
+		iov[iovcnt].iov_base = entry->buf->data + entry->offset;
+		iov[iovcnt].iov_len = entry->end - entry->offset;
+		iovcnt++;
+	}
+	ssize_t res = writev(fd, iov, iovcnt);
+	if (res <= 0)
+		return res;
+
+	queue->size -= res;
+	size_t left = (size_t)res;
+	while (queue->count > 0) {
+		struct msgqueue_entry *entry = &queue->entries[queue->head];
+		uint32_t len = entry->end - entry->offset;
+		if (left < len) {
+			entry->offset += left;
+			break;
+		}
+		left -= len;
+		msgqueue_release(queue, entry->buf);
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+	}
+	if (queue->count == 0)
+		queue->head = 0;
+	return res;
+}
+
+#ifdef HAVE_SYS_EVENTFD_H
+# define CMDQUEUE_SIGNAL_SIZE	sizeof(uint64_t)
+#else
+# define CMDQUEUE_SIGNAL_SIZE	1
+#endif
+
+int cmdqueue_init(struct cmdqueue *queue)
+{
+	queue->head = NULL;
+#ifdef HAVE_SYS_EVENTFD_H
+	queue->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (queue->fd < 0) {
+		util_error("%s: eventfd: %s", __func__, strerror(errno));
+		return -1;
+	}
+	queue->wfd = queue->fd;
+#else
+	int fds[2];
+	int i;
+	if (pipe(fds) < 0) {
+		util_error("%s: pipe: %s", __func__, strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL, 0) | O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	queue->fd = fds[0];
+	queue->wfd = fds[1];
+#endif
+	return 0;
+}
+
+/**
+ * Close the wakeup fd. Entries still queued are not freed; take them
+ * first if they own memory.
+ */
+void cmdqueue_free(struct cmdqueue *queue)
+{
+	if (queue->wfd != queue->fd && queue->wfd >= 0)
+		close(queue->wfd);
+	if (queue->fd >= 0)
+		close(queue->fd);
+	queue->fd = -1;
+	queue->wfd = -1;
+}
+
+/**
+ * Post an entry from any thread. Never blocks; the consumer is only
+ * woken up if the queue was empty.
+ */
+void cmdqueue_post(struct cmdqueue *queue, struct cmdqueue_entry *entry)
+{
+	struct cmdqueue_entry *head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+	do {
+		entry->next = head;
+	} while (!__atomic_compare_exchange_n(&queue->head, &head, entry, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	if (!head) {
+		uint64_t one = 1;
+		ssize_t res;
+		do {
+			res = write(queue->wfd, &one, CMDQUEUE_SIGNAL_SIZE);
+		} while (res < 0 && errno == EINTR);
+	}
+}
+
+/**
+ * Take all pending entries, in the order they were posted, and reset the
+ * wakeup fd. Only the thread that owns the queue may call this.
+ */
+struct cmdqueue_entry *cmdqueue_take(struct cmdqueue *queue)
+{
+	struct cmdqueue_entry *entry, *next, *fifo = NULL;
+	uint64_t buf[8];
+
+	/* reset the wakeup first, entries posted after the exchange below
+	 * signal again */
+	while (read(queue->fd, buf, sizeof(buf)) > 0)
+		;
+
+	entry = __atomic_exchange_n(&queue->head, NULL, __ATOMIC_ACQUIRE);
+	while (entry) {
+		next = entry->next;
+		entry->next = fifo;
+		fifo = entry;
+		entry = next;
+	}
+	return fifo;
+}
+
 #ifndef HAVE_STPCPY
 /**
  * Copy characters from one string into another
@@ -378,3 +806,14 @@ uint64_t mstime64(void)
 	// time_t could be 4 bytes
 	return ((long long)tv.tv_sec) * 1000LL + ((long long)tv.tv_usec) / 1000LL;
 }
+
+/**
+ * Get number of microseconds since the epoch.
+ */
+uint64_t ustime64(void)
+{
+	struct timeval tv;
+	get_tick_count(&tv);
+
+	return ((long long)tv.tv_sec) * 1000000LL + (long long)tv.tv_usec;
+}
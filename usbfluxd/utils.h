@@ -23,6 +23,10 @@
 #define UTILS_H
 
 #include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
 #include <plist/plist.h>
 
 enum fdowner {
@@ -30,7 +34,8 @@ enum fdowner {
 	FD_CLIENT,
 	FD_USB,
 	FD_USBMUX,
-	FD_REMOTE
+	FD_REMOTE,
+	FD_SIGNAL
 };
 
 struct fdlist {
@@ -57,6 +62,92 @@ int collection_count(struct collection *col);
 void collection_free(struct collection *col);
 void collection_copy(struct collection *dest, struct collection *src);
 
+/* Intrusive doubly linked list. The list head is a struct list_node of its
+ * own, elements embed one struct list_node for every list they can be on. */
+struct list_node {
+	struct list_node *prev;
+	struct list_node *next;
+};
+
+#define list_entry(node, type, member) \
+	((type *)((char *)(node) - offsetof(type, member)))
+
+void list_init(struct list_node *head);
+void list_add_tail(struct list_node *head, struct list_node *node);
+void list_del(struct list_node *node);
+int list_empty(const struct list_node *head);
+
+/* Pointers indexed by file descriptor */
+struct fdtable {
+	void **slots;
+	int capacity;
+};
+
+void fdtable_init(struct fdtable *table);
+void fdtable_free(struct fdtable *table);
+int fdtable_set(struct fdtable *table, int fd, void *ptr);
+void *fdtable_get(struct fdtable *table, int fd);
+void fdtable_clear(struct fdtable *table, int fd, void *ptr);
+
+/* Reference counted message buffer. A buffer that is queued for more than
+ * one connection must not be modified anymore. */
+struct msgbuf {
+	unsigned int refcount;
+	uint32_t size;
+	uint32_t capacity;
+	unsigned char data[];
+};
+
+struct msgbuf *msgbuf_new(uint32_t capacity);
+struct msgbuf *msgbuf_ref(struct msgbuf *buf);
+void msgbuf_unref(struct msgbuf *buf);
+int msgbuf_append(struct msgbuf **buf, const void *data, uint32_t length);
+
+/* Output queue of a connection: a ring of (possibly shared) message buffer
+ * slices, sent with writev(). */
+struct msgqueue_entry {
+	struct msgbuf *buf;
+	uint32_t start;		// first byte queued
+	uint32_t offset;	// first byte not sent yet
+	uint32_t end;
+};
+
+struct msgqueue {
+	struct msgqueue_entry *entries;
+	uint32_t head;
+	uint32_t count;
+	uint32_t capacity;
+	uint64_t size;		// bytes queued
+	struct msgbuf *spare;	// sent private buffer kept for reuse
+};
+
+void msgqueue_init(struct msgqueue *queue);
+void msgqueue_free(struct msgqueue *queue);
+void msgqueue_clear(struct msgqueue *queue);
+void *msgqueue_reserve(struct msgqueue *queue, uint32_t length);
+int msgqueue_write(struct msgqueue *queue, const void *data, uint32_t length);
+int msgqueue_push(struct msgqueue *queue, struct msgbuf *buf, uint32_t offset, uint32_t length);
+void msgqueue_truncate(struct msgqueue *queue, uint64_t keep);
+ssize_t msgqueue_send(struct msgqueue *queue, int fd);
+
+/* Lock-free multi-producer queue through which other threads hand work to
+ * the main loop. fd becomes readable when entries are posted; the loop
+ * polls it and takes all pending entries at once. */
+struct cmdqueue_entry {
+	struct cmdqueue_entry *next;
+};
+
+struct cmdqueue {
+	struct cmdqueue_entry *head;	// posted entries, newest first
+	int fd;				// readable while entries are pending
+	int wfd;			// written to by cmdqueue_post
+};
+
+int cmdqueue_init(struct cmdqueue *queue);
+void cmdqueue_free(struct cmdqueue *queue);
+void cmdqueue_post(struct cmdqueue *queue, struct cmdqueue_entry *entry);
+struct cmdqueue_entry *cmdqueue_take(struct cmdqueue *queue);
+
 #define MERGE_(a,b) a ## _ ## b
 #define LABEL_(a,b) MERGE_(a, b)
 #define UNIQUE_VAR(a) LABEL_(a, __LINE__)
@@ -72,6 +163,15 @@ void collection_copy(struct collection *dest, struct collection *src);
 		} \
 	} while(0);
 
+/* iterate over a list of type elements linked by member; the current
+ * element may be removed from the list, other elements must not be */
+#define LIST_FOREACH(var, head, type, member) \
+	do { \
+		struct list_node *UNIQUE_VAR(_node), *UNIQUE_VAR(_next); \
+		for(UNIQUE_VAR(_node)=(head)->next; UNIQUE_VAR(_node)!=(head); UNIQUE_VAR(_node)=UNIQUE_VAR(_next)) { \
+			UNIQUE_VAR(_next) = UNIQUE_VAR(_node)->next; \
+			var = list_entry(UNIQUE_VAR(_node), type, member);
+
 #ifndef HAVE_STPCPY
 char *stpcpy(char * s1, const char * s2);
 #endif
@@ -91,6 +191,7 @@ int plist_read_from_filename(plist_t *plist, const char *filename);
 int plist_write_to_filename(plist_t plist, const char *filename, plist_format_t format);
 
 uint64_t mstime64(void);
+uint64_t ustime64(void);
 void get_tick_count(struct timeval * tv);
 
 #endif